@@ -0,0 +1,855 @@
+#include "archive.h"
+#include "compress.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PREFIX_MAX (3 * ARCHIVE_NAME_MAX + 2)
+// the prefix, 20 digits of start time and ".open"
+#define FILE_NAME_MAX (PREFIX_MAX + 32)
+
+// A segment the thread is writing
+struct ARCHIVE_OPEN_SEGMENT {
+    struct ARCHIVE_OPEN_SEGMENT* next; // the most recently used first
+    char session_id[ARCHIVE_NAME_MAX];
+    char* path;                        // of the .open file
+    int fd;
+    unsigned long long size;           // written so far, always whole blocks
+    unsigned long long started_ms;     // on the monotonic clock, like the others
+    struct ARCHIVE_INDEX_ENTRY* index;
+    unsigned int num_blocks;
+    unsigned int index_capacity;
+    // the block being filled
+    char* block;
+    struct ARCHIVE_BLOCK header;
+    unsigned long long block_started_ms;
+};
+
+// A message in the spill file, followed by the message
+struct SPILL_RECORD {
+    char session_id[ARCHIVE_NAME_MAX];
+    struct ARCHIVE_RECORD record;
+};
+#define SPILL_TAKE_EVERY 64
+
+static unsigned long long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int write_all(int fd, const void* data, size_t len) {
+    const char* p = data;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const void* data, size_t len, off_t offset) {
+    const char* p = data;
+    while (len > 0) {
+        ssize_t written = pwrite(fd, p, len, offset);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        p += written;
+        offset += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static char* dir_path(const char* dir, const char* name) {
+    char* path = malloc(strlen(dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+void archive_file_prefix(const char* session_id, char* out) {
+    static const char hex[] = "0123456789ABCDEF";
+    int n = 0;
+    for (int i = 0; i < ARCHIVE_NAME_MAX && session_id[i] != '\0'; i++) {
+        unsigned char c = session_id[i];
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_') {
+            out[n++] = c;
+        } else {
+            out[n++] = '%';
+            out[n++] = hex[c >> 4];
+            out[n++] = hex[c & 15];
+        }
+    }
+    out[n++] = '.';
+    out[n] = '\0';
+}
+
+// Writes the index after the blocks of a .open segment, makes it read-only and renames it to .seg
+static int finish_file(int fd, const char* path, unsigned long long end, const struct ARCHIVE_INDEX_ENTRY* index,
+                       unsigned int num_blocks) {
+    struct ARCHIVE_FOOTER footer = {.index_offset = end, .num_blocks = num_blocks, .magic = ARCHIVE_INDEX_MAGIC};
+    if (ftruncate(fd, end) == -1 || lseek(fd, end, SEEK_SET) == -1
+        || write_all(fd, index, num_blocks * sizeof(struct ARCHIVE_INDEX_ENTRY)) == -1
+        || write_all(fd, &footer, sizeof(footer)) == -1 || fdatasync(fd) == -1 || fchmod(fd, 0400) == -1) {
+        return -1;
+    }
+    char* finished = strdup(path);
+    strcpy(finished + strlen(finished) - strlen(".open"), ".seg");
+    int result = rename(path, finished);
+    free(finished);
+    return result;
+}
+
+static struct ARCHIVE_OPEN_SEGMENT* open_segment(struct ARCHIVER* archiver, const char* session_id,
+                                                 unsigned long long now_ms) {
+    struct ARCHIVE_HEADER header = {.magic = ARCHIVE_MAGIC, .version = 1};
+    memcpy(header.session_id, session_id, strnlen(session_id, ARCHIVE_NAME_MAX - 1));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.start_us = (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+    char prefix[PREFIX_MAX];
+    archive_file_prefix(session_id, prefix);
+    char name[FILE_NAME_MAX];
+    char* path = NULL;
+    int fd = -1;
+    for (int attempt = 0; attempt < 100 && fd == -1; attempt++) {
+        // a finished segment could have the name too, if the clock went back
+        snprintf(name, sizeof(name), "%s%020llu.seg", prefix, header.start_us);
+        path = dir_path(archiver->dir, name);
+        int taken = access(path, F_OK) == 0;
+        free(path);
+        snprintf(name, sizeof(name), "%s%020llu.open", prefix, header.start_us);
+        path = dir_path(archiver->dir, name);
+        fd = taken ? -1 : open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd == -1) {
+            free(path);
+            path = NULL;
+            if (!taken && errno != EEXIST) {
+                return NULL;
+            }
+            header.start_us++;
+        }
+    }
+    if (fd == -1) {
+        return NULL;
+    }
+    if (write_all(fd, &header, sizeof(header)) == -1) {
+        close(fd);
+        unlink(path);
+        free(path);
+        return NULL;
+    }
+
+    struct ARCHIVE_OPEN_SEGMENT* segment = calloc(1, sizeof(struct ARCHIVE_OPEN_SEGMENT));
+    strcpy(segment->session_id, header.session_id);
+    segment->path = path;
+    segment->fd = fd;
+    segment->size = sizeof(header);
+    segment->started_ms = now_ms;
+    segment->block = malloc(ARCHIVE_BLOCK_SIZE);
+    segment->next = archiver->open;
+    archiver->open = segment;
+    archiver->num_open++;
+    return segment;
+}
+
+// Writes out the block being filled. What's in it is lost if the disk won't take it.
+static void write_block(struct ARCHIVER* archiver, struct ARCHIVE_OPEN_SEGMENT* segment, struct ARCHIVE_STATS* done) {
+    struct ARCHIVE_BLOCK* header = &segment->header;
+    if (header->count == 0) {
+        return;
+    }
+    int packed_len = lz_compress(segment->block, header->raw_len, archiver->packed, header->raw_len - 1);
+    const char* data = packed_len > 0 ? archiver->packed : segment->block;
+    header->stored_len = packed_len > 0 ? (unsigned int) packed_len : header->raw_len;
+
+    if (write_all(segment->fd, header, sizeof(*header)) == 0 && write_all(segment->fd, data, header->stored_len) == 0) {
+        if (segment->num_blocks == segment->index_capacity) {
+            segment->index_capacity = segment->index_capacity == 0 ? 64 : segment->index_capacity * 2;
+            segment->index = realloc(segment->index, segment->index_capacity * sizeof(struct ARCHIVE_INDEX_ENTRY));
+        }
+        segment->index[segment->num_blocks++] = (struct ARCHIVE_INDEX_ENTRY) {.offset = segment->size, .block = *header};
+        segment->size += sizeof(*header) + header->stored_len;
+        done->messages += header->count;
+        done->blocks++;
+        done->raw_bytes += header->raw_len;
+        done->stored_bytes += sizeof(*header) + header->stored_len;
+    } else {
+        // back to the end of the last whole block, or readers stop at the broken one
+        done->dropped += header->count;
+        if (ftruncate(segment->fd, segment->size) == 0) {
+            lseek(segment->fd, segment->size, SEEK_SET);
+        }
+    }
+    memset(header, 0, sizeof(*header));
+}
+
+static void finish_segment(struct ARCHIVER* archiver, struct ARCHIVE_OPEN_SEGMENT* segment, struct ARCHIVE_STATS* done) {
+    write_block(archiver, segment, done);
+    struct ARCHIVE_OPEN_SEGMENT** link = &archiver->open;
+    while (*link != segment) {
+        link = &(*link)->next;
+    }
+    *link = segment->next;
+    archiver->num_open--;
+
+    // if it can't be finished it stays .open, and the next server to start here tries again
+    if (finish_file(segment->fd, segment->path, segment->size, segment->index, segment->num_blocks) == 0) {
+        done->segments++;
+    }
+    close(segment->fd);
+    free(segment->path);
+    free(segment->index);
+    free(segment->block);
+    free(segment);
+}
+
+static void archive_item(struct ARCHIVER* archiver, struct ARCHIVE_ITEM* item, unsigned long long now_ms,
+                         struct ARCHIVE_STATS* done) {
+    struct ARCHIVE_OPEN_SEGMENT** link = &archiver->open;
+    while (*link != NULL && strcmp((*link)->session_id, item->session_id) != 0) {
+        link = &(*link)->next;
+    }
+    struct ARCHIVE_OPEN_SEGMENT* segment = *link;
+    if (segment != NULL) {
+        // to the front, so the one at the end is the one that has waited longest
+        *link = segment->next;
+        segment->next = archiver->open;
+        archiver->open = segment;
+    } else {
+        if (archiver->num_open == ARCHIVE_MAX_OPEN) {
+            struct ARCHIVE_OPEN_SEGMENT* last = archiver->open;
+            while (last->next != NULL) {
+                last = last->next;
+            }
+            finish_segment(archiver, last, done);
+        }
+        segment = open_segment(archiver, item->session_id, now_ms);
+        if (segment == NULL) {
+            done->dropped++;
+            return;
+        }
+    }
+
+    struct ARCHIVE_RECORD record = {.seq = item->seq, .time_us = item->time_us, .len = item->len};
+    struct ARCHIVE_BLOCK* header = &segment->header;
+    if (header->raw_len + sizeof(record) + item->len > ARCHIVE_BLOCK_SIZE) {
+        write_block(archiver, segment, done);
+        if (segment->size >= archiver->segment_size) {
+            finish_segment(archiver, segment, done);
+            archive_item(archiver, item, now_ms, done);
+            return;
+        }
+    }
+    if (header->count == 0) {
+        header->min_seq = header->max_seq = item->seq;
+        header->min_us = header->max_us = item->time_us;
+        segment->block_started_ms = now_ms;
+    }
+    memcpy(segment->block + header->raw_len, &record, sizeof(record));
+    memcpy(segment->block + header->raw_len + sizeof(record), item->frame, item->len);
+    header->raw_len += sizeof(record) + item->len;
+    header->count++;
+    header->min_seq = item->seq < header->min_seq ? item->seq : header->min_seq;
+    header->max_seq = item->seq > header->max_seq ? item->seq : header->max_seq;
+    header->min_us = item->time_us < header->min_us ? item->time_us : header->min_us;
+    header->max_us = item->time_us > header->max_us ? item->time_us : header->max_us;
+}
+
+// Appends items to the spill file and frees them. A record that's only partly written is
+// past spill_end, where the next one overwrites it.
+static void spill_items(struct ARCHIVER* archiver, struct ARCHIVE_ITEM* items, struct ARCHIVE_STATS* done) {
+    while (items != NULL) {
+        struct ARCHIVE_ITEM* next = items->next;
+        if (archiver->spill_fd == -1) {
+            char* path = dir_path(archiver->dir, ARCHIVE_SPILL_NAME);
+            archiver->spill_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            free(path);
+        }
+        struct SPILL_RECORD header = {.record = {.seq = items->seq, .time_us = items->time_us, .len = items->len}};
+        strcpy(header.session_id, items->session_id);
+        if (archiver->spill_fd != -1 && pwrite_all(archiver->spill_fd, &header, sizeof(header), archiver->spill_end) == 0
+            && pwrite_all(archiver->spill_fd, items->frame, items->len, archiver->spill_end + sizeof(header)) == 0) {
+            archiver->spill_end += sizeof(header) + items->len;
+            done->spilled++;
+        } else {
+            done->dropped++;
+        }
+        free(items);
+        items = next;
+    }
+}
+
+// Archives what's queued, and spills what overflowed after it. Whatever is on the queue came
+// before anything on the overflow list, so it can't wait for the spill file to be through.
+static void take_queues(struct ARCHIVER* archiver, unsigned long long now_ms, struct ARCHIVE_STATS* done) {
+    pthread_mutex_lock(&archiver->lock);
+    struct ARCHIVE_ITEM* items = archiver->head;
+    struct ARCHIVE_ITEM* overflow = archiver->overflow_head;
+    archiver->head = NULL;
+    archiver->tail = NULL;
+    archiver->stats.queued_bytes = 0;
+    archiver->overflow_head = NULL;
+    archiver->overflow_tail = NULL;
+    archiver->overflow_bytes = 0;
+    pthread_mutex_unlock(&archiver->lock);
+
+    while (items != NULL) {
+        struct ARCHIVE_ITEM* next = items->next;
+        archive_item(archiver, items, now_ms, done);
+        free(items);
+        items = next;
+    }
+    spill_items(archiver, overflow, done);
+}
+
+// Archives the spill file from spill_read up to spill_end, which is always the end of a record.
+// Every SPILL_TAKE_EVERY records the queues are taken again, so the overflow list has room
+// long before the spill file is through.
+static void drain_spill(struct ARCHIVER* archiver, unsigned long long now_ms, struct ARCHIVE_STATS* done) {
+    if (archiver->spill_buf == NULL) {
+        archiver->spill_buf = malloc(ARCHIVE_SPILL_CHUNK);
+    }
+    struct ARCHIVE_ITEM* item = malloc(sizeof(struct ARCHIVE_ITEM) + ARCHIVE_BLOCK_SIZE);
+    unsigned int archived = 0;
+    while (archiver->spill_read < archiver->spill_end) {
+        unsigned long long left = archiver->spill_end - archiver->spill_read;
+        size_t want = left < ARCHIVE_SPILL_CHUNK ? left : ARCHIVE_SPILL_CHUNK;
+        ssize_t got = pread(archiver->spill_fd, archiver->spill_buf, want, archiver->spill_read);
+        size_t pos = 0;
+        while (got > 0 && pos + sizeof(struct SPILL_RECORD) <= (size_t) got) {
+            if (++archived % SPILL_TAKE_EVERY == 0) {
+                take_queues(archiver, now_ms, done);
+            }
+            struct SPILL_RECORD header;
+            memcpy(&header, archiver->spill_buf + pos, sizeof(header));
+            if (header.record.len > ARCHIVE_BLOCK_SIZE || pos + sizeof(header) + header.record.len > (size_t) got) {
+                break;
+            }
+            memcpy(item->session_id, header.session_id, ARCHIVE_NAME_MAX);
+            item->session_id[ARCHIVE_NAME_MAX - 1] = '\0';
+            item->seq = header.record.seq;
+            item->time_us = header.record.time_us;
+            item->len = header.record.len;
+            memcpy(item->frame, archiver->spill_buf + pos + sizeof(header), item->len);
+            archive_item(archiver, item, now_ms, done);
+            pos += sizeof(header) + header.record.len;
+        }
+        if (pos == 0) {
+            // a chunk always holds a whole record, so the rest can't be read back
+            done->dropped++;
+            archiver->spill_read = archiver->spill_end;
+            break;
+        }
+        archiver->spill_read += pos;
+        take_queues(archiver, now_ms, done);
+    }
+    free(item);
+}
+
+// Writes out blocks that have waited long enough, and finishes segments that are old enough
+static void archive_tick(struct ARCHIVER* archiver, unsigned long long now_ms, struct ARCHIVE_STATS* done) {
+    struct ARCHIVE_OPEN_SEGMENT* segment = archiver->open;
+    while (segment != NULL) {
+        struct ARCHIVE_OPEN_SEGMENT* next = segment->next;
+        if (segment->header.count > 0 && now_ms - segment->block_started_ms >= ARCHIVE_FLUSH_S * 1000) {
+            write_block(archiver, segment, done);
+        }
+        if (segment->size >= archiver->segment_size || now_ms - segment->started_ms >= ARCHIVE_SEAL_S * 1000ULL) {
+            finish_segment(archiver, segment, done);
+        }
+        segment = next;
+    }
+}
+
+static void* archiver_main(void* arg) {
+    struct ARCHIVER* archiver = arg;
+    pthread_mutex_lock(&archiver->lock);
+    while (1) {
+        if (archiver->head == NULL && archiver->overflow_head == NULL && !archiver->stopping
+            && archiver->spill_read == archiver->spill_end) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += ARCHIVE_FLUSH_S;
+            pthread_cond_timedwait(&archiver->wake, &archiver->lock, &deadline);
+        }
+        int stopping = archiver->stopping;
+        pthread_mutex_unlock(&archiver->lock);
+
+        struct ARCHIVE_STATS done = {0};
+        unsigned long long now_ms = monotonic_ms();
+        take_queues(archiver, now_ms, &done);
+        drain_spill(archiver, now_ms, &done);
+        archive_tick(archiver, now_ms, &done);
+        if (archiver->spill_end != 0 && archiver->spill_read == archiver->spill_end
+            && ftruncate(archiver->spill_fd, 0) == 0) {
+            archiver->spill_end = 0;
+            archiver->spill_read = 0;
+        }
+        // nothing is added once it's stopping, but there can be more spilled to get to
+        while (stopping && archiver->open != NULL && archiver->spill_read == archiver->spill_end) {
+            finish_segment(archiver, archiver->open, &done);
+        }
+        if (done.dropped > 0) {
+            printf("Error - %llu messages couldn't be archived, the archive has a gap\n", done.dropped);
+        }
+
+        pthread_mutex_lock(&archiver->lock);
+        if (archiver->overflow_head == NULL && archiver->spill_read == archiver->spill_end) {
+            // caught up, so messages can be queued again
+            archiver->spilling = 0;
+        }
+        archiver->stats.spilled += done.spilled;
+        archiver->stats.spill_bytes = archiver->spill_end - archiver->spill_read;
+        archiver->stats.messages += done.messages;
+        archiver->stats.dropped += done.dropped;
+        archiver->stats.blocks += done.blocks;
+        archiver->stats.segments += done.segments;
+        archiver->stats.raw_bytes += done.raw_bytes;
+        archiver->stats.stored_bytes += done.stored_bytes;
+        if (stopping && archiver->head == NULL && archiver->overflow_head == NULL
+            && archiver->spill_read == archiver->spill_end) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&archiver->lock);
+    return NULL;
+}
+
+// Finishes a segment a server didn't get to, with the blocks that made it to the disk whole.
+// Returns 1 if it did, 0 if there was nothing in it, -1 if it couldn't.
+static int recover_segment(const char* path) {
+    struct ARCHIVE_SEGMENT_READER reader;
+    if (archive_segment_open(&reader, path) == -1) {
+        struct stat st;
+        if (stat(path, &st) == 0 && st.st_size < (off_t) sizeof(struct ARCHIVE_HEADER)) {
+            // cut off before its header was, so there's nothing in it
+            return unlink(path) == 0 ? 0 : -1;
+        }
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    int result = fd == -1 ? -1 : finish_file(fd, path, reader.end, reader.index, reader.num_blocks) + 1;
+    if (fd != -1) {
+        close(fd);
+    }
+    archive_segment_close(&reader);
+    return result;
+}
+
+// Takes up the spill file a server left, up to its last whole record
+static void reopen_spill(struct ARCHIVER* archiver, const char* dir) {
+    char* path = dir_path(dir, ARCHIVE_SPILL_NAME);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        free(path);
+        return;
+    }
+    unsigned long long end = 0;
+    struct SPILL_RECORD header;
+    while (pread(fd, &header, sizeof(header), end) == sizeof(header) && header.record.len <= ARCHIVE_BLOCK_SIZE
+           && end + sizeof(header) + header.record.len <= (unsigned long long) st.st_size) {
+        end += sizeof(header) + header.record.len;
+    }
+    if (end == 0 || ftruncate(fd, end) == -1) {
+        close(fd);
+        unlink(path);
+    } else {
+        archiver->spill_fd = fd;
+        archiver->spill_end = end;
+        archiver->spilling = 1;
+        archiver->stats.spill_bytes = end;
+    }
+    free(path);
+}
+
+int archiver_start(struct ARCHIVER* archiver, const char* dir, size_t segment_size, size_t queue_limit) {
+    memset(archiver, 0, sizeof(struct ARCHIVER));
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        return -1;
+    }
+    int recovered = 0;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len > strlen(".open") && strcmp(entry->d_name + len - strlen(".open"), ".open") == 0) {
+            char* path = dir_path(dir, entry->d_name);
+            recovered += (recover_segment(path) == 1);
+            free(path);
+        }
+    }
+    closedir(d);
+    archiver->spill_fd = -1;
+    reopen_spill(archiver, dir);
+
+    archiver->dir = strdup(dir);
+    archiver->segment_size = segment_size;
+    archiver->queue_limit = queue_limit;
+    archiver->packed = malloc(ARCHIVE_BLOCK_SIZE);
+    pthread_mutex_init(&archiver->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&archiver->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    int error = pthread_create(&archiver->thread, NULL, archiver_main, archiver);
+    if (error != 0) {
+        pthread_cond_destroy(&archiver->wake);
+        pthread_mutex_destroy(&archiver->lock);
+        free(archiver->dir);
+        free(archiver->packed);
+        if (archiver->spill_fd != -1) {
+            close(archiver->spill_fd);
+        }
+        archiver->dir = NULL;
+        errno = error;
+        return -1;
+    }
+    return recovered;
+}
+
+int archiver_add(struct ARCHIVER* archiver, const char* session_id, unsigned long long seq, unsigned long long time_us,
+                 const char* frame, size_t len) {
+    size_t size = sizeof(struct ARCHIVE_ITEM) + len;
+    struct ARCHIVE_ITEM* item = len + sizeof(struct ARCHIVE_RECORD) <= ARCHIVE_BLOCK_SIZE ? malloc(size) : NULL;
+    if (item != NULL) {
+        item->next = NULL;
+        size_t id_len = strnlen(session_id, ARCHIVE_NAME_MAX - 1);
+        memcpy(item->session_id, session_id, id_len);
+        item->session_id[id_len] = '\0';
+        item->seq = seq;
+        item->time_us = time_us;
+        item->len = len;
+        memcpy(item->frame, frame, len);
+    }
+
+    pthread_mutex_lock(&archiver->lock);
+    if (item == NULL) {
+        archiver->stats.dropped++;
+        pthread_mutex_unlock(&archiver->lock);
+        errno = EMSGSIZE;
+        return -1;
+    }
+    // once anything overflows, so does everything after it, until the thread has caught up
+    if (archiver->spilling || archiver->stats.queued_bytes + size > archiver->queue_limit) {
+        if (archiver->overflow_bytes + size > archiver->queue_limit) {
+            archiver->stats.dropped++;
+            pthread_mutex_unlock(&archiver->lock);
+            free(item);
+            errno = ENOBUFS;
+            return -1;
+        }
+        if (archiver->overflow_tail != NULL) {
+            archiver->overflow_tail->next = item;
+        } else {
+            archiver->overflow_head = item;
+            pthread_cond_signal(&archiver->wake);
+        }
+        archiver->overflow_tail = item;
+        archiver->overflow_bytes += size;
+        archiver->spilling = 1;
+        pthread_mutex_unlock(&archiver->lock);
+        return 0;
+    }
+    if (archiver->tail != NULL) {
+        archiver->tail->next = item;
+    } else {
+        archiver->head = item;
+    }
+    archiver->tail = item;
+    // the thread comes by every ARCHIVE_FLUSH_S anyway
+    size_t wake_at = archiver->queue_limit / 2 < ARCHIVE_BLOCK_SIZE ? archiver->queue_limit / 2 : ARCHIVE_BLOCK_SIZE;
+    if (archiver->stats.queued_bytes < wake_at && archiver->stats.queued_bytes + size >= wake_at) {
+        pthread_cond_signal(&archiver->wake);
+    }
+    archiver->stats.queued_bytes += size;
+    pthread_mutex_unlock(&archiver->lock);
+    return 0;
+}
+
+void archiver_stats(struct ARCHIVER* archiver, struct ARCHIVE_STATS* stats) {
+    pthread_mutex_lock(&archiver->lock);
+    *stats = archiver->stats;
+    stats->queued_bytes += archiver->overflow_bytes;
+    pthread_mutex_unlock(&archiver->lock);
+}
+
+void archiver_stop(struct ARCHIVER* archiver) {
+    if (archiver->dir == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&archiver->lock);
+    archiver->stopping = 1;
+    pthread_cond_signal(&archiver->wake);
+    pthread_mutex_unlock(&archiver->lock);
+    pthread_join(archiver->thread, NULL);
+    pthread_cond_destroy(&archiver->wake);
+    pthread_mutex_destroy(&archiver->lock);
+    if (archiver->spill_fd != -1) {
+        // everything in it was archived
+        char* path = dir_path(archiver->dir, ARCHIVE_SPILL_NAME);
+        unlink(path);
+        free(path);
+        close(archiver->spill_fd);
+        archiver->spill_fd = -1;
+    }
+    free(archiver->dir);
+    free(archiver->packed);
+    free(archiver->spill_buf);
+    archiver->dir = NULL;
+    archiver->packed = NULL;
+    archiver->spill_buf = NULL;
+}
+
+int archive_segment_open(struct ARCHIVE_SEGMENT_READER* reader, const char* path) {
+    memset(reader, 0, sizeof(struct ARCHIVE_SEGMENT_READER));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < (off_t) sizeof(struct ARCHIVE_HEADER)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    // only the blocks a scan needs are read, so reading ahead is wasted
+    madvise(map, st.st_size, MADV_RANDOM);
+    reader->map = map;
+    reader->size = st.st_size;
+    memcpy(&reader->header, reader->map, sizeof(reader->header));
+    if (reader->header.magic != ARCHIVE_MAGIC) {
+        archive_segment_close(reader);
+        errno = EINVAL;
+        return -1;
+    }
+    reader->header.session_id[ARCHIVE_NAME_MAX - 1] = '\0';
+
+    // A finished segment ends in its index, which is only used if everything in it is inside
+    // the file. Scans read the blocks where it says they are.
+    struct ARCHIVE_FOOTER footer;
+    if (reader->size >= sizeof(struct ARCHIVE_HEADER) + sizeof(footer)) {
+        memcpy(&footer, reader->map + reader->size - sizeof(footer), sizeof(footer));
+        size_t index_end = reader->size - sizeof(footer);
+        if (footer.magic == ARCHIVE_INDEX_MAGIC) {
+            if (footer.index_offset < sizeof(struct ARCHIVE_HEADER) || footer.index_offset > index_end
+                || (index_end - footer.index_offset) / sizeof(struct ARCHIVE_INDEX_ENTRY) != footer.num_blocks
+                || (index_end - footer.index_offset) % sizeof(struct ARCHIVE_INDEX_ENTRY) != 0) {
+                archive_segment_close(reader);
+                errno = EINVAL;
+                return -1;
+            }
+            size_t index_len = index_end - footer.index_offset;
+            reader->index = malloc(index_len + 1);
+            memcpy(reader->index, reader->map + footer.index_offset, index_len);
+            for (unsigned int b = 0; b < footer.num_blocks; b++) {
+                const struct ARCHIVE_INDEX_ENTRY* entry = &reader->index[b];
+                if (entry->offset < sizeof(struct ARCHIVE_HEADER) || entry->offset > footer.index_offset
+                    || footer.index_offset - entry->offset < sizeof(struct ARCHIVE_BLOCK)
+                    || entry->block.stored_len > footer.index_offset - entry->offset - sizeof(struct ARCHIVE_BLOCK)
+                    || entry->block.raw_len > ARCHIVE_BLOCK_SIZE || entry->block.stored_len > entry->block.raw_len) {
+                    archive_segment_close(reader);
+                    errno = EINVAL;
+                    return -1;
+                }
+            }
+            reader->num_blocks = footer.num_blocks;
+            reader->finished = 1;
+            reader->end = footer.index_offset;
+            return 0;
+        }
+    }
+
+    // One that's still being written (or never was finished) has as many blocks as are whole
+    size_t pos = sizeof(struct ARCHIVE_HEADER);
+    unsigned int capacity = 0;
+    struct ARCHIVE_BLOCK block;
+    while (pos + sizeof(block) <= reader->size) {
+        memcpy(&block, reader->map + pos, sizeof(block));
+        if (block.count == 0 || block.raw_len > ARCHIVE_BLOCK_SIZE || block.stored_len > block.raw_len
+            || pos + sizeof(block) + block.stored_len > reader->size) {
+            break;
+        }
+        if (reader->num_blocks == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            reader->index = realloc(reader->index, capacity * sizeof(struct ARCHIVE_INDEX_ENTRY));
+        }
+        reader->index[reader->num_blocks++] = (struct ARCHIVE_INDEX_ENTRY) {.offset = pos, .block = block};
+        pos += sizeof(block) + block.stored_len;
+    }
+    reader->end = pos;
+    return 0;
+}
+
+void archive_segment_close(struct ARCHIVE_SEGMENT_READER* reader) {
+    if (reader->map != NULL) {
+        munmap((void*) reader->map, reader->size);
+    }
+    free(reader->index);
+    reader->map = NULL;
+    reader->index = NULL;
+}
+
+// The records of a block, decompressed into buf if they have to be. NULL if it's corrupt.
+static const char* block_records(const struct ARCHIVE_SEGMENT_READER* reader, const struct ARCHIVE_INDEX_ENTRY* entry,
+                                 char* buf) {
+    const char* data = reader->map + entry->offset + sizeof(struct ARCHIVE_BLOCK);
+    if (entry->block.stored_len == entry->block.raw_len) {
+        return data;
+    }
+    int len = lz_decompress(data, entry->block.stored_len, buf, ARCHIVE_BLOCK_SIZE);
+    return len == (int) entry->block.raw_len ? buf : NULL;
+}
+
+struct SEGMENT_FILE {
+    unsigned long long start_us;
+    char* name;
+};
+
+static int by_start(const void* a, const void* b) {
+    const struct SEGMENT_FILE* x = a;
+    const struct SEGMENT_FILE* y = b;
+    return x->start_us < y->start_us ? -1 : x->start_us > y->start_us;
+}
+
+long long archive_scan(const char* dir, const char* session_id, enum ARCHIVE_KEY key, unsigned long long from,
+                       unsigned long long to, archive_visitor visit, void* arg, struct ARCHIVE_SCAN_STATS* stats) {
+    struct ARCHIVE_SCAN_STATS ignored;
+    if (stats == NULL) {
+        stats = &ignored;
+    }
+    memset(stats, 0, sizeof(*stats));
+
+    char prefix[PREFIX_MAX];
+    archive_file_prefix(session_id, prefix);
+    size_t prefix_len = strlen(prefix);
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        return -1;
+    }
+    struct SEGMENT_FILE* files = NULL;
+    int num_files = 0;
+    int capacity = 0;
+    struct dirent* dirent;
+    while ((dirent = readdir(d)) != NULL) {
+        char* end;
+        if (strncmp(dirent->d_name, prefix, prefix_len) != 0) {
+            continue;
+        }
+        unsigned long long start_us = strtoull(dirent->d_name + prefix_len, &end, 10);
+        if (end == dirent->d_name + prefix_len || (strcmp(end, ".seg") != 0 && strcmp(end, ".open") != 0)) {
+            continue;
+        }
+        if (num_files == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            files = realloc(files, capacity * sizeof(struct SEGMENT_FILE));
+        }
+        files[num_files++] = (struct SEGMENT_FILE) {.start_us = start_us, .name = strdup(dirent->d_name)};
+    }
+    closedir(d);
+    qsort(files, num_files, sizeof(struct SEGMENT_FILE), by_start);
+
+    char* buf = malloc(ARCHIVE_BLOCK_SIZE);
+    long long visited = 0;
+    int stopped = 0;
+    for (int f = 0; f < num_files; f++) {
+        char* path = dir_path(dir, files[f].name);
+        struct ARCHIVE_SEGMENT_READER reader;
+        int opened = archive_segment_open(&reader, path);
+        size_t len = strlen(path);
+        if (opened == -1 && errno == ENOENT && strcmp(path + len - strlen(".open"), ".open") == 0) {
+            // finished since the directory was read
+            strcpy(path + len - strlen(".open"), ".seg");
+            opened = archive_segment_open(&reader, path);
+        }
+        free(path);
+        free(files[f].name);
+        if (opened == -1 || stopped) {
+            if (opened == 0) {
+                archive_segment_close(&reader);
+            }
+            continue;
+        }
+        if (strcmp(reader.header.session_id, session_id) != 0) {
+            archive_segment_close(&reader);
+            continue;
+        }
+        stats->segments++;
+        stats->blocks += reader.num_blocks;
+
+        for (unsigned int b = 0; b < reader.num_blocks && !stopped; b++) {
+            const struct ARCHIVE_BLOCK* block = &reader.index[b].block;
+            unsigned long long low = key == ARCHIVE_BY_TIME ? block->min_us : block->min_seq;
+            unsigned long long high = key == ARCHIVE_BY_TIME ? block->max_us : block->max_seq;
+            if (high < from || low > to) {
+                continue;
+            }
+            const char* records = block_records(&reader, &reader.index[b], buf);
+            if (records == NULL) {
+                continue;
+            }
+            stats->blocks_read++;
+            stats->bytes_read += block->raw_len;
+
+            size_t pos = 0;
+            struct ARCHIVE_RECORD record;
+            while (pos + sizeof(record) <= block->raw_len) {
+                memcpy(&record, records + pos, sizeof(record));
+                if (pos + sizeof(record) + record.len > block->raw_len) {
+                    break;
+                }
+                unsigned long long value = key == ARCHIVE_BY_TIME ? record.time_us : record.seq;
+                if (value >= from && value <= to) {
+                    struct ARCHIVE_ENTRY entry = {.seq = record.seq, .time_us = record.time_us,
+                                                  .frame = records + pos + sizeof(record), .len = record.len};
+                    visited++;
+                    if (visit(&entry, arg) != 0) {
+                        stopped = 1;
+                        break;
+                    }
+                }
+                pos += sizeof(record) + record.len;
+            }
+        }
+        archive_segment_close(&reader);
+    }
+    free(files);
+    free(buf);
+    return visited;
+}
@@ -0,0 +1,211 @@
+#ifndef ECE361_TEXTCONFERENCING_ARCHIVE_H
+#define ECE361_TEXTCONFERENCING_ARCHIVE_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * The archive: every session message a server numbers, kept in files under archive_dir for
+ * as long as anyone wants, and read back by time or sequence number range.
+ *
+ * Each session's messages go into segment files named <session>.<start>.seg, where <session>
+ * has everything but letters, digits, - and _ written as %XX, and <start> is the wall clock
+ * microsecond the segment was started. A segment is an ARCHIVE_HEADER, then blocks, then an
+ * index with an ARCHIVE_INDEX_ENTRY per block and an ARCHIVE_FOOTER. A block is an
+ * ARCHIVE_BLOCK followed by its records, LZ compressed (see compress.h) unless that doesn't
+ * make them smaller. A record is an ARCHIVE_RECORD followed by the message as the server sent
+ * it. Blocks hold up to ARCHIVE_BLOCK_SIZE of records, so getting at any one message means
+ * decompressing at most that much.
+ *
+ * While a segment is being written it's <session>.<start>.open, without the index, and its
+ * blocks are found by walking their headers. A block is written once it's full, or once its
+ * first record is ARCHIVE_FLUSH_S old. A segment is finished (the index written, renamed to
+ * .seg and made read-only) once it holds segment_size bytes or is ARCHIVE_SEAL_S old, or when
+ * the server stops. A segment that a server didn't get to finish is finished by the next one
+ * to start.
+ *
+ * The server hands messages to archiver_add, which only copies them onto a queue. A thread of
+ * the archiver's own compresses and writes them, so the event loop never waits on the disk.
+ * It's woken once a block's worth (or half of queue_limit) is queued, and otherwise takes the
+ * queue every ARCHIVE_FLUSH_S, since waking it for every message costs more than the message
+ * does. So a server that's killed loses up to twice ARCHIVE_FLUSH_S of messages.
+ *
+ * If the thread falls queue_limit bytes behind, messages go onto an overflow list instead (of
+ * up to queue_limit bytes too), which the thread appends to a spill file (ARCHIVE_SPILL_NAME in
+ * archive_dir) before anything else, and between stretches of archiving what's in the file.
+ * Messages keep going that way until the thread has caught up with all of it, so they're
+ * archived in the order they came. A spill file a server left behind is archived by the next
+ * one to start, all of it, so some messages can be in the archive twice. Messages are only
+ * dropped when the overflow list is full too, or the disk won't take them, and are then
+ * counted, since an archive with gaps in it has to say so.
+ *
+ * Readers map segments read-only, and use the index to decompress only the blocks that can
+ * hold the range, one at a time, so a range of any length takes a block's worth of memory.
+ * Sequence numbers start over when a session is made again after everyone left it, so a
+ * range of them can match messages from more than one run of the session.
+ */
+
+#define ARCHIVE_MAGIC 0x31435241       // "ARC1"
+#define ARCHIVE_INDEX_MAGIC 0x58444e49 // "INDX"
+#define ARCHIVE_BLOCK_SIZE (64 * 1024)
+#define ARCHIVE_FLUSH_S 1
+#define ARCHIVE_SEAL_S 3600
+// Segments being written at once, the one that has waited longest is finished to make room
+#define ARCHIVE_MAX_OPEN 64
+#define ARCHIVE_NAME_MAX 64
+// No segment's name is without a '.'
+#define ARCHIVE_SPILL_NAME "spill"
+// Read back from the spill file at a time
+#define ARCHIVE_SPILL_CHUNK (1024 * 1024)
+
+struct ARCHIVE_HEADER {
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long start_us;
+    char session_id[ARCHIVE_NAME_MAX];
+};
+
+struct ARCHIVE_BLOCK {
+    unsigned int stored_len;         // bytes that follow
+    unsigned int raw_len;            // of the records, the same as stored_len if they aren't compressed
+    unsigned int count;              // records
+    unsigned int reserved;
+    // of the records in it, which aren't necessarily in order (see above, and clocks get set back)
+    unsigned long long min_seq;
+    unsigned long long max_seq;
+    unsigned long long min_us;
+    unsigned long long max_us;
+};
+
+struct ARCHIVE_INDEX_ENTRY {
+    unsigned long long offset;       // of the block in the segment
+    struct ARCHIVE_BLOCK block;
+};
+
+struct ARCHIVE_FOOTER {
+    unsigned long long index_offset;
+    unsigned int num_blocks;
+    unsigned int magic;
+};
+
+struct ARCHIVE_RECORD {
+    unsigned long long seq;
+    unsigned long long time_us;      // wall clock, when the server numbered it
+    unsigned int len;                // of the message that follows
+    unsigned int reserved;
+};
+
+struct ARCHIVE_STATS {
+    unsigned long long messages;     // written
+    unsigned long long dropped;      // because the disk wouldn't take them, the archive has gaps if any were
+    unsigned long long spilled;      // to the file, because the queue was full
+    unsigned long long blocks;
+    unsigned long long segments;     // finished
+    unsigned long long raw_bytes;    // of the records in the blocks written
+    unsigned long long stored_bytes; // what they took on disk
+    size_t queued_bytes;             // on the queue and the overflow list
+    unsigned long long spill_bytes;  // in the spill file, not yet archived
+};
+
+struct ARCHIVE_ITEM {
+    struct ARCHIVE_ITEM* next;
+    char session_id[ARCHIVE_NAME_MAX];
+    unsigned long long seq;
+    unsigned long long time_us;
+    unsigned int len;
+    char frame[];
+};
+
+struct ARCHIVE_OPEN_SEGMENT;
+
+struct ARCHIVER {
+    char* dir;                       // NULL when not archiving
+    size_t segment_size;
+    size_t queue_limit;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    // the queues and the stats are under lock
+    struct ARCHIVE_ITEM* head;
+    struct ARCHIVE_ITEM* tail;
+    struct ARCHIVE_ITEM* overflow_head; // for the thread to spill
+    struct ARCHIVE_ITEM* overflow_tail;
+    size_t overflow_bytes;
+    int spilling;                    // everything goes to overflow until the thread has caught up
+    int stopping;
+    struct ARCHIVE_STATS stats;
+    // only the thread touches these
+    struct ARCHIVE_OPEN_SEGMENT* open;
+    int num_open;
+    char* packed;                    // where blocks are compressed to
+    int spill_fd;                    // -1 until something is spilled
+    unsigned long long spill_end;    // of the last whole record in it, 0 while nothing is spilled
+    unsigned long long spill_read;   // how much of the spill file is archived
+    char* spill_buf;
+};
+
+// Makes dir if it isn't there, finishes any segment left unfinished in it, and starts the
+// thread, which archives any spill file left there first. Returns how many segments it
+// finished, or -1 (with errno set) if dir can't be used.
+int archiver_start(struct ARCHIVER* archiver, const char* dir, size_t segment_size, size_t queue_limit);
+
+// Queues a copy of a message for the thread, or puts it on the overflow list if the queue is
+// full. Returns -1 (with errno set) if it was dropped.
+int archiver_add(struct ARCHIVER* archiver, const char* session_id, unsigned long long seq, unsigned long long time_us,
+                 const char* frame, size_t len);
+
+void archiver_stats(struct ARCHIVER* archiver, struct ARCHIVE_STATS* stats);
+
+// Writes out everything queued, finishes every segment and stops the thread
+void archiver_stop(struct ARCHIVER* archiver);
+
+// Reading a segment back, from a read-only mapping of the whole file
+struct ARCHIVE_SEGMENT_READER {
+    const char* map;
+    size_t size;
+    struct ARCHIVE_HEADER header;
+    struct ARCHIVE_INDEX_ENTRY* index;
+    unsigned int num_blocks;
+    int finished;                    // 0 for a .open segment, whose blocks were found by walking them
+    size_t end;                      // of the last whole block
+};
+
+// Returns -1 (with errno set, or EINVAL if it isn't a segment or its index points outside it) if the
+// file can't be used
+int archive_segment_open(struct ARCHIVE_SEGMENT_READER* reader, const char* path);
+
+void archive_segment_close(struct ARCHIVE_SEGMENT_READER* reader);
+
+enum ARCHIVE_KEY {
+    ARCHIVE_BY_TIME,
+    ARCHIVE_BY_SEQ
+};
+
+struct ARCHIVE_ENTRY {
+    unsigned long long seq;
+    unsigned long long time_us;
+    const char* frame;               // the message as it was sent, only good until the visitor returns
+    unsigned int len;
+};
+
+// Called with every message in range, a segment at a time in the order they were started.
+// Returning anything but 0 stops the scan.
+typedef int (*archive_visitor)(const struct ARCHIVE_ENTRY* entry, void* arg);
+
+// What a scan had to look at
+struct ARCHIVE_SCAN_STATS {
+    unsigned int segments;
+    unsigned long long blocks;       // in the segments
+    unsigned long long blocks_read;  // that could hold the range, and were decompressed
+    unsigned long long bytes_read;   // decompressed
+};
+
+// Visits the session's messages whose key is in [from, to]. Returns how many were visited, or
+// -1 (with errno set) if dir can't be read. stats may be NULL.
+long long archive_scan(const char* dir, const char* session_id, enum ARCHIVE_KEY key, unsigned long long from,
+                       unsigned long long to, archive_visitor visit, void* arg, struct ARCHIVE_SCAN_STATS* stats);
+
+// Writes what a session's segment files start with, "<session>.", to out (3 * ARCHIVE_NAME_MAX + 2 bytes)
+void archive_file_prefix(const char* session_id, char* out);
+
+#endif //ECE361_TEXTCONFERENCING_ARCHIVE_H
@@ -0,0 +1,173 @@
+#define _GNU_SOURCE // strptime, timegm
+// Reads a server's archive (see archive.h) back out, one line per message:
+//     <time> <seq> <source>: <text>
+// with the time in UTC, as the server numbered the message.
+// Usage: archive_export list <dir> <session>
+//            the session's segments, with the time and sequence numbers each covers
+//        archive_export time <dir> <session> [from] [to]
+//            the messages from from to to, in unix seconds or YYYY-MM-DDTHH:MM:SS (UTC);
+//            everything by default
+//        archive_export seq <dir> <session> <from> <to>
+//            the messages numbered from to to
+// Messages are written as their blocks are decompressed, so a range of any length takes a
+// block's worth of memory, and segments are mapped rather than read, so only the blocks that
+// can hold the range come off the disk. What was read to find them goes to stderr.
+// It can run while the server is writing the archive, and sees what the server has written
+// out so far (up to ARCHIVE_FLUSH_S behind).
+#include "archive.h"
+#include "packet.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Unix seconds, or YYYY-MM-DDTHH:MM:SS in UTC. Returns -1 if it's neither.
+static int parse_time(const char* arg, unsigned long long* us) {
+    char* end;
+    unsigned long long seconds = strtoull(arg, &end, 10);
+    if (end != arg && *end == '\0') {
+        *us = seconds * 1000000;
+        return 0;
+    }
+    struct tm tm = {0};
+    end = strptime(arg, "%Y-%m-%dT%H:%M:%S", &tm);
+    if (end == NULL || *end != '\0') {
+        return -1;
+    }
+    *us = (unsigned long long) timegm(&tm) * 1000000;
+    return 0;
+}
+
+static void format_time(unsigned long long us, char* out, size_t size) {
+    time_t seconds = us / 1000000;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    size_t len = strftime(out, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(out + len, size - len, ".%06lluZ", us % 1000000);
+}
+
+static int print_entry(const struct ARCHIVE_ENTRY* entry, void* arg) {
+    unsigned long long* unreadable = arg;
+    struct message* msg = buf_to_message(entry->frame, entry->len);
+    if (msg == NULL) {
+        (*unreadable)++;
+        return 0;
+    }
+    char when[64];
+    format_time(entry->time_us, when, sizeof(when));
+    printf("%s %llu %s: %s\n", when, entry->seq, msg->source, msg->data);
+    free(msg);
+    return 0;
+}
+
+static int by_name(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+static int list(const char* dir, const char* session_id) {
+    char prefix[3 * ARCHIVE_NAME_MAX + 2];
+    archive_file_prefix(session_id, prefix);
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        printf("Error - can't read %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    // the start times are zero-padded, so by name is by time
+    char** names = NULL;
+    int num_names = 0;
+    struct dirent* dirent;
+    while ((dirent = readdir(d)) != NULL) {
+        if (strncmp(dirent->d_name, prefix, strlen(prefix)) == 0) {
+            names = realloc(names, (num_names + 1) * sizeof(char*));
+            names[num_names++] = strdup(dirent->d_name);
+        }
+    }
+    closedir(d);
+    qsort(names, num_names, sizeof(char*), by_name);
+
+    for (int i = 0; i < num_names; i++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        struct ARCHIVE_SEGMENT_READER reader;
+        if (archive_segment_open(&reader, path) == -1) {
+            printf("%s: can't be read: %s\n", names[i], strerror(errno));
+            free(names[i]);
+            continue;
+        }
+        unsigned long long messages = 0;
+        unsigned long long raw = 0;
+        unsigned long long min_seq = 0, max_seq = 0, min_us = 0, max_us = 0;
+        for (unsigned int b = 0; b < reader.num_blocks; b++) {
+            const struct ARCHIVE_BLOCK* block = &reader.index[b].block;
+            if (b == 0 || block->min_seq < min_seq) {
+                min_seq = block->min_seq;
+            }
+            if (b == 0 || block->min_us < min_us) {
+                min_us = block->min_us;
+            }
+            max_seq = block->max_seq > max_seq ? block->max_seq : max_seq;
+            max_us = block->max_us > max_us ? block->max_us : max_us;
+            messages += block->count;
+            raw += block->raw_len;
+        }
+        char from[64], to[64];
+        format_time(min_us, from, sizeof(from));
+        format_time(max_us, to, sizeof(to));
+        printf("%s: %s, %llu messages in %u blocks, %llu bytes stored as %zu", names[i],
+               reader.finished ? "finished" : "being written", messages, reader.num_blocks, raw, reader.end);
+        if (messages > 0) {
+            printf(", seq %llu to %llu, %s to %s", min_seq, max_seq, from, to);
+        }
+        printf("\n");
+        archive_segment_close(&reader);
+        free(names[i]);
+    }
+    free(names);
+    return 0;
+}
+
+int main(int argc, const char** argv) {
+    int by_time = argc >= 4 && argc <= 6 && strcmp(argv[1], "time") == 0;
+    int by_seq = argc == 6 && strcmp(argv[1], "seq") == 0;
+    if (argc == 4 && strcmp(argv[1], "list") == 0) {
+        return list(argv[2], argv[3]);
+    }
+    if (!by_time && !by_seq) {
+        printf("Usage: archive_export list <dir> <session>\n"
+               "       archive_export time <dir> <session> [from] [to]\n"
+               "       archive_export seq <dir> <session> <from> <to>\n"
+               "Times are unix seconds or YYYY-MM-DDTHH:MM:SS, in UTC\n");
+        return 1;
+    }
+
+    unsigned long long from = 0;
+    unsigned long long to = -1ULL;
+    if (by_seq) {
+        from = strtoull(argv[4], NULL, 10);
+        to = strtoull(argv[5], NULL, 10);
+    } else if ((argc > 4 && parse_time(argv[4], &from) == -1) || (argc > 5 && parse_time(argv[5], &to) == -1)) {
+        printf("Error - times are unix seconds or YYYY-MM-DDTHH:MM:SS\n");
+        return 1;
+    } else if (argc > 5) {
+        // to the end of that second
+        to += 999999;
+    }
+
+    // whatever the server allowed, it might have sent
+    max_data = MAX_DATA_LIMIT;
+    unsigned long long unreadable = 0;
+    struct ARCHIVE_SCAN_STATS stats;
+    long long count = archive_scan(argv[2], argv[3], by_seq ? ARCHIVE_BY_SEQ : ARCHIVE_BY_TIME, from, to, print_entry,
+                                   &unreadable, &stats);
+    if (count == -1) {
+        printf("Error - can't read %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+    fflush(stdout);
+    fprintf(stderr, "%lld messages (%llu unreadable), from %llu of %llu blocks in %u segments, %llu bytes decompressed\n",
+            count - (long long) unreadable, unreadable, stats.blocks_read, stats.blocks, stats.segments, stats.bytes_read);
+    return 0;
+}
@@ -0,0 +1,230 @@
+// Measures file transfer throughput through a running server, next to what a plain
+// loopback TCP connection manages on the same machine.
+// Usage: bench_blob <server-port> <sender> <password> <receiver> <password> [MB]
+// Both users have to exist (see login.txt), the file is sent to the receiver as a DM.
+// Start the server with splice=0 to see the buffered relay instead.
+#include "packet.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define DEFAULT_MB 256
+#define HEADER_ROOM (MAX_OPTIONS_LEN + 100)
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void send_all(int sockfd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sockfd, buf, len, 0);
+        if (n == -1) {
+            printf("Error sending: %s\n", strerror(errno));
+            exit(1);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void send_message(int sockfd, struct message* msg) {
+    int len;
+    char* buf = encode_message(msg, -1, &len);
+    send_all(sockfd, buf, len);
+    free(buf);
+}
+
+static int connect_local(int port) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sockfd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        printf("Error connecting to port %d: %s\n", port, strerror(errno));
+        exit(1);
+    }
+    return sockfd;
+}
+
+// Reads frames until an ack or nak shows up, and exits on the nak
+static struct message* wait_for(int sockfd, unsigned int ack, unsigned int nak) {
+    static char buf[BLOB_CHUNK_MAX + 2 * MAX_STR_LEN];
+    static int buf_len = 0;
+    while (1) {
+        int len;
+        while ((len = frame_length(buf, buf_len)) > 0) {
+            struct message* msg = buf_to_message(buf, len);
+            memmove(buf, buf + len, buf_len - len);
+            buf_len -= len;
+            if (msg != NULL && msg->type == ack) {
+                return msg;
+            }
+            if (msg != NULL && msg->type == nak) {
+                printf("Error: %s\n", msg->data);
+                exit(1);
+            }
+            free(msg);
+        }
+        int n = recv(sockfd, buf + buf_len, sizeof(buf) - buf_len, 0);
+        if (n <= 0) {
+            printf("Error: the server closed the connection\n");
+            exit(1);
+        }
+        buf_len += n;
+    }
+}
+
+static int login(int port, const char* user, const char* password) {
+    int sockfd = connect_local(port);
+    struct message msg;
+    message_init(&msg, LOGIN);
+    strcpy(msg.source, user);
+    message_printf(&msg, "%s", password);
+    send_message(sockfd, &msg);
+    free(wait_for(sockfd, LO_ACK, LO_NAK));
+    return sockfd;
+}
+
+// The receiving side: counts payload bytes until BLOB_END (or EOF for the baseline)
+struct RECEIVER {
+    int sockfd;
+    int framed;
+    unsigned long long bytes;
+    double finished;
+};
+
+static void* receive(void* arg) {
+    struct RECEIVER* receiver = arg;
+    char* buf = malloc(BLOB_CHUNK_MAX + 2 * MAX_STR_LEN);
+    int buf_len = 0;
+    int done = 0;
+    while (!done) {
+        int n = recv(receiver->sockfd, buf + buf_len, BLOB_CHUNK_MAX + 2 * MAX_STR_LEN - buf_len, 0);
+        if (n <= 0) {
+            break;
+        }
+        if (!receiver->framed) {
+            receiver->bytes += n;
+            continue;
+        }
+        buf_len += n;
+
+        int offset = 0;
+        int len;
+        while ((len = frame_length(buf + offset, buf_len - offset)) > 0) {
+            unsigned int type;
+            int size;
+            frame_header(buf + offset, len, &type, &size);
+            if (type == BLOB_CHUNK) {
+                receiver->bytes += size - 1;
+            } else if (type == BLOB_END) {
+                done = 1;
+            }
+            offset += len;
+        }
+        if (len == -1) {
+            printf("Error: received a malformed frame\n");
+            exit(1);
+        }
+        memmove(buf, buf + offset, buf_len - offset);
+        buf_len -= offset;
+    }
+    receiver->finished = now_seconds();
+    free(buf);
+    return NULL;
+}
+
+static double baseline(unsigned long long total) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(listener, (struct sockaddr*) &addr, sizeof(addr)) == -1 || listen(listener, 1) == -1) {
+        printf("Error setting up the baseline: %s\n", strerror(errno));
+        exit(1);
+    }
+    getsockname(listener, (struct sockaddr*) &addr, &addr_len);
+
+    int sender = connect_local(ntohs(addr.sin_port));
+    struct RECEIVER receiver = {accept(listener, NULL, NULL), 0, 0, 0};
+    pthread_t thread;
+    pthread_create(&thread, NULL, receive, &receiver);
+
+    char* chunk = calloc(1, BLOB_CHUNK_MAX);
+    double start = now_seconds();
+    for (unsigned long long sent = 0; sent < total; sent += BLOB_CHUNK_MAX) {
+        send_all(sender, chunk, BLOB_CHUNK_MAX);
+    }
+    close(sender);
+    pthread_join(thread, NULL);
+    close(receiver.sockfd);
+    close(listener);
+    free(chunk);
+    return receiver.bytes / (receiver.finished - start);
+}
+
+int main(int argc, const char** argv) {
+    if (argc != 6 && argc != 7) {
+        printf("Usage: bench_blob <server-port> <sender> <password> <receiver> <password> [MB]\n");
+        exit(1);
+    }
+    int port = atoi(argv[1]);
+    unsigned long long total = (unsigned long long) (argc == 7 ? atoi(argv[6]) : DEFAULT_MB) * 1024 * 1024;
+    total -= total % BLOB_CHUNK_MAX;
+
+    int sender = login(port, argv[2], argv[3]);
+    struct RECEIVER receiver = {login(port, argv[4], argv[5]), 1, 0, 0};
+
+    struct message offer;
+    message_init(&offer, BLOB_OFFER);
+    offer.blob_id = 1;
+    strcpy(offer.source, argv[2]);
+    message_printf(&offer, "dm %s %llu bench.bin", argv[4], total);
+    send_message(sender, &offer);
+    free(wait_for(sender, BL_ACK, BL_NAK));
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, receive, &receiver);
+
+    char* frame = calloc(1, HEADER_ROOM + BLOB_CHUNK_MAX);
+    char header[HEADER_ROOM];
+    int header_len = blob_chunk_header(header, offer.blob_id, argv[2], BLOB_CHUNK_MAX);
+    memcpy(frame + HEADER_ROOM - header_len, header, header_len);
+    double start = now_seconds();
+    for (unsigned long long sent = 0; sent < total; sent += BLOB_CHUNK_MAX) {
+        send_all(sender, frame + HEADER_ROOM - header_len, header_len + BLOB_CHUNK_MAX);
+    }
+    struct message end;
+    message_init(&end, BLOB_END);
+    end.blob_id = offer.blob_id;
+    strcpy(end.source, argv[2]);
+    send_message(sender, &end);
+    pthread_join(thread, NULL);
+
+    double relay = receiver.bytes / (receiver.finished - start);
+    if (receiver.bytes != total) {
+        printf("Error: sent %llu bytes but %llu arrived\n", total, receiver.bytes);
+        exit(1);
+    }
+    double direct = baseline(total);
+    printf("%llu MB through the server: %8.1f MB/s\n", total >> 20, relay / (1024 * 1024));
+    printf("%llu MB over plain loopback: %8.1f MB/s\n", total >> 20, direct / (1024 * 1024));
+    printf("relay / loopback: %.2f\n", relay / direct);
+    close(sender);
+    close(receiver.sockfd);
+    free(frame);
+    return 0;
+}
@@ -0,0 +1,154 @@
+// Shows what payload compression costs and saves at different thresholds.
+// Usage: bench_compress [chat corpus, one message per line]
+// Without a corpus, a deterministic synthetic one is generated (chat lines plus
+// QU_ACK-style user listings, which is what history replay and /list look like).
+#include "packet.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SYNTHETIC_MESSAGES 20000
+#define ROUNDS 20
+
+static const char* words[] = {
+    "the", "a", "to", "and", "is", "it", "you", "i", "that", "for", "on", "in", "we", "this",
+    "meeting", "session", "lab", "server", "client", "packet", "deadline", "tomorrow", "today",
+    "ok", "yes", "no", "thanks", "please", "can", "someone", "check", "build", "test", "again",
+    "lol", "sounds", "good", "see", "later", "what", "about", "message", "queue", "latency",
+};
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the number of messages put in corpus
+static int synthetic_corpus(char** corpus) {
+    unsigned int state = 361;
+    for (int i = 0; i < SYNTHETIC_MESSAGES; i++) {
+        char* line = malloc(MAX_DATA);
+        int len = 0;
+        if (i % 10 == 9) {
+            // a listing of online users, like QU_ACK
+            while (len < MAX_DATA - 60) {
+                state = state * 1103515245 + 12345;
+                len += sprintf(line + len, "user%u: room%u\n", (state >> 16) % 500, (state >> 8) % 20);
+            }
+        } else {
+            // chat lines are mostly short, with a long tail
+            state = state * 1103515245 + 12345;
+            int num_words = 1 + ((state >> 16) % 8 == 0 ? (state >> 8) % 150 : (state >> 8) % 12);
+            for (int w = 0; w < num_words && len < MAX_DATA - 20; w++) {
+                state = state * 1103515245 + 12345;
+                len += sprintf(line + len, w == 0 ? "%s" : " %s", words[(state >> 16) % (sizeof(words) / sizeof(words[0]))]);
+            }
+        }
+        corpus[i] = line;
+    }
+    return SYNTHETIC_MESSAGES;
+}
+
+static int read_corpus(const char* path, char** corpus, int max) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        printf("Error: can't read %s\n", path);
+        exit(1);
+    }
+    char* line = NULL;
+    size_t cap = 0;
+    int count = 0;
+    ssize_t len;
+    while (count < max && (len = getline(&line, &cap, fp)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (len == 0 || len >= MAX_DATA) {
+            continue;
+        }
+        corpus[count++] = strdup(line);
+    }
+    free(line);
+    fclose(fp);
+    return count;
+}
+
+int main(int argc, const char** argv) {
+    char** corpus = malloc(sizeof(char*) * SYNTHETIC_MESSAGES * 10);
+    int count = argc > 1 ? read_corpus(argv[1], corpus, SYNTHETIC_MESSAGES * 10) : synthetic_corpus(corpus);
+    if (count == 0) {
+        printf("Error: the corpus is empty\n");
+        exit(1);
+    }
+
+    struct message* messages = malloc(count * sizeof(struct message));
+    for (int i = 0; i < count; i++) {
+        message_init(&messages[i], MESSAGE);
+        strcpy(messages[i].source, "benchuser");
+        message_printf(&messages[i], "%s", corpus[i]);
+    }
+
+    // what the messages take up in memory, payloads that don't fit inline included
+    size_t footprint = 0;
+    for (int i = 0; i < count; i++) {
+        footprint += sizeof(struct message) + (messages[i].data_owned ? messages[i].capacity : 0);
+    }
+
+    int thresholds[] = {-1, 0, 64, 128, 256, 512};
+    printf("%d messages, %.1f bytes each in memory (struct message is %zu)\n", count,
+           (double) footprint / count, sizeof(struct message));
+    printf("%10s %14s %8s %14s %14s\n", "threshold", "wire bytes", "ratio", "encode ns/msg", "decode ns/msg");
+
+    long long baseline = 0;
+    for (int t = 0; t < sizeof(thresholds) / sizeof(thresholds[0]); t++) {
+        long long wire = 0;
+        char** frames = malloc(sizeof(char*) * count);
+        int* lengths = malloc(sizeof(int) * count);
+
+        double start = now_seconds();
+        for (int round = 0; round < ROUNDS; round++) {
+            for (int i = 0; i < count; i++) {
+                frames[i] = encode_message(&messages[i], thresholds[t], &lengths[i]);
+                if (round < ROUNDS - 1) {
+                    free(frames[i]);
+                }
+            }
+        }
+        double encode_time = now_seconds() - start;
+
+        start = now_seconds();
+        for (int round = 0; round < ROUNDS; round++) {
+            for (int i = 0; i < count; i++) {
+                struct message* decoded = buf_to_message(frames[i], lengths[i]);
+                if (decoded == NULL || decoded->size != messages[i].size || strcmp(decoded->data, messages[i].data) != 0) {
+                    printf("Error: message %d didn't survive the round trip\n", i);
+                    exit(1);
+                }
+                free(decoded);
+            }
+        }
+        double decode_time = now_seconds() - start;
+
+        for (int i = 0; i < count; i++) {
+            wire += lengths[i];
+            free(frames[i]);
+        }
+        free(frames);
+        free(lengths);
+        if (thresholds[t] == -1) {
+            baseline = wire;
+        }
+
+        char label[16];
+        if (thresholds[t] == -1) {
+            strcpy(label, "off");
+        } else {
+            sprintf(label, "%d", thresholds[t]);
+        }
+        printf("%10s %14lld %8.3f %14.1f %14.1f\n", label, wire, (double) wire / baseline,
+               encode_time * 1e9 / ((double) count * ROUNDS), decode_time * 1e9 / ((double) count * ROUNDS));
+    }
+    return 0;
+}
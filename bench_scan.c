@@ -0,0 +1,150 @@
+// Shows how fast chat payloads are checked for UTF-8 (see scan.h) with each kernel the CPU
+// can run, and how fast frames are found in a receive buffer.
+// Usage: bench_scan [rounds]
+// The payloads are generated deterministically: short chat lines, MAX_DATA-sized ASCII, and
+// MAX_DATA-sized text in a mix of scripts.
+#include "packet.h"
+#include "scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PAYLOADS 20000
+#define DEFAULT_ROUNDS 50
+
+static const char* words[] = {
+    "the", "a", "to", "and", "is", "it", "you", "i", "that", "for", "on", "in", "we", "this",
+    "meeting", "session", "lab", "server", "client", "packet", "deadline", "tomorrow", "today",
+    "ok", "yes", "no", "thanks", "please", "can", "someone", "check", "build", "test", "again",
+};
+
+static const char* unicode_words[] = {
+    "héllo", "wörld", "日本語", "テキスト", "привет", "мир", "γεια", "σου", "שלום", "مرحبا",
+    "안녕", "😀", "🎉", "👍", "naïve", "café", "中文", "聊天",
+};
+
+struct CORPUS {
+    const char* name;
+    char* payloads[PAYLOADS];
+    int lens[PAYLOADS];
+    size_t bytes;
+};
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Words picked at random up to max_len (or fewer for short lines)
+static void generate(struct CORPUS* corpus, const char* name, const char** list, int list_len, int max_len,
+                     int short_lines) {
+    unsigned int state = 361;
+    corpus->name = name;
+    corpus->bytes = 0;
+    for (int i = 0; i < PAYLOADS; i++) {
+        char* line = malloc(max_len + 32);
+        int len = 0;
+        state = state * 1103515245 + 12345;
+        int num_words = short_lines ? 1 + (state >> 16) % 12 : 1 << 20;
+        for (int w = 0; w < num_words; w++) {
+            state = state * 1103515245 + 12345;
+            const char* word = list[(state >> 16) % list_len];
+            if (len + (int) strlen(word) + 1 > max_len) {
+                break;
+            }
+            len += sprintf(line + len, w == 0 ? "%s" : " %s", word);
+        }
+        corpus->payloads[i] = line;
+        corpus->lens[i] = len;
+        corpus->bytes += len;
+    }
+}
+
+static double validate_rate(struct CORPUS* corpus, int rounds) {
+    int valid = 0;
+    double start = now_seconds();
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < PAYLOADS; i++) {
+            valid += text_valid(corpus->payloads[i], corpus->lens[i]);
+        }
+    }
+    double elapsed = now_seconds() - start;
+    if (valid != rounds * PAYLOADS) {
+        printf("Error - %s: %d of %d payloads weren't valid\n", corpus->name, rounds * PAYLOADS - valid,
+               rounds * PAYLOADS);
+        exit(1);
+    }
+    return corpus->bytes * (double) rounds / elapsed / 1e9;
+}
+
+int main(int argc, char** argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : DEFAULT_ROUNDS;
+    if (rounds < 1) {
+        printf("Usage: bench_scan [rounds]\n");
+        exit(1);
+    }
+
+    struct CORPUS* corpora = malloc(3 * sizeof(struct CORPUS));
+    generate(&corpora[0], "chat lines", words, sizeof(words) / sizeof(words[0]), MAX_DATA - 1, 1);
+    generate(&corpora[1], "ascii 1k", words, sizeof(words) / sizeof(words[0]), MAX_DATA - 1, 0);
+    generate(&corpora[2], "unicode 1k", unicode_words, sizeof(unicode_words) / sizeof(unicode_words[0]),
+             MAX_DATA - 1, 0);
+
+    printf("UTF-8 validation, GB/s (best kernel on this CPU: %s)\n", scan_isa_name(scan_best_isa()));
+    printf("%-8s", "");
+    for (int c = 0; c < 3; c++) {
+        printf(" %12s", corpora[c].name);
+    }
+    printf("\n");
+    for (int isa = 0; isa < NUM_SCAN_ISAS; isa++) {
+        if (scan_select(isa) == -1) {
+            continue;
+        }
+        printf("%-8s", scan_isa_name(isa));
+        for (int c = 0; c < 3; c++) {
+            printf(" %12.2f", validate_rate(&corpora[c], rounds));
+        }
+        printf("\n");
+    }
+    printf("(chat lines average %zu bytes, so the cost per call dominates there)\n", corpora[0].bytes / PAYLOADS);
+
+    // The chat lines as MESSAGE frames, back to back like they arrive
+    size_t buf_size = corpora[0].bytes + (size_t) PAYLOADS * (MAX_NAME + MAX_OPTIONS_LEN + 24);
+    char* buf = malloc(buf_size);
+    size_t buf_len = 0;
+    for (int i = 0; i < PAYLOADS; i++) {
+        struct message msg;
+        message_init(&msg, MESSAGE);
+        snprintf(msg.source, MAX_NAME, "user%d", i % 500);
+        msg.seq = i + 1;
+        strcpy(msg.session_id, "room1");
+        message_printf(&msg, "%s", corpora[0].payloads[i]);
+        int len;
+        char* frame = encode_message(&msg, -1, &len);
+        memcpy(buf + buf_len, frame, len);
+        buf_len += len;
+        free(frame);
+        message_release(&msg);
+    }
+    int frames = 0;
+    double start = now_seconds();
+    for (int round = 0; round < rounds; round++) {
+        size_t offset = 0;
+        while (offset < buf_len) {
+            int len = frame_length(buf + offset, buf_len - offset);
+            if (len <= 0) {
+                printf("Error - frame %d can't be read\n", frames);
+                exit(1);
+            }
+            offset += len;
+            frames++;
+        }
+    }
+    double elapsed = now_seconds() - start;
+    printf("framing: %.2f GB/s, %.1f ns per frame\n", buf_len * (double) rounds / elapsed / 1e9,
+           elapsed * 1e9 / frames);
+    return 0;
+}
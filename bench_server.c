@@ -0,0 +1,297 @@
+// Runs a server inside this process (see server_create) and drives thousands of clients at
+// it over socketpairs, without any network or second process in the way. The server runs on
+// a clock of its own that moves CLOCK_STEP_US every turn of its loop, so timeouts and rate
+// limits (which are off here) come out the same on every run.
+// Usage: bench_server [clients] [messages per client] [session size]
+//            logs the clients in, puts them in sessions of session size (SESSION_CAP at most)
+//            and has each of them send its messages, one round at a time. Every member has
+//            to get every other member's messages, and the time from the first message
+//            sent to the last one delivered is reported.
+// The server's own output is thrown away, the results go to stdout.
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define DEFAULT_CLIENTS 4000
+#define DEFAULT_MESSAGES 20
+#define CLOCK_STEP_US 100
+// Turns of the server's loop in a row that may go by without anything arriving
+#define MAX_IDLE_TURNS 10000
+#define CLIENT_BUF (2 * MAX_STR_LEN + MAX_OPTIONS_LEN)
+
+struct BENCH_CLIENT {
+    int fd;                          // our end of the socketpair
+    char name[MAX_NAME];
+    char buf[CLIENT_BUF];
+    int len;
+    unsigned long long messages;     // session messages received
+};
+
+static struct SERVER* server;
+static struct BENCH_CLIENT* clients;
+static int num_clients;
+static int epoll_fd;
+static unsigned long long clock_us = 0;
+static unsigned long long frames_by_type[SR_NAK + 1];
+static int bad_frames = 0;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void read_client(struct BENCH_CLIENT* client) {
+    while (1) {
+        ssize_t n = recv(client->fd, client->buf + client->len, CLIENT_BUF - client->len, 0);
+        if (n <= 0) {
+            return;
+        }
+        client->len += n;
+
+        int offset = 0;
+        while (offset < client->len) {
+            unsigned int type;
+            int size;
+            int header = frame_header(client->buf + offset, client->len - offset, &type, &size);
+            if (header == 0 || (header > 0 && header + size - 1 > client->len - offset)) {
+                break;
+            }
+            if (header == -1 || type > SR_NAK) {
+                bad_frames++;
+                client->len = 0;
+                return;
+            }
+            frames_by_type[type]++;
+            if (type == MESSAGE) {
+                client->messages++;
+            }
+            offset += header + size - 1;
+        }
+        memmove(client->buf, client->buf + offset, client->len - offset);
+        client->len -= offset;
+    }
+}
+
+// One turn of the server's loop, then whatever it sent is read
+static int turn() {
+    int events = server_run_once(server, 0);
+    clock_us += CLOCK_STEP_US;
+    server_set_clock(server, clock_us);
+
+    int got = 0;
+    struct epoll_event ready[EPOLL_BATCH];
+    int num_ready;
+    while ((num_ready = epoll_wait(epoll_fd, ready, EPOLL_BATCH, 0)) > 0) {
+        for (int e = 0; e < num_ready; e++) {
+            read_client(&clients[ready[e].data.u32]);
+        }
+        got += num_ready;
+    }
+    return events > 0 || got > 0;
+}
+
+// Turns the loop until count frames of the type have arrived in all
+static void pump_until(unsigned int type, unsigned long long count) {
+    int idle = 0;
+    while (frames_by_type[type] < count) {
+        if (turn()) {
+            idle = 0;
+        } else if (++idle == MAX_IDLE_TURNS) {
+            printf("Error - stuck at %llu of %llu frames of type %u\n", frames_by_type[type], count, type);
+            exit(1);
+        }
+    }
+}
+
+static void send_frame(struct BENCH_CLIENT* client, const char* frame, int len) {
+    int sent = 0;
+    while (sent < len) {
+        ssize_t n = send(client->fd, frame + sent, len - sent, MSG_NOSIGNAL);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // the server has a backlog from us, let it catch up
+            turn();
+            continue;
+        }
+        if (n <= 0) {
+            printf("Error - the server closed %s: %s\n", client->name, strerror(errno));
+            exit(1);
+        }
+        sent += n;
+    }
+}
+
+static void send_request(struct BENCH_CLIENT* client, unsigned int type, const char* data) {
+    struct message msg;
+    message_init(&msg, type);
+    strcpy(msg.source, client->name);
+    message_printf(&msg, "%s", data);
+    int len;
+    char* frame = encode_message(&msg, -1, &len);
+    send_frame(client, frame, len);
+    free(frame);
+    message_release(&msg);
+}
+
+int main(int argc, char** argv) {
+    num_clients = argc > 1 ? atoi(argv[1]) : DEFAULT_CLIENTS;
+    int num_messages = argc > 2 ? atoi(argv[2]) : DEFAULT_MESSAGES;
+    int session_size = argc > 3 ? atoi(argv[3]) : SESSION_CAP;
+    if (num_clients < 2 || num_messages < 1 || session_size < 2 || session_size > SESSION_CAP) {
+        printf("Usage: bench_server [clients] [messages per client] [session size, 2 to %d]\n", SESSION_CAP);
+        exit(1);
+    }
+    int num_sessions = (num_clients + session_size - 1) / session_size;
+
+    // Both ends of every socketpair are ours
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < 2 * (rlim_t) num_clients + 64) {
+        printf("Error - %d clients need %d descriptors, only %llu are allowed\n",
+               num_clients, 2 * num_clients + 64, (unsigned long long) limit.rlim_cur);
+        exit(1);
+    }
+
+    struct SERVER_CONFIG config;
+    server_default_config(&config);
+    for (int i = 0; i < NUM_RATE_CLASSES; i++) {
+        config.rate_limits[i].rate = 0;
+    }
+    config.session_rate_limit.rate = 0;
+    config.memory_budget = 0;
+    config.bulk_queue_limit = 0;
+
+    // The server talks about every login and join, which nobody needs to see here
+    FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("bench_server");
+        exit(1);
+    }
+    server = server_create(&config);
+    if (server == NULL || server_set_clock(server, clock_us) == -1) {
+        fprintf(out, "Error - can't create the server\n");
+        exit(1);
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    clients = calloc(num_clients, sizeof(struct BENCH_CLIENT));
+    for (int i = 0; i < num_clients; i++) {
+        struct BENCH_CLIENT* client = &clients[i];
+        snprintf(client->name, MAX_NAME, "bench%d", i);
+        server_add_user(server, client->name, "p");
+
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+            fprintf(out, "Error - socketpair: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (server_attach(server, pair[1], 0) == NULL) {
+            fprintf(out, "Error - the server has no room for client %d\n", i);
+            exit(1);
+        }
+        client->fd = pair[0];
+        fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event event = {.events = EPOLLIN, .data.u32 = i};
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &event);
+    }
+
+    double start = now_seconds();
+    for (int i = 0; i < num_clients; i++) {
+        send_request(&clients[i], LOGIN, "p");
+    }
+    pump_until(LO_ACK, num_clients);
+    double logged_in = now_seconds();
+
+    // The first member of each session makes it, then the rest join
+    char session_id[MAX_SESSION_ID];
+    for (int i = 0; i < num_clients; i += session_size) {
+        snprintf(session_id, sizeof(session_id), "s%d", i / session_size);
+        send_request(&clients[i], NEW_SESS, session_id);
+    }
+    pump_until(NS_ACK, num_sessions);
+    for (int i = 0; i < num_clients; i++) {
+        if (i % session_size != 0) {
+            snprintf(session_id, sizeof(session_id), "s%d", i / session_size);
+            send_request(&clients[i], JOIN, session_id);
+        }
+    }
+    pump_until(JN_ACK, num_clients - num_sessions);
+    double joined = now_seconds();
+
+    // Every client's message is encoded once, so what's measured is the server
+    char** frames = malloc(num_clients * sizeof(char*));
+    int* frame_lens = malloc(num_clients * sizeof(int));
+    unsigned long long expected = 0;
+    for (int i = 0; i < num_clients; i++) {
+        struct message msg;
+        message_init(&msg, MESSAGE);
+        strcpy(msg.source, clients[i].name);
+        message_printf(&msg, "a message from %s to everyone else in the session", clients[i].name);
+        frames[i] = encode_message(&msg, -1, &frame_lens[i]);
+        message_release(&msg);
+
+        int first = i - i % session_size;
+        int members = first + session_size <= num_clients ? session_size : num_clients - first;
+        expected += (unsigned long long) (members - 1) * num_messages;
+    }
+
+    double sending = now_seconds();
+    unsigned long long start_clock_us = clock_us;
+    for (int round = 0; round < num_messages; round++) {
+        for (int i = 0; i < num_clients; i++) {
+            send_frame(&clients[i], frames[i], frame_lens[i]);
+        }
+        turn();
+    }
+    pump_until(MESSAGE, expected);
+    double done = now_seconds();
+
+    int wrong = 0;
+    for (int i = 0; i < num_clients; i++) {
+        int first = i - i % session_size;
+        int members = first + session_size <= num_clients ? session_size : num_clients - first;
+        if (clients[i].messages != (unsigned long long) (members - 1) * num_messages) {
+            if (wrong++ < 10) {
+                fprintf(out, "%s got %llu messages instead of %llu\n", clients[i].name,
+                        clients[i].messages, (unsigned long long) (members - 1) * num_messages);
+            }
+        }
+    }
+
+    unsigned long long sent = (unsigned long long) num_clients * num_messages;
+    fprintf(out, "%d clients in %d sessions of up to %d, %d messages each\n",
+            num_clients, num_sessions, session_size, num_messages);
+    fprintf(out, "logged in in %.1f ms, joined in %.1f ms\n",
+            (logged_in - start) * 1e3, (joined - logged_in) * 1e3);
+    fprintf(out, "%llu messages sent, %llu delivered in %.3f s (%.1f ms on the server's clock)\n",
+            sent, frames_by_type[MESSAGE], done - sending, (clock_us - start_clock_us) / 1e3);
+    fprintf(out, "%.0f messages/s in, %.0f deliveries/s out, %.0f ns per delivery\n",
+            sent / (done - sending), frames_by_type[MESSAGE] / (done - sending),
+            (done - sending) * 1e9 / frames_by_type[MESSAGE]);
+    if (wrong > 0 || bad_frames > 0) {
+        fprintf(out, "FAILED: %d clients got the wrong number of messages, %d bad frames\n", wrong, bad_frames);
+    }
+
+    for (int i = 0; i < num_clients; i++) {
+        free(frames[i]);
+        close(clients[i].fd);
+    }
+    free(frames);
+    free(frame_lens);
+    server_destroy(server);
+    free(clients);
+    fclose(out);
+    return wrong > 0 || bad_frames > 0;
+}
@@ -0,0 +1,175 @@
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+int capture_open(struct CAPTURE_WRITER* writer, const char* path, size_t buffer_size, unsigned long long now_us) {
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = -1;
+    writer->buf = malloc(buffer_size);
+    if (writer->buf == NULL) {
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        free(writer->buf);
+        writer->buf = NULL;
+        return -1;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct CAPTURE_HEADER header = {
+        .magic = CAPTURE_MAGIC,
+        .version = 1,
+        .start_us = (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000
+    };
+    writer->fd = fd;
+    writer->size = buffer_size;
+    writer->last_us = now_us;
+    memcpy(writer->buf, &header, sizeof(header));
+    writer->len = sizeof(header);
+    writer->bytes = sizeof(header);
+    return 0;
+}
+
+void capture_record(struct CAPTURE_WRITER* writer, enum CAPTURE_KIND kind, unsigned int conn,
+                    unsigned int type, const char* frame, size_t len, unsigned long long now_us) {
+    if (writer->fd == -1) {
+        return;
+    }
+    unsigned long long delta = now_us > writer->last_us ? now_us - writer->last_us : 0;
+    struct CAPTURE_RECORD record = {
+        .delta_us = delta > 0xffffffffULL ? 0xffffffffU : (unsigned int) delta,
+        .conn = conn,
+        .len = (unsigned int) len,
+        .kind = kind,
+        .type = type
+    };
+    writer->last_us = now_us;
+
+    if (writer->len + sizeof(record) + len > writer->size && capture_flush(writer) == -1) {
+        return;
+    }
+    memcpy(writer->buf + writer->len, &record, sizeof(record));
+    writer->len += sizeof(record);
+    if (writer->len + len <= writer->size) {
+        memcpy(writer->buf + writer->len, frame, len);
+        writer->len += len;
+    } else if (capture_flush(writer) == -1 || write_all(writer->fd, frame, len) == -1) {
+        // bigger than the whole buffer
+        capture_close(writer);
+        return;
+    }
+    writer->records++;
+    writer->bytes += sizeof(record) + len;
+}
+
+int capture_flush(struct CAPTURE_WRITER* writer) {
+    if (writer->fd == -1) {
+        return -1;
+    }
+    if (writer->len > 0 && write_all(writer->fd, writer->buf, writer->len) == -1) {
+        capture_close(writer);
+        return -1;
+    }
+    writer->len = 0;
+    return 0;
+}
+
+void capture_close(struct CAPTURE_WRITER* writer) {
+    if (writer->fd == -1) {
+        return;
+    }
+    int fd = writer->fd;
+    if (writer->len > 0) {
+        write_all(fd, writer->buf, writer->len);
+    }
+    close(fd);
+    free(writer->buf);
+    writer->buf = NULL;
+    writer->len = 0;
+    writer->fd = -1;
+}
+
+int capture_read_open(struct CAPTURE_READER* reader, const char* path) {
+    memset(reader, 0, sizeof(*reader));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t) st.st_size < sizeof(struct CAPTURE_HEADER)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    memcpy(&reader->header, map, sizeof(reader->header));
+    if (reader->header.magic != CAPTURE_MAGIC || reader->header.version != 1) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    reader->map = map;
+    reader->size = st.st_size;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    capture_rewind(reader);
+    return 0;
+}
+
+int capture_next(struct CAPTURE_READER* reader, struct CAPTURE_RECORD* record, const char** frame) {
+    if (reader->size - reader->pos < sizeof(*record)) {
+        return 0;
+    }
+    memcpy(record, reader->map + reader->pos, sizeof(*record));
+    if (reader->size - reader->pos - sizeof(*record) < record->len) {
+        // the server stopped in the middle of writing it
+        return 0;
+    }
+    *frame = reader->map + reader->pos + sizeof(*record);
+    reader->pos += sizeof(*record) + record->len;
+    reader->at_us += record->delta_us;
+    return 1;
+}
+
+void capture_rewind(struct CAPTURE_READER* reader) {
+    reader->pos = sizeof(struct CAPTURE_HEADER);
+    reader->at_us = 0;
+}
+
+void capture_read_close(struct CAPTURE_READER* reader) {
+    if (reader->map != NULL) {
+        munmap((void*) reader->map, reader->size);
+        reader->map = NULL;
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef ECE361_TEXTCONFERENCING_CAPTURE_H
+#define ECE361_TEXTCONFERENCING_CAPTURE_H
+
+#include <stddef.h>
+
+/*
+ * Traffic captures, for replaying what clients sent against another build (see replay.c).
+ * With capture=<path> the server writes every frame it takes from a client, exactly as it
+ * arrived, along with when each client connected and disconnected. Frames of the server's
+ * own links (cluster nodes, a standby) aren't part of it, and neither is the data of file
+ * chunks, which never goes through a struct message.
+ *
+ * The file is a CAPTURE_HEADER followed by records, each a CAPTURE_RECORD and len bytes
+ * of frame. Records are in the order the server handled them, and times are deltas from
+ * the record before, so a record costs 16 bytes plus its frame. The writer buffers in
+ * memory and writes a whole buffer at a time; the server flushes it every second as well,
+ * so a killed server loses at most the last second. A reader stops at a cut off record.
+ *
+ * The capture holds whatever clients sent, their passwords included, so it's only
+ * readable by the server's user.
+ */
+
+#define CAPTURE_MAGIC 0x31504143 // "CAP1"
+
+struct CAPTURE_HEADER {
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long start_us;     // wall clock, when the capture was started
+};
+
+enum CAPTURE_KIND {
+    CAPTURE_OPEN,                    // a client connected, no frame
+    CAPTURE_FRAME,                   // a frame it sent
+    CAPTURE_CLOSE                    // the connection was closed, by either side
+};
+
+struct CAPTURE_RECORD {
+    unsigned int delta_us;           // since the record before, a gap over ~71 minutes is cut to that
+    unsigned int conn;               // numbered from 1 in the order clients connected
+    unsigned int len;                // of the frame that follows
+    unsigned char kind;              // CAPTURE_KIND
+    unsigned char type;              // the frame's MESSAGE_TYPE
+    unsigned short reserved;
+};
+
+struct CAPTURE_WRITER {
+    int fd;                          // -1 when not capturing
+    char* buf;
+    size_t len;
+    size_t size;
+    unsigned long long last_us;      // of the last record, on the caller's clock
+    unsigned long long records;
+    unsigned long long bytes;        // written to the file, with what's buffered
+};
+
+// Starts a new capture at path, replacing anything there. Returns -1 if it can't be created.
+int capture_open(struct CAPTURE_WRITER* writer, const char* path, size_t buffer_size, unsigned long long now_us);
+
+// now_us is monotonic and in microseconds, any clock as long as it's always the same one
+void capture_record(struct CAPTURE_WRITER* writer, enum CAPTURE_KIND kind, unsigned int conn,
+                    unsigned int type, const char* frame, size_t len, unsigned long long now_us);
+
+// Writes out what's buffered. On an error the capture is closed and -1 returned.
+int capture_flush(struct CAPTURE_WRITER* writer);
+
+void capture_close(struct CAPTURE_WRITER* writer);
+
+// Reading a capture back, from a read-only mapping of the whole file
+struct CAPTURE_READER {
+    const char* map;
+    size_t size;
+    size_t pos;
+    unsigned long long at_us;        // time of the last record read, from the start of the capture
+    struct CAPTURE_HEADER header;
+};
+
+// Returns -1 (with errno set, or EINVAL if it isn't a capture) if the file can't be used
+int capture_read_open(struct CAPTURE_READER* reader, const char* path);
+
+// The next record, its frame pointing into the mapping. Returns 0 at the end.
+int capture_next(struct CAPTURE_READER* reader, struct CAPTURE_RECORD* record, const char** frame);
+
+// Back to the first record
+void capture_rewind(struct CAPTURE_READER* reader);
+
+void capture_read_close(struct CAPTURE_READER* reader);
+
+#endif //ECE361_TEXTCONFERENCING_CAPTURE_H
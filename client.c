@@ -1,6 +1,9 @@
 // Code is adapted from Beej's Guide
 #include "packet.h"
 #include "client.h"
+#include "shm_ring.h"
+#include "latency.h"
+#include "connector.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,11 +11,13 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <signal.h>
 #include <math.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <time.h>
 
  
 // strategy: use pthread as a receiving thread to continue to listen to
@@ -22,34 +27,272 @@
 // variables used to control execution flow
 int request_thread_exit = 0;
 
+// the ID the user is logged in as, also used by the receiving thread
+char client_id[MAX_NAME];
+
+// What's needed to RESUME the login (and session) if the connection drops
+#define IP_LENGTH 50
+#define PORT_LENGTH 6
+#define RESUME_ATTEMPTS 5
+char resume_ip[IP_LENGTH];
+char resume_port[PORT_LENGTH];
+char resume_token[RESUME_TOKEN_LEN];
+int resuming = 0;
+
+// How connect_to_server races the server's addresses (see connector.h). TC_CONNECT_DELAY_MS,
+// TC_CONNECT_TIMEOUT_MS and TC_RESOLVE_TIMEOUT_MS in the environment override the defaults.
+struct CONNECT_OPTIONS connect_options;
+
+// Whether the server agreed to LZ compressed payloads (we always offer them)
+int compression_enabled = 0;
+
+// The largest payload (with the \0) the server takes, from LO_ACK or RS_ACK. Servers that
+// don't say take MAX_DATA. max_data itself stays at the limit, for what we receive.
+int server_max_data = MAX_DATA;
+
+// Optional batching of outgoing chat (TC_BATCH_MS=<ms> in the environment, off by default).
+// MESSAGE and DM_REQ wait up to batch_ms so a burst goes out in one send(); anything else
+// flushes the batch first, so ordering is kept. The receiving thread does the timed flush,
+// and is woken through batch_pipe when a batch is started.
+#define BATCH_CAP (4 * MAX_STR_LEN)
+int batch_ms = 0;
+char batch_buf[BATCH_CAP];
+int batch_len = 0;
+long long batch_deadline;
+int batch_pipe[2] = {-1, -1};
+pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// With TC_LATENCY=<seconds>, MESSAGE and DM_REQ are stamped when sent, what arrives stamped is
+// recorded per leg (see latency.h), and every latency_report_s what was recorded goes to the
+// server in a LAT_REPORT. Only the receiving thread touches the histograms.
+int latency_report_s = 0;
+struct LAT_HISTOGRAM latency_legs[NUM_LAT_LEGS];
+long long latency_report_deadline;
+
+// File transfers. The main thread sends the offer and waits here for the BL_ACK/BL_NAK
+// that the receiving thread picks up. Incoming files are only touched by the receiving thread.
+#define BLOB_REPLY_TIMEOUT 5
+#define MAX_INCOMING_FILES 8
+unsigned int next_blob_id = 1;
+unsigned int blob_reply_id = 0;
+int blob_reply = 0; // BL_ACK, BL_NAK, or 0 while waiting
+char blob_reply_data[MAX_DATA];
+pthread_mutex_t blob_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t blob_cond = PTHREAD_COND_INITIALIZER;
+
+struct INCOMING_FILE {
+    char source[MAX_NAME];
+    unsigned int id;
+    FILE* fp; // NULL if the slot is free
+    char path[MAX_NAME + MAX_BLOB_NAME + 16];
+    unsigned long long size;
+    unsigned long long received;
+};
+struct INCOMING_FILE incoming_files[MAX_INCOMING_FILES];
+
+// Shared memory rings (TC_SHM=1 in the environment, only when the server is given as the
+// path of its Unix-domain socket). Once the server has handed them over, frames go through
+// the rings and the socket only carries doorbells. Senders hold batch_lock to use them.
+#define SHM_FULL_WAIT_US 1000
+int shm_wanted = 0;
+int shm_active = 0;
+struct SHM_MAP shm_map;
+
+// Whatever the server sent right behind LO_ACK (direct messages that waited for us to log
+// in, say) that was read while logging in, left for the receiving thread to go through
+char* early_input = NULL;
+int early_input_len = 0;
+int early_input_used = 0;
+
+long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// batch_lock has to be held
+void flush_batch_locked(int sockfd) {
+    if (batch_len > 0) {
+        send_buffer_to_server(sockfd, batch_buf, batch_len);
+        batch_len = 0;
+    }
+}
+
+// Sessions we're in, with the last message received from each (for RESUME).
+// Plain text goes to current_session. Both threads use these, so they're locked.
+struct JOINED_SESSION {
+    char session_id[MAX_SESSION_ID];
+    unsigned long long last_seq;
+};
+struct JOINED_SESSION joined_sessions[MAX_JOINED_SESSIONS];
+int num_joined_sessions = 0;
+char current_session[MAX_SESSION_ID];
+pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void add_joined_session(const char* session_id) {
+    pthread_mutex_lock(&sessions_lock);
+    if (num_joined_sessions < MAX_JOINED_SESSIONS) {
+        strcpy(joined_sessions[num_joined_sessions].session_id, session_id);
+        joined_sessions[num_joined_sessions].last_seq = 0;
+        num_joined_sessions++;
+    }
+    strcpy(current_session, session_id);
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+// An empty session_id removes all of them
+void remove_joined_session(const char* session_id) {
+    pthread_mutex_lock(&sessions_lock);
+    for (int i = num_joined_sessions - 1; i >= 0; i--) {
+        if (session_id[0] == '\0' || strcmp(joined_sessions[i].session_id, session_id) == 0) {
+            joined_sessions[i] = joined_sessions[--num_joined_sessions];
+        }
+    }
+    if (session_id[0] == '\0' || strcmp(current_session, session_id) == 0) {
+        // fall back to any session we're still in
+        strcpy(current_session, num_joined_sessions > 0 ? joined_sessions[0].session_id : "");
+    }
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+// The last search, and where its next page starts (0 once there's none), for /more.
+// Locked by sessions_lock too.
+char search_query[MAX_STR_LEN];
+char search_session[MAX_SESSION_ID];
+unsigned long long search_cursor = 0;
+
+// How many more parts of a STATS report are on their way; only the receiving thread uses it
+unsigned int stats_parts_left = 0;
+
+void update_last_seq(const char* session_id, unsigned long long seq) {
+    pthread_mutex_lock(&sessions_lock);
+    for (int i = 0; i < num_joined_sessions; i++) {
+        if (strcmp(joined_sessions[i].session_id, session_id) == 0 && seq > joined_sessions[i].last_seq) {
+            joined_sessions[i].last_seq = seq;
+        }
+    }
+    pthread_mutex_unlock(&sessions_lock);
+}
+
 /*
  * Responsible for receiving messages from the socket, and printing message.
  * Use non-blocking IO, and upon leaving session, this thread terminates.
  */
 void* receive_messages(void* fd) {
     int sockfd = *((int*) fd);
-    char buf[MAX_STR_LEN];
+
+    // TCP may merge or split messages, so bytes are collected until a whole one is there.
+    // File chunks are the biggest frames.
+    char buf[BLOB_CHUNK_MAX + 2 * MAX_STR_LEN];
+    int buf_len = 0;
 
     // use fd_set to listen for active message
     fd_set active_fd;
+    FD_ZERO(&active_fd);
     FD_SET(sockfd, &active_fd);
+    if (batch_pipe[0] != -1) {
+        FD_SET(batch_pipe[0], &active_fd);
+    }
 
     while (1) {
         fd_set fd_copy = active_fd;
-        if (select(sockfd + 1, &fd_copy, NULL, NULL, NULL) == -1) {
+        int max_fd = sockfd > batch_pipe[0] ? sockfd : batch_pipe[0];
+
+        // wake up when the pending batch is due
+        struct timeval timeout;
+        struct timeval* timeout_ptr = NULL;
+        pthread_mutex_lock(&batch_lock);
+        if (batch_len > 0) {
+            long long wait = batch_deadline - now_ms();
+            if (wait < 0) {
+                wait = 0;
+            }
+            timeout.tv_sec = wait / 1000;
+            timeout.tv_usec = (wait % 1000) * 1000;
+            timeout_ptr = &timeout;
+        }
+        pthread_mutex_unlock(&batch_lock);
+        if (latency_report_s > 0) {
+            long long wait = latency_report_deadline - now_ms();
+            if (wait < 0) {
+                wait = 0;
+            }
+            if (timeout_ptr == NULL || wait < timeout.tv_sec * 1000LL + timeout.tv_usec / 1000) {
+                timeout.tv_sec = wait / 1000;
+                timeout.tv_usec = (wait % 1000) * 1000;
+                timeout_ptr = &timeout;
+            }
+        }
+
+        if (early_input_used < early_input_len || (shm_active && shm_input_waiting())) {
+            // no need to sleep, something is waiting already
+            timeout.tv_sec = 0;
+            timeout.tv_usec = 0;
+            timeout_ptr = &timeout;
+        }
+
+        if (select(max_fd + 1, &fd_copy, NULL, NULL, timeout_ptr) == -1) {
             printf("Select error\n");
             close(sockfd);
             *(int*)fd = -1;
             return NULL;
         }
 
-        if (FD_ISSET(sockfd, &fd_copy)) {
-            // sockfd can be read from
-            int num_read = recv(sockfd, buf, MAX_STR_LEN, 0);
-            if (num_read == 0) {
-                printf("Server disconnected!\n");
+        if (batch_pipe[0] != -1 && FD_ISSET(batch_pipe[0], &fd_copy)) {
+            // only a wake-up, the deadline is checked below
+            char drain[64];
+            read(batch_pipe[0], drain, sizeof(drain));
+        }
+        pthread_mutex_lock(&batch_lock);
+        if (batch_len > 0 && now_ms() >= batch_deadline) {
+            flush_batch_locked(sockfd);
+        }
+        pthread_mutex_unlock(&batch_lock);
+        if (latency_report_s > 0 && now_ms() >= latency_report_deadline) {
+            send_latency_report(sockfd);
+        }
+
+        if (FD_ISSET(sockfd, &fd_copy) || shm_active || early_input_used < early_input_len) {
+            // sockfd can be read from (or with shared memory, the ring may have something)
+            int num_read;
+            if (early_input_used < early_input_len) {
+                num_read = take_early_input(buf + buf_len, sizeof(buf) - buf_len);
+            } else if (shm_active) {
+                num_read = receive_shm(sockfd, FD_ISSET(sockfd, &fd_copy), buf + buf_len, sizeof(buf) - buf_len);
+            } else {
+                num_read = recv(sockfd, buf + buf_len, sizeof(buf) - buf_len, 0);
+            }
+            if (num_read == 0 || (num_read == -1 && errno == ECONNRESET)) {
                 close(sockfd);
                 *(int*)fd = -1;
+
+                // whatever was batched is lost with the connection, like anything else in flight
+                pthread_mutex_lock(&batch_lock);
+                batch_len = 0;
+                if (shm_active) {
+                    shm_active = 0;
+                    shm_region_unmap(&shm_map);
+                }
+                pthread_mutex_unlock(&batch_lock);
+
+                // Unless we logged out, try to pick up where we left off on a new connection
+                if (request_thread_exit == 0 && resume_token[0] != '\0') {
+                    printf("Server disconnected, trying to resume...\n");
+                    resuming = 1;
+                    sockfd = resume_connection();
+                    resuming = 0;
+                    if (sockfd != -1) {
+                        *(int*)fd = sockfd;
+                        FD_ZERO(&active_fd);
+                        FD_SET(sockfd, &active_fd);
+                        if (batch_pipe[0] != -1) {
+                            FD_SET(batch_pipe[0], &active_fd);
+                        }
+                        buf_len = 0;
+                        continue;
+                    }
+                }
+                printf("Server disconnected!\n");
                 return NULL;
             }
 
@@ -59,22 +302,43 @@ void* receive_messages(void* fd) {
                     return NULL;
                 }
                 continue;
-            } else {
+            }
+            buf_len += num_read;
+
+            int offset = 0;
+            int len;
+            while ((len = frame_length(buf + offset, buf_len - offset)) > 0) {
+                unsigned int type;
+                int size;
+                int header_len = frame_header(buf + offset, len, &type, &size);
+                if (type == BLOB_CHUNK) {
+                    // too big for a struct message, written out straight from the buffer
+                    handle_blob_chunk(buf + offset, header_len, size);
+                    offset += len;
+                    continue;
+                }
+
                 // Received something from the server, so display the message. However, different
                 // messages could be displayed, depending on server response type. Note that we
                 // don't expect any login messages to be displayed here!
-                buf[num_read] = '\0';
-                struct message *msg = str_to_message(buf);
+                struct message *msg = buf_to_message(buf + offset, len);
+                offset += len;
+                if (msg == NULL) {
+                    printf("Received a message that can't be decoded\n");
+                    continue;
+                }
 
                 switch (msg->type) {
                     case JN_ACK:
                         printf("Joined the session %s successfully\n", msg->data);
+                        add_joined_session(msg->data);
                         break;
                     case JN_NAK:
                         printf("Cannot join the session %s\n", msg->data);
                         break;
                     case NS_ACK:
                         printf("Created and joined the new session.\n");
+                        add_joined_session(msg->data);
                         break;
                     case NS_NAK:
                         printf("Could not create and/or join the new session.\n");
@@ -82,15 +346,81 @@ void* receive_messages(void* fd) {
                     case QU_ACK:
                         printf("Query result: \n%s\n", msg->data);
                         break;
+                    case ST_ACK:
+                        if (stats_parts_left == 0) {
+                            printf("Server stats: \n");
+                        }
+                        printf("%s\n", msg->data);
+                        stats_parts_left = msg->seq;
+                        break;
+                    case SR_ACK:
+                        pthread_mutex_lock(&sessions_lock);
+                        search_cursor = msg->seq;
+                        pthread_mutex_unlock(&sessions_lock);
+                        if (msg->size > 1) {
+                            printf("Search results in %s:\n%s%s", msg->session_id, msg->data,
+                                   msg->seq != 0 ? "(/more for older ones)\n" : "");
+                        } else {
+                            printf("No %smessages in %s match\n", msg->seq != 0 ? "more " : "", msg->session_id);
+                        }
+                        break;
+                    case SR_NAK:
+                        printf("Could not search: %s\n", msg->data);
+                        break;
                     case MESSAGE:
-                        printf("Session message from %s: %s\n", msg->source, msg->data);
+                        printf("Session message in %s from %s: %s\n", msg->session_id, msg->source, msg->data);
+                        update_last_seq(msg->session_id, msg->seq);
+                        record_latency(msg);
+                        break;
+                    case RS_ACK:
+                        compression_enabled = msg->compression;
+                        server_max_data = msg->max_data ? (int) msg->max_data : MAX_DATA;
+                        if (msg->size > 1) {
+                            printf("Reconnected, back in session(s) %s\n", msg->data);
+                        } else {
+                            printf("Reconnected\n");
+                        }
                         break;
+                    case RS_NAK:
+                        printf("Could not resume: %s\n", msg->data);
+                        resume_token[0] = '\0';
+                        free(msg);
+                        close(sockfd);
+                        *(int*)fd = -1;
+                        return NULL;
                     case DM_MSG:
                         printf("Direct message from %s: %s\n", msg->source, msg->data);
+                        record_latency(msg);
                         break;
                     case DM_NAK:
                         printf("Could not send direct message: %s\n", msg->data);
                         break;
+                    case PING: {
+                        // the server hasn't heard from us in a while
+                        struct message pong;
+                        message_init(&pong, PONG);
+                        strcpy(pong.source, client_id);
+                        send_message_to_server(sockfd, &pong);
+                        break;
+                    }
+                    case PONG:
+                        break;
+                    case BL_ACK:
+                    case BL_NAK:
+                        pthread_mutex_lock(&blob_lock);
+                        if (msg->blob_id == blob_reply_id) {
+                            blob_reply = msg->type;
+                            snprintf(blob_reply_data, sizeof(blob_reply_data), "%s", msg->data);
+                            pthread_cond_signal(&blob_cond);
+                        }
+                        pthread_mutex_unlock(&blob_lock);
+                        break;
+                    case BLOB_OFFER:
+                        handle_blob_offer(msg);
+                        break;
+                    case BLOB_END:
+                        handle_blob_end(msg);
+                        break;
                     default:
                         printf("Received known / unexpected packet!!!\n");
                         break;
@@ -99,6 +429,14 @@ void* receive_messages(void* fd) {
                     free(msg);
                 } // the login acknowledgments are freed elsewhere
             }
+
+            if (len == -1) {
+                printf("Received a malformed message from the server\n");
+                buf_len = 0;
+            } else {
+                memmove(buf, buf + offset, buf_len - offset);
+                buf_len -= offset;
+            }
         }
     }
 }
@@ -110,9 +448,46 @@ int main(int argc, const char** argv) {
         exit(1);
     }
 
+    const char* batch_env = getenv("TC_BATCH_MS");
+    if (batch_env != NULL && atoi(batch_env) > 0) {
+        if (pipe(batch_pipe) == -1) {
+            printf("Error creating the batching pipe, sending without batching\n");
+        } else {
+            batch_ms = atoi(batch_env);
+            fcntl(batch_pipe[0], F_SETFL, O_NONBLOCK);
+        }
+    }
+
+    // the server decides how big its messages get, anything up to the limit is accepted
+    max_data = MAX_DATA_LIMIT;
+
+    const char* latency_env = getenv("TC_LATENCY");
+    if (latency_env != NULL && atoi(latency_env) > 0) {
+        latency_report_s = atoi(latency_env);
+        latency_report_deadline = now_ms() + latency_report_s * 1000LL;
+    }
+
+    const char* shm_env = getenv("TC_SHM");
+    shm_wanted = (shm_env != NULL && atoi(shm_env) > 0);
+
+    connector_default_options(&connect_options);
+    struct {
+        const char* name;
+        int* value;
+    } connect_envs[] = {
+        {"TC_CONNECT_DELAY_MS", &connect_options.attempt_delay_ms},
+        {"TC_CONNECT_TIMEOUT_MS", &connect_options.attempt_timeout_ms},
+        {"TC_RESOLVE_TIMEOUT_MS", &connect_options.resolve_timeout_ms},
+    };
+    for (int i = 0; i < sizeof(connect_envs) / sizeof(connect_envs[0]); i++) {
+        const char* env = getenv(connect_envs[i].name);
+        if (env != NULL && atoi(env) > 0) {
+            *connect_envs[i].value = atoi(env);
+        }
+    }
+
     int sockfd = -1;
     pthread_t receive_thread;
-    char client_id[MAX_NAME];
 
     while (1) {
         enum CLIENT_ACTION_TYPE curr_action;
@@ -127,10 +502,13 @@ int main(int argc, const char** argv) {
                 }
                 break;
             case CLIENT_LOGIN:
-                if (sockfd == -1) {
+                if (resuming) {
+                    printf("Still trying to reconnect, please wait\n");
+                } else if (sockfd == -1) {
                     sockfd = handle_login(buf, client_id);
                     if (sockfd != -1) {
                         // login succeeded, create a new thread that listens on sockfd
+                        request_thread_exit = 0;
                         pthread_create(&receive_thread, NULL, receive_messages, (void *) &sockfd);
                     } else {
                         sockfd = -1;
@@ -142,8 +520,8 @@ int main(int argc, const char** argv) {
                 break;
             case CLIENT_LOGOUT:
                 if (sockfd != -1) {
-                    handle_logout(sockfd, client_id);
                     request_thread_exit = 1;
+                    handle_logout(sockfd, client_id);
                     pthread_join(receive_thread, NULL);
                     close(sockfd);
                     sockfd = -1;
@@ -160,7 +538,7 @@ int main(int argc, const char** argv) {
                 break;
             case LEAVESESSION:
                 if (sockfd != -1) {
-                    handle_leave_session(sockfd, client_id);
+                    handle_leave_session(buf, sockfd, client_id);
                 } else {
                     printf("Please login first\n");
                 }
@@ -172,6 +550,13 @@ int main(int argc, const char** argv) {
                     printf("Please login first\n");
                 }
                 break;
+            case SWITCHSESSION:
+                if (sockfd != -1) {
+                    handle_switch_session(buf);
+                } else {
+                    printf("Please login first\n");
+                }
+                break;
             case LIST:
                 if (sockfd != -1) {
                     handle_list(sockfd, client_id);
@@ -179,6 +564,27 @@ int main(int argc, const char** argv) {
                     printf("Please login first\n");
                 }
                 break;
+            case STATS_REQUEST:
+                if (sockfd != -1) {
+                    handle_stats(sockfd, client_id);
+                } else {
+                    printf("Please login first\n");
+                }
+                break;
+            case SEARCH_REQUEST:
+                if (sockfd != -1) {
+                    handle_search(sockfd, buf, client_id);
+                } else {
+                    printf("Please login first\n");
+                }
+                break;
+            case SEARCH_MORE:
+                if (sockfd != -1) {
+                    handle_search_more(sockfd, client_id);
+                } else {
+                    printf("Please login first\n");
+                }
+                break;
             case TEXT:
                 if (sockfd != -1) {
                     handle_send_text(sockfd, buf, client_id);
@@ -193,10 +599,18 @@ int main(int argc, const char** argv) {
                     printf("Please login first\n");
                 }
                 break;
+            case SENDFILE:
+            case DMFILE:
+                if (sockfd != -1) {
+                    handle_send_file(sockfd, buf, client_id, curr_action == DMFILE);
+                } else {
+                    printf("Please login first\n");
+                }
+                break;
             case QUIT:
                 if (sockfd != -1) {
-                    handle_logout(sockfd, client_id);
                     request_thread_exit = 1;
+                    handle_logout(sockfd, client_id);
                     pthread_join(receive_thread, NULL);
                     close(sockfd);
                     sockfd = -1;
@@ -268,8 +682,18 @@ char* get_user_input(enum CLIENT_ACTION_TYPE* action) {
             }
             return the_rest;
         } else if (strcmp(first_word, "/leavesession") == 0) {
+            // without a session ID, every session is left
             *action = LEAVESESSION;
-            return NULL;
+            char* the_rest = malloc(MAX_STR_LEN * sizeof(char));
+            delim = strtok(NULL, " ");
+            strcpy(the_rest, delim != NULL ? delim : "");
+            return the_rest;
+        } else if (strcmp(first_word, "/switchsession") == 0) {
+            *action = SWITCHSESSION;
+            char* the_rest = malloc(MAX_STR_LEN * sizeof(char));
+            delim = strtok(NULL, " ");
+            strcpy(the_rest, delim != NULL ? delim : "");
+            return the_rest;
         } else if (strcmp(first_word, "/createsession") == 0) {
             *action = CREATESESSION;
             char* the_rest = malloc(MAX_STR_LEN * sizeof(char));
@@ -284,6 +708,18 @@ char* get_user_input(enum CLIENT_ACTION_TYPE* action) {
         } else if (strcmp(first_word, "/list") == 0) {
             *action = LIST;
             return NULL;
+        } else if (strcmp(first_word, "/stats") == 0) {
+            *action = STATS_REQUEST;
+            return NULL;
+        } else if (strcmp(first_word, "/search") == 0) {
+            *action = SEARCH_REQUEST;
+            char* the_rest = malloc(MAX_STR_LEN * sizeof(char));
+            delim = strtok(NULL, "\0");
+            strcpy(the_rest, delim != NULL ? delim : "");
+            return the_rest;
+        } else if (strcmp(first_word, "/more") == 0) {
+            *action = SEARCH_MORE;
+            return NULL;
         } else if (strcmp(first_word, "/quit") == 0) {
             *action = QUIT;
             return NULL;
@@ -297,6 +733,12 @@ char* get_user_input(enum CLIENT_ACTION_TYPE* action) {
                 strcpy(the_rest, "");
             }
             return the_rest;
+        } else if (strcmp(first_word, "/sendfile") == 0 || strcmp(first_word, "/dmfile") == 0) {
+            *action = strcmp(first_word, "/sendfile") == 0 ? SENDFILE : DMFILE;
+            char* the_rest = malloc(MAX_STR_LEN * sizeof(char));
+            delim = strtok(NULL, "\0");
+            strcpy(the_rest, delim != NULL ? delim : "");
+            return the_rest;
         } else if (strcmp(first_word, "/dm") == 0) {
             *action = DM;
             char* the_rest = malloc(MAX_STR_LEN * sizeof(char));
@@ -318,11 +760,203 @@ char* get_user_input(enum CLIENT_ACTION_TYPE* action) {
 }
 
 
-int handle_login(char* cmd, char* client_id) {
-    // both incluing \0
-#define IP_LENGTH 50
-#define PORT_LENGTH 6
+int connect_to_server(const char* server_ip, const char* server_port) {
+    if (server_ip[0] == '/') {
+        // the server's Unix-domain socket, the port doesn't matter
+        return connect_locally(server_ip);
+    }
+
+    struct CONNECT_RESULT result;
+    int sockfd = connector_connect(server_ip, server_port, &connect_options, &result);
+    if (sockfd == -1) {
+        printf("%s\n", result.error);
+    } else if (result.attempts > 1) {
+        printf("Connected to %s in %d ms, after trying %d addresses\n", result.address, result.connect_ms,
+               result.attempts);
+    }
+    return sockfd;
+}
+
+int connect_locally(const char* path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("The socket path is too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd == -1) {
+        printf("Socket error\n");
+        return -1;
+    }
+    if (connect(sockfd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        close(sockfd);
+        printf("Cannot connect to %s\n", path);
+        return -1;
+    }
+    return sockfd;
+}
+
+int request_shared_memory(int sockfd) {
+    struct message request;
+    message_init(&request, SHM_REQ);
+    strcpy(request.source, client_id);
+    send_message_to_server(sockfd, &request);
+
+    // The memfd comes along with the SHM_ACK. Anything the server sent before it is
+    // kept for the receiving thread.
+    char buf[MAX_STR_LEN];
+    int buf_len = 0;
+    int fd = -1;
+    while (1) {
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov = {.iov_base = buf + buf_len, .iov_len = sizeof(buf) - buf_len};
+        struct msghdr header = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+        ssize_t num_read = recvmsg(sockfd, &header, 0);
+        if (num_read <= 0) {
+            printf("Server disconnected!\n");
+            return -1;
+        }
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+        buf_len += num_read;
+
+        int len;
+        while ((len = frame_length(buf, buf_len)) > 0) {
+            struct message* msg = buf_to_message(buf, len);
+            if (msg == NULL || (msg->type != SHM_ACK && msg->type != SHM_NAK)) {
+                keep_early_input(buf, len);
+            }
+            memmove(buf, buf + len, buf_len - len);
+            buf_len -= len;
+            if (msg == NULL || (msg->type != SHM_ACK && msg->type != SHM_NAK)) {
+                free(msg);
+                continue;
+            }
+            int result = -1;
+            if (msg->type == SHM_NAK) {
+                printf("Staying on the socket: %s\n", msg->data);
+            } else if (fd == -1 || shm_region_map(fd, &shm_map) == -1) {
+                // the server already switched, so the connection is no use without the rings
+                printf("Could not map the shared memory from the server\n");
+            } else {
+                printf("Using %zu KB shared memory rings\n", shm_map.ring_size / 1024);
+                shm_active = 1;
+                result = 0;
+            }
+            if (fd != -1) {
+                close(fd);
+            }
+            if (msg->type == SHM_ACK && result == -1) {
+                free(msg);
+                return -2;
+            }
+            free(msg);
+            return result;
+        }
+        if (len == -1) {
+            printf("Received a malformed message from the server\n");
+            return -2;
+        }
+    }
+}
+
+void keep_early_input(const char* data, int len) {
+    if (early_input_used == early_input_len) {
+        early_input_len = 0;
+        early_input_used = 0;
+    }
+    early_input = realloc(early_input, early_input_len + len);
+    memcpy(early_input + early_input_len, data, len);
+    early_input_len += len;
+}
+
+int take_early_input(char* buf, size_t len) {
+    size_t left = early_input_len - early_input_used;
+    if (len > left) {
+        len = left;
+    }
+    memcpy(buf, early_input + early_input_used, len);
+    early_input_used += len;
+    return len;
+}
+
+int shm_input_waiting() {
+    struct SHM_RING* ring = &shm_map.region->to_client;
+    shm_ring_arm(&ring->reader_waiting);
+    if (shm_ring_used(&shm_map, ring) != 0) {
+        shm_ring_disarm(&ring->reader_waiting);
+        return 1;
+    }
+    return 0;
+}
+
+int receive_shm(int sockfd, int doorbell, char* buf, size_t len) {
+    if (doorbell) {
+        char doorbells[256];
+        int num_read = recv(sockfd, doorbells, sizeof(doorbells), 0);
+        if (num_read == 0 || (num_read == -1 && errno == ECONNRESET)) {
+            return num_read;
+        }
+    }
+    struct SHM_RING* ring = &shm_map.region->to_client;
+    ssize_t num_read = shm_ring_read(&shm_map, ring, buf, len);
+    if (num_read == -1) {
+        printf("The shared memory from the server is corrupt\n");
+        errno = ECONNRESET;
+        return -1;
+    }
+    if (num_read > 0 && shm_ring_wake(&ring->writer_waiting)) {
+        // the server has more for us, and was waiting for room
+        send(sockfd, "", 1, MSG_NOSIGNAL);
+    }
+    if (num_read == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return num_read;
+}
+
+// Reconnects to the server we were logged in to and asks for the old login back.
+// The answer (RS_ACK or RS_NAK) and any missed session messages arrive on the new socket.
+int resume_connection() {
+    for (int attempt = 0; attempt < RESUME_ATTEMPTS; attempt++) {
+        if (attempt > 0) {
+            sleep(1);
+        }
+        int sockfd = connect_to_server(resume_ip, resume_port);
+        if (sockfd == -1) {
+            continue;
+        }
+
+        // the token, then where we are in each session
+        struct message resume_message;
+        message_init(&resume_message, RESUME);
+        resume_message.compression = 1;
+        strcpy(resume_message.source, client_id);
+        message_printf(&resume_message, "%s", resume_token);
+        pthread_mutex_lock(&sessions_lock);
+        for (int i = 0; i < num_joined_sessions; i++) {
+            // the server replays the whole history of a session that doesn't fit
+            char line[MAX_SESSION_ID + 24];
+            int line_len = snprintf(line, sizeof(line), "\n%llu %s", joined_sessions[i].last_seq,
+                                    joined_sessions[i].session_id);
+            if ((int) resume_message.size + line_len <= server_max_data) {
+                message_appendf(&resume_message, "%s", line);
+            }
+        }
+        pthread_mutex_unlock(&sessions_lock);
+        send_message_to_server(sockfd, &resume_message);
+        message_release(&resume_message);
+        return sockfd;
+    }
+    return -1;
+}
 
+int handle_login(char* cmd, char* client_id) {
     int sockfd;
     char password[MAX_PASSWD];
     char server_ip[IP_LENGTH];
@@ -384,61 +1018,58 @@ int handle_login(char* cmd, char* client_id) {
         return -1;
     }
 
-    struct addrinfo hints, *server_info;
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    if ((getaddrinfo(server_ip, server_port, &hints, &server_info)) != 0) {
-        printf("Unable to reach the server you specified\n");
-        return -1;
-    }
-
-    struct addrinfo* connectionPtr;
-    // loop through all the results and connect to the first we can
-    for(connectionPtr = server_info; connectionPtr != NULL; connectionPtr = connectionPtr->ai_next) {
-        if ((sockfd = socket(connectionPtr->ai_family,
-                             connectionPtr->ai_socktype,
-                             connectionPtr->ai_protocol)) == -1) {
-            printf("Socket error\n");
-            continue;
-        }
-
-        if (connect(sockfd, connectionPtr->ai_addr, connectionPtr->ai_addrlen) == -1) {
-            close(sockfd);
-            printf("Cannot connect\n");
-            continue;
-        }
-        break;
-    }
-
-    if (connectionPtr == NULL) {
-        printf("The client failed to connect.\n");
+    if ((sockfd = connect_to_server(server_ip, server_port)) == -1) {
         return -1;
     }
 
-    freeaddrinfo(server_info);
-
     // Send login info to the server
     struct message login_message;
-    login_message.type = LOGIN;
-    login_message.size = strlen(password) + 1;
+    message_init(&login_message, LOGIN);
+    login_message.compression = 1;
     strcpy(login_message.source, client_id);
-    strcpy(login_message.data, password);
+    message_printf(&login_message, "%s", password);
     send_message_to_server(sockfd, &login_message);
 
     // wait for server to confirm or deny login
     char buf[MAX_STR_LEN];
-    int num_read = recv(sockfd, buf, MAX_STR_LEN, 0);
+    int num_read = recv(sockfd, buf, MAX_STR_LEN - 1, 0);
+    if (num_read <= 0) {
+        printf("Server disconnected!\n");
+        close(sockfd);
+        return -1;
+    }
     buf[num_read] = '\0';
 
     struct message *msg = str_to_message(buf);
     if (msg->type == LO_ACK) {
+        // anything left from an earlier connection is of no use now
+        early_input_len = 0;
+        early_input_used = 0;
+        int len = frame_length(buf, num_read);
+        if (len > 0 && len < num_read) {
+            keep_early_input(buf + len, num_read - len);
+        }
         printf("You're now logged in as: %s\n", client_id);
+        // keep what's needed to resume this login if the connection drops
+        strncpy(resume_token, msg->data, RESUME_TOKEN_LEN - 1);
+        strcpy(resume_ip, server_ip);
+        strcpy(resume_port, server_port);
+        remove_joined_session("");
+        compression_enabled = msg->compression;
+        server_max_data = msg->max_data ? (int) msg->max_data : MAX_DATA;
         free(msg);
+        if (shm_wanted && server_ip[0] == '/' && request_shared_memory(sockfd) == -2) {
+            close(sockfd);
+            return -1;
+        }
         return sockfd;
     } else {
         printf("Login failed: %s\n", msg->data);
+        if (msg->retry_after > 0) {
+            printf("Try again in %d seconds\n", msg->retry_after);
+        }
         free(msg);
+        close(sockfd);
         return -1;
     }
 }
@@ -446,10 +1077,6 @@ int handle_login(char* cmd, char* client_id) {
 
 
 void handle_register (char* cmd) {
-    // both incluing \0
-#define IP_LENGTH 50
-#define PORT_LENGTH 6
-
     int sockfd;
     char client_id[MAX_NAME];
     char password[MAX_PASSWD];
@@ -520,46 +1147,15 @@ void handle_register (char* cmd) {
         return;
     }
 
-    struct addrinfo hints, *server_info;
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    if ((getaddrinfo(server_ip, server_port, &hints, &server_info)) != 0) {
-        printf("Unable to reach the server you specified\n");
-        return;
-    }
-
-    struct addrinfo* connectionPtr;
-    // loop through all the results and connect to the first we can
-    for(connectionPtr = server_info; connectionPtr != NULL; connectionPtr = connectionPtr->ai_next) {
-        if ((sockfd = socket(connectionPtr->ai_family,
-                             connectionPtr->ai_socktype,
-                             connectionPtr->ai_protocol)) == -1) {
-            printf("Socket error\n");
-            continue;
-        }
-
-        if (connect(sockfd, connectionPtr->ai_addr, connectionPtr->ai_addrlen) == -1) {
-            close(sockfd);
-            printf("Cannot connect\n");
-            continue;
-        }
-        break;
-    }
-
-    if (connectionPtr == NULL) {
-        printf("The client failed to connect.\n");
+    if ((sockfd = connect_to_server(server_ip, server_port)) == -1) {
         return;
     }
 
-    freeaddrinfo(server_info);
-
     // Send login info to the server
     struct message login_message;
-    login_message.type = REGISTER;
-    login_message.size = strlen(password) + 1;
+    message_init(&login_message, REGISTER);
     strcpy(login_message.source, client_id);
-    strcpy(login_message.data, password);
+    message_printf(&login_message, "%s", password);
     send_message_to_server(sockfd, &login_message);
 
     // wait for server to confirm or deny login
@@ -588,7 +1184,7 @@ void handle_join_session(char* session_name, int sockfd, char* client_id) {
     }
 
     struct message join_message;
-    join_message.type = JOIN;
+    message_init(&join_message, JOIN);
     join_message.size = strlen(session_name) + 1;
     if (join_message.size >= MAX_SESSION_ID) {
         printf("Error - session ID is too long, must be %d characters or below\n", MAX_SESSION_ID - 1);
@@ -596,27 +1192,29 @@ void handle_join_session(char* session_name, int sockfd, char* client_id) {
     }
 
     strcpy(join_message.source, client_id);
-    strcpy(join_message.data, session_name);
+    message_printf(&join_message, "%s", session_name);
 
     send_message_to_server(sockfd, &join_message);
 }
 
 void handle_logout(int sockfd, char* client_id) {
     struct message logout_message;
-    logout_message.type = EXIT;
-    logout_message.size = 1;
-    logout_message.data[0] = '\0';
+    message_init(&logout_message, EXIT);
     strcpy(logout_message.source, client_id);
     send_message_to_server(sockfd, &logout_message);
 }
 
-void handle_leave_session(int sockfd, char* client_id) {
+void handle_leave_session(char* session_name, int sockfd, char* client_id) {
+    if (strlen(session_name) >= MAX_SESSION_ID) {
+        printf("Error - session ID is too long, must be %d characters or below\n", MAX_SESSION_ID - 1);
+        return;
+    }
     struct message leave_session_message;
-    leave_session_message.type = LEAVE_SESS;
-    leave_session_message.size = 1;
-    leave_session_message.data[0] = '\0';
+    message_init(&leave_session_message, LEAVE_SESS);
+    message_printf(&leave_session_message, "%s", session_name);
     strcpy(leave_session_message.source, client_id);
     send_message_to_server(sockfd, &leave_session_message);
+    remove_joined_session(session_name);
 }
 
 void handle_create_session(char* session_name, int sockfd, char* client_id) {
@@ -626,45 +1224,128 @@ void handle_create_session(char* session_name, int sockfd, char* client_id) {
         return;
     }
     struct message create_session_message;
-    create_session_message.type = NEW_SESS;
+    message_init(&create_session_message, NEW_SESS);
     create_session_message.size = strlen(session_name) + 1;
     if (create_session_message.size >= MAX_SESSION_ID) {
         printf("Error - session ID is too long. must be %d characters or below\n", MAX_SESSION_ID - 1);
         return;
     }
+    if (strchr(session_name, ',') != NULL) {
+        printf("Error - session ID can't contain ','\n");
+        return;
+    }
 
     strcpy(create_session_message.source, client_id);
-    strcpy(create_session_message.data, session_name);
+    message_printf(&create_session_message, "%s", session_name);
     send_message_to_server(sockfd, &create_session_message);
 }
 
 void handle_list(int sockfd, char* client_id) {
     struct message list_message;
-    list_message.type = QUERY;
-    list_message.size = 1;
-    list_message.data[0] = '\0';
+    message_init(&list_message, QUERY);
     strcpy(list_message.source, client_id);
     send_message_to_server(sockfd, &list_message);
 }
 
+void handle_stats(int sockfd, char* client_id) {
+    struct message stats_message;
+    message_init(&stats_message, STATS);
+    strcpy(stats_message.source, client_id);
+    send_message_to_server(sockfd, &stats_message);
+}
+
+void handle_search(int sockfd, char* query, char* client_id) {
+    if (query[0] == '\0') {
+        printf("Usage: /search <words>\n");
+        return;
+    }
+    if (!fits_server(query)) {
+        return;
+    }
+    pthread_mutex_lock(&sessions_lock);
+    snprintf(search_query, sizeof(search_query), "%s", query);
+    strcpy(search_session, current_session);
+    search_cursor = 0;
+    pthread_mutex_unlock(&sessions_lock);
+
+    struct message search_message;
+    message_init(&search_message, SEARCH);
+    strcpy(search_message.source, client_id);
+    strcpy(search_message.session_id, search_session);
+    message_printf(&search_message, "%s", query);
+    send_message_to_server(sockfd, &search_message);
+    message_release(&search_message);
+}
+
+void handle_search_more(int sockfd, char* client_id) {
+    struct message search_message;
+    message_init(&search_message, SEARCH);
+    strcpy(search_message.source, client_id);
+    pthread_mutex_lock(&sessions_lock);
+    strcpy(search_message.session_id, search_session);
+    search_message.seq = search_cursor;
+    message_printf(&search_message, "%s", search_query);
+    pthread_mutex_unlock(&sessions_lock);
+
+    if (search_message.seq == 0) {
+        printf("There's nothing more to show\n");
+    } else {
+        send_message_to_server(sockfd, &search_message);
+    }
+    message_release(&search_message);
+}
+
+void handle_switch_session(char* session_name) {
+    int found = 0;
+    pthread_mutex_lock(&sessions_lock);
+    for (int i = 0; i < num_joined_sessions; i++) {
+        if (strcmp(joined_sessions[i].session_id, session_name) == 0) {
+            strcpy(current_session, session_name);
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    if (found) {
+        printf("Messages now go to session %s\n", session_name);
+    } else {
+        printf("You're not in session %s\n", session_name);
+    }
+}
+
+int fits_server(const char* text) {
+    size_t len = strlen(text);
+    if (len + 1 > (size_t) server_max_data) {
+        printf("Message is too long (%zu characters), the server takes at most %d.\n", len, server_max_data - 1);
+        return 0;
+    }
+    return 1;
+}
+
 void handle_send_text (int sockfd, char* msg, char* client_id) {
+    if (!fits_server(msg)) {
+        return;
+    }
     struct message text_message;
-    text_message.type = MESSAGE;
-    text_message.size = strlen(msg) + 1;
-    strcpy(text_message.data, msg);
+    message_init(&text_message, MESSAGE);
+    pthread_mutex_lock(&sessions_lock);
+    strcpy(text_message.session_id, current_session);
+    pthread_mutex_unlock(&sessions_lock);
+    message_printf(&text_message, "%s", msg);
     strcpy(text_message.source, client_id);
     send_message_to_server(sockfd, &text_message);
+    message_release(&text_message);
 }
 
 void handle_send_dm (int sockfd, char* cmd, char* client_id) {
 
     struct message text_message;
-    text_message.type = DM_REQ;
+    message_init(&text_message, DM_REQ);
     strcpy(text_message.source, client_id);
     
     char receiver[MAX_NAME];
     char msg [MAX_DATA];
-    int available_message_size = MAX_DATA - MAX_NAME - 2;
+    int available_message_size = MAX_DATA;
     char* error_msg = "2 arguments are requires: <receiver client ID> <message>";
 
     // get receiver ID
@@ -693,15 +1374,227 @@ void handle_send_dm (int sockfd, char* cmd, char* client_id) {
         printf("Message is too long and will be truncated.\n");
         msg[available_message_size-1] = '\0';
     }
+    if (!fits_server(msg)) {
+        return;
+    }
 
-    sprintf(text_message.data, "%s %s", receiver, msg);
-    text_message.size = strlen(text_message.data) + 1;
+    strcpy(text_message.to, receiver);
+    message_printf(&text_message, "%s", msg);
     send_message_to_server(sockfd, &text_message);
+    message_release(&text_message);
+}
+
+void handle_send_file (int sockfd, char* cmd, char* client_id, int dm) {
+    char target[MAX_NAME > MAX_SESSION_ID ? MAX_NAME : MAX_SESSION_ID];
+    char* path;
+    if (dm) {
+        char* receiver = strtok(cmd, " ");
+        path = strtok(NULL, "\n");
+        if (receiver == NULL || path == NULL) {
+            printf("2 arguments are required: <receiver client ID> <file>\n");
+            return;
+        }
+        if (strlen(receiver) >= MAX_NAME) {
+            printf("Receiver ID is too long, try again.\n");
+            return;
+        }
+        strcpy(target, receiver);
+    } else {
+        path = cmd;
+        pthread_mutex_lock(&sessions_lock);
+        strcpy(target, current_session);
+        pthread_mutex_unlock(&sessions_lock);
+        if (target[0] == '\0') {
+            printf("Join a session first, or use /dmfile\n");
+            return;
+        }
+    }
+
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        printf("Can't open %s: %s\n", path, strerror(errno));
+        return;
+    }
+    fseek(fp, 0, SEEK_END);
+    unsigned long long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    // only the file name goes to the recipients
+    char name[MAX_BLOB_NAME];
+    const char* slash = strrchr(path, '/');
+    strncpy(name, slash != NULL ? slash + 1 : path, MAX_BLOB_NAME - 1);
+    name[MAX_BLOB_NAME - 1] = '\0';
+
+    struct message offer;
+    message_init(&offer, BLOB_OFFER);
+    offer.blob_id = next_blob_id++;
+    strcpy(offer.source, client_id);
+    message_printf(&offer, "%s %s %llu %s", dm ? "dm" : "sess", target, size, name);
+
+    pthread_mutex_lock(&blob_lock);
+    blob_reply_id = offer.blob_id;
+    blob_reply = 0;
+    pthread_mutex_unlock(&blob_lock);
+    send_message_to_server(sockfd, &offer);
+    message_release(&offer);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += BLOB_REPLY_TIMEOUT;
+    pthread_mutex_lock(&blob_lock);
+    while (blob_reply == 0 && pthread_cond_timedwait(&blob_cond, &blob_lock, &deadline) == 0);
+    int reply = blob_reply;
+    blob_reply_id = 0;
+    pthread_mutex_unlock(&blob_lock);
+    if (reply != BL_ACK) {
+        printf("Could not send %s: %s\n", name, reply == BL_NAK ? blob_reply_data : "no answer from the server");
+        fclose(fp);
+        return;
+    }
+
+    // The payload is read in right behind the room for its header, so each chunk
+    // goes out with one send
+    long long start = now_ms();
+    int header_room = MAX_OPTIONS_LEN + 100;
+    char* frame = malloc(header_room + BLOB_CHUNK_MAX);
+    size_t num_read;
+    unsigned long long sent = 0;
+    while ((num_read = fread(frame + header_room, 1, BLOB_CHUNK_MAX, fp)) > 0) {
+        char header[MAX_OPTIONS_LEN + 100];
+        int header_len = blob_chunk_header(header, offer.blob_id, client_id, num_read);
+        memcpy(frame + header_room - header_len, header, header_len);
+
+        // holding batch_lock keeps a PONG from landing in the middle of the chunk
+        pthread_mutex_lock(&batch_lock);
+        flush_batch_locked(sockfd);
+        send_buffer_to_server(sockfd, frame + header_room - header_len, header_len + num_read);
+        pthread_mutex_unlock(&batch_lock);
+        sent += num_read;
+    }
+    free(frame);
+    fclose(fp);
+
+    struct message end;
+    message_init(&end, BLOB_END);
+    end.blob_id = offer.blob_id;
+    strcpy(end.source, client_id);
+    send_message_to_server(sockfd, &end);
+
+    long long elapsed = now_ms() - start;
+    printf("Sent %s (%llu bytes) in %lld ms\n", name, sent, elapsed);
+}
+
+void handle_blob_offer(struct message* msg) {
+    unsigned long long size;
+    char name[MAX_BLOB_NAME];
+    if (sscanf(msg->data, "%llu %63[^\n]", &size, name) != 2) {
+        printf("Received a malformed file offer from %s\n", msg->source);
+        return;
+    }
+
+    struct INCOMING_FILE* file = NULL;
+    for (int i = 0; i < MAX_INCOMING_FILES && file == NULL; i++) {
+        if (incoming_files[i].fp == NULL) {
+            file = &incoming_files[i];
+        }
+    }
+    if (file == NULL) {
+        printf("Too many files coming in, ignoring %s from %s\n", name, msg->source);
+        return;
+    }
+
+    // the sender only sends the file name, but make sure it stays in this directory
+    for (char* c = name; *c != '\0'; c++) {
+        if (*c == '/') {
+            *c = '_';
+        }
+    }
+    sprintf(file->path, "received_%s_%s", msg->source, name);
+    file->fp = fopen(file->path, "wb");
+    if (file->fp == NULL) {
+        printf("Can't save %s from %s: %s\n", name, msg->source, strerror(errno));
+        return;
+    }
+    strcpy(file->source, msg->source);
+    file->id = msg->blob_id;
+    file->size = size;
+    file->received = 0;
+    if (msg->session_id[0] != '\0') {
+        printf("Receiving %s (%llu bytes) from %s in %s, saving it to %s\n", name, size, msg->source, msg->session_id, file->path);
+    } else {
+        printf("Receiving %s (%llu bytes) from %s, saving it to %s\n", name, size, msg->source, file->path);
+    }
+}
+
+// Finds the file a chunk or BLOB_END belongs to
+struct INCOMING_FILE* find_incoming_file(const char* source, unsigned int id) {
+    for (int i = 0; i < MAX_INCOMING_FILES; i++) {
+        if (incoming_files[i].fp != NULL && incoming_files[i].id == id && strcmp(incoming_files[i].source, source) == 0) {
+            return &incoming_files[i];
+        }
+    }
+    return NULL;
+}
+
+void handle_blob_chunk(const char* frame, int header_len, int size) {
+    // header: type,options size source
+    char source[MAX_NAME];
+    const char* fields = strchr(frame, ' ');
+    if (fields == NULL || sscanf(fields, " %*d %19s", source) != 1) {
+        return;
+    }
+    struct INCOMING_FILE* file = find_incoming_file(source, frame_blob_id(frame, header_len));
+    if (file == NULL) {
+        return;
+    }
+    fwrite(frame + header_len, 1, size - 1, file->fp);
+    file->received += size - 1;
+}
+
+void handle_blob_end(struct message* msg) {
+    struct INCOMING_FILE* file = find_incoming_file(msg->source, msg->blob_id);
+    if (file == NULL) {
+        return;
+    }
+    fclose(file->fp);
+    file->fp = NULL;
+    if (msg->data[0] == '\0' && file->received == file->size) {
+        printf("Received %s (%llu bytes) from %s\n", file->path, file->received, msg->source);
+    } else {
+        printf("Transfer of %s from %s stopped after %llu of %llu bytes%s%s\n", file->path, msg->source,
+               file->received, file->size, msg->data[0] != '\0' ? ": " : "", msg->data);
+    }
 }
 
 void send_string_to_server(int sockfd, const char* msg_str) {
+    send_buffer_to_server(sockfd, msg_str, strlen(msg_str));
+}
+
+void send_buffer_to_server(int sockfd, const char* msg_str, size_t len) {
+    if (shm_active) {
+        // batch_lock is held, so the rings can't go away underneath us
+        struct SHM_RING* ring = &shm_map.region->to_server;
+        while (len > 0) {
+            ssize_t written = shm_ring_write(&shm_map, ring, msg_str, len);
+            if (written == -1) {
+                printf("The shared memory to the server is corrupt\n");
+                exit(1);
+            }
+            msg_str += written;
+            len -= written;
+            if (written > 0 && shm_ring_wake(&ring->reader_waiting)) {
+                send(sockfd, "", 1, MSG_NOSIGNAL);
+            }
+            if (len > 0) {
+                // the server is behind, give it a moment
+                usleep(SHM_FULL_WAIT_US);
+            }
+        }
+        return;
+    }
+
     // Send TCP message to client
-    if (send(sockfd, msg_str, strlen(msg_str), 0) == -1) {
+    if (send(sockfd, msg_str, len, 0) == -1) {
         printf("%s\n", msg_str);
         printf("Error sending message: %d\n", errno);
         exit(1);
@@ -709,8 +1602,53 @@ void send_string_to_server(int sockfd, const char* msg_str) {
 }
 
 void send_message_to_server(int sockfd, struct message* msg) {
-    const char* msg_str = message_to_str(msg);
-    send_string_to_server(sockfd, msg_str);
+    if (latency_report_s > 0 && (msg->type == MESSAGE || msg->type == DM_REQ)) {
+        msg->sent_us = lat_now_us();
+    }
+    int len;
+    char* msg_str = encode_message(msg, compression_enabled ? COMPRESS_THRESHOLD : -1, &len);
+
+    pthread_mutex_lock(&batch_lock);
+    if (batch_ms > 0 && (msg->type == MESSAGE || msg->type == DM_REQ)) {
+        if (batch_len + len > BATCH_CAP) {
+            flush_batch_locked(sockfd);
+        }
+        if (batch_len == 0) {
+            batch_deadline = now_ms() + batch_ms;
+            write(batch_pipe[1], "", 1);
+        }
+        memcpy(batch_buf + batch_len, msg_str, len);
+        batch_len += len;
+    } else {
+        flush_batch_locked(sockfd);
+        send_buffer_to_server(sockfd, msg_str, len);
+    }
+    pthread_mutex_unlock(&batch_lock);
     free(msg_str);
 }
 
+void record_latency(struct message* msg) {
+    if (latency_report_s == 0 || msg->sent_us == 0 || msg->received_us == 0 || msg->forwarded_us == 0) {
+        return;
+    }
+    // the legs cross clocks, a skewed one can make them negative, which lat_record counts as 0
+    lat_record(&latency_legs[LAT_UP], (long long) (msg->received_us - msg->sent_us));
+    lat_record(&latency_legs[LAT_DWELL], (long long) (msg->forwarded_us - msg->received_us));
+    lat_record(&latency_legs[LAT_DOWN], (long long) (lat_now_us() - msg->forwarded_us));
+}
+
+void send_latency_report(int sockfd) {
+    latency_report_deadline = now_ms() + latency_report_s * 1000LL;
+    if (latency_legs[LAT_UP].total == 0) {
+        return;
+    }
+    char text[LAT_REPORT_MAX];
+    lat_format_report(latency_legs, text, sizeof(text));
+    struct message report;
+    message_init(&report, LAT_REPORT);
+    strcpy(report.source, client_id);
+    message_printf(&report, "%s", text);
+    send_message_to_server(sockfd, &report);
+    message_release(&report);
+    memset(latency_legs, 0, sizeof(latency_legs));
+}
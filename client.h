@@ -17,11 +17,42 @@ enum CLIENT_ACTION_TYPE {
     QUIT,
     CLIENT_REGISTER,
     TEXT,
-    DM
+    DM,
+    SWITCHSESSION,
+    STATS_REQUEST,
+    SENDFILE,
+    DMFILE,
+    SEARCH_REQUEST,
+    SEARCH_MORE
 };
 
 char* get_user_input(enum CLIENT_ACTION_TYPE* action);
 
+// return sockfd, or -1 if no address of the server could be connected to. The addresses
+// are looked up and raced against each other (see connector.h), the first to connect wins.
+// A server_ip starting with / is the path of the server's Unix-domain socket.
+int connect_to_server(const char* server_ip, const char* server_port);
+
+int connect_locally(const char* path);
+
+// Switches a freshly logged in local connection over to shared memory. Returns 0 if it did,
+// -1 if the server said no (the socket is still fine), -2 if the connection is unusable.
+int request_shared_memory(int sockfd);
+
+// Leaves bytes read while logging in for the receiving thread, which takes them before
+// reading anything else
+void keep_early_input(const char* data, int len);
+int take_early_input(char* buf, size_t len);
+
+// Gets ready to sleep on the doorbell, returns 1 if there's input in the ring already
+int shm_input_waiting();
+
+// The receiving thread's recv() once the rings are in use
+int receive_shm(int sockfd, int doorbell, char* buf, size_t len);
+
+// return the new sockfd with a RESUME already sent on it, or -1
+int resume_connection();
+
 // return sockfd, or -1 for failure - try again
 int handle_login(char* cmd, char* client_id);
 
@@ -31,16 +62,45 @@ void handle_logout(int sockfd, char* client_id);
 
 void handle_join_session(char* session_name, int sockfd, char* client_id);
 
-void handle_leave_session(int sockfd, char* client_id);
+// leaves every session if session_name is empty
+void handle_leave_session(char* session_name, int sockfd, char* client_id);
+
+// picks the session plain text is sent to
+void handle_switch_session(char* session_name);
 
 void handle_create_session(char* session_name, int sockfd, char* client_id);
 
 void handle_list(int sockfd, char* client_id);
 
+void handle_stats(int sockfd, char* client_id);
+
+// searches the current session for messages with every word in query
+void handle_search(int sockfd, char* query, char* client_id);
+
+// asks for the next page of the last search
+void handle_search_more(int sockfd, char* client_id);
+
+// Returns 1 if text is small enough for the server to take, and says why not if it isn't
+int fits_server(const char* text);
+
 void handle_send_text (int sockfd, char* msg, char* client_id);
 
 void handle_send_dm (int sockfd, char* cmd, char* client_id);
 
+// cmd is "<path>" for the current session, or "<receiver> <path>" when dm is set
+void handle_send_file (int sockfd, char* cmd, char* client_id, int dm);
+
+// what the receiving thread does with BLOB_OFFER, BLOB_CHUNK and BLOB_END
+void handle_blob_offer(struct message* msg);
+void handle_blob_chunk(const char* frame, int header_len, int size);
+void handle_blob_end(struct message* msg);
+
 void send_message_to_server(int sockfd, struct message* msg);
 
-void send_string_to_server(int sockfd, const char* msg_str);
\ No newline at end of file
+// with TC_LATENCY set, what the receiving thread does with the stamps on MESSAGE and DM_MSG
+void record_latency(struct message* msg);
+void send_latency_report(int sockfd);
+
+void send_string_to_server(int sockfd, const char* msg_str);
+
+void send_buffer_to_server(int sockfd, const char* msg_str, size_t len);
\ No newline at end of file
@@ -0,0 +1,154 @@
+#include "compress.h"
+
+#include <string.h>
+#include <stdint.h>
+
+static uint32_t read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes a length that didn't fit in its nibble as a run of 255s and a remainder
+static int write_length(unsigned char* out, int op, int out_cap, int length) {
+    while (length >= 255) {
+        if (op >= out_cap) return -1;
+        out[op++] = 255;
+        length -= 255;
+    }
+    if (op >= out_cap) return -1;
+    out[op++] = length;
+    return op;
+}
+
+static int write_sequence(unsigned char* out, int op, int out_cap, const unsigned char* literals,
+                          int literal_len, int offset, int match_len) {
+    if (op >= out_cap) return -1;
+    int token = op++;
+    out[token] = (literal_len >= 15 ? 15 : literal_len) << 4;
+    if (literal_len >= 15 && (op = write_length(out, op, out_cap, literal_len - 15)) == -1) {
+        return -1;
+    }
+
+    if (op + literal_len > out_cap) return -1;
+    memcpy(out + op, literals, literal_len);
+    op += literal_len;
+
+    if (match_len == 0) {
+        // last sequence, literals only
+        return op;
+    }
+
+    if (op + 2 > out_cap) return -1;
+    out[op++] = offset & 0xff;
+    out[op++] = offset >> 8;
+
+    match_len -= LZ_MIN_MATCH;
+    out[token] |= (match_len >= 15 ? 15 : match_len);
+    if (match_len >= 15 && (op = write_length(out, op, out_cap, match_len - 15)) == -1) {
+        return -1;
+    }
+    return op;
+}
+
+int lz_compress(const char* input, int in_len, char* output, int out_cap) {
+    const unsigned char* in = (const unsigned char*) input;
+    unsigned char* out = (unsigned char*) output;
+
+    // positions + 1, so 0 means "nothing seen with this hash"
+    int table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    int ip = 0;
+    int anchor = 0;
+    int op = 0;
+    while (ip + LZ_MIN_MATCH <= in_len) {
+        uint32_t v = read32(in + ip);
+        int h = lz_hash(v);
+        int ref = table[h] - 1;
+        table[h] = ip + 1;
+
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || read32(in + ref) != v) {
+            ip++;
+            continue;
+        }
+
+        int match_len = LZ_MIN_MATCH;
+        while (ip + match_len < in_len && in[ref + match_len] == in[ip + match_len]) {
+            match_len++;
+        }
+
+        op = write_sequence(out, op, out_cap, in + anchor, ip - anchor, ip - ref, match_len);
+        if (op == -1) {
+            return -1;
+        }
+        ip += match_len;
+        anchor = ip;
+    }
+
+    return write_sequence(out, op, out_cap, in + anchor, in_len - anchor, 0, 0);
+}
+
+static int read_length(const unsigned char* in, int* ip, int in_len, int length) {
+    int b;
+    do {
+        if (*ip >= in_len) return -1;
+        b = in[(*ip)++];
+        length += b;
+    } while (b == 255);
+    return length;
+}
+
+int lz_decompress(const char* input, int in_len, char* output, int out_cap) {
+    const unsigned char* in = (const unsigned char*) input;
+    unsigned char* out = (unsigned char*) output;
+
+    int ip = 0;
+    int op = 0;
+    while (ip < in_len) {
+        int token = in[ip++];
+
+        int literal_len = token >> 4;
+        if (literal_len == 15 && (literal_len = read_length(in, &ip, in_len, literal_len)) == -1) {
+            return -1;
+        }
+        if (ip + literal_len > in_len || op + literal_len > out_cap) {
+            return -1;
+        }
+        memcpy(out + op, in + ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+
+        if (ip == in_len) {
+            break;
+        }
+
+        if (ip + 2 > in_len) {
+            return -1;
+        }
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) {
+            return -1;
+        }
+
+        int match_len = token & 15;
+        if (match_len == 15 && (match_len = read_length(in, &ip, in_len, match_len)) == -1) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (op + match_len > out_cap) {
+            return -1;
+        }
+
+        // byte by byte, since the match may overlap what it's producing
+        for (int i = 0; i < match_len; i++, op++) {
+            out[op] = out[op - offset];
+        }
+    }
+    return op;
+}
@@ -0,0 +1,25 @@
+#ifndef ECE361_TEXTCONFERENCING_COMPRESS_H
+#define ECE361_TEXTCONFERENCING_COMPRESS_H
+
+/*
+ * A small LZ77 block codec in the style of LZ4: a greedy single-probe hash match finder,
+ * and a format of (literals, back-reference) sequences. It only works on whole blocks
+ * and keeps no state between calls, so it is cheap enough to run on every large payload.
+ *
+ * Each sequence is a token byte (high nibble: literal count, low nibble: match length - 4,
+ * 15 meaning more length bytes follow), the literals, then a 2-byte little-endian offset.
+ * The last sequence only has literals.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+// Returns the compressed length, or -1 if the result doesn't fit in out_cap
+// (callers pass in_len - 1 to only keep output that is actually smaller)
+int lz_compress(const char* in, int in_len, char* out, int out_cap);
+
+// Returns the decompressed length, or -1 if the input is corrupt or doesn't fit in out_cap
+int lz_decompress(const char* in, int in_len, char* out, int out_cap);
+
+#endif //ECE361_TEXTCONFERENCING_COMPRESS_H
@@ -0,0 +1,325 @@
+#define _GNU_SOURCE // pipe2
+#include "connector.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// What the lookup shares with the connect, freed by whichever lets go of it last
+struct RESOLVER {
+    pthread_mutex_t lock;
+    int refs;
+    int wake[2];                     // a byte once the lookup is done
+    char* host;
+    char* port;
+    int done;
+    struct addrinfo* answer;
+};
+
+struct CONNECT_ADDRESS {
+    struct sockaddr_storage addr;
+    socklen_t len;
+};
+
+struct CONNECT_ATTEMPT {
+    int fd;
+    long long deadline;
+    struct CONNECT_ADDRESS* address;
+};
+
+// Everything connector_connect keeps track of
+struct CONNECT_STATE {
+    struct RESOLVER* resolver;       // NULL once it has answered, or for a numeric address
+    struct CONNECT_ADDRESS addresses[CONNECT_MAX_ADDRESSES];
+    int num_addresses;
+    int next_address;
+    struct CONNECT_ATTEMPT attempts[CONNECT_MAX_ATTEMPTS];
+    int num_attempts;
+};
+
+static long long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void connector_default_options(struct CONNECT_OPTIONS* options) {
+    options->attempt_delay_ms = 250;
+    options->attempt_timeout_ms = 10000;
+    options->resolve_timeout_ms = 10000;
+}
+
+static void resolver_release(struct RESOLVER* resolver) {
+    pthread_mutex_lock(&resolver->lock);
+    int last = (--resolver->refs == 0);
+    pthread_mutex_unlock(&resolver->lock);
+    if (!last) {
+        return;
+    }
+    if (resolver->answer != NULL) {
+        freeaddrinfo(resolver->answer);
+    }
+    close(resolver->wake[0]);
+    close(resolver->wake[1]);
+    pthread_mutex_destroy(&resolver->lock);
+    free(resolver->host);
+    free(resolver->port);
+    free(resolver);
+}
+
+static void* lookup_main(void* arg) {
+    struct RESOLVER* resolver = arg;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* answer = NULL;
+    if (getaddrinfo(resolver->host, resolver->port, &hints, &answer) != 0) {
+        answer = NULL;
+    }
+
+    pthread_mutex_lock(&resolver->lock);
+    resolver->answer = answer;
+    resolver->done = 1;
+    pthread_mutex_unlock(&resolver->lock);
+    // the pipe is only closed once the lookup and the connect are both done with it
+    ssize_t written = write(resolver->wake[1], "", 1);
+    (void) written;
+    resolver_release(resolver);
+    return NULL;
+}
+
+static struct RESOLVER* start_lookup(const char* host, const char* port) {
+    struct RESOLVER* resolver = calloc(1, sizeof(struct RESOLVER));
+    if (pipe2(resolver->wake, O_NONBLOCK | O_CLOEXEC) == -1) {
+        free(resolver);
+        return NULL;
+    }
+    pthread_mutex_init(&resolver->lock, NULL);
+    resolver->refs = 2;
+    resolver->host = strdup(host);
+    resolver->port = strdup(port);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, lookup_main, resolver) != 0) {
+        resolver->refs = 1;
+        resolver_release(resolver);
+        resolver = NULL;
+    }
+    pthread_attr_destroy(&attr);
+    return resolver;
+}
+
+// Takes the addresses in the order getaddrinfo sorted them (RFC 6724), but alternating
+// families from the first one on, so a family that doesn't work costs one attempt at a time
+static void add_addresses(struct CONNECT_STATE* state, const struct addrinfo* answer) {
+    int families[2] = {-1, -1};
+    for (const struct addrinfo* ai = answer; ai != NULL && families[0] == -1; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET6 || ai->ai_family == AF_INET) {
+            families[0] = ai->ai_family;
+            families[1] = ai->ai_family == AF_INET6 ? AF_INET : AF_INET6;
+        }
+    }
+    const struct addrinfo* next[2] = {answer, answer};
+    for (int turn = 0; families[0] != -1 && state->num_addresses < CONNECT_MAX_ADDRESSES; turn = 1 - turn) {
+        while (next[turn] != NULL && (next[turn]->ai_family != families[turn]
+                                      || next[turn]->ai_addrlen > sizeof(struct sockaddr_storage))) {
+            next[turn] = next[turn]->ai_next;
+        }
+        if (next[turn] == NULL) {
+            if (next[1 - turn] == NULL) {
+                break;
+            }
+            continue;
+        }
+        struct CONNECT_ADDRESS* address = &state->addresses[state->num_addresses++];
+        memcpy(&address->addr, next[turn]->ai_addr, next[turn]->ai_addrlen);
+        address->len = next[turn]->ai_addrlen;
+        next[turn] = next[turn]->ai_next;
+    }
+}
+
+// Takes the lookup's answer if it's in
+static void take_answer(struct CONNECT_STATE* state) {
+    char drain[16];
+    while (read(state->resolver->wake[0], drain, sizeof(drain)) > 0) {
+    }
+    pthread_mutex_lock(&state->resolver->lock);
+    int done = state->resolver->done;
+    if (done) {
+        add_addresses(state, state->resolver->answer);
+    }
+    pthread_mutex_unlock(&state->resolver->lock);
+    if (done) {
+        resolver_release(state->resolver);
+        state->resolver = NULL;
+    }
+}
+
+static void format_address(const struct CONNECT_ADDRESS* address, char* out, size_t size) {
+    char host[INET6_ADDRSTRLEN] = "?";
+    if (address->addr.ss_family == AF_INET6) {
+        const struct sockaddr_in6* in6 = (const struct sockaddr_in6*) &address->addr;
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+        snprintf(out, size, "[%s]:%d", host, ntohs(in6->sin6_port));
+    } else {
+        const struct sockaddr_in* in = (const struct sockaddr_in*) &address->addr;
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+        snprintf(out, size, "%s:%d", host, ntohs(in->sin_port));
+    }
+}
+
+static void drop_attempt(struct CONNECT_STATE* state, int i) {
+    close(state->attempts[i].fd);
+    state->attempts[i] = state->attempts[--state->num_attempts];
+}
+
+// The winner goes back to blocking, like any other socket of the client's, and the rest are closed
+static int finish(struct CONNECT_STATE* state, int winner, struct CONNECT_RESULT* result, long long start) {
+    int fd = state->attempts[winner].fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    format_address(state->attempts[winner].address, result->address, sizeof(result->address));
+    state->attempts[winner] = state->attempts[--state->num_attempts];
+    while (state->num_attempts > 0) {
+        drop_attempt(state, 0);
+    }
+    result->connect_ms = monotonic_ms() - start;
+    return fd;
+}
+
+static int fail(struct CONNECT_STATE* state, struct CONNECT_RESULT* result, const char* error, long long start) {
+    while (state->num_attempts > 0) {
+        drop_attempt(state, 0);
+    }
+    if (state->resolver != NULL) {
+        // it finishes on its own, and whichever of us is last frees it
+        resolver_release(state->resolver);
+    }
+    result->error = error;
+    result->connect_ms = monotonic_ms() - start;
+    return -1;
+}
+
+int connector_connect(const char* host, const char* port, const struct CONNECT_OPTIONS* options,
+                      struct CONNECT_RESULT* result) {
+    memset(result, 0, sizeof(struct CONNECT_RESULT));
+    long long start = monotonic_ms();
+    struct CONNECT_STATE* state = calloc(1, sizeof(struct CONNECT_STATE));
+
+    // A numeric address needs no lookup
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+    struct addrinfo* numeric;
+    if (getaddrinfo(host, port, &hints, &numeric) == 0) {
+        add_addresses(state, numeric);
+        freeaddrinfo(numeric);
+    } else if ((state->resolver = start_lookup(host, port)) == NULL) {
+        free(state);
+        result->error = "Unable to look up the server";
+        return -1;
+    }
+
+    long long resolve_deadline = start + options->resolve_timeout_ms;
+    long long next_attempt_ms = start;
+    int fd = -2;
+    while (fd == -2) {
+        long long now = monotonic_ms();
+        if (state->resolver != NULL) {
+            take_answer(state);
+            result->resolve_ms = now - start;
+        }
+
+        // Another attempt, if it's time or there's nothing else going on
+        if (state->next_address < state->num_addresses && state->num_attempts < CONNECT_MAX_ATTEMPTS
+            && (now >= next_attempt_ms || state->num_attempts == 0)) {
+            struct CONNECT_ADDRESS* address = &state->addresses[state->next_address++];
+            result->attempts++;
+            next_attempt_ms = now + options->attempt_delay_ms;
+            int sockfd = socket(address->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if (sockfd == -1) {
+                continue;
+            }
+            struct CONNECT_ATTEMPT* attempt = &state->attempts[state->num_attempts++];
+            attempt->fd = sockfd;
+            attempt->deadline = now + options->attempt_timeout_ms;
+            attempt->address = address;
+            if (connect(sockfd, (struct sockaddr*) &address->addr, address->len) == 0) {
+                fd = finish(state, state->num_attempts - 1, result, start);
+            } else if (errno != EINPROGRESS) {
+                // refused or unreachable already, on to the next one
+                drop_attempt(state, state->num_attempts - 1);
+                next_attempt_ms = now;
+            }
+            continue;
+        }
+
+        // Out of things to try?
+        if (state->num_attempts == 0 && state->next_address == state->num_addresses) {
+            if (state->num_addresses > 0) {
+                fd = fail(state, result, "The client failed to connect.", start);
+            } else if (state->resolver == NULL) {
+                fd = fail(state, result, "Unable to reach the server you specified", start);
+            } else if (now >= resolve_deadline) {
+                fd = fail(state, result, "Looking up the server took too long", start);
+            }
+            if (fd != -2) {
+                break;
+            }
+        }
+
+        // Wait for an attempt to finish, the answer, or the next thing to do
+        long long wake_ms = state->resolver != NULL ? resolve_deadline : now + options->attempt_timeout_ms;
+        if (state->next_address < state->num_addresses && state->num_attempts < CONNECT_MAX_ATTEMPTS) {
+            wake_ms = next_attempt_ms;
+        }
+        struct pollfd fds[CONNECT_MAX_ATTEMPTS + 1];
+        int num_fds = 0;
+        for (int i = 0; i < state->num_attempts; i++) {
+            wake_ms = state->attempts[i].deadline < wake_ms ? state->attempts[i].deadline : wake_ms;
+            fds[num_fds++] = (struct pollfd) {.fd = state->attempts[i].fd, .events = POLLOUT};
+        }
+        if (state->resolver != NULL) {
+            fds[num_fds++] = (struct pollfd) {.fd = state->resolver->wake[0], .events = POLLIN};
+        }
+        int timeout = wake_ms > now ? (int) (wake_ms - now) : 0;
+        if (poll(fds, num_fds, timeout) == -1 && errno != EINTR) {
+            fd = fail(state, result, "Unable to wait for the connection", start);
+            break;
+        }
+
+        now = monotonic_ms();
+        for (int i = state->num_attempts - 1; i >= 0; i--) {
+            if (fds[i].revents != 0) {
+                int error = 0;
+                socklen_t error_len = sizeof(error);
+                if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 && error == 0) {
+                    fd = finish(state, i, result, start);
+                    break;
+                }
+            } else if (now < state->attempts[i].deadline) {
+                continue;
+            }
+            // failed or out of time, the next address goes right away
+            drop_attempt(state, i);
+            next_attempt_ms = now;
+        }
+    }
+    free(state);
+    return fd;
+}
@@ -0,0 +1,46 @@
+#ifndef ECE361_TEXTCONFERENCING_CONNECTOR_H
+#define ECE361_TEXTCONFERENCING_CONNECTOR_H
+
+/*
+ * Connecting to a server by name the way RFC 8305 ("Happy Eyeballs") does, so that a dead
+ * address or a slow resolver costs about attempt_delay_ms, not a TCP timeout.
+ *
+ * getaddrinfo() blocks, so the name is looked up by a thread of its own (glibc asks for the
+ * IPv6 and IPv4 addresses at once), and the connect gives up on it after resolve_timeout_ms.
+ * The addresses are tried in the order it sorted them (RFC 6724), except that the families
+ * take turns, starting with whichever came first. Attempts are non-blocking and start one
+ * every attempt_delay_ms, or right away once every attempt so far has failed. The first to
+ * connect wins and the rest are closed. Each attempt gives up after attempt_timeout_ms, and
+ * the whole thing once every address has.
+ *
+ * A lookup that's still running when the connect gives up is left to finish on its own, and
+ * cleans up after itself. Numeric addresses aren't looked up at all.
+ */
+
+// Attempts at once, anything past that waits for one to fail
+#define CONNECT_MAX_ATTEMPTS 8
+// Addresses tried, of both families
+#define CONNECT_MAX_ADDRESSES 16
+
+struct CONNECT_OPTIONS {
+    int attempt_delay_ms;   // before the next address is tried alongside
+    int attempt_timeout_ms; // for each address
+    int resolve_timeout_ms; // to wait for the first address
+};
+
+// What happened, for whoever wants to say
+struct CONNECT_RESULT {
+    const char* error;      // why it failed, NULL if it didn't
+    int attempts;           // addresses tried
+    int resolve_ms;         // until the lookup answered
+    int connect_ms;         // in all
+    char address[64];       // the one that answered, as text
+};
+
+void connector_default_options(struct CONNECT_OPTIONS* options);
+
+// Returns a connected, blocking TCP socket, or -1 with result->error set
+int connector_connect(const char* host, const char* port, const struct CONNECT_OPTIONS* options,
+                      struct CONNECT_RESULT* result);
+
+#endif //ECE361_TEXTCONFERENCING_CONNECTOR_H
@@ -0,0 +1,67 @@
+#include "governor.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+void mem_init(struct MEMORY_GOVERNOR* gov, size_t budget) {
+    memset(gov, 0, sizeof(struct MEMORY_GOVERNOR));
+    gov->budget = budget;
+}
+
+void mem_charge(struct MEMORY_GOVERNOR* gov, enum MEM_SUBSYSTEM subsystem, size_t bytes) {
+    gov->used[subsystem] += bytes;
+    gov->total += bytes;
+    if (gov->total > gov->peak) {
+        gov->peak = gov->total;
+    }
+}
+
+void mem_credit(struct MEMORY_GOVERNOR* gov, enum MEM_SUBSYSTEM subsystem, size_t bytes) {
+    gov->used[subsystem] -= bytes;
+    gov->total -= bytes;
+}
+
+enum MEM_PRESSURE mem_pressure(const struct MEMORY_GOVERNOR* gov) {
+    if (gov->budget == 0) {
+        return MEM_OK;
+    }
+    if (gov->total > gov->budget) {
+        return MEM_FULL;
+    }
+    if (gov->total > gov->budget / 100 * MEM_HIGH_WATER_PERCENT) {
+        return MEM_HIGH;
+    }
+    return MEM_OK;
+}
+
+const char* mem_subsystem_name(enum MEM_SUBSYSTEM subsystem) {
+    static const char* names[NUM_MEM_SUBSYSTEMS] = {
+        [MEM_CONNECTIONS] = "connections",
+        [MEM_INPUT] = "input buffers",
+        [MEM_OUTPUT] = "output",
+        [MEM_HISTORY] = "history",
+        [MEM_SESSIONS] = "sessions",
+        [MEM_CLIENTS] = "clients",
+        [MEM_BLOBS] = "blobs",
+        [MEM_SHM] = "shared rings",
+        [MEM_MAILBOXES] = "mailboxes",
+        [MEM_SEARCH] = "search",
+    };
+    return names[subsystem];
+}
+
+size_t mem_rss() {
+    // the second field of statm is the resident size in pages
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    unsigned long size, resident;
+    int fields = fscanf(fp, "%lu %lu", &size, &resident);
+    fclose(fp);
+    if (fields != 2) {
+        return 0;
+    }
+    return (size_t) resident * sysconf(_SC_PAGESIZE);
+}
@@ -0,0 +1,61 @@
+#ifndef ECE361_TEXTCONFERENCING_GOVERNOR_H
+#define ECE361_TEXTCONFERENCING_GOVERNOR_H
+
+#include <stddef.h>
+
+/*
+ * Keeps count of the bytes the server has allocated, per subsystem, against a budget.
+ * It doesn't allocate anything itself: callers charge what they malloc and credit what
+ * they free, and ask mem_pressure how close to the budget they are before taking on more.
+ */
+
+enum MEM_SUBSYSTEM {
+    MEM_CONNECTIONS, // connection records
+    MEM_INPUT,       // input buffers, the ones lent out and the ones in the pool
+    MEM_OUTPUT,      // formatted messages, queued for sending or kept in session history
+    MEM_HISTORY,     // the history rings themselves
+    MEM_SESSIONS,
+    MEM_CLIENTS,
+    MEM_BLOBS,       // file transfers in progress, not counting their chunks
+    MEM_SHM,         // shared memory rings of local clients
+    MEM_MAILBOXES,   // direct messages waiting for users who are offline
+    MEM_SEARCH,      // the sessions' search indexes
+    NUM_MEM_SUBSYSTEMS
+};
+
+enum MEM_PRESSURE {
+    MEM_OK,
+    MEM_HIGH, // past the high water mark, refuse new work
+    MEM_FULL  // over budget, shed what we already have
+};
+
+// Refusing new work starts at this percentage of the budget
+#define MEM_HIGH_WATER_PERCENT 90
+
+struct MEMORY_GOVERNOR {
+    size_t budget; // 0 means unlimited
+    size_t used[NUM_MEM_SUBSYSTEMS];
+    size_t total;
+    size_t peak;
+
+    // what it had to turn away
+    unsigned long long refused_connections;
+    unsigned long long refused_joins;
+    unsigned long long shed_connections;
+    unsigned long long trimmed_history;
+};
+
+void mem_init(struct MEMORY_GOVERNOR* gov, size_t budget);
+
+void mem_charge(struct MEMORY_GOVERNOR* gov, enum MEM_SUBSYSTEM subsystem, size_t bytes);
+
+void mem_credit(struct MEMORY_GOVERNOR* gov, enum MEM_SUBSYSTEM subsystem, size_t bytes);
+
+enum MEM_PRESSURE mem_pressure(const struct MEMORY_GOVERNOR* gov);
+
+const char* mem_subsystem_name(enum MEM_SUBSYSTEM subsystem);
+
+// Resident set size of the whole process in bytes, or 0 if it can't be read
+size_t mem_rss();
+
+#endif //ECE361_TEXTCONFERENCING_GOVERNOR_H
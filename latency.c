@@ -0,0 +1,108 @@
+#include "latency.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+unsigned long long lat_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void lat_record(struct LAT_HISTOGRAM* hist, long long us) {
+    unsigned long long value = us > 0 ? (unsigned long long) us : 0;
+    int bucket = 0;
+    while (bucket < LAT_BUCKETS - 1 && value >= (2ULL << bucket)) {
+        bucket++;
+    }
+    hist->counts[bucket]++;
+    hist->total++;
+    if (value > hist->max_us) {
+        hist->max_us = value;
+    }
+}
+
+unsigned long long lat_percentile(const struct LAT_HISTOGRAM* hist, double p) {
+    if (hist->total == 0) {
+        return 0;
+    }
+    unsigned long long rank = (unsigned long long) (hist->total * p / 100.0 + 0.5);
+    rank = rank < 1 ? 1 : rank;
+    unsigned long long seen = 0;
+    for (int bucket = 0; bucket < LAT_BUCKETS; bucket++) {
+        seen += hist->counts[bucket];
+        if (seen >= rank) {
+            // never more than was actually seen
+            unsigned long long bound = (2ULL << bucket) - 1;
+            return bound < hist->max_us ? bound : hist->max_us;
+        }
+    }
+    return hist->max_us;
+}
+
+int lat_format_report(const struct LAT_HISTOGRAM* legs, char* buf, size_t size) {
+    int n = 0;
+    for (int leg = 0; leg < NUM_LAT_LEGS; leg++) {
+        int last = LAT_BUCKETS - 1;
+        while (last > 0 && legs[leg].counts[last] == 0) {
+            last--;
+        }
+        n += snprintf(buf + n, n < (int) size ? size - n : 0, "%s %llu %llu", lat_leg_name(leg),
+                      legs[leg].total, legs[leg].max_us);
+        for (int bucket = 0; bucket <= last; bucket++) {
+            n += snprintf(buf + n, n < (int) size ? size - n : 0, " %llu", legs[leg].counts[bucket]);
+        }
+        n += snprintf(buf + n, n < (int) size ? size - n : 0, "\n");
+    }
+    return n;
+}
+
+int lat_merge_report(struct LAT_HISTOGRAM* legs, const char* report) {
+    // parsed completely before anything is added, so a bad report changes nothing
+    struct LAT_HISTOGRAM parsed[NUM_LAT_LEGS];
+    memset(parsed, 0, sizeof(parsed));
+    const char* line = report;
+    for (int leg = 0; leg < NUM_LAT_LEGS; leg++) {
+        size_t name_len = strlen(lat_leg_name(leg));
+        if (strncmp(line, lat_leg_name(leg), name_len) != 0 || line[name_len] != ' ') {
+            return -1;
+        }
+        char* end;
+        const char* p = line + name_len;
+        parsed[leg].total = strtoull(p, &end, 10);
+        parsed[leg].max_us = strtoull(end, &end, 10);
+        p = end;
+        unsigned long long sum = 0;
+        for (int bucket = 0; bucket < LAT_BUCKETS && *p == ' '; bucket++) {
+            parsed[leg].counts[bucket] = strtoull(p, &end, 10);
+            sum += parsed[leg].counts[bucket];
+            p = end;
+        }
+        if (*p != '\n' || sum != parsed[leg].total) {
+            return -1;
+        }
+        line = p + 1;
+    }
+
+    for (int leg = 0; leg < NUM_LAT_LEGS; leg++) {
+        for (int bucket = 0; bucket < LAT_BUCKETS; bucket++) {
+            legs[leg].counts[bucket] += parsed[leg].counts[bucket];
+        }
+        legs[leg].total += parsed[leg].total;
+        if (parsed[leg].max_us > legs[leg].max_us) {
+            legs[leg].max_us = parsed[leg].max_us;
+        }
+    }
+    return 0;
+}
+
+const char* lat_leg_name(enum LAT_LEG leg) {
+    static const char* names[NUM_LAT_LEGS] = {
+        [LAT_UP] = "up",
+        [LAT_DWELL] = "dwell",
+        [LAT_DOWN] = "down",
+    };
+    return names[leg];
+}
@@ -0,0 +1,57 @@
+#ifndef ECE361_TEXTCONFERENCING_LATENCY_H
+#define ECE361_TEXTCONFERENCING_LATENCY_H
+
+#include <stddef.h>
+
+/*
+ * End-to-end latency of chat messages, measured in-band. A client with TC_LATENCY set stamps
+ * the MESSAGEs and DM_REQs it sends with "ts", its clock when it sent them. The server adds
+ * "tr" (when it woke up to read the frame) and "tx" (when it formatted what it sends on), and
+ * the receiving client splits the trip into three legs, each kept in a histogram:
+ *  - up:    ts to tr, the sender's batching, both kernels and the network
+ *  - dwell: tr to tx, waiting for and being handled by the server
+ *  - down:  tx to arrival, the server's output queue, both kernels and the network
+ * Now and then the client sends what it collected as a LAT_REPORT and starts over, and the
+ * server adds it up for STATS.
+ *
+ * The stamps are wall clock microseconds, so across hosts the legs are only as good as the
+ * clocks are in sync. A leg that comes out negative counts as 0.
+ */
+
+// Bucket 0 holds 0 and 1 us, bucket i [2^i, 2^(i+1)) us, the last one everything longer
+#define LAT_BUCKETS 32
+
+// Enough for any report: three legs of a name and LAT_BUCKETS + 2 numbers
+#define LAT_REPORT_MAX 2400
+
+enum LAT_LEG {
+    LAT_UP,
+    LAT_DWELL,
+    LAT_DOWN,
+    NUM_LAT_LEGS
+};
+
+struct LAT_HISTOGRAM {
+    unsigned long long counts[LAT_BUCKETS];
+    unsigned long long total;
+    unsigned long long max_us;
+};
+
+// The clock the stamps are taken with
+unsigned long long lat_now_us();
+
+void lat_record(struct LAT_HISTOGRAM* hist, long long us);
+
+// Upper bound of the bucket the p-th percentile (0 to 100) falls in, 0 if it's empty
+unsigned long long lat_percentile(const struct LAT_HISTOGRAM* hist, double p);
+
+// One line per leg, "<leg> <total> <max> <count>...", up to the last bucket that isn't empty.
+// Returns the length, like snprintf.
+int lat_format_report(const struct LAT_HISTOGRAM* legs, char* buf, size_t size);
+
+// Adds a report's counts to legs, returns -1 if it isn't one
+int lat_merge_report(struct LAT_HISTOGRAM* legs, const char* report);
+
+const char* lat_leg_name(enum LAT_LEG leg);
+
+#endif //ECE361_TEXTCONFERENCING_LATENCY_H
@@ -0,0 +1,502 @@
+// Opens a large number of idle, logged in connections to a running server and reports
+// how much resident memory each one costs it, going by the rss in STATS.
+// Usage: loadgen users <count>
+//            prints login.txt lines for the users load0 .. load<count>
+//        loadgen idle <port> <count> [source address ...]
+//            logs load1 .. load<count> in (load0 asks for the STATS). Connections are spread
+//            over the source addresses (all of 127.0.0.0/8 is loopback), since one address
+//            only has so many ports to connect from.
+//        loadgen chat <port> <count> <seconds> [messages per second]
+//            logs load1 .. load<count> in, in sessions of SESSION_CAP, and has each of them
+//            send messages to its session (2 a second by default). Every message has to
+//            reach every other member exactly once and in order, and no connection may
+//            drop; the longest stretch without a single delivery is reported as well.
+//            Meant to run across a server handoff (see takeover=), and needs the
+//            server's session_rate and message_rate to allow the traffic (0 is unlimited).
+// The server needs a memory_budget that leaves room for them all (or 0), and both ends
+// need a descriptor limit above count.
+#define _GNU_SOURCE // IP_BIND_ADDRESS_NO_PORT
+#include "packet.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+
+// Bytes of server memory an idle connection may cost
+#define TARGET_BYTES_PER_CONNECTION 1024
+
+// Connections being set up at once
+#define CONNECT_WINDOW 512
+
+enum LOAD_STATE {
+    LOAD_NONE,
+    LOAD_CONNECTING,
+    LOAD_LOGGING_IN,
+    LOAD_IDLE
+};
+
+static unsigned char* states; // by fd
+static int epoll_fd;
+static int logged_in = 0;
+static int failed = 0;
+static int in_progress = 0;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int send_message(int sockfd, struct message* msg) {
+    int len;
+    char* buf = encode_message(msg, -1, &len);
+    int sent = send(sockfd, buf, len, MSG_NOSIGNAL);
+    free(buf);
+    return sent == len ? 0 : -1;
+}
+
+static void send_login(int sockfd, int user) {
+    struct message msg;
+    message_init(&msg, LOGIN);
+    snprintf(msg.source, MAX_NAME, "load%d", user);
+    message_printf(&msg, "p");
+    send_message(sockfd, &msg);
+}
+
+// Reads frames on a blocking socket until one of the given type shows up
+static struct message* wait_for(int sockfd, unsigned int type) {
+    static char buf[2 * MAX_STR_LEN];
+    static int buf_len = 0;
+    while (1) {
+        int len;
+        while ((len = frame_length(buf, buf_len)) > 0) {
+            struct message* msg = buf_to_message(buf, len);
+            memmove(buf, buf + len, buf_len - len);
+            buf_len -= len;
+            if (msg != NULL && msg->type == type) {
+                return msg;
+            }
+            if (msg != NULL && msg->type == LO_NAK) {
+                printf("Error: can't log in: %s\n", msg->data);
+                exit(1);
+            }
+            free(msg);
+        }
+        int n = recv(sockfd, buf + buf_len, sizeof(buf) - buf_len, 0);
+        if (n <= 0) {
+            printf("Error: the server closed the connection\n");
+            exit(1);
+        }
+        buf_len += n;
+    }
+}
+
+// Asks for STATS and returns the rss in it, printing the connections line
+static size_t server_rss(int sockfd) {
+    struct message msg;
+    message_init(&msg, STATS);
+    strcpy(msg.source, "load0");
+    send_message(sockfd, &msg);
+
+    // the report can come in several parts, the last with "s" 0
+    size_t rss = 0;
+    int more = 1;
+    while (more) {
+        struct message* reply = wait_for(sockfd, ST_ACK);
+        const char* found = strstr(reply->data, "rss ");
+        if (found != NULL) {
+            rss = strtoull(found + 4, NULL, 10);
+        }
+        const char* line = strstr(reply->data, "connections: ");
+        if (line != NULL && (line == reply->data || line[-1] == '\n')) {
+            printf("  server: %.*s\n", (int) strcspn(line, "\n"), line);
+        }
+        more = reply->seq > 0;
+        free(reply);
+    }
+    return rss;
+}
+
+// Handles whatever the idle connections were sent: their login answers, and PINGs
+static void poll_connections(int timeout_ms) {
+    struct epoll_event events[256];
+    int n = epoll_wait(epoll_fd, events, 256, timeout_ms);
+    for (int e = 0; e < n; e++) {
+        int sockfd = events[e].data.fd;
+        if (states[sockfd] == LOAD_CONNECTING) {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
+            in_progress--;
+            if (error != 0) {
+                printf("Error connecting: %s\n", strerror(error));
+                failed++;
+                states[sockfd] = LOAD_NONE;
+                close(sockfd);
+                continue;
+            }
+            // the user number was parked in the event data until now
+            send_login(sockfd, events[e].data.u64 >> 32);
+            struct epoll_event event = {.events = EPOLLIN, .data.fd = sockfd};
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sockfd, &event);
+            states[sockfd] = LOAD_LOGGING_IN;
+            continue;
+        }
+
+        // The server's frames here are a few dozen bytes, written whole, so they arrive whole
+        char buf[4096];
+        int buf_len = recv(sockfd, buf, sizeof(buf), 0);
+        if (buf_len <= 0) {
+            if (states[sockfd] == LOAD_IDLE) {
+                logged_in--;
+            }
+            failed++;
+            states[sockfd] = LOAD_NONE;
+            close(sockfd);
+            continue;
+        }
+        int offset = 0;
+        int len;
+        while ((len = frame_length(buf + offset, buf_len - offset)) > 0) {
+            struct message* msg = buf_to_message(buf + offset, len);
+            offset += len;
+            if (msg == NULL) {
+                continue;
+            }
+            if (msg->type == LO_ACK && states[sockfd] == LOAD_LOGGING_IN) {
+                states[sockfd] = LOAD_IDLE;
+                logged_in++;
+            } else if (msg->type == LO_NAK) {
+                if (failed++ == 0) {
+                    printf("Error: can't log in: %s\n", msg->data);
+                }
+            } else if (msg->type == PING) {
+                struct message pong;
+                message_init(&pong, PONG);
+                strcpy(pong.source, msg->source);
+                send_message(sockfd, &pong);
+            }
+            free(msg);
+        }
+    }
+}
+
+static int open_connection(int port, const struct in_addr* source, int user) {
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sockfd == -1) {
+        printf("Error: socket: %s\n", strerror(errno));
+        return -1;
+    }
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    if (source != NULL) {
+        // the port is picked at connect(), so it only has to be unique per destination
+        int yes = 1;
+        setsockopt(sockfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &yes, sizeof(yes));
+        addr.sin_addr = *source;
+        if (bind(sockfd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+            printf("Error binding to %s: %s\n", inet_ntoa(*source), strerror(errno));
+            close(sockfd);
+            return -1;
+        }
+    }
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(sockfd, (struct sockaddr*) &addr, sizeof(addr)) == -1 && errno != EINPROGRESS) {
+        printf("Error connecting: %s\n", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+    struct epoll_event event = {.events = EPOLLOUT};
+    event.data.u64 = ((unsigned long long) user << 32) | (unsigned int) sockfd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &event);
+    states[sockfd] = LOAD_CONNECTING;
+    in_progress++;
+    return sockfd;
+}
+
+static int connect_blocking(int port) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sockfd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        printf("Error connecting to port %d: %s\n", port, strerror(errno));
+        exit(1);
+    }
+    return sockfd;
+}
+
+static int idle(int port, int count, int num_sources, const char** source_names) {
+    struct in_addr* sources = calloc(num_sources, sizeof(struct in_addr));
+    for (int i = 0; i < num_sources; i++) {
+        if (inet_pton(AF_INET, source_names[i], &sources[i]) != 1) {
+            printf("Error: %s isn't an IPv4 address\n", source_names[i]);
+            return 1;
+        }
+    }
+
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < (rlim_t) count + 16) {
+        printf("Error: only %llu descriptors allowed, %d connections need more\n",
+               (unsigned long long) limit.rlim_cur, count);
+        return 1;
+    }
+    states = calloc(count + 64, 1);
+    epoll_fd = epoll_create1(0);
+
+    int stats_fd = connect_blocking(port);
+    send_login(stats_fd, 0);
+    free(wait_for(stats_fd, LO_ACK));
+    printf("before:\n");
+    size_t rss_before = server_rss(stats_fd);
+
+    double start = now_seconds();
+    double last_report = start;
+    int opened = 0;
+    while (opened < count) {
+        while (opened < count && in_progress < CONNECT_WINDOW) {
+            const struct in_addr* source = num_sources > 0 ? &sources[opened % num_sources] : NULL;
+            if (open_connection(port, source, opened + 1) == -1) {
+                return 1;
+            }
+            opened++;
+        }
+        poll_connections(100);
+        if (now_seconds() - last_report >= 5) {
+            printf("  %d opened, %d logged in, %d failed\n", opened, logged_in, failed);
+            last_report = now_seconds();
+        }
+    }
+    // the stragglers, and give the server a moment to finish
+    double deadline = now_seconds() + 10;
+    while (logged_in + failed < count && now_seconds() < deadline) {
+        poll_connections(100);
+    }
+    printf("%d of %d connections logged in after %.1f s, %d failed\n",
+           logged_in, count, now_seconds() - start, failed);
+
+    printf("after:\n");
+    size_t rss_after = server_rss(stats_fd);
+    if (rss_before == 0 || rss_after == 0 || logged_in == 0) {
+        printf("Error: no rss to compare\n");
+        return 1;
+    }
+    double per_connection = ((double) rss_after - (double) rss_before) / logged_in;
+    printf("server rss %zu -> %zu bytes, %.0f bytes per idle connection (target %d)\n",
+           rss_before, rss_after, per_connection, TARGET_BYTES_PER_CONNECTION);
+    return (failed > 0 || per_connection > TARGET_BYTES_PER_CONNECTION) ? 1 : 0;
+}
+
+// One of the clients of "loadgen chat"
+struct CHATTER {
+    int sockfd;
+    int group;                       // the session it's in, members are group * SESSION_CAP + i
+    int joined;
+    unsigned int sent;               // messages, which are numbered from 0
+    unsigned int expected[SESSION_CAP]; // next number from each member of the group
+    unsigned long long last_seq;     // "s" of the last session message received
+    double next_send;
+    int buf_len;
+    char buf[65536];
+};
+
+static struct CHATTER* chatters;
+static int num_chatters;
+static unsigned long long delivered = 0;
+static unsigned long long out_of_order = 0;
+static unsigned long long refused = 0;
+static int disconnected = 0;
+static double last_delivery = 0;
+static double longest_pause = 0;
+
+static void chatter_frame(struct CHATTER* chatter, struct message* msg) {
+    if (msg->type == JN_ACK || msg->type == NS_ACK) {
+        chatter->joined = 1;
+    } else if (msg->type == MESSAGE) {
+        int sender;
+        unsigned int number;
+        int member = -1;
+        if (sscanf(msg->data, "%d %u", &sender, &number) == 2 && sender >= 0 && sender < num_chatters) {
+            member = sender % SESSION_CAP;
+        }
+        if (member == -1 || chatters[sender].group != chatter->group
+            || number != chatter->expected[member] || msg->seq <= chatter->last_seq) {
+            if (out_of_order++ == 0) {
+                printf("Error: load%d got \"%s\" (s=%llu) out of order\n",
+                       (int) (chatter - chatters) + 1, msg->data, msg->seq);
+            }
+        }
+        if (member != -1) {
+            chatter->expected[member] = number + 1;
+        }
+        chatter->last_seq = msg->seq;
+        delivered++;
+
+        double now = now_seconds();
+        if (last_delivery > 0 && now - last_delivery > longest_pause) {
+            longest_pause = now - last_delivery;
+        }
+        last_delivery = now;
+    } else if (msg->type == PING) {
+        struct message pong;
+        message_init(&pong, PONG);
+        strcpy(pong.source, msg->source);
+        send_message(chatter->sockfd, &pong);
+    } else if (msg->type == JN_NAK || msg->type == NS_NAK || msg->type == LO_NAK) {
+        if (refused++ == 0) {
+            printf("Error: load%d was refused: %s\n", (int) (chatter - chatters) + 1, msg->data);
+        }
+    }
+}
+
+static void poll_chatters(int timeout_ms) {
+    struct epoll_event events[256];
+    int n = epoll_wait(epoll_fd, events, 256, timeout_ms);
+    for (int e = 0; e < n; e++) {
+        struct CHATTER* chatter = &chatters[events[e].data.u32];
+        int num_read = recv(chatter->sockfd, chatter->buf + chatter->buf_len, sizeof(chatter->buf) - chatter->buf_len, 0);
+        if (num_read <= 0) {
+            if (num_read == -1 && errno == EAGAIN) {
+                continue;
+            }
+            printf("Error: load%d was disconnected\n", events[e].data.u32 + 1);
+            disconnected++;
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, chatter->sockfd, NULL);
+            continue;
+        }
+        chatter->buf_len += num_read;
+        int offset = 0;
+        int len;
+        while ((len = frame_length(chatter->buf + offset, chatter->buf_len - offset)) > 0) {
+            struct message* msg = buf_to_message(chatter->buf + offset, len);
+            offset += len;
+            if (msg != NULL) {
+                chatter_frame(chatter, msg);
+                free(msg);
+            }
+        }
+        memmove(chatter->buf, chatter->buf + offset, chatter->buf_len - offset);
+        chatter->buf_len -= offset;
+    }
+}
+
+static int chat(int port, int count, int seconds, double rate) {
+    num_chatters = count;
+    chatters = calloc(count, sizeof(struct CHATTER));
+    epoll_fd = epoll_create1(0);
+    char session_prefix[16];
+    snprintf(session_prefix, sizeof(session_prefix), "load%d", (int) getpid());
+
+    // The first member of each group makes its session, and the others join once it's there
+    for (int phase = 0; phase < 2; phase++) {
+        for (int i = 0; i < count; i++) {
+            struct CHATTER* chatter = &chatters[i];
+            if ((i % SESSION_CAP == 0) != (phase == 0)) {
+                continue;
+            }
+            chatter->group = i / SESSION_CAP;
+            chatter->sockfd = connect_blocking(port);
+            send_login(chatter->sockfd, i + 1);
+            struct message request;
+            message_init(&request, phase == 0 ? NEW_SESS : JOIN);
+            snprintf(request.source, MAX_NAME, "load%d", i + 1);
+            message_printf(&request, "%s-%d", session_prefix, chatter->group);
+            send_message(chatter->sockfd, &request);
+            fcntl(chatter->sockfd, F_SETFL, fcntl(chatter->sockfd, F_GETFL) | O_NONBLOCK);
+            struct epoll_event event = {.events = EPOLLIN, .data.u32 = i};
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, chatter->sockfd, &event);
+        }
+        int wanted = phase == 0 ? (count + SESSION_CAP - 1) / SESSION_CAP : count;
+        int joined = 0;
+        double deadline = now_seconds() + 10;
+        while (joined < wanted && now_seconds() < deadline && refused == 0) {
+            poll_chatters(100);
+            joined = 0;
+            for (int i = 0; i < count; i++) {
+                joined += chatters[i].joined;
+            }
+        }
+        if (joined < wanted) {
+            printf("Error: only %d of %d clients got into their session\n", joined, wanted);
+            return 1;
+        }
+    }
+    printf("%d clients in %d sessions, sending %.1f messages a second each for %d s\n",
+           count, (count + SESSION_CAP - 1) / SESSION_CAP, rate, seconds);
+
+    double start = now_seconds();
+    for (int i = 0; i < count; i++) {
+        // spread out over the first interval
+        chatters[i].next_send = start + (double) i / count / rate;
+    }
+    double last_report = start;
+    while (now_seconds() - start < seconds) {
+        double now = now_seconds();
+        for (int i = 0; i < count; i++) {
+            struct CHATTER* chatter = &chatters[i];
+            while (chatter->next_send <= now) {
+                struct message msg;
+                message_init(&msg, MESSAGE);
+                snprintf(msg.source, MAX_NAME, "load%d", i + 1);
+                snprintf(msg.session_id, MAX_SESSION_ID, "%s-%d", session_prefix, chatter->group);
+                message_printf(&msg, "%d %u", i, chatter->sent++);
+                send_message(chatter->sockfd, &msg);
+                chatter->next_send += 1 / rate;
+            }
+        }
+        poll_chatters(5);
+        if (now - last_report >= 1) {
+            printf("  %.0f s: %llu delivered, longest pause %.0f ms\n", now - start, delivered, longest_pause * 1000);
+            last_report = now;
+        }
+    }
+
+    // Everything sent has to arrive: each message goes to the rest of its sender's group
+    unsigned long long wanted = 0;
+    for (int i = 0; i < count; i++) {
+        int group_size = count - chatters[i].group * SESSION_CAP;
+        group_size = group_size < SESSION_CAP ? group_size : SESSION_CAP;
+        wanted += (unsigned long long) chatters[i].sent * (group_size - 1);
+    }
+    double deadline = now_seconds() + 5;
+    while (delivered < wanted && now_seconds() < deadline) {
+        poll_chatters(100);
+    }
+    printf("%llu of %llu messages delivered, %llu out of order, %llu refused, %d disconnected, "
+           "longest pause %.0f ms\n", delivered, wanted, out_of_order, refused, disconnected, longest_pause * 1000);
+    return (delivered != wanted || out_of_order > 0 || refused > 0 || disconnected > 0) ? 1 : 0;
+}
+
+int main(int argc, const char** argv) {
+    if (argc == 3 && strcmp(argv[1], "users") == 0) {
+        int count = atoi(argv[2]);
+        for (int i = 0; i <= count; i++) {
+            printf("load%d p\n", i);
+        }
+        return 0;
+    }
+    if (argc >= 4 && strcmp(argv[1], "idle") == 0) {
+        return idle(atoi(argv[2]), atoi(argv[3]), argc - 4, argv + 4);
+    }
+    if (argc >= 5 && strcmp(argv[1], "chat") == 0) {
+        return chat(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), argc >= 6 ? atof(argv[5]) : 2);
+    }
+    printf("Usage: loadgen users <count>\n");
+    printf("       loadgen idle <server-port> <count> [source address ...]\n");
+    printf("       loadgen chat <server-port> <count> <seconds> [messages per second]\n");
+    return 1;
+}
@@ -0,0 +1,320 @@
+#include "packet.h"
+
+int max_data = MAX_DATA;
+
+void message_init (struct message* msg, unsigned int type) {
+    memset(msg, 0, offsetof(struct message, inline_data));
+    msg->type = type;
+    msg->data = msg->inline_data;
+    msg->capacity = MESSAGE_INLINE_DATA;
+    msg->size = 1;
+    msg->data[0] = '\0';
+}
+
+char* message_reserve (struct message* msg, unsigned int capacity) {
+    if (capacity > msg->capacity) {
+        char* data = malloc(capacity);
+        memcpy(data, msg->data, msg->size);
+        if (msg->data_owned) {
+            free(msg->data);
+        }
+        msg->data = data;
+        msg->data_owned = 1;
+        msg->capacity = capacity;
+    }
+    return msg->data;
+}
+
+void message_release (struct message* msg) {
+    if (msg->data_owned) {
+        free(msg->data);
+    }
+    msg->data = msg->inline_data;
+    msg->data_owned = 0;
+    msg->capacity = MESSAGE_INLINE_DATA;
+}
+
+void message_vappendf (struct message* msg, const char* format, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+
+    int start = msg->size - 1;
+    if (start + len + 1 > max_data) {
+        len = max_data - 1 - start;
+    }
+    if (len <= 0) {
+        return;
+    }
+    message_reserve(msg, start + len + 1);
+    vsnprintf(msg->data + start, len + 1, format, args);
+    msg->size = start + len + 1;
+}
+
+void message_appendf (struct message* msg, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    message_vappendf(msg, format, args);
+    va_end(args);
+}
+
+void message_printf (struct message* msg, const char* format, ...) {
+    msg->size = 1;
+    msg->data[0] = '\0';
+    va_list args;
+    va_start(args, format);
+    message_vappendf(msg, format, args);
+    va_end(args);
+}
+
+char* encode_message (struct message* msg, int compress_threshold, int* len) {
+    char* buffer = malloc(msg->size + MAX_OPTIONS_LEN + 100);
+    int data_len = msg->size - 1;
+
+    char* packed = NULL;
+    int packed_len = -1;
+    if (compress_threshold >= 0 && data_len >= compress_threshold) {
+        packed = malloc(data_len);
+        packed_len = lz_compress(msg->data, data_len, packed, data_len - 1);
+    }
+
+    int n = sprintf(buffer, "%d", msg->type);
+    if (msg->seq != 0) {
+        n += sprintf(buffer + n, ",s=%llu", msg->seq);
+    }
+    if (msg->session_id[0] != '\0') {
+        n += sprintf(buffer + n, ",sess=%s", msg->session_id);
+    }
+    if (msg->compression) {
+        n += sprintf(buffer + n, ",z=lz");
+    }
+    if (msg->retry_after) {
+        n += sprintf(buffer + n, ",retry=%d", msg->retry_after);
+    }
+    if (msg->max_data) {
+        n += sprintf(buffer + n, ",max=%u", msg->max_data);
+    }
+    if (msg->blob_id) {
+        n += sprintf(buffer + n, ",blob=%u", msg->blob_id);
+    }
+    if (msg->to[0] != '\0') {
+        n += sprintf(buffer + n, ",to=%s", msg->to);
+    }
+    if (msg->trace != 0) {
+        n += sprintf(buffer + n, ",t=%llu", msg->trace);
+    }
+    if (msg->sent_us != 0) {
+        n += sprintf(buffer + n, ",ts=%llu", msg->sent_us);
+    }
+    if (msg->received_us != 0) {
+        n += sprintf(buffer + n, ",tr=%llu", msg->received_us);
+    }
+    if (msg->forwarded_us != 0) {
+        n += sprintf(buffer + n, ",tx=%llu", msg->forwarded_us);
+    }
+    if (packed_len != -1) {
+        n += sprintf(buffer + n, ",c=%d", msg->size);
+        n += sprintf(buffer + n, " %d %s ", packed_len + 1, msg->source);
+        memcpy(buffer + n, packed, packed_len);
+        n += packed_len;
+    } else {
+        n += sprintf(buffer + n, " %d %s ", msg->size, msg->source);
+        memcpy(buffer + n, msg->data, data_len);
+        n += data_len;
+    }
+    free(packed);
+    // a '\0' will be added to the very end of buffer
+    buffer[n] = '\0';
+    *len = n;
+    return buffer;
+}
+
+const char* message_to_str (struct message* msg) {
+    int len;
+    return encode_message(msg, -1, &len);
+}
+
+int parse_message_options (struct message* msg, char* options) {
+    int compressed_from = 0;
+    char* saveptr;
+    for (char* option = strtok_r(options, ",", &saveptr); option != NULL; option = strtok_r(NULL, ",", &saveptr)) {
+        char* value = strchr(option, '=');
+        if (value == NULL) {
+            continue;
+        }
+        *value++ = '\0';
+        if (strcmp(option, "s") == 0) {
+            msg->seq = strtoull(value, NULL, 10);
+        } else if (strcmp(option, "sess") == 0) {
+            strncpy(msg->session_id, value, MAX_SESSION_ID - 1);
+        } else if (strcmp(option, "z") == 0) {
+            msg->compression = (strcmp(value, "lz") == 0);
+        } else if (strcmp(option, "blob") == 0) {
+            msg->blob_id = strtoul(value, NULL, 10);
+        } else if (strcmp(option, "to") == 0) {
+            strncpy(msg->to, value, MAX_NAME - 1);
+        } else if (strcmp(option, "t") == 0) {
+            msg->trace = strtoull(value, NULL, 10);
+        } else if (strcmp(option, "ts") == 0) {
+            msg->sent_us = strtoull(value, NULL, 10);
+        } else if (strcmp(option, "tr") == 0) {
+            msg->received_us = strtoull(value, NULL, 10);
+        } else if (strcmp(option, "tx") == 0) {
+            msg->forwarded_us = strtoull(value, NULL, 10);
+        } else if (strcmp(option, "retry") == 0) {
+            msg->retry_after = atoi(value);
+        } else if (strcmp(option, "max") == 0) {
+            msg->max_data = strtoul(value, NULL, 10);
+        } else if (strcmp(option, "c") == 0) {
+            compressed_from = atoi(value);
+        }
+        // unknown options are ignored, so either side can add new ones
+    }
+    return compressed_from;
+}
+
+int frame_header (const char* buf, int len, unsigned int* type, int* size) {
+    int i = 0;
+
+    // type
+    int start = i;
+    *type = 0;
+    while (i < len && buf[i] >= '0' && buf[i] <= '9') {
+        if (i - start >= 10) return -1;
+        *type = *type * 10 + (buf[i] - '0');
+        i++;
+    }
+    if (i == len) return 0;
+    if (i == start) return -1;
+
+    // optional header fields, up to the next space (memchr takes a vector at a time)
+    if (buf[i] == ',') {
+        const char* space = memchr(buf + i, ' ', len - i <= MAX_OPTIONS_LEN ? len - i : MAX_OPTIONS_LEN + 1);
+        if (space == NULL) return len - i <= MAX_OPTIONS_LEN ? 0 : -1;
+        i = space - buf;
+    }
+    if (buf[i] != ' ') return -1;
+    i++;
+
+    // size, file chunks are the only thing allowed past MAX_DATA
+    int max_size = (*type == BLOB_CHUNK) ? BLOB_CHUNK_MAX + 1 : max_data;
+    start = i;
+    *size = 0;
+    while (i < len && buf[i] >= '0' && buf[i] <= '9') {
+        *size = *size * 10 + (buf[i] - '0');
+        if (*size > max_size) return -1;
+        i++;
+    }
+    if (i == len) return 0;
+    if (i == start || buf[i] != ' ' || *size < 1) return -1;
+    i++;
+
+    // source
+    const char* space = memchr(buf + i, ' ', len - i < MAX_NAME ? len - i : MAX_NAME);
+    if (space == NULL) return len - i < MAX_NAME ? 0 : -1;
+    if (space == buf + i) return -1;
+    return space - buf + 1;
+}
+
+int frame_length (const char* buf, int len) {
+    unsigned int type;
+    int size;
+    int header_len = frame_header(buf, len, &type, &size);
+    if (header_len <= 0) return header_len;
+    if (len - header_len < size - 1) return 0;
+    return header_len + size - 1;
+}
+
+int blob_chunk_header (char* out, unsigned int blob_id, const char* source, int payload_len) {
+    return sprintf(out, "%d,blob=%u %d %s ", BLOB_CHUNK, blob_id, payload_len + 1, source);
+}
+
+unsigned int frame_blob_id (const char* buf, int header_len) {
+    char options[MAX_OPTIONS_LEN + 1];
+    int i = 0;
+    while (buf[i] != ',' && buf[i] != ' ') i++;
+    if (buf[i] != ',') return 0;
+    int start = ++i;
+    while (buf[i] != ' ') i++;
+    memcpy(options, buf + start, i - start);
+    options[i - start] = '\0';
+    struct message scratch;
+    message_init(&scratch, BLOB_CHUNK);
+    parse_message_options(&scratch, options);
+    return scratch.blob_id;
+}
+
+struct message* buf_to_message (const char* buf, int len) {
+    unsigned int type;
+    int size;
+    int header_len = frame_header(buf, len, &type, &size);
+    if (header_len <= 0 || len - header_len < size - 1 || type == BLOB_CHUNK) {
+        // chunks don't fit in a struct message, they're handled straight from the buffer
+        return NULL;
+    }
+
+    // The header is read into a message on the stack first, since the payload size
+    // (after decompression) decides how much to allocate
+    struct message header;
+    message_init(&header, type);
+
+    // frame_header already checked the layout, so only the values are left to pick out
+    int i = 0;
+    while (buf[i] != ',' && buf[i] != ' ') i++;
+
+    int compressed_from = 0;
+    if (buf[i] == ',') {
+        char options[MAX_OPTIONS_LEN + 1];
+        int start = ++i;
+        while (buf[i] != ' ') i++;
+        memcpy(options, buf + start, i - start);
+        options[i - start] = '\0';
+        compressed_from = parse_message_options(&header, options);
+    }
+    i++;
+
+    header.size = size;
+    while (buf[i] != ' ') i++;
+    i++;
+
+    // the source is all that's left of the header
+    memcpy(header.source, buf + i, header_len - 1 - i);
+    header.source[header_len - 1 - i] = '\0';
+    i = header_len;
+
+    if (compressed_from < 0 || compressed_from > max_data) {
+        return NULL;
+    }
+    int final_size = compressed_from > 0 ? compressed_from : header.size;
+    int extra = final_size > MESSAGE_INLINE_DATA ? final_size : 0;
+    struct message* result = malloc(sizeof(struct message) + extra);
+    *result = header;
+    if (extra > 0) {
+        result->data = (char*) (result + 1);
+        result->capacity = final_size;
+    } else {
+        result->data = result->inline_data;
+    }
+
+    if (compressed_from > 0) {
+        if (lz_decompress(buf + i, header.size - 1, result->data, compressed_from - 1) != compressed_from - 1) {
+            free(result);
+            return NULL;
+        }
+        result->size = compressed_from;
+    } else {
+        memcpy(result->data, buf + i, result->size - 1);
+    }
+    result->data[result->size - 1] = '\0';
+    return result;
+}
+
+struct message* str_to_message (const char* input) {
+    struct message* result = buf_to_message(input, strlen(input));
+    if (result == NULL) {
+        printf("Message string formatting error: %s\n", input);
+        exit(1);
+    }
+    return result;
+}
@@ -3,17 +3,36 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <assert.h>
+#include <stddef.h>
+
+#include "compress.h"
 
 // These all include the null-terminator, so the actual size
 // is one-less
 #define MAX_NAME 20
 #define MAX_PASSWD 20
+// MAX_DATA is the default payload limit, max_data is the one in force (see below)
 #define MAX_DATA 1000
 #define MAX_STR_LEN MAX_NAME+MAX_PASSWD+MAX_DATA
+// How high max_data can be set
+#define MAX_DATA_LIMIT 32768
+// Payloads up to this size (with the \0) are kept inside the struct message
+#define MESSAGE_INLINE_DATA 44
 #define MAX_SESSION_ID 20
 #define SESSION_CAP 20
+// How many sessions one login can be in at the same time
+#define MAX_JOINED_SESSIONS 8
+// Optional header fields, see message_to_str. Room for all of a MESSAGE's with latency stamps.
+#define MAX_OPTIONS_LEN 256
+#define RESUME_TOKEN_LEN 17
+// Payloads this big or bigger are worth compressing, if the other side can decompress them
+#define COMPRESS_THRESHOLD 256
+// BLOB_CHUNK frames are the one exception to max_data, their payload is raw file data
+#define BLOB_CHUNK_MAX 65536
+#define MAX_BLOB_NAME 64
 
 
 enum MSG_TYPE {
@@ -41,66 +60,174 @@ enum MSG_TYPE {
     // user registration 
     REGISTER,
     REG_ACK,
-    REG_NAK
+    REG_NAK,
+
+    // keep-alive probing of idle connections, either side may answer a PING
+    PING,
+    PONG,
+
+    // reattach to the previous login (and session) after the connection dropped,
+    // data is the token from LO_ACK
+    RESUME,
+    RS_ACK,
+    RS_NAK,
+
+    // server status, e.g. memory use. It can take several ST_ACKs, each with "s" set to how many
+    // more are coming.
+    STATS,
+    ST_ACK,
+
+    // File transfer. The sender offers a blob ("dm <user> <size> <name>", or
+    // "sess <session> <size> <name>") under an id of its choosing, and once it gets BL_ACK
+    // streams it as BLOB_CHUNKs followed by a BLOB_END. Recipients get the same three
+    // kinds of frames, with the sender as source.
+    BLOB_OFFER,
+    BL_ACK,
+    BL_NAK,
+    BLOB_CHUNK,
+    BLOB_END,
+
+    // Switch a connection on the Unix-domain socket over to shared memory rings (see
+    // shm_ring.h). SHM_ACK carries the memfd, and everything after it goes through the rings.
+    SHM_REQ,
+    SHM_ACK,
+    SHM_NAK,
+
+    // Only between the servers of a cluster, which otherwise send each other the types
+    // above on a user's behalf (see server.h).
+    NODE_HELLO,    // first on a link, data is "<sender's node index> <cluster_key>", "s" a hash of the node list
+    NODE_MEMBERS,  // "sess" has data members on the sender, which has seen up to "s"
+    NODE_PRESENCE, // source is logged in on the sender if data is 1, or no longer if it's 0
+    NODE_SYNCED,   // the sender has announced all its members and logins
+
+    // Only from a primary to its hot standby, which otherwise gets the types above as records
+    // of what changed (see server.h), and back
+    REPL_SNAPSHOT, // data is the length of the snapshot, whose bytes follow the frame
+    REPL_SEQ,      // "sess" got message "s", whose text isn't replicated
+    REPL_MAILBOX_TAKEN, // source's mailbox was delivered
+    REPL_HEARTBEAT, // "s" records were sent before this one, data is when it was sent
+    REPL_ACK,      // the standby applied "s" records, data is the heartbeat it answers
+
+    // A client's latency histograms since its last report (see latency.h)
+    LAT_REPORT,
+
+    // Full-text search of a session's history (see search.h). data is the words to look
+    // for, "sess" the session, "s" where the previous page left off (0 for the newest).
+    // SR_ACK has a line "<seq> <source>: <text>" per match, newest first, and "s" set to
+    // ask for the next page with, or unset if there are no more.
+    SEARCH,
+    SR_ACK,
+    SR_NAK,
+
+    // From a standby, first on its link to the primary: data is the replica_key
+    REPL_HELLO,
+
+    // Between nodes: a user is logging in at the sender, which isn't their home. The home
+    // answers with a NODE_CLAIM "to" them, the same "s", and data 1 if they may, or 0.
+    NODE_CLAIM
 };
 
+// The largest payload (with the \0) that is sent or accepted, at most MAX_DATA_LIMIT.
+// The server reads it from its config and announces it when a client logs in. The client
+// accepts anything up to the limit, but only sends what the server said it takes.
+extern int max_data;
+
+/*
+ * Only as big as its payload needs: data points at inline_data for short ones, or at
+ * memory of its own for longer ones. Messages on the stack are set up with message_init
+ * and filled with message_printf, and need message_release if the payload could have
+ * outgrown inline_data. The ones buf_to_message returns are a single allocation, free()
+ * is enough.
+ */
 struct message {
     unsigned int type;
     unsigned int size; // includes the \0
+    unsigned int capacity; // how much data can hold
     char source[MAX_NAME];
-    char data[MAX_DATA];
+    char* data;
+
+    // Optional header fields, 0 / empty when not present
+    unsigned long long seq; // "s": position in the session's message stream
+    char session_id[MAX_SESSION_ID]; // "sess": which session a MESSAGE belongs to
+    unsigned char compression; // "z": on LOGIN / RESUME and their ACKs, 1 if LZ payloads are understood
+    unsigned char data_owned; // data was allocated by message_reserve
+    unsigned short retry_after; // "retry": on LO_NAK, seconds to wait before trying again
+    unsigned int max_data; // "max": on LO_ACK / RS_ACK, the largest payload the server accepts
+    unsigned int blob_id; // "blob": which transfer a BLOB_* frame belongs to
+    char to[MAX_NAME]; // "to": who a DM_REQ / DM_MSG is for, or a reply between servers
+    unsigned long long trace; // "t": follows a message through the server, see probes.h
+    // "ts", "tr", "tx": when a MESSAGE or DM was sent, reached the server and left it (see latency.h)
+    unsigned long long sent_us;
+    unsigned long long received_us;
+    unsigned long long forwarded_us;
+
+    char inline_data[MESSAGE_INLINE_DATA];
 };
 
+// Every reply on the stack and every parsed frame pays for the header fields, 184 bytes of
+// them on x86-64. A new field has to fit in what's left, or the budget has to be raised on purpose.
+#define MESSAGE_SIZE_BUDGET 192
+_Static_assert(sizeof(struct message) <= MESSAGE_SIZE_BUDGET, "struct message outgrew MESSAGE_SIZE_BUDGET");
+
+// An empty message of the given type
+void message_init (struct message* msg, unsigned int type);
+
+// Makes room for a payload of capacity bytes (with the \0), keeping what's there
+char* message_reserve (struct message* msg, unsigned int capacity);
+
+void message_release (struct message* msg);
+
+// Appends formatted text to the payload, cut off at max_data
+void message_vappendf (struct message* msg, const char* format, va_list args);
+
+void message_appendf (struct message* msg, const char* format, ...);
+
+// Sets the payload to formatted text, cut off at max_data
+void message_printf (struct message* msg, const char* format, ...);
+
 /*
  * When storing a message in string format, use " " as separator. When the user enters
- * an ID, have to make sure it doesn't contain the " " character
+ * an ID, have to make sure it doesn't contain the " " character.
+ * Optional header fields are appended to the type as ",key=value", e.g. "11,s=42 6 alice hello".
+ *
+ * Payloads of at least compress_threshold bytes are LZ compressed if that makes them smaller
+ * (-1 never compresses). The frame then has a ",c=<uncompressed size>" field, and its size
+ * and data are those of the compressed bytes. The result is \0 terminated, but compressed
+ * data can contain \0 too, so *len is the length to send.
  */
-const char* message_to_str (struct message* msg) {
-    char* buffer = malloc(msg->size + 100);
-    // a '\0' will be added to the very end of buffer
-    sprintf(buffer, "%d %d %s %s", msg->type, msg->size, msg->source, msg->data);
-    return buffer;
-}
-
-struct message* str_to_message (const char* input) {
-    struct message* result = malloc(sizeof(struct message));
-
-    char* delim = strtok(input, " ");
-    if (delim == NULL) {
-        printf("Message string formatting error1: %s\n", input);
-        exit(1);
-    }
-    result->type = atoi(delim);
-
-    delim = strtok(NULL, " ");
-    if (delim == NULL) {
-        printf("Message string formatting error2: %s\n", input);
-        exit(1);
-    }
-    result->size = atoi(delim);
-
-    delim = strtok(NULL, " ");
-    if (delim == NULL) {
-        printf("Message string formatting error3: %s\n", input);
-        exit(1);
-    }
-    strcpy(result->source, delim);
-
-    if (result->size == 1) {
-        strcpy(result->data, "");
-    } else {
-        delim = strtok(NULL, "\0");
-        if (delim == NULL) {
-            printf("Message string formatting error\n");
-            exit(1);
-        }
-        strcpy(result->data, delim);
-    }
-
-    assert(result->data[result->size - 1] == '\0');
-    return result;
-}
+char* encode_message (struct message* msg, int compress_threshold, int* len);
 
+const char* message_to_str (struct message* msg);
+
+// Fills in the optional header fields from the ",key=value" list after the type.
+// Returns the uncompressed size from "c", or 0 if the payload isn't compressed.
+int parse_message_options (struct message* msg, char* options);
+
+/*
+ * Messages aren't delimited on the wire, and TCP is free to merge or split them. But the
+ * data part is always exactly size-1 bytes (the \0 isn't sent), so the header tells us
+ * where a message ends. Parses the header at the start of buf: returns its length (up to
+ * and including the space before the data) and sets *type and *size, or returns 0 if more
+ * bytes are needed, or -1 if buf doesn't start with a well-formed message.
+ */
+int frame_header (const char* buf, int len, unsigned int* type, int* size);
+
+// Returns the length of the first complete message in buf, 0 if more bytes are needed,
+// or -1 if buf doesn't start with a well-formed message
+int frame_length (const char* buf, int len);
+
+// Writes the header of a BLOB_CHUNK with payload_len bytes of data, returns its length
+int blob_chunk_header (char* out, unsigned int blob_id, const char* source, int payload_len);
+
+// Gets the blob id out of a frame header (which frame_header already checked)
+unsigned int frame_blob_id (const char* buf, int header_len);
+
+/*
+ * Parses the message at the start of buf (len bytes, which have to hold at least the whole
+ * message), decompressing the payload if needed. Returns NULL if it isn't a valid message.
+ */
+struct message* buf_to_message (const char* buf, int len);
 
+struct message* str_to_message (const char* input);
 
 #endif //ECE361_TEXTCONFERENCING_PACKET_H
@@ -0,0 +1,45 @@
+#ifndef ECE361_TEXTCONFERENCING_PROBES_H
+#define ECE361_TEXTCONFERENCING_PROBES_H
+
+/*
+ * USDT probes (provider "chat"), for bpftrace, perf and systemtap. With <sys/sdt.h> from
+ * systemtap-sdt-dev each one is a single nop plus a note in the binary, which a tracer turns
+ * into a breakpoint while it's attached. Without the header they compile to nothing.
+ *
+ * Every message gets a trace ID when its frame is read ("t" on the wire if the sender set one,
+ * otherwise the next one here). It goes out with what the message turns into (a session MESSAGE,
+ * a DM_MSG, frames to other nodes), and the replies to it are queued under it, so one ID
+ * follows a message from the socket it came in on to every socket it's written to. It comes
+ * first in the probes that have one:
+ *
+ *   frame_received(trace, fd, type, size)   a complete frame was taken from fd's input
+ *   handler_start(trace, fd, type)          its handler is called
+ *   handler_end(trace, fd, type)            and returned
+ *   enqueue(trace, fd, lane, len)           a frame was queued for fd
+ *   delivered(trace, fd)                    a frame was written to fd completely
+ *   flush(fd, written, left)                one writev to fd, bytes written and still queued
+ *   disconnect(fd, user)                    fd is being closed, user is "" if not logged in
+ *
+ * e.g. the path of message 42:
+ *   bpftrace -e 'usdt:./server:chat:frame_received,usdt:./server:chat:handler_*,
+ *                usdt:./server:chat:enqueue,usdt:./server:chat:delivered
+ *                /arg0 == 42/ { printf("%lld %s fd %d\n", nsecs, probe, arg1); }'
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>) && !defined(NO_PROBES)
+#include <sys/sdt.h>
+#define HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define PROBE2(name, a, b) DTRACE_PROBE2(chat, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(chat, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(chat, name, a, b, c, d)
+#else
+#define PROBE2(name, a, b) do { (void) (a); (void) (b); } while (0)
+#define PROBE3(name, a, b, c) do { (void) (a); (void) (b); (void) (c); } while (0)
+#define PROBE4(name, a, b, c, d) do { (void) (a); (void) (b); (void) (c); (void) (d); } while (0)
+#endif
+
+#endif //ECE361_TEXTCONFERENCING_PROBES_H
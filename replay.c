@@ -0,0 +1,540 @@
+// Feeds a capture (see capture.h) back into a server, one connection per captured client,
+// for comparing builds under the load that was recorded.
+// Usage: replay dump <capture>
+//            what's in it: how many clients, how long, and the frames by type
+//        replay run <capture> <port> [speed]
+//            sends every frame as it was captured, speed times as fast (1 by default, 0
+//            as fast as the server takes them). Reports throughput, how long session
+//            messages and DMs took to reach their recipients (each is stamped as it's
+//            sent, see latency.h), and a digest of what every connection was sent.
+//        replay compare <capture> <port A> <port B> [speed]
+//            runs it against one server, then the other, and compares the two runs.
+//            Both should be started fresh with the same login.txt and options.
+// The digest leaves out what differs from one run to the next anyway: trace IDs, stamps,
+// sequence numbers, login tokens, STATS and PINGs. It doesn't depend on the order frames
+// arrived in, since messages from different senders can interleave differently.
+// A request another client's frames may depend on (logging in, joining or creating a session,
+// registering, QUERY) is answered before the replay goes on, at any speed, so a faster run
+// doesn't have someone joining a session before it exists. Likewise a client only disconnects
+// once the server has had SETTLE_MS to deliver what the others sent before, so it doesn't
+// miss messages it got in the capture.
+// Captured PONGs aren't sent, PINGs are answered as they come instead. Nor is what can't
+// be repeated over TCP without the rest of it: SHM_REQ, and file offers, whose data isn't
+// captured. A captured RESUME fails, since the new server's tokens are different.
+// The server's rate limits apply as usual, so replaying faster than 1x needs them raised
+// (or 0, unlimited) on both servers for the runs to be comparable.
+#include "packet.h"
+#include "capture.h"
+#include "latency.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+// A run ends once every frame is sent and the server has been quiet this long
+#define QUIET_MS 1000
+
+// Most the replay waits for the answer to a request before going on without it
+#define ANSWER_WAIT_MS 1000
+
+// How long the server has to be quiet before a client disconnects
+#define SETTLE_MS 20
+
+// Room for two of the largest frames a server can send
+#define REPLAY_IN_BUF (2 * (MAX_DATA_LIMIT + MAX_NAME + MAX_OPTIONS_LEN + 24))
+
+struct REPLAY_CONN {
+    int sockfd;                      // -1 before it's opened and after it's closed
+    char* out;                       // frames the socket hasn't taken yet
+    size_t out_len;
+    size_t out_size;
+    int closing;                     // the capture says it closed, once out is written
+    int waiting;                     // for the answer to a request
+    char* in;
+    int in_len;
+    unsigned long long frames;       // received
+    unsigned long long digest;       // of the frames received, see frame_digest
+};
+
+struct REPLAY_RESULT {
+    double seconds;
+    unsigned long long clients;
+    unsigned long long frames_sent;
+    unsigned long long frames_skipped;
+    unsigned long long frames_received;
+    unsigned long long failed;       // connections refused or reset
+    unsigned long long unanswered;   // requests the replay stopped waiting for
+    int waiting;                     // connections waiting for an answer
+    double last_received;
+    struct LAT_HISTOGRAM legs[NUM_LAT_LEGS];
+    struct LAT_HISTOGRAM delivery;   // from being sent to being received, all legs together
+    struct REPLAY_CONN* conns;       // by capture number
+    unsigned int num_conns;
+};
+
+static int epoll_fd;
+
+static const char* type_names[] = {
+    "LOGIN", "LO_ACK", "LO_NAK", "EXIT", "JOIN", "JN_ACK", "JN_NAK", "LEAVE_SESS", "NEW_SESS",
+    "NS_ACK", "NS_NAK", "MESSAGE", "QUERY", "QU_ACK", "DM_REQ", "DM_MSG", "DM_NAK", "REGISTER",
+    "REG_ACK", "REG_NAK", "PING", "PONG", "RESUME", "RS_ACK", "RS_NAK", "STATS", "ST_ACK",
+    "BLOB_OFFER", "BL_ACK", "BL_NAK", "BLOB_CHUNK", "BLOB_END", "SHM_REQ", "SHM_ACK", "SHM_NAK",
+    "NODE_HELLO", "NODE_MEMBERS", "NODE_PRESENCE", "NODE_SYNCED", "REPL_SNAPSHOT", "REPL_SEQ",
+    "REPL_MAILBOX_TAKEN", "REPL_HEARTBEAT", "REPL_ACK", "LAT_REPORT", "SEARCH", "SR_ACK", "SR_NAK"
+};
+
+static const char* type_name(unsigned int type) {
+    return type < sizeof(type_names) / sizeof(type_names[0]) ? type_names[type] : "?";
+}
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long fnv1a(unsigned long long hash, const void* data, size_t len) {
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// What a frame from the server comes down to, without what changes from run to run.
+// 0 for frames that aren't compared at all.
+static unsigned long long frame_digest(const struct message* msg) {
+    if (msg->type == PING || msg->type == ST_ACK) {
+        return 0;
+    }
+    unsigned long long hash = fnv1a(0xcbf29ce484222325ULL, &msg->type, sizeof(msg->type));
+    hash = fnv1a(hash, msg->source, strlen(msg->source) + 1);
+    hash = fnv1a(hash, msg->session_id, strlen(msg->session_id) + 1);
+    hash = fnv1a(hash, msg->to, strlen(msg->to) + 1);
+    if (msg->type != LO_ACK && msg->type != RS_ACK) {
+        hash = fnv1a(hash, msg->data, msg->size);
+    }
+    return hash;
+}
+
+static int request_type(unsigned int type) {
+    return type == LOGIN || type == JOIN || type == NEW_SESS || type == REGISTER || type == QUERY;
+}
+
+static int answer_type(unsigned int type) {
+    return type == LO_ACK || type == LO_NAK || type == JN_ACK || type == JN_NAK || type == NS_ACK
+           || type == NS_NAK || type == REG_ACK || type == REG_NAK || type == QU_ACK;
+}
+
+static int skipped_type(unsigned int type) {
+    return type == PONG || type == SHM_REQ || type == BLOB_OFFER || type == BLOB_END;
+}
+
+static void queue_output(struct REPLAY_CONN* conn, const char* frame, size_t len) {
+    if (conn->out_len + len > conn->out_size) {
+        conn->out_size = (conn->out_len + len) * 2;
+        conn->out = realloc(conn->out, conn->out_size);
+    }
+    memcpy(conn->out + conn->out_len, frame, len);
+    conn->out_len += len;
+}
+
+static void stop_waiting(struct REPLAY_CONN* conn, struct REPLAY_RESULT* result) {
+    if (conn->waiting) {
+        conn->waiting = 0;
+        result->waiting--;
+    }
+}
+
+static void close_conn(struct REPLAY_CONN* conn, struct REPLAY_RESULT* result) {
+    stop_waiting(conn, result);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+    close(conn->sockfd);
+    conn->sockfd = -1;
+    conn->out_len = 0;
+    conn->in_len = 0;
+}
+
+// Writes what the socket takes, and half-closes it once a closed client's frames are all out
+static void flush_conn(struct REPLAY_CONN* conn, struct REPLAY_RESULT* result) {
+    if (conn->sockfd == -1) {
+        return;
+    }
+    size_t written = 0;
+    while (written < conn->out_len) {
+        ssize_t n = send(conn->sockfd, conn->out + written, conn->out_len - written, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            result->failed++;
+            close_conn(conn, result);
+            return;
+        }
+        written += n;
+    }
+    memmove(conn->out, conn->out + written, conn->out_len - written);
+    conn->out_len -= written;
+
+    struct epoll_event event = {.events = EPOLLIN | (conn->out_len > 0 ? EPOLLOUT : 0), .data.ptr = conn};
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->sockfd, &event);
+    if (conn->out_len == 0 && conn->closing == 1) {
+        // the rest of what the server sends is still read, until it closes too
+        shutdown(conn->sockfd, SHUT_WR);
+        conn->closing = 2;
+    }
+}
+
+static void open_conn(struct REPLAY_CONN* conn, int port, struct REPLAY_RESULT* result) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sockfd == -1 || connect(sockfd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        printf("Error connecting: %s\n", strerror(errno));
+        if (sockfd != -1) {
+            close(sockfd);
+        }
+        result->failed++;
+        return;
+    }
+    int yes = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    conn->sockfd = sockfd;
+    conn->closing = 0;
+    if (conn->in == NULL) {
+        conn->in = malloc(REPLAY_IN_BUF);
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &event);
+    result->clients++;
+}
+
+static void receive(struct REPLAY_CONN* conn, struct REPLAY_RESULT* result) {
+    int n = recv(conn->sockfd, conn->in + conn->in_len, REPLAY_IN_BUF - conn->in_len, 0);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (n <= 0) {
+        if (n == -1) {
+            result->failed++;
+        }
+        close_conn(conn, result);
+        return;
+    }
+    conn->in_len += n;
+
+    int offset = 0;
+    int len;
+    while ((len = frame_length(conn->in + offset, conn->in_len - offset)) > 0) {
+        struct message* msg = buf_to_message(conn->in + offset, len);
+        offset += len;
+        if (msg == NULL) {
+            continue;
+        }
+        conn->frames++;
+        result->frames_received++;
+        result->last_received = now_seconds();
+        if (answer_type(msg->type)) {
+            stop_waiting(conn, result);
+        }
+        conn->digest += frame_digest(msg);
+        if (msg->type == PING) {
+            struct message pong;
+            message_init(&pong, PONG);
+            strcpy(pong.source, "SERVER");
+            int pong_len;
+            char* frame = encode_message(&pong, -1, &pong_len);
+            queue_output(conn, frame, pong_len);
+            free(frame);
+            flush_conn(conn, result);
+        }
+        if ((msg->type == MESSAGE || msg->type == DM_MSG) && msg->sent_us != 0 && msg->forwarded_us != 0) {
+            unsigned long long now = lat_now_us();
+            lat_record(&result->legs[LAT_UP], (long long) (msg->received_us - msg->sent_us));
+            lat_record(&result->legs[LAT_DWELL], (long long) (msg->forwarded_us - msg->received_us));
+            lat_record(&result->legs[LAT_DOWN], (long long) (now - msg->forwarded_us));
+            lat_record(&result->delivery, (long long) (now - msg->sent_us));
+        }
+        free(msg);
+        if (conn->sockfd == -1) {
+            break;
+        }
+    }
+    if (len == -1) {
+        printf("Error: the server sent a malformed frame\n");
+        result->failed++;
+        close_conn(conn, result);
+        return;
+    }
+    memmove(conn->in, conn->in + offset, conn->in_len - offset);
+    conn->in_len -= offset;
+}
+
+// Waits up to timeout_ms for the connections, handling whatever they have
+static void poll_conns(int timeout_ms, struct REPLAY_RESULT* result) {
+    struct epoll_event events[256];
+    int n = epoll_wait(epoll_fd, events, 256, timeout_ms);
+    for (int e = 0; e < n; e++) {
+        struct REPLAY_CONN* conn = events[e].data.ptr;
+        if (conn->sockfd != -1 && (events[e].events & EPOLLOUT)) {
+            flush_conn(conn, result);
+        }
+        if (conn->sockfd != -1 && (events[e].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+            receive(conn, result);
+        }
+    }
+}
+
+// Session messages and DMs carry when they were sent, and the rest goes out as captured
+static void send_frame(struct REPLAY_CONN* conn, const struct CAPTURE_RECORD* record, const char* frame,
+                       struct REPLAY_RESULT* result) {
+    if (record->type == MESSAGE || record->type == DM_REQ) {
+        struct message* msg = buf_to_message(frame, record->len);
+        if (msg != NULL) {
+            msg->sent_us = lat_now_us();
+            msg->received_us = 0;
+            msg->forwarded_us = 0;
+            int len;
+            char* stamped = encode_message(msg, -1, &len);
+            queue_output(conn, stamped, len);
+            free(stamped);
+            free(msg);
+            result->frames_sent++;
+            return;
+        }
+    }
+    queue_output(conn, frame, record->len);
+    result->frames_sent++;
+    if (request_type(record->type) && !conn->waiting) {
+        conn->waiting = 1;
+        result->waiting++;
+    }
+}
+
+static void run(struct CAPTURE_READER* reader, int port, double speed, struct REPLAY_RESULT* result) {
+    memset(result, 0, sizeof(*result));
+    struct CAPTURE_RECORD record;
+    const char* frame;
+    capture_rewind(reader);
+    while (capture_next(reader, &record, &frame)) {
+        if (record.conn > result->num_conns) {
+            result->num_conns = record.conn;
+        }
+    }
+    result->conns = calloc(result->num_conns + 1, sizeof(struct REPLAY_CONN));
+    for (unsigned int i = 0; i <= result->num_conns; i++) {
+        result->conns[i].sockfd = -1;
+    }
+
+    double start = now_seconds();
+    capture_rewind(reader);
+    while (capture_next(reader, &record, &frame)) {
+        // the answers to requests first, then wait until it's due, handling the connections meanwhile
+        double now;
+        double answer_deadline = now_seconds() + ANSWER_WAIT_MS / 1000.0;
+        while (result->waiting > 0 && (now = now_seconds()) < answer_deadline) {
+            poll_conns((int) ((answer_deadline - now) * 1000) + 1, result);
+        }
+        if (result->waiting > 0) {
+            result->unanswered += result->waiting;
+            for (unsigned int i = 0; i <= result->num_conns; i++) {
+                stop_waiting(&result->conns[i], result);
+            }
+        }
+        double due = start + (speed > 0 ? reader->at_us / 1e6 / speed : 0);
+        while ((now = now_seconds()) < due) {
+            poll_conns((int) ((due - now) * 1000) + 1, result);
+        }
+
+        struct REPLAY_CONN* conn = &result->conns[record.conn];
+        if (record.kind == CAPTURE_OPEN) {
+            open_conn(conn, port, result);
+            continue;
+        }
+        if (conn->sockfd == -1) {
+            // it never connected, or the server closed it
+            continue;
+        }
+        if (record.kind == CAPTURE_CLOSE) {
+            double settled;
+            while ((settled = now_seconds() - result->last_received) < SETTLE_MS / 1000.0) {
+                poll_conns((int) ((SETTLE_MS / 1000.0 - settled) * 1000) + 1, result);
+            }
+            conn->closing = 1;
+        } else if (skipped_type(record.type)) {
+            result->frames_skipped++;
+            continue;
+        } else {
+            send_frame(conn, &record, frame, result);
+        }
+        flush_conn(conn, result);
+        if (speed == 0) {
+            // don't let the server fall too far behind, or everything is one big burst
+            poll_conns(0, result);
+        }
+    }
+
+    // the server's answers to the last of it. The run took until the last frame arrived.
+    double sent = now_seconds();
+    while (now_seconds() - (result->last_received > sent ? result->last_received : sent) < QUIET_MS / 1000.0) {
+        poll_conns(100, result);
+    }
+    result->seconds = (result->last_received > sent ? result->last_received : sent) - start;
+
+    for (unsigned int i = 0; i <= result->num_conns; i++) {
+        if (result->conns[i].sockfd != -1) {
+            close_conn(&result->conns[i], result);
+        }
+        free(result->conns[i].out);
+        free(result->conns[i].in);
+    }
+}
+
+static void print_result(const char* label, const struct REPLAY_RESULT* result) {
+    printf("%s: %llu clients, %.2f s, %llu frames sent (%.0f/s), %llu received (%.0f/s), "
+           "%llu skipped, %llu connections failed, %llu requests unanswered\n", label, result->clients,
+           result->seconds, result->frames_sent, result->frames_sent / result->seconds, result->frames_received,
+           result->frames_received / result->seconds, result->frames_skipped, result->failed, result->unanswered);
+    const struct LAT_HISTOGRAM* delivery = &result->delivery;
+    if (delivery->total == 0) {
+        printf("  no messages were delivered\n");
+        return;
+    }
+    printf("  delivery, us: %llu messages, p50 %llu p99 %llu p99.9 %llu max %llu\n", delivery->total,
+           lat_percentile(delivery, 50), lat_percentile(delivery, 99), lat_percentile(delivery, 99.9),
+           delivery->max_us);
+    for (int leg = 0; leg < NUM_LAT_LEGS; leg++) {
+        printf("  %-8s p50 %llu p99 %llu max %llu\n", lat_leg_name(leg), lat_percentile(&result->legs[leg], 50),
+               lat_percentile(&result->legs[leg], 99), result->legs[leg].max_us);
+    }
+}
+
+static int open_capture(struct CAPTURE_READER* reader, const char* path) {
+    if (capture_read_open(reader, path) == -1) {
+        printf("Error: can't read a capture from %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int dump(const char* path) {
+    struct CAPTURE_READER reader;
+    if (open_capture(&reader, path) == -1) {
+        return 1;
+    }
+    unsigned long long by_type[256] = {0};
+    unsigned long long bytes_by_type[256] = {0};
+    unsigned long long clients = 0;
+    unsigned long long frames = 0;
+    struct CAPTURE_RECORD record;
+    const char* frame;
+    while (capture_next(&reader, &record, &frame)) {
+        if (record.kind == CAPTURE_OPEN) {
+            clients++;
+        } else if (record.kind == CAPTURE_FRAME) {
+            frames++;
+            by_type[record.type]++;
+            bytes_by_type[record.type] += record.len;
+        }
+    }
+    time_t started = reader.header.start_us / 1000000;
+    printf("%s: started %s", path, ctime(&started));
+    printf("%llu clients, %llu frames over %.3f s\n", clients, frames, reader.at_us / 1e6);
+    for (int type = 0; type < 256; type++) {
+        if (by_type[type] > 0) {
+            printf("  %-12s %10llu frames %12llu bytes\n", type_name(type), by_type[type], bytes_by_type[type]);
+        }
+    }
+    capture_read_close(&reader);
+    return 0;
+}
+
+int main(int argc, const char** argv) {
+    if (argc == 3 && strcmp(argv[1], "dump") == 0) {
+        return dump(argv[2]);
+    }
+    int compare = (argc == 5 || argc == 6) && strcmp(argv[1], "compare") == 0;
+    if (!compare && !((argc == 4 || argc == 5) && strcmp(argv[1], "run") == 0)) {
+        printf("Usage: replay dump <capture>\n"
+               "       replay run <capture> <port> [speed]\n"
+               "       replay compare <capture> <port A> <port B> [speed]\n");
+        return 1;
+    }
+    double speed = 1;
+    if (argc == (compare ? 6 : 5)) {
+        speed = atof(argv[argc - 1]);
+    }
+
+    struct CAPTURE_READER reader;
+    if (open_capture(&reader, argv[2]) == -1) {
+        return 1;
+    }
+    // whatever the servers allow, they might send
+    max_data = MAX_DATA_LIMIT;
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    epoll_fd = epoll_create1(0);
+
+    struct REPLAY_RESULT results[2];
+    int num_runs = compare ? 2 : 1;
+    for (int r = 0; r < num_runs; r++) {
+        run(&reader, atoi(argv[3 + r]), speed, &results[r]);
+        char label[64];
+        snprintf(label, sizeof(label), "port %s", argv[3 + r]);
+        print_result(label, &results[r]);
+    }
+
+    int differences = 0;
+    if (!compare) {
+        for (unsigned int i = 1; i <= results[0].num_conns; i++) {
+            printf("  client %u: %llu frames, digest %016llx\n", i, results[0].conns[i].frames,
+                   results[0].conns[i].digest);
+        }
+    } else {
+        for (unsigned int i = 1; i <= results[0].num_conns; i++) {
+            const struct REPLAY_CONN* a = &results[0].conns[i];
+            const struct REPLAY_CONN* b = &results[1].conns[i];
+            if (a->digest != b->digest) {
+                if (differences++ < 20) {
+                    printf("  client %u was sent something else: %llu frames vs %llu\n", i, a->frames, b->frames);
+                }
+            }
+        }
+        if (differences == 0) {
+            printf("Same output: every one of the %u clients was sent the same thing by both\n", results[0].num_conns);
+        } else {
+            printf("Different output for %d of %u clients\n", differences, results[0].num_conns);
+        }
+        if (results[0].seconds > 0 && results[1].seconds > 0 && results[0].delivery.total > 0
+            && results[1].delivery.total > 0) {
+            printf("B vs A: %+.1f%% throughput, p50 delivery %llu vs %llu us, p99 %llu vs %llu us\n",
+                   100.0 * (results[1].frames_received / results[1].seconds)
+                   / (results[0].frames_received / results[0].seconds) - 100.0,
+                   lat_percentile(&results[1].delivery, 50), lat_percentile(&results[0].delivery, 50),
+                   lat_percentile(&results[1].delivery, 99), lat_percentile(&results[0].delivery, 99));
+        }
+    }
+    for (int r = 0; r < num_runs; r++) {
+        free(results[r].conns);
+    }
+    capture_read_close(&reader);
+    return differences > 0;
+}
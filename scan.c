@@ -0,0 +1,279 @@
+#include "scan.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+// What can be wrong with a byte given the one before it (see the paper for how they combine)
+#define TOO_SHORT      (1 << 0) // a lead byte with too few continuation bytes after it
+#define TOO_LONG       (1 << 1) // a continuation byte after ASCII
+#define OVERLONG_3     (1 << 2)
+#define TOO_LARGE      (1 << 3)
+#define SURROGATE      (1 << 4)
+#define OVERLONG_2     (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4     (1 << 6)
+#define TWO_CONTS      (1 << 7) // a continuation byte after another, fine if it's a 3rd or 4th byte
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+// By the high nibble of the byte before, its low nibble, and the high nibble of the byte itself
+static const unsigned char byte_1_high[16] = {
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+};
+static const unsigned char byte_1_low[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000
+};
+static const unsigned char byte_2_high[16] = {
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+};
+
+// A block ending in a lead byte whose sequence doesn't fit in it is only fine if more follows.
+// Anything above these (at the end of a block) is such a byte.
+static const unsigned char incomplete_max[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1
+};
+
+static int text_valid_scalar(const char* buf, size_t len) {
+    const unsigned char* s = (const unsigned char*) buf;
+    size_t i = 0;
+    while (i < len) {
+        // ASCII without a \0, a word at a time
+        while (len - i >= 8) {
+            uint64_t word;
+            memcpy(&word, s + i, 8);
+            if ((word & 0x8080808080808080ULL) != 0
+                || ((word - 0x0101010101010101ULL) & ~word & 0x8080808080808080ULL) != 0) {
+                break;
+            }
+            i += 8;
+        }
+        if (i == len) {
+            break;
+        }
+
+        unsigned char c = s[i];
+        if (c < 0x80) {
+            if (c == 0) {
+                return 0;
+            }
+            i++;
+            continue;
+        }
+        int follow;
+        unsigned int code;
+        if (c >= 0xc2 && c <= 0xdf) {
+            follow = 1;
+            code = c & 0x1f;
+        } else if ((c & 0xf0) == 0xe0) {
+            follow = 2;
+            code = c & 0x0f;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            follow = 3;
+            code = c & 0x07;
+        } else {
+            return 0;
+        }
+        if (len - i <= (size_t) follow) {
+            return 0;
+        }
+        for (int k = 1; k <= follow; k++) {
+            if ((s[i + k] & 0xc0) != 0x80) {
+                return 0;
+            }
+            code = (code << 6) | (s[i + k] & 0x3f);
+        }
+        if ((follow == 2 && (code < 0x800 || (code >= 0xd800 && code <= 0xdfff)))
+            || (follow == 3 && (code < 0x10000 || code > 0x10ffff))) {
+            return 0;
+        }
+        i += follow + 1;
+    }
+    return 1;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("ssse3")))
+static int text_valid_ssse3(const char* buf, size_t len) {
+    const __m128i table_1_high = _mm_loadu_si128((const __m128i*) byte_1_high);
+    const __m128i table_1_low = _mm_loadu_si128((const __m128i*) byte_1_low);
+    const __m128i table_2_high = _mm_loadu_si128((const __m128i*) byte_2_high);
+    const __m128i max_value = _mm_loadu_si128((const __m128i*) (incomplete_max + 16));
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i error = zero;
+    __m128i nul = zero;
+    __m128i prev_input = zero;
+    __m128i prev_incomplete = zero;
+
+    for (size_t i = 0; i < len; i += 16) {
+        __m128i input;
+        if (len - i >= 16) {
+            input = _mm_loadu_si128((const __m128i*) (buf + i));
+        } else {
+            // padded with spaces, which are neither \0 nor part of a sequence
+            char tail[16];
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, buf + i, len - i);
+            input = _mm_loadu_si128((const __m128i*) tail);
+        }
+        nul = _mm_or_si128(nul, _mm_cmpeq_epi8(input, zero));
+
+        if (_mm_movemask_epi8(input) == 0) {
+            // all ASCII, only a sequence cut off by the block before can be wrong
+            error = _mm_or_si128(error, prev_incomplete);
+        } else {
+            __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+            __m128i special = _mm_and_si128(
+                _mm_and_si128(_mm_shuffle_epi8(table_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                              _mm_shuffle_epi8(table_1_low, _mm_and_si128(prev1, nibble))),
+                _mm_shuffle_epi8(table_2_high, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+            // a continuation byte that's the 3rd or 4th of its sequence has to be one
+            __m128i third = _mm_subs_epu8(_mm_alignr_epi8(input, prev_input, 14), _mm_set1_epi8(0xe0 - 0x80));
+            __m128i fourth = _mm_subs_epu8(_mm_alignr_epi8(input, prev_input, 13), _mm_set1_epi8(0xf0 - 0x80));
+            __m128i must_continue = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char) 0x80));
+            error = _mm_or_si128(error, _mm_xor_si128(must_continue, special));
+            prev_incomplete = _mm_subs_epu8(input, max_value);
+        }
+        prev_input = input;
+    }
+    error = _mm_or_si128(error, prev_incomplete);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, zero)) == 0xffff && _mm_movemask_epi8(nul) == 0;
+}
+
+__attribute__((target("avx2")))
+static int text_valid_avx2(const char* buf, size_t len) {
+    const __m256i table_1_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) byte_1_high));
+    const __m256i table_1_low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) byte_1_low));
+    const __m256i table_2_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) byte_2_high));
+    const __m256i max_value = _mm256_loadu_si256((const __m256i*) incomplete_max);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i error = zero;
+    __m256i nul = zero;
+    __m256i prev_input = zero;
+    __m256i prev_incomplete = zero;
+
+    for (size_t i = 0; i < len; i += 32) {
+        __m256i input;
+        if (len - i >= 32) {
+            input = _mm256_loadu_si256((const __m256i*) (buf + i));
+        } else {
+            char tail[32];
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, buf + i, len - i);
+            input = _mm256_loadu_si256((const __m256i*) tail);
+        }
+        nul = _mm256_or_si256(nul, _mm256_cmpeq_epi8(input, zero));
+
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = _mm256_or_si256(error, prev_incomplete);
+        } else {
+            // alignr works within each 128-bit half, so the bytes before the upper half are
+            // brought next to it first
+            __m256i before = _mm256_permute2x128_si256(prev_input, input, 0x21);
+            __m256i prev1 = _mm256_alignr_epi8(input, before, 15);
+            __m256i special = _mm256_and_si256(
+                _mm256_and_si256(
+                    _mm256_shuffle_epi8(table_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                    _mm256_shuffle_epi8(table_1_low, _mm256_and_si256(prev1, nibble))),
+                _mm256_shuffle_epi8(table_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+            __m256i third = _mm256_subs_epu8(_mm256_alignr_epi8(input, before, 14), _mm256_set1_epi8(0xe0 - 0x80));
+            __m256i fourth = _mm256_subs_epu8(_mm256_alignr_epi8(input, before, 13), _mm256_set1_epi8(0xf0 - 0x80));
+            __m256i must_continue = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char) 0x80));
+            error = _mm256_or_si256(error, _mm256_xor_si256(must_continue, special));
+            prev_incomplete = _mm256_subs_epu8(input, max_value);
+        }
+        prev_input = input;
+    }
+    error = _mm256_or_si256(error, prev_incomplete);
+    return _mm256_testz_si256(error, error) && _mm256_movemask_epi8(nul) == 0;
+}
+#endif
+
+static int text_valid_detect(const char* buf, size_t len);
+
+static int (*const kernels[NUM_SCAN_ISAS])(const char*, size_t) = {
+    [SCAN_SCALAR] = text_valid_scalar,
+#ifdef SCAN_X86
+    [SCAN_SSSE3] = text_valid_ssse3,
+    [SCAN_AVX2] = text_valid_avx2,
+#endif
+};
+
+static int (*text_valid_kernel)(const char*, size_t) = text_valid_detect;
+static enum SCAN_ISA active_isa = SCAN_SCALAR;
+
+static int text_valid_detect(const char* buf, size_t len) {
+    scan_select(scan_best_isa());
+    return text_valid_kernel(buf, len);
+}
+
+int text_valid(const char* buf, size_t len) {
+    return text_valid_kernel(buf, len);
+}
+
+enum SCAN_ISA scan_best_isa(void) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return SCAN_AVX2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return SCAN_SSSE3;
+    }
+#endif
+    return SCAN_SCALAR;
+}
+
+enum SCAN_ISA scan_active_isa(void) {
+    if (text_valid_kernel == text_valid_detect) {
+        scan_select(scan_best_isa());
+    }
+    return active_isa;
+}
+
+int scan_select(enum SCAN_ISA isa) {
+    if (isa < 0 || isa >= NUM_SCAN_ISAS || isa > scan_best_isa() || kernels[isa] == NULL) {
+        return -1;
+    }
+    active_isa = isa;
+    text_valid_kernel = kernels[isa];
+    return 0;
+}
+
+const char* scan_isa_name(enum SCAN_ISA isa) {
+    static const char* names[] = {"scalar", "ssse3", "avx2"};
+    return isa >= 0 && isa < NUM_SCAN_ISAS ? names[isa] : "?";
+}
@@ -0,0 +1,39 @@
+#ifndef ECE361_TEXTCONFERENCING_SCAN_H
+#define ECE361_TEXTCONFERENCING_SCAN_H
+
+#include <stddef.h>
+
+/*
+ * Checking chat text before it's passed on: it has to be well-formed UTF-8 (no overlong forms,
+ * surrogates or code points past U+10FFFF, nothing cut off at the end) without any \0, since
+ * everything downstream treats payloads as C strings.
+ *
+ * The vector kernels take 16 or 32 bytes at a time and classify every byte together with the
+ * three before it, with a few table lookups on their high and low nibbles (the scheme of Keiser
+ * and Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte"), so multibyte text is
+ * as cheap as ASCII. The scalar one skips ASCII a word at a time and decodes the rest.
+ * Which one runs is decided the first time, by what the CPU has.
+ */
+
+enum SCAN_ISA {
+    SCAN_SCALAR,
+    SCAN_SSSE3,
+    SCAN_AVX2,
+    NUM_SCAN_ISAS
+};
+
+// Returns 1 if the len bytes are valid UTF-8 without a \0, 0 if not
+int text_valid(const char* buf, size_t len);
+
+// The best kernel this CPU can run
+enum SCAN_ISA scan_best_isa(void);
+
+// The kernel text_valid uses
+enum SCAN_ISA scan_active_isa(void);
+
+// Makes text_valid use the given kernel, returns -1 if the CPU can't run it
+int scan_select(enum SCAN_ISA isa);
+
+const char* scan_isa_name(enum SCAN_ISA isa);
+
+#endif //ECE361_TEXTCONFERENCING_SCAN_H
@@ -0,0 +1,349 @@
+#include "search.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// A segment of a list is what's decoded from one skip entry (or the head) to the next
+#define SEGMENT_MAX (SEARCH_SKIP_BYTES + 16)
+
+void search_index_init(struct SEARCH_INDEX* index) {
+    memset(index, 0, sizeof(struct SEARCH_INDEX));
+}
+
+static void free_list(struct SEARCH_INDEX* index, struct POSTING_LIST* list) {
+    index->bytes -= sizeof(struct POSTING_LIST) + list->capacity + list->skip_capacity * sizeof(struct POSTING_SKIP);
+    index->num_lists--;
+    free(list->gaps);
+    free(list->skips);
+    free(list);
+}
+
+void search_index_free(struct SEARCH_INDEX* index) {
+    for (unsigned int b = 0; b < index->num_buckets; b++) {
+        struct POSTING_LIST* list = index->buckets[b];
+        while (list != NULL) {
+            struct POSTING_LIST* next = list->next;
+            free_list(index, list);
+            list = next;
+        }
+    }
+    free(index->buckets);
+    index->bytes -= index->num_buckets * sizeof(struct POSTING_LIST*);
+    index->buckets = NULL;
+    index->num_buckets = 0;
+}
+
+static int word_byte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+// Reads the next word from *pos on into word, returns its length, or 0 if there are no more
+static int next_word(const char** pos, const char* end, char* word) {
+    const char* p = *pos;
+    int len = 0;
+    while (p < end && len < 2) {
+        while (p < end && !word_byte(*p)) {
+            p++;
+        }
+        len = 0;
+        while (p < end && word_byte(*p)) {
+            if (len < SEARCH_WORD_MAX) {
+                word[len++] = (*p >= 'A' && *p <= 'Z') ? *p - 'A' + 'a' : *p;
+            }
+            p++;
+        }
+    }
+    *pos = p;
+    return len >= 2 ? len : 0;
+}
+
+static unsigned int word_hash(const char* word, int len) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char) word[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static struct POSTING_LIST** find_list(struct SEARCH_INDEX* index, const char* word, int len, unsigned int hash) {
+    if (index->num_buckets == 0) {
+        return NULL;
+    }
+    struct POSTING_LIST** link = &index->buckets[hash & (index->num_buckets - 1)];
+    while (*link != NULL && ((*link)->hash != hash || (*link)->word_len != len || memcmp((*link)->word, word, len) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static void grow_buckets(struct SEARCH_INDEX* index) {
+    unsigned int num_buckets = index->num_buckets == 0 ? 64 : index->num_buckets * 2;
+    struct POSTING_LIST** buckets = calloc(num_buckets, sizeof(struct POSTING_LIST*));
+    for (unsigned int b = 0; b < index->num_buckets; b++) {
+        struct POSTING_LIST* list = index->buckets[b];
+        while (list != NULL) {
+            struct POSTING_LIST* next = list->next;
+            list->next = buckets[list->hash & (num_buckets - 1)];
+            buckets[list->hash & (num_buckets - 1)] = list;
+            list = next;
+        }
+    }
+    free(index->buckets);
+    index->bytes += (num_buckets - index->num_buckets) * sizeof(struct POSTING_LIST*);
+    index->buckets = buckets;
+    index->num_buckets = num_buckets;
+}
+
+static int get_varint(const unsigned char* buf, unsigned long long* value) {
+    int n = 0;
+    *value = 0;
+    do {
+        *value |= (unsigned long long) (buf[n] & 0x7f) << (7 * n);
+    } while (buf[n++] & 0x80);
+    return n;
+}
+
+static void append_posting(struct SEARCH_INDEX* index, struct POSTING_LIST* list, unsigned long long seq) {
+    if (list->count == 0) {
+        list->first_seq = seq;
+        list->last_seq = seq;
+        list->count = 1;
+        return;
+    }
+    if (seq == list->last_seq) {
+        // the word was in the message more than once
+        return;
+    }
+
+    if (list->len + 10 > list->capacity) {
+        unsigned int capacity = list->capacity == 0 ? 8 : list->capacity * 2;
+        list->gaps = realloc(list->gaps, capacity);
+        index->bytes += capacity - list->capacity;
+        list->capacity = capacity;
+    }
+    unsigned long long gap = seq - list->last_seq;
+    while (gap >= 0x80) {
+        list->gaps[list->len++] = (gap & 0x7f) | 0x80;
+        gap >>= 7;
+    }
+    list->gaps[list->len++] = gap;
+    list->last_seq = seq;
+    list->count++;
+
+    unsigned int anchor = list->num_skips > list->skip_start ? list->skips[list->num_skips - 1].offset : list->start;
+    if (list->len - anchor >= SEARCH_SKIP_BYTES) {
+        if (list->num_skips == list->skip_capacity) {
+            unsigned int capacity = list->skip_capacity == 0 ? 4 : list->skip_capacity * 2;
+            list->skips = realloc(list->skips, capacity * sizeof(struct POSTING_SKIP));
+            index->bytes += (capacity - list->skip_capacity) * sizeof(struct POSTING_SKIP);
+            list->skip_capacity = capacity;
+        }
+        list->skips[list->num_skips++] = (struct POSTING_SKIP) {.seq = seq, .offset = list->len};
+    }
+}
+
+int search_index_add(struct SEARCH_INDEX* index, unsigned long long seq, const char* text, size_t len) {
+    if (seq <= index->last_seq) {
+        return -1;
+    }
+    index->last_seq = seq;
+
+    const char* pos = text;
+    char word[SEARCH_WORD_MAX];
+    int word_len;
+    while ((word_len = next_word(&pos, text + len, word)) > 0) {
+        unsigned int hash = word_hash(word, word_len);
+        struct POSTING_LIST** link = find_list(index, word, word_len, hash);
+        if (link == NULL || *link == NULL) {
+            if (index->num_lists >= index->num_buckets) {
+                grow_buckets(index);
+            }
+            struct POSTING_LIST* list = calloc(1, sizeof(struct POSTING_LIST));
+            list->hash = hash;
+            list->word_len = word_len;
+            memcpy(list->word, word, word_len);
+            link = &index->buckets[hash & (index->num_buckets - 1)];
+            list->next = *link;
+            *link = list;
+            index->num_lists++;
+            index->bytes += sizeof(struct POSTING_LIST);
+        }
+        append_posting(index, *link, seq);
+    }
+    return 0;
+}
+
+// Moves what's left of the list to the front once the dropped part is half of it
+static void compact_list(struct SEARCH_INDEX* index, struct POSTING_LIST* list) {
+    if (list->start < SEARCH_SKIP_BYTES || list->start * 2 < list->len) {
+        return;
+    }
+    memmove(list->gaps, list->gaps + list->start, list->len - list->start);
+    list->len -= list->start;
+    for (unsigned int i = list->skip_start; i < list->num_skips; i++) {
+        list->skips[i - list->skip_start] = (struct POSTING_SKIP) {
+            .seq = list->skips[i].seq,
+            .offset = list->skips[i].offset - list->start
+        };
+    }
+    list->num_skips -= list->skip_start;
+    list->skip_start = 0;
+    list->start = 0;
+
+    if (list->capacity > 64 && list->len * 4 < list->capacity) {
+        list->gaps = realloc(list->gaps, list->capacity / 2);
+        index->bytes -= list->capacity / 2;
+        list->capacity /= 2;
+    }
+}
+
+void search_index_remove(struct SEARCH_INDEX* index, unsigned long long seq, const char* text, size_t len) {
+    if (seq > index->removed_seq) {
+        index->removed_seq = seq;
+    }
+
+    const char* pos = text;
+    char word[SEARCH_WORD_MAX];
+    int word_len;
+    while (text != NULL && (word_len = next_word(&pos, text + len, word)) > 0) {
+        struct POSTING_LIST** link = find_list(index, word, word_len, word_hash(word, word_len));
+        if (link == NULL || *link == NULL) {
+            continue;
+        }
+        struct POSTING_LIST* list = *link;
+        if (list->last_seq <= seq) {
+            *link = list->next;
+            free_list(index, list);
+            continue;
+        }
+        while (list->first_seq <= seq) {
+            unsigned long long gap;
+            list->start += get_varint(list->gaps + list->start, &gap);
+            list->first_seq += gap;
+            list->count--;
+        }
+        while (list->skip_start < list->num_skips && list->skips[list->skip_start].offset <= list->start) {
+            list->skip_start++;
+        }
+        compact_list(index, list);
+    }
+}
+
+// The head of the list is anchor 0, its skip entries the ones after
+static unsigned int num_anchors(const struct POSTING_LIST* list) {
+    return 1 + list->num_skips - list->skip_start;
+}
+
+static unsigned long long anchor_seq(const struct POSTING_LIST* list, unsigned int anchor) {
+    return anchor == 0 ? list->first_seq : list->skips[list->skip_start + anchor - 1].seq;
+}
+
+// The last anchor at or before seq, which has to be at least first_seq
+static unsigned int find_anchor(const struct POSTING_LIST* list, unsigned long long seq) {
+    unsigned int low = 0;
+    unsigned int high = num_anchors(list) - 1;
+    while (low < high) {
+        unsigned int mid = (low + high + 1) / 2;
+        if (anchor_seq(list, mid) <= seq) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+// Decodes the postings from one anchor to the next into seqs, returns how many there are
+static int decode_segment(const struct POSTING_LIST* list, unsigned int anchor, unsigned long long* seqs) {
+    unsigned int offset = anchor == 0 ? list->start : list->skips[list->skip_start + anchor - 1].offset;
+    unsigned int end = anchor + 1 < num_anchors(list) ? list->skips[list->skip_start + anchor].offset : list->len;
+    int n = 0;
+    seqs[n++] = anchor_seq(list, anchor);
+    while (offset < end) {
+        unsigned long long gap;
+        offset += get_varint(list->gaps + offset, &gap);
+        seqs[n] = seqs[n - 1] + gap;
+        n++;
+    }
+    return n;
+}
+
+static int list_has(const struct POSTING_LIST* list, unsigned long long seq) {
+    if (seq < list->first_seq || seq > list->last_seq) {
+        return 0;
+    }
+    unsigned long long seqs[SEGMENT_MAX];
+    int n = decode_segment(list, find_anchor(list, seq), seqs);
+    for (int i = 0; i < n && seqs[i] <= seq; i++) {
+        if (seqs[i] == seq) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int search_index_query(struct SEARCH_INDEX* index, const char* query, size_t len, unsigned long long before_seq,
+                       unsigned long long* hits, int max_hits) {
+    struct POSTING_LIST* terms[SEARCH_MAX_TERMS];
+    int num_terms = 0;
+    int missing = 0;
+    const char* pos = query;
+    char word[SEARCH_WORD_MAX];
+    int word_len;
+    while (num_terms < SEARCH_MAX_TERMS && (word_len = next_word(&pos, query + len, word)) > 0) {
+        struct POSTING_LIST** link = find_list(index, word, word_len, word_hash(word, word_len));
+        if (link == NULL || *link == NULL) {
+            missing = 1;
+            continue;
+        }
+        int repeated = 0;
+        for (int i = 0; i < num_terms; i++) {
+            repeated |= (terms[i] == *link);
+        }
+        if (!repeated) {
+            terms[num_terms++] = *link;
+        }
+    }
+    if (num_terms == 0 && !missing) {
+        return -1;
+    }
+    if (missing) {
+        return 0;
+    }
+
+    int rarest = 0;
+    for (int i = 1; i < num_terms; i++) {
+        if (terms[i]->count < terms[rarest]->count) {
+            rarest = i;
+        }
+    }
+    struct POSTING_LIST* list = terms[rarest];
+    if (before_seq != 0 && before_seq <= list->first_seq) {
+        return 0;
+    }
+
+    int num_hits = 0;
+    unsigned long long seqs[SEGMENT_MAX];
+    unsigned int anchor = before_seq == 0 ? num_anchors(list) - 1 : find_anchor(list, before_seq - 1);
+    while (num_hits < max_hits) {
+        int n = decode_segment(list, anchor, seqs);
+        // a skip entry's own posting is the last one of the segment before it
+        for (int i = n - 1; i >= (anchor == 0 ? 0 : 1) && num_hits < max_hits; i--) {
+            if (before_seq != 0 && seqs[i] >= before_seq) {
+                continue;
+            }
+            int match = 1;
+            for (int t = 0; t < num_terms && match; t++) {
+                match = (t == rarest || list_has(terms[t], seqs[i]));
+            }
+            if (match) {
+                hits[num_hits++] = seqs[i];
+            }
+        }
+        if (anchor == 0) {
+            break;
+        }
+        anchor--;
+    }
+    return num_hits;
+}
@@ -0,0 +1,85 @@
+#ifndef ECE361_TEXTCONFERENCING_SEARCH_H
+#define ECE361_TEXTCONFERENCING_SEARCH_H
+
+#include <stddef.h>
+
+/*
+ * Full-text search over a session's history. Each session keeps an inverted index from the
+ * words in its messages to the sequence numbers of the messages they appear in, updated as
+ * messages go into the history and come out of it, so a SEARCH never has to read the history.
+ *
+ * A word is a run of ASCII letters and digits and of non-ASCII bytes (so "café" and "日本語"
+ * are words too), lower-cased, cut off after SEARCH_WORD_MAX bytes. Runs of one byte aren't
+ * indexed. Scripts that don't put spaces between words end up as one long word per run.
+ *
+ * Messages are added in order, so every posting list is ascending. It's stored as the first
+ * sequence number and then the gaps to each next one as varints (7 bits a byte), which is a
+ * byte or two per posting. Messages also leave in order, oldest first, which takes the head
+ * off the lists of their words; the bytes at the front are only moved out of the way once
+ * they are half of the list.
+ *
+ * A query's words must all be in a message for it to match. The rarest word's list is walked
+ * from the newest posting back, and the others are looked up in theirs. Every list has a skip
+ * entry every SEARCH_SKIP_BYTES, so neither has to decode more than that to get anywhere, and
+ * the cost follows the number of matches, not the size of the history.
+ */
+
+#define SEARCH_WORD_MAX 32
+#define SEARCH_MAX_TERMS 8
+// A list gets a skip entry every this many bytes of gaps, so a lookup decodes at most that much
+#define SEARCH_SKIP_BYTES 64
+
+// Decoding from offset in the gaps gives the postings after seq
+struct POSTING_SKIP {
+    unsigned long long seq;
+    unsigned int offset;
+};
+
+struct POSTING_LIST {
+    struct POSTING_LIST* next; // in the same bucket
+    unsigned int hash;
+    unsigned int count;
+    unsigned long long first_seq;
+    unsigned long long last_seq;
+    // the gaps from first_seq on are in gaps[start, len)
+    unsigned char* gaps;
+    unsigned int start;
+    unsigned int len;
+    unsigned int capacity;
+    // the ones before skip_start point before start
+    struct POSTING_SKIP* skips;
+    unsigned int skip_start;
+    unsigned int num_skips;
+    unsigned int skip_capacity;
+    unsigned char word_len;
+    char word[SEARCH_WORD_MAX];
+};
+
+struct SEARCH_INDEX {
+    struct POSTING_LIST** buckets;
+    unsigned int num_buckets; // a power of 2, or 0 before the first word
+    unsigned int num_lists;
+    unsigned long long last_seq;    // the newest message added
+    unsigned long long removed_seq; // the newest message taken out
+    size_t bytes;                   // everything the index has allocated
+};
+
+void search_index_init(struct SEARCH_INDEX* index);
+
+void search_index_free(struct SEARCH_INDEX* index);
+
+// Indexes message seq, which has to be newer than every message added before it.
+// Returns -1 if it isn't, and the message isn't indexed.
+int search_index_add(struct SEARCH_INDEX* index, unsigned long long seq, const char* text, size_t len);
+
+// Takes message seq, and every message before it, out of the lists of the words in text.
+// Messages have to leave oldest first; anything older than the index is ignored.
+void search_index_remove(struct SEARCH_INDEX* index, unsigned long long seq, const char* text, size_t len);
+
+// Finds up to max_hits messages older than before_seq (0 for the newest) that have every
+// word of the query, newest first. Returns how many were found, or -1 if the query has no
+// words that could be indexed.
+int search_index_query(struct SEARCH_INDEX* index, const char* query, size_t len, unsigned long long before_seq,
+                       unsigned long long* hits, int max_hits);
+
+#endif //ECE361_TEXTCONFERENCING_SEARCH_H
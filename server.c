@@ -1,6 +1,12 @@
 // Code is adapted from Beej's Guide
+#define _GNU_SOURCE // splice
 #include "packet.h"
 #include "server.h"
+#include "governor.h"
+#include "probes.h"
+#include "latency.h"
+#include "scan.h"
+#include "search.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,19 +15,25 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
 
-#define BACKLOG 20
-
-struct CLIENT_INFO_NODE* client_info_head = NULL;
-struct SESSION_INFO_NODE* session_info_head = NULL;
-
-#define LOGIN_FILE "login.txt"
+#define BACKLOG SOMAXCONN // connections can arrive by the thousand
 
 // get sockaddr, IPv4 or IPv6
 void *get_in_addr(struct sockaddr *sa) {
@@ -31,41 +43,178 @@ void *get_in_addr(struct sockaddr *sa) {
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-int main(int argc, const char** argv) {
 
-    // process command line input
-    if (argc != 2) {
-        printf("Error - please run this command as 'server <TCP port to listen on>'\n");
-        exit(1);
+void server_default_config(struct SERVER_CONFIG* config) {
+    *config = (struct SERVER_CONFIG) {
+        .prelogin_timeout = 30,
+        .idle_timeout = 60,
+        .ping_timeout = 15,
+        .stall_timeout = 30,
+        .resume_timeout = 120,
+        .history_size = 128,
+        .compression = 1,
+        .compress_threshold = COMPRESS_THRESHOLD,
+        .rate_limits = {
+            [RATE_MESSAGE] = {.rate = 20, .burst = 40},
+            [RATE_DM] = {.rate = 10, .burst = 20},
+            [RATE_REQUEST] = {.rate = 5, .burst = 20}
+        },
+        .session_rate_limit = {.rate = 50, .burst = 100},
+        .frames_per_turn = 16,
+        .memory_budget = 64 * 1024,
+        .degraded_lag_ms = 50,
+        .overloaded_lag_ms = 250,
+        .retry_after = 5,
+        .bulk_queue_limit = 512,
+        .blob_max_size = 1024,
+        .splice = 1,
+        .max_data = MAX_DATA,
+        .unix_socket = NULL,
+        .shm_ring_size = 1024,
+        .mailbox_size = 100,
+        .mailbox_memory = 64,
+        .mailbox_dir = NULL,
+        .handoff_socket = NULL,
+        .takeover = NULL,
+        .cluster = NULL,
+        .cluster_key = NULL,
+        .node = 0,
+        .replica_port = NULL,
+        .standby = NULL,
+        .replica_key = NULL,
+        .standby_timeout = 5,
+        .replica_lag_limit = 16 * 1024,
+        .replicate_messages = 1,
+        .capture = NULL,
+        .login_file = "login.txt",
+        .validate_text = 1,
+        .search_memory = 256,
+        .archive_dir = NULL,
+        .archive_segment = 16 * 1024,
+        .archive_queue = 8 * 1024
+    };
+}
+
+int parse_config_option(struct SERVER_CONFIG* config, const char* option) {
+    struct {
+        const char* name;
+        int* value;
+    } options[] = {
+        {"prelogin_timeout", &config->prelogin_timeout},
+        {"idle_timeout", &config->idle_timeout},
+        {"ping_timeout", &config->ping_timeout},
+        {"stall_timeout", &config->stall_timeout},
+        {"resume_timeout", &config->resume_timeout},
+        {"history_size", &config->history_size},
+        {"compression", &config->compression},
+        {"compress_threshold", &config->compress_threshold},
+        {"message_rate", &config->rate_limits[RATE_MESSAGE].rate},
+        {"message_burst", &config->rate_limits[RATE_MESSAGE].burst},
+        {"dm_rate", &config->rate_limits[RATE_DM].rate},
+        {"dm_burst", &config->rate_limits[RATE_DM].burst},
+        {"request_rate", &config->rate_limits[RATE_REQUEST].rate},
+        {"request_burst", &config->rate_limits[RATE_REQUEST].burst},
+        {"session_rate", &config->session_rate_limit.rate},
+        {"session_burst", &config->session_rate_limit.burst},
+        {"frames_per_turn", &config->frames_per_turn},
+        {"memory_budget", &config->memory_budget},
+        {"degraded_lag_ms", &config->degraded_lag_ms},
+        {"overloaded_lag_ms", &config->overloaded_lag_ms},
+        {"retry_after", &config->retry_after},
+        {"bulk_queue_limit", &config->bulk_queue_limit},
+        {"blob_max_size", &config->blob_max_size},
+        {"splice", &config->splice},
+        {"max_data", &config->max_data},
+        {"shm_ring_size", &config->shm_ring_size},
+        {"mailbox_size", &config->mailbox_size},
+        {"mailbox_memory", &config->mailbox_memory},
+        {"node", &config->node},
+        {"standby_timeout", &config->standby_timeout},
+        {"replica_lag_limit", &config->replica_lag_limit},
+        {"replicate_messages", &config->replicate_messages},
+        {"validate_text", &config->validate_text},
+        {"search_memory", &config->search_memory},
+        {"archive_segment", &config->archive_segment},
+        {"archive_queue", &config->archive_queue},
+    };
+    struct {
+        const char* name;
+        const char** value;
+    } string_options[] = {
+        {"unix_socket", &config->unix_socket},
+        {"mailbox_dir", &config->mailbox_dir},
+        {"handoff_socket", &config->handoff_socket},
+        {"takeover", &config->takeover},
+        {"cluster", &config->cluster},
+        {"cluster_key", &config->cluster_key},
+        {"replica_port", &config->replica_port},
+        {"standby", &config->standby},
+        {"replica_key", &config->replica_key},
+        {"capture", &config->capture},
+        {"login_file", &config->login_file},
+        {"archive_dir", &config->archive_dir},
+    };
+
+    const char* equals = strchr(option, '=');
+    if (equals == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+        if (strlen(options[i].name) == equals - option && strncmp(option, options[i].name, equals - option) == 0) {
+            *options[i].value = atoi(equals + 1);
+            return 0;
+        }
     }
+    for (int i = 0; i < sizeof(string_options) / sizeof(string_options[0]); i++) {
+        if (strlen(string_options[i].name) == equals - option
+            && strncmp(option, string_options[i].name, equals - option) == 0) {
+            *string_options[i].value = equals + 1;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+unsigned long long now_ms(struct SERVER* server) {
+    return now_us(server) / 1000;
+}
+
+unsigned long long now_us(struct SERVER* server) {
+    if (server->manual_clock) {
+        return server->clock_us;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    // read login information
-    client_info_head = read_login();
-    if (client_info_head == NULL) {
-        printf("Error - no client login information is found\n");
+int open_tcp_listener(const char* port) {
+    int sockfd = try_tcp_listener(port);
+    if (sockfd == -1) {
+        printf("server: failed to bind\n");
         exit(1);
     }
+    return sockfd;
+}
 
-    int sockfd; // listen on sock_fd
+int try_tcp_listener(const char* port) {
+    int sockfd;
     struct addrinfo hints, *servinfo;
-    struct sockaddr_storage client_addr; // connector's address information socklen_t sin_size;
-    struct sigaction sa;
     int yes=1;
-    char s[INET6_ADDRSTRLEN];
     int rv;
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE; // use my IP
 
-    if ((rv = getaddrinfo(NULL, argv[1], &hints, &servinfo)) != 0) {
+    if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
         printf("Error: getaddrinfo: %s\n", gai_strerror(rv));
-        exit(1);
+        return -1;
     }
 
     struct addrinfo* curr = servinfo;
     for (; curr != NULL; curr = curr->ai_next) {
-        if ((sockfd = socket(curr->ai_family, curr->ai_socktype, curr->ai_protocol)) == -1) {
+        if ((sockfd = socket(curr->ai_family, curr->ai_socktype | SOCK_CLOEXEC, curr->ai_protocol)) == -1) {
             printf("server: socket\n");
             continue;
         }
@@ -75,7 +224,6 @@ int main(int argc, const char** argv) {
         }
         if (bind(sockfd, curr->ai_addr, curr->ai_addrlen) == -1) {
             close(sockfd);
-            printf("server: bind\n");
             continue;
         }
         break;
@@ -83,569 +231,5092 @@ int main(int argc, const char** argv) {
 
     freeaddrinfo(servinfo); // all done with this structure
 
-    if(curr==NULL){
-        printf("server: failed to bind\n");
-        exit(1);
+    if (curr == NULL) {
+        return -1;
     }
     if (listen(sockfd, BACKLOG) == -1) {
         printf("listen\n");
-        exit(1);
+        close(sockfd);
+        return -1;
     }
-    printf("Server: Listening for connection on port %s\n", argv[1]);
+    return sockfd;
+}
 
-    int highest_fd = sockfd;
-    fd_set active_fd;
-    FD_ZERO(&active_fd);
-    FD_SET(sockfd, &active_fd);
+int open_unix_listener(const char* path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
 
-    while (1) {
-        fd_set fd_copy = active_fd;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    // left behind by an earlier run, nobody can be listening on it any more
+    unlink(path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 || listen(fd, BACKLOG) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-        if (select(highest_fd + 1, &fd_copy, NULL, NULL, NULL) == -1) {
-            printf("Select error\n");
-            exit(1);
+void accept_connections(struct SERVER* server, int listen_fd) {
+    for (int n = 0; n < ACCEPT_BATCH; n++) {
+        struct sockaddr_storage client_addr; // connector's address information
+        socklen_t sin_size = sizeof(struct sockaddr_storage);
+        char s[INET6_ADDRSTRLEN];
+        int new_fd = accept4(listen_fd, (struct sockaddr *)&client_addr, &sin_size, SOCK_NONBLOCK);
+        if (new_fd == -1 && (errno == EMFILE || errno == ENFILE) && server->spare_fd != -1) {
+            // The connection would stay pending and wake us up again straight away,
+            // so take it with the descriptor kept for this and close it
+            printf("Too many connections, refusing a new one\n");
+            close(server->spare_fd);
+            new_fd = accept(listen_fd, NULL, NULL);
+            if (new_fd != -1) {
+                close(new_fd);
+            }
+            server->spare_fd = open("/dev/null", O_RDONLY);
+            continue;
+        }
+        if (new_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                printf("Accept connection error\n");
+            }
+            return;
+        }
+        if (new_fd >= server->max_connections) {
+            printf("Too many connections, refusing a new one\n");
+            close(new_fd);
+            continue;
+        }
+        if (mem_pressure(&server->memory) != MEM_OK) {
+            printf("Low on memory, refusing a new connection\n");
+            server->memory.refused_connections++;
+            close(new_fd);
+            continue;
         }
 
-        // fd_copy will only be left with the fd's that can be read right now
-        for (int i = 0; i <= highest_fd; i++) {
-            if (FD_ISSET(i, &fd_copy)) {
-
-                if (i == sockfd) {
-                    // This is the socket that listens for incoming connections.
-                    // Establish a new connection here.
-                    socklen_t sin_size = sizeof(struct sockaddr_storage);
-                    int new_fd = accept(sockfd, (struct sockaddr *)&client_addr, &sin_size);
-                    if (new_fd == -1) {
-                        printf("Accept connection error\n");
-                        continue;
-                    }
+        if (client_addr.ss_family == AF_UNIX) {
+            strcpy(s, "the local socket");
+        } else {
+            inet_ntop(client_addr.ss_family, get_in_addr((struct sockaddr *)&client_addr), s, sizeof s);
+        }
+        printf("server: got connection from %s\n", s);
 
-                    inet_ntop(client_addr.ss_family, get_in_addr((struct sockaddr *)&client_addr), s, sizeof s);
-                    printf("server: got connection from %s\n", s);
+        struct CONNECTION* conn = open_connection(server, new_fd);
+        conn->local = (client_addr.ss_family == AF_UNIX);
+        if (listen_fd == server->cluster_fd) {
+            // another server, which says which one in its NODE_HELLO
+            conn->peer = PEER_UNIDENTIFIED;
+        } else if (listen_fd == server->replica_fd) {
+            // a standby, once it has said the replica_key, which prelogin_timeout waits for
+            conn->replica_pending = 1;
+        } else if (server->capture.fd != -1) {
+            conn->capture_id = ++server->next_capture_id;
+            capture_record(&server->capture, CAPTURE_OPEN, conn->capture_id, 0, NULL, 0, now_us(server));
+        }
+    }
+}
 
-                    // add the new fd to the file set
-                    FD_SET(new_fd, &active_fd);
-                    highest_fd = (highest_fd > new_fd) ? highest_fd : new_fd;
-                } else {
-                    // handle regular communication with clients that have already connected
-                    char buf[MAX_STR_LEN];
-                    int num_read = recv(i, buf, MAX_STR_LEN, 0);
-                    if (num_read == -1) {
-                        printf("Error when server reads from socket. %d\n", errno);
-                        exit(1);
-                    }
+struct CONNECTION* open_connection(struct SERVER* server, int sockfd) {
+    struct CONNECTION* conn = malloc(sizeof(struct CONNECTION));
+    mem_charge(&server->memory, MEM_CONNECTIONS, sizeof(struct CONNECTION));
+    conn->server = server;
+    conn->sockfd = sockfd;
+    conn->state = CONN_PRE_LOGIN;
+    conn->client = NULL;
+    conn->ping_outstanding = 0;
+    conn->closing = 0;
+    conn->next_closing = NULL;
+    conn->in_buf = NULL;
+    conn->in_len = 0;
+    conn->compression = 0;
+    memset(conn->lanes, 0, sizeof(conn->lanes));
+    conn->out_bytes = 0;
+    conn->dropped_frames = 0;
+    conn->dirty = 0;
+    conn->next_dirty = NULL;
+    timer_init(&conn->stall_timer, output_stalled, conn);
+    conn->input_paused = 0;
+    conn->ready = 0;
+    conn->want_write = 0;
+    conn->next_ready = NULL;
+    timer_init(&conn->throttle_timer, throttle_expired, conn);
+    conn->query_deferred_ms = 0;
+    conn->chunk_active = 0;
+    conn->blob_blocked = 0;
+    conn->local = 0;
+    conn->relay = NULL;
+    conn->shm = NULL;
+    conn->reserved_by = NULL;
+    conn->peer = -1;
+    conn->replica = 0;
+    conn->replica_pending = 0;
+    conn->held_login = NULL;
+    conn->capture_id = 0;
 
-                    if (num_read == 0 || (num_read == -1 && errno == 54)) {
-                        // Client disconnected
-                        struct CLIENT_INFO_NODE* curr = client_info_head;
-                        while (curr != NULL) {
-                            if (curr->sockfd == i) {
-                                struct SESSION_INFO_NODE* session = curr->active_session;
-                                if (session) {
-                                    remove_user_from_session(session, curr);
-                                }
-                                curr->active_session = NULL;
-                                curr->sockfd = -1;
-                                break;
-                            }
-                            curr = curr->next;
-                        }
-                        assert(curr != NULL);
-                        printf("Client %s disconnected\n", curr->username);
-                        close(i);
-                        FD_CLR(i, &active_fd);
-                        continue;
-                    }
+    // The client has prelogin_timeout to log in, counted from the connection
+    timer_init(&conn->timer, connection_timeout, conn);
+    timer_add(&server->timers, &conn->timer, SECONDS_TO_TICKS(server->config.prelogin_timeout));
 
-                    buf[num_read] = '\0';
-                    struct message * msg = str_to_message(buf);
-                    int result;
-                    switch (msg->type) {
-                        case REGISTER:
-                            // Register doesn't involve logging in, so the FD set is cleared rightaway.
-                            // User has to establish a separate connection to log in.
-                            handle_register_user(msg, i);
-                            FD_CLR(i, &active_fd);
-                            break;
-                        case LOGIN:
-                            result = handle_login(msg, i);
-                            if (result == -1) {
-                                FD_CLR(i, &active_fd);
-                            }
-                            break;
-                        case EXIT:
-                            handle_exit(msg);
-                            FD_CLR(i, &active_fd);
-                            break;
-                        case JOIN:
-                            handle_join_session(msg, i);
-                            break;
-                        case LEAVE_SESS:
-                            handle_leave_session(msg, i);
-                            break;
-                        case NEW_SESS:
-                            handle_new_session(msg, i);
-                            break;
-                        case MESSAGE:
-                            handle_send_message(msg, i);
-                            break;
-                        case QUERY:
-                            handle_query(msg, i);
-                            break;
-                        case DM_REQ:
-                            handle_dm(msg, i);
-                            break;
-                        default:
-                            printf("No packet type has been matched");
-                            exit(1);
+    // Output is queued and flushed by the event loop, so the socket (accepted
+    // non-blocking) never has to block
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = sockfd};
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, sockfd, &event);
+    conn->watched = EPOLLIN;
 
-                    }
-                    free(msg);
-                }
-            }
-        }
-    }
+    server->connections[sockfd] = conn;
+    server->highest_fd = (server->highest_fd > sockfd) ? server->highest_fd : sockfd;
+    return conn;
 }
 
+void schedule_close(struct SERVER* server, struct CONNECTION* conn, const char* reason) {
+    if (conn->closing) {
+        return;
+    }
+    conn->closing = 1;
+    conn->next_closing = server->closing_head;
+    server->closing_head = conn;
 
+    if (reason != NULL) {
+        printf("Closing connection %d (%s): %s\n", conn->sockfd,
+               conn->client ? conn->client->username : "not logged in", reason);
+    }
+}
 
-struct CLIENT_INFO_NODE* read_login() {
-    // Reads the login information from a text file, login.txt
-    FILE* fp = fopen(LOGIN_FILE, "r");
-    if (fp == NULL) {
-        printf("Error: Can't read the login file\n");
-        exit(1);
+void close_pending_connections(struct SERVER* server) {
+    while (server->closing_head != NULL) {
+        struct CONNECTION* conn = server->closing_head;
+        server->closing_head = conn->next_closing;
+        close_connection(server, conn);
     }
+}
 
-    char *line;
-    size_t len = 0;
-    char delim[] = " \t\r\n\v\f";
+void close_connection(struct SERVER* server, struct CONNECTION* conn) {
+    // Unless the user already logged out (EXIT), they keep their session for a
+    // while so they can RESUME it from a new connection
+    struct CLIENT_INFO_NODE* client = conn->client;
+    if (client != NULL && client->sockfd == conn->sockfd) {
+        client->sockfd = -1;
+        timer_add(&server->timers, &client->resume_timer, SECONDS_TO_TICKS(server->config.resume_timeout));
+        printf("Client %s disconnected\n", client->username);
+        announce_presence(server, client);
+    }
+    if (conn->peer != -1) {
+        node_link_down(server, conn);
+    }
+    if (conn->replica) {
+        replica_link_down(server, conn);
+    }
+    if (conn->held_login != NULL) {
+        // the home's answer finds nobody waiting, and tells it they didn't log in after all
+        struct CLIENT_INFO_NODE* claimant = get_client_info(server, conn->held_login->source);
+        if (claimant != NULL && claimant->claim_sockfd == conn->sockfd) {
+            claimant->claim_sockfd = -1;
+        }
+        free(conn->held_login);
+        conn->held_login = NULL;
+    }
+    PROBE2(disconnect, conn->sockfd, client != NULL ? client->username : "");
+    if (conn->capture_id != 0) {
+        capture_record(&server->capture, CAPTURE_CLOSE, conn->capture_id, 0, NULL, 0, now_us(server));
+    }
 
-    struct CLIENT_INFO_NODE* head = NULL;
-    struct CLIENT_INFO_NODE* curr;
+    detach_blob_transfers(server, conn);
 
-    while (getline(&line, &len, fp) != -1) {
-        if (!head) {
-            head = malloc(sizeof(struct CLIENT_INFO_NODE));
-            curr = head;
-        } else {
-            curr->next = malloc(sizeof(struct CLIENT_INFO_NODE));
-            curr = curr -> next;
+    // Last chance for replies like LO_NAK. Whatever the socket doesn't take is dropped.
+    flush_connection(server, conn);
+    for (int lane = 0; lane < NUM_LANES; lane++) {
+        while (conn->lanes[lane].head != NULL) {
+            remove_out_chunk(server, conn, lane, &conn->lanes[lane].head);
         }
-        char* ptr = strtok(line, delim);
-        strcpy(curr->username, ptr);
-
-        ptr = strtok(NULL, delim);
-        strcpy(curr->password, ptr);
+    }
+    if (conn->dirty) {
+        struct CONNECTION** link = &server->dirty_head;
+        while (*link != conn) {
+            link = &(*link)->next_dirty;
+        }
+        *link = conn->next_dirty;
+    }
+    if (conn->ready) {
+        struct CONNECTION** link = &server->ready_head;
+        while (*link != conn) {
+            link = &(*link)->next_ready;
+        }
+        *link = conn->next_ready;
+    }
 
-        curr->next = NULL;
-        curr->active_session = NULL;
-        curr->sockfd = -1;
+    timer_cancel(&server->timers, &conn->timer);
+    timer_cancel(&server->timers, &conn->stall_timer);
+    timer_cancel(&server->timers, &conn->throttle_timer);
+    if (conn->query_deferred_ms != 0) {
+        server->num_deferred_queries--;
     }
-    free(line);
-    fclose(fp);
-    return head;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+    close(conn->sockfd);
+    server->connections[conn->sockfd] = NULL;
+    conn->in_len = 0;
+    release_input_buffer(server, conn);
+    if (conn->relay != NULL) {
+        free(conn->relay);
+        mem_credit(&server->memory, MEM_BLOBS, sizeof(struct BLOB_RELAY));
+    }
+    if (conn->shm != NULL) {
+        mem_credit(&server->memory, MEM_SHM, shm_region_size(conn->shm->ring_size));
+        shm_region_unmap(conn->shm);
+        free(conn->shm);
+    }
+    free(conn);
+    mem_credit(&server->memory, MEM_CONNECTIONS, sizeof(struct CONNECTION));
 }
 
-struct CLIENT_INFO_NODE* get_client_info (const char* username) {
-    struct CLIENT_INFO_NODE* curr = client_info_head;
-    while (curr != NULL) {
-        if (strcmp(username, curr->username) == 0) {
-            return curr;
-        }
-        curr = curr -> next;
+void connection_timeout(struct TIMER* timer, void* arg) {
+    struct CONNECTION* conn = arg;
+    struct SERVER* server = conn->server;
+    if (conn->closing) {
+        return;
+    }
+
+    if (conn->state == CONN_PRE_LOGIN) {
+        schedule_close(server, conn, "did not log in in time");
+    } else if (conn->ping_outstanding) {
+        schedule_close(server, conn, "did not answer a PING");
+    } else if (server->monitor.mode != MODE_NORMAL) {
+        // keep-alives can wait until the loop has caught up
+        server->monitor.skipped_pings++;
+        timer_add(&server->timers, &conn->timer, SECONDS_TO_TICKS(server->config.idle_timeout));
+    } else {
+        // Idle for a while, make sure the other end is still there
+        struct message ping;
+        message_init(&ping, PING);
+        strcpy(ping.source, "SERVER");
+        send_message_to_client(server, conn->sockfd, &ping);
+        conn->ping_outstanding = 1;
+        timer_add(&server->timers, &conn->timer, SECONDS_TO_TICKS(server->config.ping_timeout));
     }
-    return NULL;
 }
 
+void handle_client_data(struct SERVER* server, struct CONNECTION* conn) {
+    // Any traffic proves the client is alive
+    conn->ping_outstanding = 0;
+    if (conn->state == CONN_LOGGED_IN) {
+        timer_add(&server->timers, &conn->timer, SECONDS_TO_TICKS(server->config.idle_timeout));
+    }
 
+    if (conn->chunk_active) {
+        // the rest of a file chunk, which doesn't go through in_buf
+        continue_blob_chunk(server, conn);
+        return;
+    }
 
-struct SESSION_INFO_NODE* get_session_info (const char* session_id) {
-    struct SESSION_INFO_NODE* curr = session_info_head;
-    while (curr != NULL) {
-        if (strcmp(session_id, curr->session_id) == 0) {
-            return curr;
+    if (conn->shm != NULL) {
+        // Only doorbells come this way now: there's input in the ring, or the client
+        // made room in the other one
+        char doorbells[256];
+        int num_read = recv(conn->sockfd, doorbells, sizeof(doorbells), 0);
+        if (num_read == 0 || (num_read == -1 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            schedule_close(server, conn, num_read == 0 ? "disconnected" : strerror(errno));
+            return;
+        }
+        if (conn->out_bytes > 0) {
+            mark_dirty(server, conn);
         }
-        curr = curr -> next;
+        process_input(server, conn);
+        return;
     }
-    return NULL;
-}
 
+    if (take_input_buffer(server, conn) == -1) {
+        schedule_close(server, conn, "out of memory");
+        return;
+    }
+    int num_read = recv(conn->sockfd, conn->in_buf + conn->in_len, server->in_buf_size - conn->in_len, 0);
+    if (num_read == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+        release_input_buffer(server, conn);
+        return;
+    }
+    if (num_read <= 0) {
+        // Client disconnected, or the connection was reset
+        schedule_close(server, conn, num_read == 0 ? "disconnected" : strerror(errno));
+        return;
+    }
+    conn->in_len += num_read;
 
-void send_message_to_client(int sockfd, struct message* msg) {
-    // Send TCP message to client
-    const char* msg_str = message_to_str(msg);
-    printf("Sending message: %s\n", msg_str);
-    send_string_to_client(sockfd, msg_str);
-    free(msg_str);
+    process_input(server, conn);
 }
 
-void send_string_to_client(int sockfd, const char* msg_str) {
-    // Send TCP message to client
-    if (send(sockfd, msg_str, strlen(msg_str), 0) == -1) {
-        printf("Error sending message: %d\n", errno);
-        exit(1);
+void process_input(struct SERVER* server, struct CONNECTION* conn) {
+    if (conn->shm != NULL) {
+        pull_shm_input(server, conn);
+    }
+    if (conn->in_buf == NULL) {
+        // the last turn happened to take everything there was
+        if (conn->shm != NULL && shm_input_pending(server, conn)) {
+            pause_input(server, conn);
+            mark_ready(server, conn);
+        } else {
+            resume_input(server, conn);
+        }
+        return;
     }
-}
 
+    // There may be any number of messages in the buffer, possibly with a partial one at the end
+    int offset = 0;
+    int budget = server->config.frames_per_turn > 0 ? server->config.frames_per_turn : 1;
+    if (conn->peer != -1) {
+        budget = LINK_FRAMES_PER_TURN;
+    }
+    int throttled = 0;
+    while (!conn->closing && budget > 0) {
+        // File chunks are too big for a struct message, and are relayed as they arrive
+        unsigned int type;
+        int size;
+        int header_len = frame_header(conn->in_buf + offset, conn->in_len - offset, &type, &size);
+        if (header_len > 0 && type == BLOB_CHUNK && conn->shm != NULL) {
+            // the relay reads the rest of a chunk from the socket
+            schedule_close(server, conn, "sent a file chunk over shared memory");
+            break;
+        }
+        if (header_len > 0 && type == BLOB_CHUNK) {
+            int used = start_blob_chunk(server, conn, offset, header_len, size);
+            if (used == 0) {
+                // the recipients have to catch up first
+                throttled = 1;
+                break;
+            }
+            offset += used;
+            budget--;
+            if (conn->chunk_active) {
+                // the rest of it is still on the socket
+                break;
+            }
+            continue;
+        }
 
-int handle_login(struct message* msg, int sockfd) {
-    // msg is the login message
-    // Must check the username and password against the known database.
-    // If login is successful, a positive fd will be set in matching_username->sockfd.
-    // This also sends a response to the client
-    struct message new_msg;
-    strcpy(new_msg.source, "SERVER");
-    new_msg.type = LO_NAK;
+        // frame_header already says where the frame ends
+        int len = header_len;
+        if (header_len > 0) {
+            len = conn->in_len - offset - header_len < size - 1 ? 0 : header_len + size - 1;
+        }
+        if (len == 0) {
+            break;
+        }
+        if (len == -1) {
+            schedule_close(server, conn, "sent a malformed message");
+            break;
+        }
 
-    struct CLIENT_INFO_NODE* matching_username = get_client_info(msg->source);
-    if (matching_username) {
-        if (strcmp(msg->data, matching_username->password) == 0) {
+        struct message* msg = buf_to_message(conn->in_buf + offset, len);
+        if (msg == NULL) {
+            schedule_close(server, conn, "sent a message that can't be decoded");
+            break;
+        }
 
-            if (matching_username->sockfd != -1) {
-                strcpy(new_msg.data, "You have already logged in elsewhere\n");
-            } else {
-                // successful log in
-                matching_username->sockfd = sockfd;
-                new_msg.type = LO_ACK;
-                strcpy(new_msg.data, "");
+        long long wait = rate_limit_wait(server, conn, msg);
+        if (wait > 0 && send_rate_limit_nak(server, msg, conn->sockfd) == -1) {
+            // Leave it in the buffer and stop reading until it's allowed. The client
+            // isn't blocked on us, TCP just pushes back on it.
+            free(msg);
+            throttled = 1;
+            timer_add(&server->timers, &conn->throttle_timer, (wait + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+            break;
+        }
+        if (wait == 0 && conn->capture_id != 0) {
+            capture_record(&server->capture, CAPTURE_FRAME, conn->capture_id, msg->type, conn->in_buf + offset, len, now_us(server));
+        }
+        offset += len;
+        budget--;
+        if (wait == 0) {
+            if (msg->trace == 0) {
+                msg->trace = ++server->next_trace_id;
             }
-        } else {
-            strcpy(new_msg.data, "invalid password");
+            if (msg->sent_us != 0 && msg->received_us == 0 && (msg->type == MESSAGE || msg->type == DM_REQ)) {
+                msg->received_us = server->loop_woke_us;
+            }
+            PROBE4(frame_received, msg->trace, conn->sockfd, msg->type, len);
+            server->current_trace = msg->trace;
+            PROBE3(handler_start, msg->trace, conn->sockfd, msg->type);
+            dispatch_message(server, conn, msg);
+            PROBE3(handler_end, msg->trace, conn->sockfd, msg->type);
+            server->current_trace = 0;
         }
-    } else {
-        strcpy(new_msg.data, "username not found");
+        free(msg);
     }
 
-    new_msg.size = strlen(new_msg.data) + 1;
+    memmove(conn->in_buf, conn->in_buf + offset, conn->in_len - offset);
+    conn->in_len -= offset;
+    release_input_buffer(server, conn);
 
-    send_message_to_client(sockfd, &new_msg);
-    return (new_msg.type == LO_ACK ? 0 : -1);
+    if (conn->closing) {
+        return;
+    }
+    if (conn->chunk_active) {
+        continue_blob_chunk(server, conn);
+    } else if (throttled) {
+        pause_input(server, conn);
+    } else if (budget == 0) {
+        // there may be more, which waits for the other connections to have their turn
+        pause_input(server, conn);
+        mark_ready(server, conn);
+    } else if (conn->shm != NULL && shm_input_pending(server, conn)) {
+        // more arrived in the ring while we were busy
+        pause_input(server, conn);
+        mark_ready(server, conn);
+    } else {
+        resume_input(server, conn);
+    }
 }
 
-void handle_exit(struct message* msg) {
-    struct CLIENT_INFO_NODE* matching_username = get_client_info(msg->source);
-    if (matching_username) {
+void pull_shm_input(struct SERVER* server, struct CONNECTION* conn) {
+    struct SHM_RING* in_ring = &conn->shm->region->to_server;
+    ssize_t available = shm_ring_used(conn->shm, in_ring);
+    if (available == 0) {
+        return;
+    }
+    if (available > 0 && take_input_buffer(server, conn) == -1) {
+        schedule_close(server, conn, "out of memory");
+        return;
+    }
+    ssize_t n = -1;
+    if (available > 0) {
+        n = shm_ring_read(conn->shm, in_ring, conn->in_buf + conn->in_len, server->in_buf_size - conn->in_len);
+    }
+    if (n == -1) {
+        schedule_close(server, conn, "corrupted its shared memory ring");
+        return;
+    }
+    conn->in_len += n;
 
-        // if currently in a session, leave this session
-        if (matching_username->active_session != NULL) {
-            struct SESSION_INFO_NODE* session = matching_username->active_session;
-            remove_user_from_session(session, matching_username);
-            matching_username->active_session = NULL;
-        }
+    // A busy client may not send doorbells at all, so this is what proves it's alive
+    conn->ping_outstanding = 0;
+    timer_add(&server->timers, &conn->timer, SECONDS_TO_TICKS(server->config.idle_timeout));
+    if (n > 0 && shm_ring_wake(&in_ring->writer_waiting)) {
+        // it was waiting for room
+        send(conn->sockfd, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+}
 
-        close(matching_username->sockfd);
-        matching_username->sockfd = -1;
+int shm_input_pending(struct SERVER* server, struct CONNECTION* conn) {
+    struct SHM_RING* in_ring = &conn->shm->region->to_server;
+    shm_ring_arm(&in_ring->reader_waiting);
+    if (shm_ring_used(conn->shm, in_ring) != 0) {
+        shm_ring_disarm(&in_ring->reader_waiting);
+        return 1;
     }
+    return 0;
 }
 
-void handle_join_session(struct message* msg, int sockfd) {
-    struct CLIENT_INFO_NODE* matching_username = get_client_info(msg->source);
-    struct message new_msg;
-    strcpy(new_msg.source, "SERVER");
-    new_msg.type = JN_NAK;
-    char error_msg[MAX_STR_LEN];
+void ring_doorbell(struct CONNECTION* conn) {
+    // If the socket is full of doorbells already, one more wouldn't change anything
+    if (shm_ring_wake(&conn->shm->region->to_client.reader_waiting)) {
+        send(conn->sockfd, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+}
 
-    // join a session that has already been created, and not yet at capacity
-    if (matching_username) {
-        if (matching_username->sockfd == sockfd && matching_username->active_session == NULL) {
-            struct SESSION_INFO_NODE* matching_session = get_session_info(msg->data);
+void handle_shm_request(struct SERVER* server, struct CONNECTION* conn, struct message* msg) {
+    struct message reply;
+    message_init(&reply, SHM_NAK);
+    strcpy(reply.source, "SERVER");
 
-            if (matching_session) {
-                int added = 0;
-                for (int i = 0; i < SESSION_CAP; i++) {
-                    if (matching_session->clients[i] == NULL) {
-                        matching_session->clients[i] = matching_username;
-                        added = 1;
-                        matching_session->num_connected_client++;
-                        matching_username->active_session = matching_session;
-                        printf("%s %p %d\n", matching_username->username, matching_username->active_session, matching_username->sockfd);
-                        break;
-                    }
-                }
+    struct SHM_MAP map;
+    int fd = -1;
+    if (conn->client == NULL || conn->client->sockfd != conn->sockfd) {
+        message_printf(&reply, "you need to log in first");
+    } else if (!conn->local) {
+        message_printf(&reply, "shared memory is only for the local socket");
+    } else if (server->config.shm_ring_size <= 0) {
+        message_printf(&reply, "shared memory is turned off");
+    } else if (conn->shm != NULL) {
+        message_printf(&reply, "already using shared memory");
+    } else if (mem_pressure(&server->memory) != MEM_OK) {
+        message_printf(&reply, "the server is busy, try again later");
+    } else {
+        // whatever is queued has to reach the socket first, the client switches over on SHM_ACK
+        flush_connection(server, conn);
+        if (conn->out_bytes > 0) {
+            message_printf(&reply, "the connection is busy, try again later");
+        } else if ((fd = shm_region_create((size_t) server->config.shm_ring_size * 1024, &map)) == -1) {
+            message_printf(&reply, "couldn't make the rings: %s", strerror(errno));
+        }
+    }
+    if (fd == -1) {
+        send_message_to_client(server, conn->sockfd, &reply);
+        return;
+    }
 
-                if (!added) {
-                    // the session is full
-                    sprintf(error_msg, "%s - the session is full!", msg->data);
-                    strcpy(new_msg.data, error_msg);
-                } else {
-                    new_msg.type = JN_ACK;
-                    strcpy(new_msg.data, msg->data);
-                }
-            } else {
-                sprintf(error_msg, "%s - you entered an invalid session ID", msg->data);
-                strcpy(new_msg.data, error_msg);
-            }
+    reply.type = SHM_ACK;
+    message_printf(&reply, "%zu", map.ring_size);
+    int len;
+    char* frame = encode_message(&reply, -1, &len);
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov = {.iov_base = frame, .iov_len = len};
+    struct msghdr header = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
 
-        } else if (matching_username->sockfd != sockfd) {
-            // user hasn't logged in yet (at least on this client)
-            sprintf(error_msg, "%s - you need to log in first", msg->data);
-            strcpy(new_msg.data, error_msg);
-        } else if (matching_username->active_session != NULL) {
-            // the user is already in a session
-            sprintf(error_msg, "%s - you're already in a session. Leave the session first.", msg->data);
-            strcpy(new_msg.data, error_msg);
-        }
-    } else {
-        // The user is not authenticated...
-        sprintf(error_msg, "%s - client ID unrecognized.", msg->data);
-        strcpy(new_msg.data, error_msg);
+    // The socket's buffer was just emptied, so the little frame goes in one piece
+    ssize_t sent = sendmsg(conn->sockfd, &header, MSG_DONTWAIT | MSG_NOSIGNAL);
+    free(frame);
+    close(fd);
+    if (sent != len) {
+        shm_region_unmap(&map);
+        schedule_close(server, conn, "couldn't hand over the shared memory");
+        return;
     }
+    conn->shm = malloc(sizeof(struct SHM_MAP));
+    *conn->shm = map;
+    mem_charge(&server->memory, MEM_SHM, shm_region_size(map.ring_size));
+    printf("Connection %d (%s) switched to %zu KB shared memory rings\n", conn->sockfd,
+           conn->client->username, map.ring_size / 1024);
+}
 
-    new_msg.size = strlen(new_msg.data) + 1;
-    send_message_to_client(sockfd, &new_msg);
+int take_input_buffer(struct SERVER* server, struct CONNECTION* conn) {
+    if (conn->in_buf != NULL) {
+        return 0;
+    }
+    if (server->input_pool_size > 0) {
+        conn->in_buf = server->input_pool[--server->input_pool_size];
+    } else if ((conn->in_buf = malloc(server->in_buf_size)) == NULL) {
+        return -1;
+    } else {
+        mem_charge(&server->memory, MEM_INPUT, server->in_buf_size);
+    }
+    server->input_buffers_lent++;
+    return 0;
 }
 
+void release_input_buffer(struct SERVER* server, struct CONNECTION* conn) {
+    if (conn->in_buf == NULL || conn->in_len > 0) {
+        return;
+    }
+    if (server->input_pool_size < INPUT_POOL_MAX) {
+        server->input_pool[server->input_pool_size++] = conn->in_buf;
+    } else {
+        free(conn->in_buf);
+        mem_credit(&server->memory, MEM_INPUT, server->in_buf_size);
+    }
+    conn->in_buf = NULL;
+    server->input_buffers_lent--;
+}
 
-void handle_leave_session(struct message* msg, int sockfd) {
-    struct CLIENT_INFO_NODE* matching_username = get_client_info(msg->source);
+void update_events(struct SERVER* server, struct CONNECTION* conn) {
+    unsigned char events = (conn->input_paused ? 0 : EPOLLIN) | (conn->want_write ? EPOLLOUT : 0);
+    if (events != conn->watched) {
+        struct epoll_event event = {.events = events, .data.fd = conn->sockfd};
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->sockfd, &event);
+        conn->watched = events;
+    }
+}
 
-    // leave the current session
-    if (matching_username) {
-        if (matching_username->sockfd == sockfd && matching_username->active_session != NULL) {
-            struct SESSION_INFO_NODE *matching_session = matching_username->active_session;
-            remove_user_from_session(matching_session, matching_username);
-            matching_username->active_session = NULL;
-        }
+void watch_output(struct SERVER* server, struct CONNECTION* conn, int on) {
+    if (conn->want_write != on) {
+        conn->want_write = on;
+        update_events(server, conn);
     }
-    // No need to send any reply, even if it results in error
 }
 
-// Helps with deleting a user from a session, and clearing the session too if it's now empty
-void remove_user_from_session(struct SESSION_INFO_NODE* session, struct CLIENT_INFO_NODE* client) {
-    int found = 0;
-    for (int i = 0; i < SESSION_CAP; i++) {
-        if (session->clients[i] == client) {
-            session->clients[i] = NULL;
-            found = 1;
-            session->num_connected_client--;
+void pause_input(struct SERVER* server, struct CONNECTION* conn) {
+    if (!conn->input_paused) {
+        conn->input_paused = 1;
+        update_events(server, conn);
+    }
+}
 
-            if (session->num_connected_client == 0) {
-                struct SESSION_INFO_NODE* p = session->prev;
-                struct SESSION_INFO_NODE* n = session->next;
-
-                // No more clients in this session, erase it
-                if (p && n) {
-                    p->next = n;
-                    n->prev = p;
-                } else if (p) {
-                    p->next = NULL;
-                } else {
-                    if (n) n->prev = NULL;
-                    session_info_head = n;
-                }
-            } else {
-                printf("There are still %d users in session\n", session->num_connected_client);
-            }
-            break;
-        }
+void resume_input(struct SERVER* server, struct CONNECTION* conn) {
+    if (conn->input_paused) {
+        conn->input_paused = 0;
+        update_events(server, conn);
     }
-    assert(found);
 }
 
-// Create and join a session
-void handle_new_session(struct message* msg, int sockfd) {
-    struct CLIENT_INFO_NODE* matching_username = get_client_info(msg->source);
-    struct message new_msg;
-    strcpy(new_msg.source, "SERVER");
-    new_msg.type = NS_NAK;
-    char error_msg[MAX_STR_LEN];
+void mark_ready(struct SERVER* server, struct CONNECTION* conn) {
+    if (!conn->ready) {
+        conn->ready = 1;
+        conn->next_ready = server->ready_head;
+        server->ready_head = conn;
+    }
+}
 
-    if (matching_username) {
-        if (matching_username->sockfd == sockfd && matching_username->active_session == NULL) {
-
-            // see if a session already exists with this session ID
-            struct SESSION_INFO_NODE* matching_session = get_session_info(msg->data);
-            if (matching_session == NULL) {
-                // Add a session node to the head of the linked list
-                struct SESSION_INFO_NODE *new_session = malloc(sizeof(struct SESSION_INFO_NODE));
-                if (session_info_head) {
-                    session_info_head->prev = new_session;
-                }
-                new_session->next = session_info_head;
-                new_session->prev = NULL;
-                session_info_head = new_session;
-
-                assert(msg->size <= MAX_SESSION_ID);
-                strncpy(new_session->session_id, msg->data, msg->size);
-                new_session->num_connected_client = 1;
-                for (int client = 0; client < SESSION_CAP; client++) {
-                    if (client == 0) {
-                        new_session->clients[client] = matching_username;
-                        matching_username->active_session = new_session;
-                    } else {
-                        new_session->clients[client] = NULL;
-                    }
-                }
-                new_msg.type = NS_ACK;
-                strcpy(new_msg.data, msg->data);
-            } else {
-                // a session already exists with this name
-                sprintf(error_msg, "%s - a session already exists with this name", msg->data);
-                strcpy(new_msg.data, error_msg);
-            }
-        } else if (matching_username->active_session != NULL) {
-            // User is in another session
-            sprintf(error_msg, "%s - you need to exit the current session first", msg->data);
-            strcpy(new_msg.data, error_msg);
-        } else {
-            // user hasn't logged in yet (at least on this client)
-            sprintf(error_msg, "%s - you need to log in first", msg->data);
-            strcpy(new_msg.data, error_msg);
+void process_ready_connections(struct SERVER* server) {
+    // Connections marked ready during this pass wait for the next one
+    struct CONNECTION* conn = server->ready_head;
+    server->ready_head = NULL;
+    while (conn != NULL) {
+        struct CONNECTION* next = conn->next_ready;
+        conn->ready = 0;
+        conn->next_ready = NULL;
+        if (!conn->closing) {
+            process_input(server, conn);
         }
-
-    } else {
-        // The user is not authenticated...
-        sprintf(error_msg, "%s - client ID unrecognized", msg->data);
-        strcpy(new_msg.data, error_msg);
+        conn = next;
     }
-
-    new_msg.size = strlen(new_msg.data) + 1;
-    send_message_to_client(sockfd, &new_msg);
 }
 
+void throttle_expired(struct TIMER* timer, void* arg) {
+    struct CONNECTION* conn = arg;
+    struct SERVER* server = conn->server;
+    if (!conn->closing) {
+        mark_ready(server, conn);
+    }
+}
 
-void handle_send_message(struct message* msg, int sockfd) {
-    struct CLIENT_INFO_NODE* matching_username = get_client_info(msg->source);
-    if (matching_username && matching_username->sockfd == sockfd) {
-        struct SESSION_INFO_NODE* session = matching_username->active_session;
+int rate_class(unsigned int type) {
+    switch (type) {
+        case MESSAGE:
+            return RATE_MESSAGE;
+        case DM_REQ:
+            return RATE_DM;
+        case JOIN:
+        case LEAVE_SESS:
+        case NEW_SESS:
+        case QUERY:
+        case STATS:
+        case BLOB_OFFER:
+        case LAT_REPORT:
+        case SEARCH:
+            return RATE_REQUEST;
+        default:
+            // logging in and out, and keep-alives, are never held back
+            return -1;
+    }
+}
 
-        if (session) {
-            const char* str = message_to_str(msg);
-            for (int i = 0; i < SESSION_CAP; i++) {
-                if (session->clients[i] != NULL && session->clients[i] != matching_username) {
-                    send_string_to_client(session->clients[i]->sockfd, str);
-                }
-            }
-            free(str);
-        }
+long long bucket_wait(struct TOKEN_BUCKET* bucket, const struct RATE_LIMIT* limit, unsigned long long now) {
+    if (limit->rate <= 0) {
+        return 0;
+    }
+    // a bucket that was never used starts out full
+    double burst = limit->burst > 0 ? limit->burst : 1;
+    bucket->tokens += (double) (now - bucket->updated_ms) * limit->rate / 1000;
+    if (bucket->tokens > burst) {
+        bucket->tokens = burst;
     }
+    bucket->updated_ms = now;
+    if (bucket->tokens >= 1) {
+        return 0;
+    }
+    return (long long) ((1 - bucket->tokens) * 1000 / limit->rate) + 1;
 }
 
+long long rate_limit_wait(struct SERVER* server, struct CONNECTION* conn, struct message* msg) {
+    int class = rate_class(msg->type);
+    struct CLIENT_INFO_NODE* client = conn->client;
+    if (class == -1 || client == NULL) {
+        return 0;
+    }
+    unsigned long long now = now_ms(server);
+    long long wait = bucket_wait(&client->buckets[class], &server->config.rate_limits[class], now);
 
-void handle_query(struct message* msg, int sockfd) {
-    // Sends the list of users, and their active sessions back as reply.
-    // Can only send the first 40 users back
+    // a session message costs the whole session, since it's sent to every member
+    struct SESSION_INFO_NODE* session = NULL;
+    if (msg->type == MESSAGE && client->sockfd == conn->sockfd) {
+        session = message_session(server, client, msg);
+    }
+    if (session != NULL) {
+        long long session_wait = bucket_wait(&session->bucket, &server->config.session_rate_limit, now);
+        wait = session_wait > wait ? session_wait : wait;
+    }
+    if (wait > 0) {
+        return wait;
+    }
 
-    struct message new_msg;
-    strcpy(new_msg.source, "SERVER");
-    new_msg.type = QU_ACK;
-    new_msg.data[0] = '\0';
-    struct CLIENT_INFO_NODE* curr = client_info_head;
-    int curr_length = 0;
-    while (curr != NULL) {
-        if (curr->sockfd != -1) {
-            strcat(new_msg.data, curr->username);
-            strcat(new_msg.data, ": ");
-            curr_length += strlen(curr->username) + 2;
-            if (curr->active_session == NULL) {
-                strcat(new_msg.data, "no session\n");
-                curr_length += 11;
-            } else {
-                strcat(new_msg.data, curr->active_session->session_id);
-                curr_length += (strlen(curr->active_session->session_id) + 1);
-                new_msg.data[curr_length - 1] = '\n';
-                new_msg.data[curr_length] = '\0'; // This allows the next strcat to find the right place to concatenate
-            }
-        }
-        curr = curr->next;
+    if (server->config.rate_limits[class].rate > 0) {
+        client->buckets[class].tokens -= 1;
+    }
+    if (session != NULL && server->config.session_rate_limit.rate > 0) {
+        session->bucket.tokens -= 1;
+    }
+    return 0;
+}
 
-        if (curr_length > MAX_DATA - MAX_NAME - MAX_SESSION_ID - 20) {
-            // It won't fit, so don't put any more data in
-            strcat(new_msg.data, "...\n");
-            curr_length += 4;
+int send_rate_limit_nak(struct SERVER* server, struct message* msg, int sockfd) {
+    struct message nak;
+    message_init(&nak, 0);
+    strcpy(nak.source, "SERVER");
+    switch (msg->type) {
+        case JOIN:
+            nak.type = JN_NAK;
             break;
-        }
+        case NEW_SESS:
+            nak.type = NS_NAK;
+            break;
+        case DM_REQ:
+            nak.type = DM_NAK;
+            break;
+        default:
+            return -1;
     }
-    curr_length++;
-    new_msg.data[curr_length - 1] = '\0';
-    new_msg.size = curr_length;
-    send_message_to_client(sockfd, &new_msg);
+    message_printf(&nak, "%.*s - too many requests, try again later", MAX_SESSION_ID, msg->data);
+    send_message_to_client(server, sockfd, &nak);
+    message_release(&nak);
+    return 0;
 }
 
-
-// Check the user information and put it into the login file for persistent storage.
-// Assume that the username and password are all valid (they're checked by the client).
-// The user isn't automatically logged-in by this - they have to login separately.
-void handle_register_user(struct message* msg, int sockfd) {
-    struct message new_msg;
-    strcpy(new_msg.source, "SERVER");
-    new_msg.type = REG_NAK;
-
-    struct CLIENT_INFO_NODE* existing_username = get_client_info(msg->source);
-    if (existing_username != NULL) {
-        strcpy(new_msg.data, "The username has already been registered.");
+void login_or_resume(struct SERVER* server, struct CONNECTION* conn, struct message* msg) {
+    int result = msg->type == LOGIN ? handle_login(server, msg, conn->sockfd) : handle_resume(server, msg, conn->sockfd);
+    if (result == -1) {
+        schedule_close(server, conn, msg->type == LOGIN ? "login failed" : "resume failed");
     } else {
-        FILE* fp = fopen(LOGIN_FILE, "a");
-        if (fp == NULL) {
-            strcpy(new_msg.data, "Server cannot write to the login file.");
-        } else {
-            fprintf(fp, "%s %s\n", msg->source, msg->data);
-            strcpy(new_msg.data, "");
-            new_msg.type = REG_ACK;
-            fclose(fp);
-            printf("Registration successful for user %s\n", msg->source);
+        conn->client = get_client_info(server, msg->source);
+        conn->state = CONN_LOGGED_IN;
+        timer_add(&server->timers, &conn->timer, SECONDS_TO_TICKS(server->config.idle_timeout));
+    }
+}
 
-            // Refresh the login information
-            client_info_head = read_login();
+void dispatch_message(struct SERVER* server, struct CONNECTION* conn, struct message* msg) {
+    int i = conn->sockfd;
+    if (conn->peer != -1) {
+        handle_node_message(server, conn, msg);
+        return;
+    }
+    if (conn->replica_pending) {
+        handle_replica_hello(server, conn, msg);
+        return;
+    }
+    if (conn->replica) {
+        handle_replica_message(server, conn, msg);
+        return;
+    }
+    switch (msg->type) {
+        case REGISTER:
+            // Register doesn't involve logging in, so the connection is closed rightaway.
+            // User has to establish a separate connection to log in.
+            handle_register_user(server, msg, i);
+            schedule_close(server, conn, NULL);
+            break;
+        case LOGIN:
+            if (server->monitor.mode == MODE_OVERLOADED) {
+                // sessions that already exist come first, the client is told when to come back
+                struct message nak;
+                message_init(&nak, LO_NAK);
+                strcpy(nak.source, "SERVER");
+                message_printf(&nak, "the server is overloaded");
+                nak.retry_after = server->config.retry_after;
+                send_message_to_client(server, i, &nak);
+                server->monitor.rejected_logins++;
+                schedule_close(server, conn, "server overloaded");
+                break;
+            }
+            if (ask_home(server, conn, msg) == -1) {
+                login_or_resume(server, conn, msg);
+            }
+            break;
+        case RESUME:
+            if (ask_home(server, conn, msg) == -1) {
+                login_or_resume(server, conn, msg);
+            }
+            break;
+        case EXIT:
+            handle_exit(server, msg, i);
+            schedule_close(server, conn, NULL);
+            break;
+        case JOIN:
+            handle_join_session(server, msg, i);
+            break;
+        case LEAVE_SESS:
+            handle_leave_session(server, msg, i);
+            break;
+        case NEW_SESS:
+            handle_new_session(server, msg, i);
+            break;
+        case MESSAGE:
+            handle_send_message(server, msg, i);
+            break;
+        case QUERY:
+            if (server->monitor.mode != MODE_NORMAL) {
+                // listing everyone is the expensive part of a QUERY, and nobody is waiting on it
+                if (conn->query_deferred_ms == 0) {
+                    conn->query_deferred_ms = now_ms(server);
+                    server->num_deferred_queries++;
+                    server->monitor.deferred_queries++;
+                }
+                break;
+            }
+            handle_query(server, msg, i);
+            break;
+        case DM_REQ:
+            handle_dm(server, msg, i);
+            break;
+        case STATS:
+            handle_stats(server, msg, i);
+            break;
+        case LAT_REPORT:
+            handle_latency_report(server, msg, i);
+            break;
+        case SEARCH:
+            handle_search(server, msg, i);
+            break;
+        case BLOB_OFFER:
+            handle_blob_offer(server, conn, msg);
+            break;
+        case BLOB_END:
+            handle_blob_end(server, conn, msg);
+            break;
+        case SHM_REQ:
+            handle_shm_request(server, conn, msg);
+            break;
+        case PING: {
+            struct message pong;
+            message_init(&pong, PONG);
+            strcpy(pong.source, "SERVER");
+            send_message_to_client(server, i, &pong);
+            break;
         }
+        case PONG:
+            // nothing to do, receiving it already reset the idle timer
+            break;
+        default:
+            printf("No packet type has been matched\n");
+            schedule_close(server, conn, "sent an unknown message type");
+            break;
     }
-    new_msg.size = strlen(new_msg.data) + 1;
-    send_message_to_client(sockfd, &new_msg);
 }
 
 
-// Handle direct messaging from one user to another. The message should be checke
-// by the client, so we can assume error free.
-void handle_dm(struct message* msg, int sockfd) {
-    struct message new_msg;
-    strcpy(new_msg.source, "SERVER");
-    new_msg.type = DM_NAK;
 
-    struct CLIENT_INFO_NODE* source_username = get_client_info(msg->source);
-    if (source_username != NULL && source_username->sockfd == sockfd) {
-        
-        // Try to extract destination information
-        char receiver[MAX_NAME];
-        char message[MAX_DATA];
+struct CLIENT_INFO_NODE* read_login(struct SERVER* server) {
+    // Reads the login information from a text file, login.txt unless login_file says otherwise
+    FILE* fp = fopen(server->config.login_file, "r");
+    if (fp == NULL) {
+        printf("Error: Can't read the login file\n");
+        exit(1);
+    }
+
+    char *line = NULL;
+    size_t len = 0;
+    char delim[] = " \t\r\n\v\f";
+
+    struct CLIENT_INFO_NODE* head = NULL;
+    struct CLIENT_INFO_NODE* curr;
+
+    while (getline(&line, &len, fp) != -1) {
+        char* username = strtok(line, delim);
+        char* password = strtok(NULL, delim);
+        if (username == NULL || password == NULL) {
+            continue;
+        }
+
+        if (!head) {
+            head = new_client_info(server, username, password);
+            curr = head;
+        } else {
+            curr->next = new_client_info(server, username, password);
+            curr = curr -> next;
+        }
+    }
+    free(line);
+    fclose(fp);
+    return head;
+}
+
+struct CLIENT_INFO_NODE* new_client_info(struct SERVER* server, const char* username, const char* password) {
+    struct CLIENT_INFO_NODE* client = malloc(sizeof(struct CLIENT_INFO_NODE));
+    mem_charge(&server->memory, MEM_CLIENTS, sizeof(struct CLIENT_INFO_NODE));
+    strcpy(client->username, username);
+    strcpy(client->password, password);
+    client->server = server;
+    client->next = NULL;
+    client->num_sessions = 0;
+    client->sockfd = -1;
+    client->resume_token[0] = '\0';
+    timer_init(&client->resume_timer, resume_expired, client);
+    memset(client->buckets, 0, sizeof(client->buckets));
+    client->mailbox = NULL;
+    client->node = -1;
+    client->claim_sockfd = -1;
+    client->claim_seq = 0;
+    index_client(server, client);
+    return client;
+}
+
+// FNV-1a, of usernames and session IDs
+static size_t hash_name(const char* name) {
+    size_t hash = 14695981039346656037ULL;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char) *name) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+void index_client(struct SERVER* server, struct CLIENT_INFO_NODE* client) {
+    if (server->num_clients >= server->client_index_size) {
+        // keep the chains at about one client each
+        size_t new_size = server->client_index_size ? server->client_index_size * 2 : 64;
+        struct CLIENT_INFO_NODE** new_index = calloc(new_size, sizeof(struct CLIENT_INFO_NODE*));
+        for (size_t i = 0; i < server->client_index_size; i++) {
+            while (server->client_index[i] != NULL) {
+                struct CLIENT_INFO_NODE* moved = server->client_index[i];
+                server->client_index[i] = moved->index_next;
+                size_t bucket = hash_name(moved->username) & (new_size - 1);
+                moved->index_next = new_index[bucket];
+                new_index[bucket] = moved;
+            }
+        }
+        free(server->client_index);
+        mem_credit(&server->memory, MEM_CLIENTS, server->client_index_size * sizeof(struct CLIENT_INFO_NODE*));
+        mem_charge(&server->memory, MEM_CLIENTS, new_size * sizeof(struct CLIENT_INFO_NODE*));
+        server->client_index = new_index;
+        server->client_index_size = new_size;
+    }
+    size_t bucket = hash_name(client->username) & (server->client_index_size - 1);
+    client->index_next = server->client_index[bucket];
+    server->client_index[bucket] = client;
+    server->num_clients++;
+}
+
+struct CLIENT_INFO_NODE* get_client_info (struct SERVER* server, const char* username) {
+    if (server->client_index_size == 0) {
+        return NULL;
+    }
+    struct CLIENT_INFO_NODE* curr = server->client_index[hash_name(username) & (server->client_index_size - 1)];
+    while (curr != NULL) {
+        if (strcmp(username, curr->username) == 0) {
+            return curr;
+        }
+        curr = curr -> index_next;
+    }
+    return NULL;
+}
+
+
+
+// Sessions come and go, unlike users, so the index shrinks too
+static void resize_session_index(struct SERVER* server, size_t new_size) {
+    struct SESSION_INFO_NODE** new_index = calloc(new_size, sizeof(struct SESSION_INFO_NODE*));
+    for (size_t i = 0; i < server->session_index_size; i++) {
+        while (server->session_index[i] != NULL) {
+            struct SESSION_INFO_NODE* moved = server->session_index[i];
+            server->session_index[i] = moved->index_next;
+            size_t bucket = hash_name(moved->session_id) & (new_size - 1);
+            moved->index_next = new_index[bucket];
+            new_index[bucket] = moved;
+        }
+    }
+    free(server->session_index);
+    mem_credit(&server->memory, MEM_SESSIONS, server->session_index_size * sizeof(struct SESSION_INFO_NODE*));
+    mem_charge(&server->memory, MEM_SESSIONS, new_size * sizeof(struct SESSION_INFO_NODE*));
+    server->session_index = new_index;
+    server->session_index_size = new_size;
+}
+
+void index_session(struct SERVER* server, struct SESSION_INFO_NODE* session) {
+    if (server->num_sessions >= server->session_index_size) {
+        resize_session_index(server, server->session_index_size ? server->session_index_size * 2 : 64);
+    }
+    size_t bucket = hash_name(session->session_id) & (server->session_index_size - 1);
+    session->index_next = server->session_index[bucket];
+    server->session_index[bucket] = session;
+    server->num_sessions++;
+}
+
+void unindex_session(struct SERVER* server, struct SESSION_INFO_NODE* session) {
+    struct SESSION_INFO_NODE** link = &server->session_index[hash_name(session->session_id)
+                                                             & (server->session_index_size - 1)];
+    while (*link != session) {
+        link = &(*link)->index_next;
+    }
+    *link = session->index_next;
+    server->num_sessions--;
+    if (server->session_index_size > 64 && server->num_sessions < server->session_index_size / 4) {
+        resize_session_index(server, server->session_index_size / 2);
+    }
+}
+
+struct SESSION_INFO_NODE* get_session_info (struct SERVER* server, const char* session_id) {
+    if (server->session_index_size == 0) {
+        return NULL;
+    }
+    struct SESSION_INFO_NODE* curr = server->session_index[hash_name(session_id) & (server->session_index_size - 1)];
+    while (curr != NULL) {
+        if (strcmp(session_id, curr->session_id) == 0) {
+            return curr;
+        }
+        curr = curr -> index_next;
+    }
+    return NULL;
+}
+
+
+void send_message_to_client(struct SERVER* server, int sockfd, struct message* msg) {
+    // Send TCP message to client, compressed if it negotiated that
+    int len;
+    char* buf = encode_message(msg, client_compress_threshold(server, sockfd), &len);
+    // not the payload, which can be a resume token or someone's private message
+    printf("Sending message: %d %d %s\n", msg->type, msg->size, msg->source);
+
+    struct OUT_BUFFER* out = out_buffer_new(server, buf, len);
+    out->trace = msg->trace != 0 ? msg->trace : server->current_trace;
+    queue_to_client(server, sockfd, out, message_lane(msg->type));
+    out_buffer_release(server, out);
+}
+
+enum OUT_LANE message_lane(unsigned int type) {
+    switch (type) {
+        case MESSAGE:
+            return LANE_BULK;
+        case BLOB_CHUNK:
+        case BLOB_END:
+            return LANE_BLOB;
+        default:
+            return LANE_CONTROL;
+    }
+}
+
+int client_compress_threshold(struct SERVER* server, int sockfd) {
+    if (sockfd >= 0 && sockfd < server->max_connections && server->connections[sockfd] != NULL && server->connections[sockfd]->compression) {
+        return server->config.compress_threshold;
+    }
+    return -1;
+}
+
+void send_string_to_client(struct SERVER* server, int sockfd, const char* msg_str) {
+    send_buffer_to_client(server, sockfd, msg_str, strlen(msg_str));
+}
+
+void send_buffer_to_client(struct SERVER* server, int sockfd, const char* msg_str, size_t len) {
+    char* copy = malloc(len);
+    memcpy(copy, msg_str, len);
+    struct OUT_BUFFER* out = out_buffer_new(server, copy, len);
+    queue_to_client(server, sockfd, out, LANE_CONTROL);
+    out_buffer_release(server, out);
+}
+
+struct OUT_BUFFER* out_buffer_new(struct SERVER* server, char* data, int len) {
+    struct OUT_BUFFER* buf = malloc(sizeof(struct OUT_BUFFER));
+    mem_charge(&server->memory, MEM_OUTPUT, sizeof(struct OUT_BUFFER) + len);
+    buf->refcount = 1;
+    buf->len = len;
+    buf->data = data;
+    buf->trace = 0;
+    return buf;
+}
+
+void out_buffer_release(struct SERVER* server, struct OUT_BUFFER* buf) {
+    if (buf != NULL && --buf->refcount == 0) {
+        mem_credit(&server->memory, MEM_OUTPUT, sizeof(struct OUT_BUFFER) + buf->len);
+        free(buf->data);
+        free(buf);
+    }
+}
+
+void queue_to_client(struct SERVER* server, int sockfd, struct OUT_BUFFER* buf, enum OUT_LANE lane) {
+    if (sockfd < 0 || sockfd >= server->max_connections || server->connections[sockfd] == NULL || server->connections[sockfd]->closing) {
+        return;
+    }
+    struct CONNECTION* conn = server->connections[sockfd];
+    if (conn->peer != -1 || conn->replica) {
+        // a link between servers keeps everything in order, and can't drop any of it
+        lane = LANE_CONTROL;
+    }
+    struct OUT_QUEUE* queue = &conn->lanes[lane];
+
+    struct OUT_CHUNK* chunk = malloc(sizeof(struct OUT_CHUNK));
+    mem_charge(&server->memory, MEM_OUTPUT, sizeof(struct OUT_CHUNK));
+    chunk->buf = buf;
+    chunk->next = NULL;
+    buf->refcount++;
+    if (queue->tail) {
+        queue->tail->next = chunk;
+    } else {
+        queue->head = chunk;
+    }
+    queue->tail = chunk;
+    queue->bytes += buf->len;
+    conn->out_bytes += buf->len;
+    PROBE4(enqueue, buf->trace, sockfd, lane, buf->len);
+
+    if (lane == LANE_BULK) {
+        drop_bulk_backlog(server, conn);
+    }
+    mark_dirty(server, conn);
+}
 
-        // get receiver ID
-        char* delim = strtok(msg->data, " ");
-        if (delim != NULL) {
-            strncpy(receiver, delim, MAX_NAME);
-            assert(receiver[MAX_NAME-1] == '\0');
+void mark_dirty(struct SERVER* server, struct CONNECTION* conn) {
+    if (!conn->dirty) {
+        conn->dirty = 1;
+        conn->next_dirty = server->dirty_head;
+        server->dirty_head = conn;
+    }
+}
+
+void remove_out_chunk(struct SERVER* server, struct CONNECTION* conn, enum OUT_LANE lane, struct OUT_CHUNK** link) {
+    struct OUT_QUEUE* queue = &conn->lanes[lane];
+    struct OUT_CHUNK* chunk = *link;
+    int unwritten = chunk->buf->len - (chunk == queue->head ? queue->offset : 0);
+    queue->bytes -= unwritten;
+    conn->out_bytes -= unwritten;
+    if (chunk == queue->head) {
+        queue->offset = 0;
+    }
+
+    *link = chunk->next;
+    if (queue->tail == chunk) {
+        // the tail is only ever removed as the last chunk left
+        queue->tail = NULL;
+    }
+    out_buffer_release(server, chunk->buf);
+    free(chunk);
+    mem_credit(&server->memory, MEM_OUTPUT, sizeof(struct OUT_CHUNK));
+}
+
+void drop_bulk_backlog(struct SERVER* server, struct CONNECTION* conn) {
+    struct OUT_QUEUE* queue = &conn->lanes[LANE_BULK];
+    size_t limit = (size_t) server->config.bulk_queue_limit * 1024;
+    if (limit == 0) {
+        return;
+    }
+
+    // A frame that's partly written has to be finished, or the stream would be corrupt.
+    // The newest frame is always kept.
+    struct OUT_CHUNK** link = (queue->offset > 0) ? &queue->head->next : &queue->head;
+    while (queue->bytes > limit && *link != NULL && *link != queue->tail) {
+        remove_out_chunk(server, conn, LANE_BULK, link);
+        conn->dropped_frames++;
+        server->dropped_bulk_frames++;
+    }
+}
 
-            delim = strtok(NULL, "\n");
-            if (delim != NULL) {
-                strncpy(message, delim, MAX_DATA);
-                assert(receiver[MAX_DATA-1] == '\0');
+void flush_connection(struct SERVER* server, struct CONNECTION* conn) {
+    if (conn->reserved_by != NULL) {
+        // a file chunk is being spliced in, the rest waits until it's done
+        return;
+    }
+
+    int progress = 0;
+    while (conn->out_bytes > 0) {
+        // Lanes are written in priority order, except that a frame that's partly written
+        // has to be finished before anything else can be put on the stream
+        struct iovec iov[FLUSH_IOV_MAX];
+        enum OUT_LANE lane_of[FLUSH_IOV_MAX];
+        int count = 0;
+        int partial = -1;
+        for (int lane = 0; lane < NUM_LANES; lane++) {
+            if (conn->lanes[lane].offset > 0) {
+                partial = lane;
+                struct OUT_CHUNK* head = conn->lanes[lane].head;
+                iov[count].iov_base = head->buf->data + conn->lanes[lane].offset;
+                iov[count].iov_len = head->buf->len - conn->lanes[lane].offset;
+                lane_of[count++] = lane;
+            }
+        }
+        for (int lane = 0; lane < NUM_LANES; lane++) {
+            struct OUT_CHUNK* chunk = conn->lanes[lane].head;
+            if (lane == partial) {
+                chunk = chunk->next;
+            }
+            for (; chunk != NULL && count < FLUSH_IOV_MAX; chunk = chunk->next) {
+                iov[count].iov_base = chunk->buf->data;
+                iov[count].iov_len = chunk->buf->len;
+                lane_of[count++] = lane;
             }
         }
 
-        if (delim == NULL) {
-            strcpy(new_msg.data, "Message formatting error");
+        ssize_t n;
+        if (conn->shm != NULL) {
+            n = shm_ring_writev(conn->shm, &conn->shm->region->to_client, iov, count);
+            if (n == 0) {
+                n = -1;
+                errno = EAGAIN;
+            } else if (n == -1) {
+                errno = EPROTO;
+            }
         } else {
-            // Everything looks good so far, try to find the stated receiver
-            struct CLIENT_INFO_NODE* recv_client = get_client_info(receiver);
-            if (recv_client == NULL) {
-                strcpy(new_msg.data, "The receiving client does not exist");
-            } else if (recv_client->sockfd == -1) {
-                strcpy(new_msg.data, "The receiving client is not online");
+            n = writev(conn->sockfd, iov, count);
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n == -1) {
+            printf("Error sending message: %d\n", errno);
+            schedule_close(server, conn, "send failed");
+            return;
+        }
+        progress = 1;
+        PROBE3(flush, conn->sockfd, n, conn->out_bytes - n);
+
+        // drop whatever was written completely, in the order it was written
+        int written_all = 1;
+        for (int i = 0; i < count; i++) {
+            struct OUT_QUEUE* queue = &conn->lanes[lane_of[i]];
+            if ((size_t) n >= iov[i].iov_len) {
+                n -= iov[i].iov_len;
+                PROBE2(delivered, queue->head->buf->trace, conn->sockfd);
+                remove_out_chunk(server, conn, lane_of[i], &queue->head);
             } else {
-                // We can send the message to the receiver
-                strcpy(new_msg.data, message);
-                new_msg.size = strlen(new_msg.data) + 1;
-                new_msg.type = DM_MSG;
-                strncpy(new_msg.source, msg->source, MAX_NAME);
-                send_message_to_client(recv_client->sockfd, &new_msg);
-                return;
+                queue->offset += n;
+                queue->bytes -= n;
+                conn->out_bytes -= n;
+                written_all = 0;
+                break;
+            }
+        }
+        if (!written_all || count < FLUSH_IOV_MAX) {
+            // a short write, the socket buffer is full (or everything went)
+            break;
+        }
+    }
+
+    if (conn->shm != NULL && progress) {
+        ring_doorbell(conn);
+    }
+    if (conn->out_bytes == 0) {
+        watch_output(server, conn, 0);
+        timer_cancel(&server->timers, &conn->stall_timer);
+    } else {
+        if (conn->shm == NULL) {
+            watch_output(server, conn, 1);
+        } else {
+            // the client sends a doorbell once it has made room, unless it already has
+            shm_ring_arm(&conn->shm->region->to_client.writer_waiting);
+            ssize_t used = shm_ring_used(conn->shm, &conn->shm->region->to_client);
+            if (used != -1 && (size_t) used < conn->shm->ring_size) {
+                shm_ring_disarm(&conn->shm->region->to_client.writer_waiting);
+                mark_dirty(server, conn);
+            }
+        }
+        if (progress || !timer_pending(&conn->stall_timer)) {
+            timer_add(&server->timers, &conn->stall_timer, SECONDS_TO_TICKS(server->config.stall_timeout));
+        }
+    }
+}
+
+void flush_pending_output(struct SERVER* server) {
+    while (server->dirty_head != NULL) {
+        struct CONNECTION* conn = server->dirty_head;
+        server->dirty_head = conn->next_dirty;
+        conn->dirty = 0;
+        conn->next_dirty = NULL;
+        if (!conn->closing) {
+            flush_connection(server, conn);
+        }
+    }
+}
+
+// The client hasn't taken any of its output for stall_timeout
+void output_stalled(struct TIMER* timer, void* arg) {
+    struct CONNECTION* conn = arg;
+    struct SERVER* server = conn->server;
+    schedule_close(server, conn, "output stalled");
+}
+
+
+void enforce_memory_budget(struct SERVER* server) {
+    // Mailboxes can wait on disk without anybody noticing, so they go first
+    while (server->config.mailbox_dir != NULL && server->memory.budget != 0 && server->memory.total > server->memory.budget
+           && spill_biggest_mailbox(server) > 0) {
+    }
+
+    // Queued output is the only thing that grows without a limit of its own, so the
+    // clients that are furthest behind go first. They can RESUME later and catch up
+    // from the session history.
+    size_t projected = server->memory.total;
+    while (server->memory.budget != 0 && projected > server->memory.budget) {
+        struct CONNECTION* biggest = NULL;
+        for (int i = 0; i <= server->highest_fd; i++) {
+            struct CONNECTION* conn = server->connections[i];
+            if (conn != NULL && !conn->closing && conn->out_bytes > 0 && conn->peer == -1 && !conn->replica
+                && (biggest == NULL || conn->out_bytes > biggest->out_bytes)) {
+                biggest = conn;
+            }
+        }
+        if (biggest == NULL) {
+            break;
+        }
+        projected -= biggest->out_bytes < projected ? biggest->out_bytes : projected;
+        server->memory.shed_connections++;
+        schedule_close(server, biggest, "using too much memory");
+    }
+
+    // Then the history, which only matters to clients that might RESUME. Only once those
+    // connections are gone, since until then their output (which shares buffers with the
+    // history) still counts, and every trim would look like it wasn't enough.
+    close_pending_connections(server);
+    while (server->memory.budget != 0 && server->memory.total > server->memory.budget) {
+        size_t before = server->memory.total;
+        if (trim_history(server) == 0 || server->memory.total >= before) {
+            // what's left is still queued for someone, or there's nothing left to trim
+            break;
+        }
+    }
+}
+
+int trim_history(struct SERVER* server) {
+    struct SESSION_INFO_NODE* biggest = NULL;
+    // a session's last entry stays, it's what a RESUME starts from
+    int biggest_count = 1;
+    for (struct SESSION_INFO_NODE* session = server->session_info_head; session != NULL; session = session->next) {
+        int count = 0;
+        for (int i = 0; i < session->history_size; i++) {
+            count += (session->history[i].plain != NULL);
+        }
+        if (count > biggest_count) {
+            biggest = session;
+            biggest_count = count;
+        }
+    }
+    if (biggest == NULL) {
+        return 0;
+    }
+
+    // the newest half stays, the rest goes oldest first for the search index. Entries older
+    // than the ring (left behind when last_seq jumped) go before the others.
+    unsigned long long keep_after = biggest->last_seq - biggest_count / 2;
+    unsigned long long first = biggest->last_seq >= (unsigned long long) biggest->history_size
+                               ? biggest->last_seq - biggest->history_size + 1 : 1;
+    int trimmed = 0;
+    for (int i = 0; i < biggest->history_size; i++) {
+        struct HISTORY_ENTRY* entry = &biggest->history[i];
+        if (entry->plain != NULL && entry->seq < first && trimmed < biggest_count - 1) {
+            forget_history_entry(server, biggest, entry);
+            trimmed++;
+        }
+    }
+    for (unsigned long long seq = first; seq <= keep_after; seq++) {
+        struct HISTORY_ENTRY* entry = &biggest->history[seq % biggest->history_size];
+        if (entry->plain != NULL && entry->seq == seq) {
+            forget_history_entry(server, biggest, entry);
+            trimmed++;
+        }
+    }
+    server->memory.trimmed_history += trimmed;
+    return trimmed;
+}
+
+void update_load_mode(struct SERVER* server, unsigned long long lag_us) {
+    server->monitor.lag_ewma_us += ((double) lag_us - server->monitor.lag_ewma_us) / 8;
+    if (lag_us > server->monitor.max_lag_us) {
+        server->monitor.max_lag_us = lag_us;
+    }
+
+    double degraded = server->config.degraded_lag_ms * 1000.0;
+    double overloaded = server->config.overloaded_lag_ms * 1000.0;
+    enum LOAD_MODE mode = server->monitor.mode;
+    if (server->monitor.lag_ewma_us > overloaded) {
+        mode = MODE_OVERLOADED;
+    } else if (server->monitor.lag_ewma_us > degraded) {
+        mode = (mode == MODE_OVERLOADED && server->monitor.lag_ewma_us > overloaded / 2) ? MODE_OVERLOADED : MODE_DEGRADED;
+    } else if (mode == MODE_OVERLOADED && server->monitor.lag_ewma_us < overloaded / 2) {
+        mode = server->monitor.lag_ewma_us > degraded / 2 ? MODE_DEGRADED : MODE_NORMAL;
+    } else if (mode == MODE_DEGRADED && server->monitor.lag_ewma_us < degraded / 2) {
+        mode = MODE_NORMAL;
+    }
+
+    if (mode != server->monitor.mode) {
+        printf("Loop lag %.1f ms, switching from %s to %s mode\n", server->monitor.lag_ewma_us / 1000,
+               load_mode_name(server->monitor.mode), load_mode_name(mode));
+        server->monitor.mode = mode;
+        server->monitor.mode_changes++;
+    }
+}
+
+const char* load_mode_name(enum LOAD_MODE mode) {
+    switch (mode) {
+        case MODE_NORMAL:
+            return "normal";
+        case MODE_DEGRADED:
+            return "degraded";
+        default:
+            return "overloaded";
+    }
+}
+
+void answer_deferred_queries(struct SERVER* server) {
+    unsigned long long now = now_ms(server);
+    for (int i = 0; i <= server->highest_fd && server->num_deferred_queries > 0; i++) {
+        struct CONNECTION* conn = server->connections[i];
+        if (conn == NULL || conn->query_deferred_ms == 0 || conn->closing) {
+            continue;
+        }
+        if (server->monitor.mode == MODE_NORMAL || now - conn->query_deferred_ms >= QUERY_DEFER_MAX_MS) {
+            conn->query_deferred_ms = 0;
+            server->num_deferred_queries--;
+            handle_query(server, NULL, conn->sockfd);
+        }
+    }
+}
+
+// Where the part of a report starting at "from" ends: at a line break, if one fits in a frame
+static size_t report_cut(const char* text, size_t len, size_t from) {
+    size_t room = max_data - 1;
+    if (len - from <= room) {
+        return len;
+    }
+    // the last line break that fits, or as much as fits if the line doesn't
+    for (size_t cut = from + room; cut > from; cut--) {
+        if (text[cut] == '\n') {
+            return cut;
+        }
+    }
+    return from + room;
+}
+
+void send_stats_report(struct SERVER* server, int sockfd, const char* text, size_t len) {
+    int frames = 0;
+    for (size_t from = 0; from < len || frames == 0; frames++) {
+        size_t cut = report_cut(text, len, from);
+        from = cut < len && text[cut] == '\n' ? cut + 1 : cut;
+    }
+    size_t from = 0;
+    for (int frame = 0; frame < frames; frame++) {
+        size_t cut = report_cut(text, len, from);
+        struct message reply;
+        message_init(&reply, ST_ACK);
+        strcpy(reply.source, "SERVER");
+        reply.seq = frames - 1 - frame;
+        message_printf(&reply, "%.*s", (int) (cut - from), text + from);
+        send_message_to_client(server, sockfd, &reply);
+        message_release(&reply);
+        from = cut < len && text[cut] == '\n' ? cut + 1 : cut;
+    }
+}
+
+void handle_stats(struct SERVER* server, struct message* msg, int sockfd) {
+    struct CLIENT_INFO_NODE* client = get_client_info(server, msg->source);
+    if (client == NULL || client->sockfd != sockfd) {
+        return;
+    }
+
+    // message_appendf would stop at max_data, which the report outgrows with most options on
+    char* text = NULL;
+    size_t len = 0;
+    FILE* report = open_memstream(&text, &len);
+    if (report == NULL) {
+        return;
+    }
+
+    fprintf(report, "mode: %s, loop lag %.2f ms (max %.2f ms), %llu mode changes\n",
+            load_mode_name(server->monitor.mode), server->monitor.lag_ewma_us / 1000, server->monitor.max_lag_us / 1000.0,
+            server->monitor.mode_changes);
+    fprintf(report, "deferred %llu queries, skipped %llu pings, rejected %llu logins\n",
+            server->monitor.deferred_queries, server->monitor.skipped_pings, server->monitor.rejected_logins);
+    fprintf(report, "memory: %zu of %zu bytes (peak %zu), rss %zu bytes\n",
+            server->memory.total, server->memory.budget, server->memory.peak, mem_rss());
+    for (int i = 0; i < NUM_MEM_SUBSYSTEMS; i++) {
+        fprintf(report, "  %s: %zu\n", mem_subsystem_name(i), server->memory.used[i]);
+    }
+
+    int num_connections = 0;
+    struct CONNECTION* biggest = NULL;
+    for (int i = 0; i <= server->highest_fd; i++) {
+        if (server->connections[i] != NULL) {
+            num_connections++;
+            if (biggest == NULL || server->connections[i]->out_bytes > biggest->out_bytes) {
+                biggest = server->connections[i];
             }
         }
+    }
+    fprintf(report, "connections: %d, largest output queue %zu bytes (%s)\n",
+            num_connections, biggest ? biggest->out_bytes : 0,
+            biggest && biggest->client ? biggest->client->username : "-");
+    fprintf(report, "input buffers: %d lent out, %d pooled, %d bytes each\n",
+            server->input_buffers_lent, server->input_pool_size, server->in_buf_size);
+    fprintf(report, "dropped %llu bulk frames for slow clients\n", server->dropped_bulk_frames);
+    if (server->config.validate_text) {
+        fprintf(report, "turned away %llu messages that weren't valid UTF-8 (checked with %s)\n",
+                server->invalid_text, scan_isa_name(scan_active_isa()));
+    }
+    if (server->config.search_memory > 0) {
+        int num_sessions = 0;
+        int num_words = 0;
+        size_t largest = 0;
+        for (struct SESSION_INFO_NODE* session = server->session_info_head; session != NULL; session = session->next) {
+            num_sessions++;
+            num_words += session->search.num_lists;
+            largest = session->search.bytes > largest ? session->search.bytes : largest;
+        }
+        fprintf(report, "search: %d words indexed in %d sessions, largest index %zu bytes; "
+                "%llu searches, %llu matches sent\n", num_words, num_sessions, largest,
+                server->searches, server->search_hits);
+    }
+    int num_blobs = 0;
+    for (struct BLOB_TRANSFER* transfer = server->blob_transfers; transfer != NULL; transfer = transfer->next) {
+        num_blobs++;
+    }
+    fprintf(report, "file transfers: %d going, %llu bytes spliced, %llu bytes copied\n",
+            num_blobs, server->blob_bytes_spliced, server->blob_bytes_copied);
+    int num_mailboxes = 0;
+    int num_mailed = 0;
+    int num_spilled = 0;
+    for (struct CLIENT_INFO_NODE* client = server->client_info_head; client != NULL; client = client->next) {
+        if (client->mailbox != NULL) {
+            num_mailboxes++;
+            num_mailed += client->mailbox->count;
+            num_spilled += client->mailbox->spilled ? client->mailbox->count : 0;
+        }
+    }
+    fprintf(report, "mailboxes: %d holding %d messages, %d of them on disk; %llu refused\n",
+            num_mailboxes, num_mailed, num_spilled, server->mailbox_refused);
+    if (server->num_nodes > 0) {
+        int links_up = 0;
+        unsigned long long frames_sent = 0;
+        unsigned long long frames_received = 0;
+        for (int node = 0; node < server->num_nodes; node++) {
+            links_up += (server->nodes[node].link != NULL);
+            frames_sent += server->nodes[node].frames_sent;
+            frames_received += server->nodes[node].frames_received;
+        }
+        fprintf(report, "cluster: node %d of %d, %d links up, %llu frames sent, %llu received, "
+                "%llu messages for unreachable sessions\n", server->local_node, server->num_nodes, links_up,
+                frames_sent, frames_received, server->cluster_dropped);
+    }
+    if (server->replication.link != NULL) {
+        fprintf(report, "replica: standby following, %llu records sent, %llu not yet applied, "
+                "%zu bytes queued, last heartbeat answered in %llu ms; %llu dropped for falling behind\n",
+                server->replication.records_sent, server->replication.records_sent - server->replication.records_acked,
+                server->replication.link->out_bytes, server->replication.lag_ms, server->replication.standbys_dropped);
+    } else if (server->config.replica_port != NULL) {
+        fprintf(report, "replica: no standby; %llu dropped for falling behind\n",
+                server->replication.standbys_dropped);
+    }
+    if (server->config.capture != NULL) {
+        fprintf(report, "capture: %s, %llu records, %llu bytes%s\n", server->config.capture, server->capture.records,
+                server->capture.bytes, server->capture.fd == -1 ? ", stopped after a write error" : "");
+    }
+    if (server->archiver.dir != NULL) {
+        struct ARCHIVE_STATS archive;
+        archiver_stats(&server->archiver, &archive);
+        fprintf(report, "archive: %s, %llu messages in %llu blocks, %llu segments finished, %llu bytes "
+                "stored as %llu, %zu bytes queued, %llu spilled (%llu bytes not yet archived)\n",
+                server->config.archive_dir, archive.messages, archive.blocks, archive.segments, archive.raw_bytes,
+                archive.stored_bytes, archive.queued_bytes, archive.spilled, archive.spill_bytes);
+        if (archive.dropped > 0) {
+            fprintf(report, "ARCHIVE INCOMPLETE: %llu messages couldn't be written to it\n", archive.dropped);
+        }
+    }
+    if (server->latency_reports > 0) {
+        fprintf(report, "latency from %llu client reports, us:", server->latency_reports);
+        for (int leg = 0; leg < NUM_LAT_LEGS; leg++) {
+            fprintf(report, "%s %s %llu p50 %llu p99 %llu p99.9 %llu max %llu", leg > 0 ? "," : "",
+                    lat_leg_name(leg), server->client_latency[leg].total,
+                    lat_percentile(&server->client_latency[leg], 50), lat_percentile(&server->client_latency[leg], 99),
+                    lat_percentile(&server->client_latency[leg], 99.9), server->client_latency[leg].max_us);
+        }
+        fprintf(report, "\n");
+    }
+    fprintf(report, "refused: %llu connections, %llu joins; shed %llu connections, "
+            "%llu history entries", server->memory.refused_connections, server->memory.refused_joins,
+            server->memory.shed_connections, server->memory.trimmed_history);
+    fclose(report);
+    send_stats_report(server, sockfd, text, len);
+    free(text);
+}
 
+void handle_latency_report(struct SERVER* server, struct message* msg, int sockfd) {
+    struct CLIENT_INFO_NODE* client = get_client_info(server, msg->source);
+    if (client == NULL || client->sockfd != sockfd) {
+        return;
+    }
+    if (lat_merge_report(server->client_latency, msg->data) == 0) {
+        server->latency_reports++;
     } else {
-        strcpy(new_msg.data, "An error was encountered by the server...");
+        printf("Client %s sent a latency report that can't be read\n", client->username);
     }
-    new_msg.size = strlen(new_msg.data) + 1;
-    send_message_to_client(sockfd, &new_msg);
 }
 
+void handle_blob_offer(struct SERVER* server, struct CONNECTION* conn, struct message* msg) {
+    struct CLIENT_INFO_NODE* client = conn->client;
+    struct message reply;
+    message_init(&reply, BL_NAK);
+    strcpy(reply.source, "SERVER");
+    reply.blob_id = msg->blob_id;
+
+    char kind[8];
+    char target[MAX_NAME > MAX_SESSION_ID ? MAX_NAME : MAX_SESSION_ID];
+    char name[MAX_BLOB_NAME];
+    unsigned long long size;
+    struct BLOB_TRANSFER* transfer = NULL;
+    if (client == NULL || client->sockfd != conn->sockfd) {
+        message_printf(&reply, "you need to log in first");
+    } else if (conn->shm != NULL) {
+        message_printf(&reply, "files can't be sent over shared memory, use a socket connection");
+    } else if (msg->blob_id == 0 || sscanf(msg->data, "%7s %19s %llu %63[^\n]", kind, target, &size, name) != 4) {
+        message_printf(&reply, "malformed file offer");
+    } else if (size > (unsigned long long) server->config.blob_max_size * 1024 * 1024) {
+        message_printf(&reply, "%s - files can be at most %d MB", name, server->config.blob_max_size);
+    } else if (find_blob_transfer(server, conn, msg->blob_id) != NULL) {
+        message_printf(&reply, "%s - transfer %u is still going", name, msg->blob_id);
+    } else if (mem_pressure(&server->memory) != MEM_OK) {
+        message_printf(&reply, "%s - the server is busy, try again later", name);
+    } else {
+        transfer = calloc(1, sizeof(struct BLOB_TRANSFER));
+        transfer->id = msg->blob_id;
+        transfer->sender = conn;
+        transfer->size = size;
+
+        // only the recipients that are online right now get it
+        if (strcmp(kind, "dm") == 0) {
+            struct CLIENT_INFO_NODE* receiver = get_client_info(server, target);
+            if (receiver != NULL && receiver != client && receiver->sockfd != -1) {
+                transfer->targets[transfer->num_targets++] = server->connections[receiver->sockfd];
+            }
+        } else if (strcmp(kind, "sess") == 0) {
+            struct SESSION_INFO_NODE* session = get_session_info(server, target);
+            if (session != NULL && find_membership(client, session) != -1) {
+                for (int i = 0; i < SESSION_CAP; i++) {
+                    struct CLIENT_INFO_NODE* member = session->clients[i];
+                    if (member != NULL && member != client && member->sockfd != -1) {
+                        transfer->targets[transfer->num_targets++] = server->connections[member->sockfd];
+                    }
+                }
+            }
+        }
+
+        if (transfer->num_targets == 0) {
+            message_printf(&reply, "%s - there's nobody online to send it to", name);
+            free(transfer);
+            transfer = NULL;
+        }
+    }
+
+    if (transfer != NULL) {
+        mem_charge(&server->memory, MEM_BLOBS, sizeof(struct BLOB_TRANSFER));
+        transfer->next = server->blob_transfers;
+        server->blob_transfers = transfer;
+
+        struct message offer;
+        message_init(&offer, BLOB_OFFER);
+        offer.blob_id = transfer->id;
+        strcpy(offer.source, client->username);
+        if (strcmp(kind, "sess") == 0) {
+            strcpy(offer.session_id, target);
+        }
+        message_printf(&offer, "%llu %s", size, name);
+        for (int i = 0; i < transfer->num_targets; i++) {
+            send_message_to_client(server, transfer->targets[i]->sockfd, &offer);
+        }
+        message_release(&offer);
+
+        reply.type = BL_ACK;
+        message_printf(&reply, "%s", name);
+    }
+    send_message_to_client(server, conn->sockfd, &reply);
+    message_release(&reply);
+}
+
+void handle_blob_end(struct SERVER* server, struct CONNECTION* conn, struct message* msg) {
+    struct BLOB_TRANSFER* transfer = find_blob_transfer(server, conn, msg->blob_id);
+    if (transfer != NULL) {
+        end_blob_transfer(server, transfer, "");
+    }
+}
+
+struct BLOB_TRANSFER* find_blob_transfer(struct SERVER* server, struct CONNECTION* sender, unsigned int id) {
+    for (struct BLOB_TRANSFER* transfer = server->blob_transfers; transfer != NULL; transfer = transfer->next) {
+        if (transfer->sender == sender && transfer->id == id) {
+            return transfer;
+        }
+    }
+    return NULL;
+}
+
+void end_blob_transfer(struct SERVER* server, struct BLOB_TRANSFER* transfer, const char* reason) {
+    struct message end;
+    message_init(&end, BLOB_END);
+    end.blob_id = transfer->id;
+    strcpy(end.source, transfer->sender->client->username);
+    message_printf(&end, "%s", reason);
+    for (int i = 0; i < transfer->num_targets; i++) {
+        send_message_to_client(server, transfer->targets[i]->sockfd, &end);
+    }
+    message_release(&end);
+
+    struct BLOB_TRANSFER** link = &server->blob_transfers;
+    while (*link != transfer) {
+        link = &(*link)->next;
+    }
+    *link = transfer->next;
+    free(transfer);
+    mem_credit(&server->memory, MEM_BLOBS, sizeof(struct BLOB_TRANSFER));
+}
+
+void detach_blob_transfers(struct SERVER* server, struct CONNECTION* conn) {
+    if (conn->reserved_by != NULL) {
+        // The chunk being spliced into this socket has nowhere to go, so the sender
+        // throws away what's in the pipe and reads the rest of it into the void
+        struct CONNECTION* sender = conn->reserved_by;
+        struct BLOB_RELAY* relay = sender->relay;
+        char scratch[4096];
+        while (relay->pipe_bytes > 0) {
+            ssize_t n = read(relay->splice_pipe[0], scratch, sizeof(scratch));
+            if (n <= 0) {
+                break;
+            }
+            relay->pipe_bytes -= n;
+        }
+        relay->pipe_bytes = 0;
+        relay->splice_target = NULL;
+        relay->chunk_transfer = NULL;
+        conn->reserved_by = NULL;
+        if (relay->chunk_remaining == 0) {
+            finish_blob_chunk(server, sender);
+        } else {
+            resume_input(server, sender);
+        }
+    }
+    struct BLOB_RELAY* relay = conn->relay;
+    if (relay != NULL && relay->splice_target != NULL) {
+        // the recipient is left with half a frame, which it can't recover from
+        schedule_close(server, relay->splice_target, "a file transfer into it was cut off");
+        relay->splice_target->reserved_by = NULL;
+        relay->splice_target = NULL;
+    }
+
+    struct BLOB_TRANSFER** link = &server->blob_transfers;
+    while (*link != NULL) {
+        struct BLOB_TRANSFER* transfer = *link;
+        if (transfer->sender == conn) {
+            end_blob_transfer(server, transfer, "the sender disconnected");
+            continue;
+        }
+        for (int i = 0; i < transfer->num_targets; i++) {
+            if (transfer->targets[i] == conn) {
+                transfer->targets[i] = transfer->targets[--transfer->num_targets];
+                break;
+            }
+        }
+        link = &transfer->next;
+    }
+
+    if (conn->blob_blocked) {
+        server->num_blob_blocked--;
+    }
+    if (relay != NULL) {
+        out_buffer_release(server, relay->chunk_buf);
+        relay->chunk_buf = NULL;
+        if (relay->splice_pipe[0] != -1) {
+            close(relay->splice_pipe[0]);
+            close(relay->splice_pipe[1]);
+        }
+    }
+}
+
+int blob_window_full(struct BLOB_TRANSFER* transfer) {
+    for (int i = 0; i < transfer->num_targets; i++) {
+        if (transfer->targets[i]->lanes[LANE_BLOB].bytes >= BLOB_WINDOW) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int start_blob_chunk(struct SERVER* server, struct CONNECTION* conn, int offset, int header_len, int size) {
+    const char* frame = conn->in_buf + offset;
+    unsigned int id = frame_blob_id(frame, header_len);
+    struct BLOB_TRANSFER* transfer = find_blob_transfer(server, conn, id);
+    if (transfer != NULL && blob_window_full(transfer)) {
+        if (!conn->blob_blocked) {
+            conn->blob_blocked = 1;
+            server->num_blob_blocked++;
+        }
+        return 0;
+    }
+    if (conn->blob_blocked) {
+        conn->blob_blocked = 0;
+        server->num_blob_blocked--;
+    }
+
+    if (conn->relay == NULL) {
+        // kept, pipe and all, for the rest of the connection
+        conn->relay = malloc(sizeof(struct BLOB_RELAY));
+        mem_charge(&server->memory, MEM_BLOBS, sizeof(struct BLOB_RELAY));
+        memset(conn->relay, 0, sizeof(struct BLOB_RELAY));
+        conn->relay->splice_pipe[0] = -1;
+        conn->relay->splice_pipe[1] = -1;
+    }
+    struct BLOB_RELAY* relay = conn->relay;
+
+    int payload_len = size - 1;
+    int available = conn->in_len - offset - header_len;
+    int in_buffer = available < payload_len ? available : payload_len;
+    conn->chunk_active = 1;
+    relay->chunk_transfer = transfer;
+    relay->chunk_remaining = payload_len - in_buffer;
+    relay->chunk_filled = 0;
+
+    // Chunks of a transfer that was refused, already ended, or has lost all its
+    // recipients are read and thrown away
+    if (transfer != NULL && transfer->num_targets > 0) {
+        char header[MAX_OPTIONS_LEN + 100];
+        int hl = blob_chunk_header(header, id, conn->client->username, payload_len);
+        struct CONNECTION* target = (transfer->num_targets == 1) ? transfer->targets[0] : NULL;
+        if (server->config.splice && relay->chunk_remaining > 0 && target != NULL && !target->closing
+            && target->out_bytes == 0 && target->reserved_by == NULL && target->shm == NULL
+            && setup_splice_pipe(conn) == 0) {
+            // The header and what already arrived go into the pipe first, so they reach
+            // the recipient ahead of the spliced part. The pipe is empty and far bigger.
+            if (write(relay->splice_pipe[1], header, hl) == hl
+                && write(relay->splice_pipe[1], frame + header_len, in_buffer) == in_buffer) {
+                relay->pipe_bytes = hl + in_buffer;
+                relay->splice_target = target;
+                target->reserved_by = conn;
+            } else {
+                // can't happen with an empty pipe, but the chunk would be lost
+                schedule_close(server, conn, "couldn't relay a file chunk");
+                return header_len + in_buffer;
+            }
+        } else {
+            char* data = malloc(hl + payload_len);
+            memcpy(data, header, hl);
+            memcpy(data + hl, frame + header_len, in_buffer);
+            relay->chunk_buf = out_buffer_new(server, data, hl + payload_len);
+            relay->chunk_filled = hl + in_buffer;
+        }
+    }
+
+    if (relay->chunk_remaining == 0 && relay->splice_target == NULL) {
+        finish_blob_chunk(server, conn);
+    }
+    return header_len + in_buffer;
+}
+
+void continue_blob_chunk(struct SERVER* server, struct CONNECTION* conn) {
+    struct BLOB_RELAY* relay = conn->relay;
+    if (relay->splice_target != NULL) {
+        pump_splice(server, conn);
+        return;
+    }
+
+    static char scratch[BLOB_CHUNK_MAX];
+    while (relay->chunk_remaining > 0) {
+        char* dest = scratch;
+        size_t want = relay->chunk_remaining;
+        if (relay->chunk_buf != NULL) {
+            dest = relay->chunk_buf->data + relay->chunk_filled;
+        } else if (want > sizeof(scratch)) {
+            want = sizeof(scratch);
+        }
+
+        ssize_t n = recv(conn->sockfd, dest, want, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            resume_input(server, conn);
+            return;
+        }
+        if (n <= 0) {
+            schedule_close(server, conn, n == 0 ? "disconnected" : strerror(errno));
+            return;
+        }
+        relay->chunk_remaining -= n;
+        relay->chunk_filled += n;
+    }
+    finish_blob_chunk(server, conn);
+}
+
+int setup_splice_pipe(struct CONNECTION* conn) {
+    struct BLOB_RELAY* relay = conn->relay;
+#ifdef SPLICE_F_MOVE
+    if (relay->splice_pipe[0] == -1) {
+        if (pipe2(relay->splice_pipe, O_NONBLOCK) == -1) {
+            return -1;
+        }
+        // a bigger pipe means fewer trips through the loop per chunk, if we're allowed one
+        fcntl(relay->splice_pipe[1], F_SETPIPE_SZ, BLOB_CHUNK_MAX * 4);
+        int size = fcntl(relay->splice_pipe[1], F_GETPIPE_SZ);
+        relay->pipe_size = size > 0 ? size : 4096;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+void pump_splice(struct SERVER* server, struct CONNECTION* conn) {
+    struct BLOB_RELAY* relay = conn->relay;
+#ifdef SPLICE_F_MOVE
+    struct CONNECTION* target = relay->splice_target;
+    while (1) {
+        int moved = 0;
+        if (relay->pipe_bytes > 0) {
+            ssize_t n = splice(relay->splice_pipe[0], NULL, target->sockfd, NULL, relay->pipe_bytes,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                relay->pipe_bytes -= n;
+                server->blob_bytes_spliced += n;
+                moved = 1;
+            } else if (n == -1 && errno != EAGAIN && errno != EINTR) {
+                printf("Error sending message: %d\n", errno);
+                schedule_close(server, target, "send failed");
+                return;
+            }
+        }
+        if (relay->chunk_remaining > 0 && relay->pipe_bytes < relay->pipe_size) {
+            size_t want = relay->pipe_size - relay->pipe_bytes;
+            if (want > relay->chunk_remaining) {
+                want = relay->chunk_remaining;
+            }
+            ssize_t n = splice(conn->sockfd, NULL, relay->splice_pipe[1], NULL, want,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                relay->chunk_remaining -= n;
+                relay->pipe_bytes += n;
+                moved = 1;
+            } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                schedule_close(server, conn, n == 0 ? "disconnected" : strerror(errno));
+                return;
+            }
+        }
+        if (relay->chunk_remaining == 0 && relay->pipe_bytes == 0) {
+            finish_blob_chunk(server, conn);
+            return;
+        }
+        if (!moved) {
+            break;
+        }
+    }
+
+    // Wait for whichever side can make progress: the recipient taking what's in the
+    // pipe, and the sender filling the room that's left in it
+    watch_output(server, target, relay->pipe_bytes > 0);
+    if (relay->chunk_remaining > 0 && relay->pipe_bytes < relay->pipe_size) {
+        resume_input(server, conn);
+    } else {
+        pause_input(server, conn);
+    }
+#endif
+}
+
+void finish_blob_chunk(struct SERVER* server, struct CONNECTION* conn) {
+    struct BLOB_RELAY* relay = conn->relay;
+    if (relay->chunk_buf != NULL) {
+        struct BLOB_TRANSFER* transfer = relay->chunk_transfer;
+        for (int i = 0; transfer != NULL && i < transfer->num_targets; i++) {
+            queue_to_client(server, transfer->targets[i]->sockfd, relay->chunk_buf, LANE_BLOB);
+        }
+        server->blob_bytes_copied += relay->chunk_buf->len;
+        out_buffer_release(server, relay->chunk_buf);
+        relay->chunk_buf = NULL;
+    }
+    if (relay->splice_target != NULL) {
+        struct CONNECTION* target = relay->splice_target;
+        target->reserved_by = NULL;
+        relay->splice_target = NULL;
+        watch_output(server, target, 0);
+        if (target->out_bytes > 0) {
+            // whatever was queued for it in the meantime
+            mark_dirty(server, target);
+        }
+    }
+    conn->chunk_active = 0;
+    relay->chunk_transfer = NULL;
+    relay->chunk_remaining = 0;
+    resume_input(server, conn);
+}
+
+void retry_blocked_blob_senders(struct SERVER* server) {
+    for (int i = 0; i <= server->highest_fd && server->num_blob_blocked > 0; i++) {
+        struct CONNECTION* conn = server->connections[i];
+        if (conn == NULL || !conn->blob_blocked || conn->closing || conn->ready) {
+            continue;
+        }
+        // the chunk header it's waiting with is still at the front of in_buf
+        unsigned int type;
+        int size;
+        int header_len = frame_header(conn->in_buf, conn->in_len, &type, &size);
+        struct BLOB_TRANSFER* transfer = NULL;
+        if (header_len > 0) {
+            transfer = find_blob_transfer(server, conn, frame_blob_id(conn->in_buf, header_len));
+        }
+        if (transfer == NULL || !blob_window_full(transfer)) {
+            mark_ready(server, conn);
+        }
+    }
+}
+
+int handle_login(struct SERVER* server, struct message* msg, int sockfd) {
+    // msg is the login message
+    // Must check the username and password against the known database.
+    // If login is successful, a positive fd will be set in matching_username->sockfd.
+    // This also sends a response to the client
+    struct message new_msg;
+    message_init(&new_msg, LO_NAK);
+    strcpy(new_msg.source, "SERVER");
+
+    struct CLIENT_INFO_NODE* matching_username = get_client_info(server, msg->source);
+    if (matching_username) {
+        if (strcmp(msg->data, matching_username->password) == 0) {
+
+            if (matching_username->sockfd != -1 || matching_username->node != -1) {
+                // here, or (this being their home) at another node
+                message_printf(&new_msg, "You have already logged in elsewhere\n");
+            } else {
+                // successful log in. A fresh login replaces anything left over from a
+                // dropped connection that could have been resumed.
+                timer_cancel(&server->timers, &matching_username->resume_timer);
+                remove_user_from_all_sessions(server, matching_username);
+                matching_username->sockfd = sockfd;
+                new_msg.type = LO_ACK;
+                new_msg.compression = negotiate_compression(server, msg, sockfd);
+                new_msg.max_data = max_data;
+                generate_resume_token(matching_username->resume_token);
+                message_printf(&new_msg, "%s", matching_username->resume_token);
+
+                struct message record;
+                message_init(&record, LOGIN);
+                strcpy(record.source, matching_username->username);
+                message_printf(&record, "%s", matching_username->resume_token);
+                replicate(server, &record);
+            }
+        } else {
+            message_printf(&new_msg, "invalid password");
+        }
+    } else {
+        message_printf(&new_msg, "username not found");
+    }
+
+    send_message_to_client(server, sockfd, &new_msg);
+    if (new_msg.type == LO_ACK) {
+        deliver_mailbox(server, matching_username, sockfd);
+        announce_presence(server, matching_username);
+    }
+    return (new_msg.type == LO_ACK ? 0 : -1);
+}
+
+void handle_exit(struct SERVER* server, struct message* msg, int sockfd) {
+    struct CLIENT_INFO_NODE* matching_username = get_client_info(server, msg->source);
+    if (matching_username && matching_username->sockfd == sockfd) {
+
+        // leave every session the user is in
+        remove_user_from_all_sessions(server, matching_username);
+
+        // the socket itself is closed by the event loop
+        matching_username->sockfd = -1;
+        matching_username->resume_token[0] = '\0';
+        announce_presence(server, matching_username);
+
+        struct message record;
+        message_init(&record, EXIT);
+        strcpy(record.source, matching_username->username);
+        replicate(server, &record);
+    }
+}
+
+void handle_join_session(struct SERVER* server, struct message* msg, int sockfd) {
+    struct CLIENT_INFO_NODE* matching_username = get_client_info(server, msg->source);
+    struct message new_msg;
+    message_init(&new_msg, JN_NAK);
+    strcpy(new_msg.source, "SERVER");
+
+    // join a session that has already been created, and not yet at capacity
+    if (matching_username) {
+        struct SESSION_INFO_NODE* matching_session = get_session_info(server, msg->data);
+        int home = home_node(server, msg->data);
+
+        if (matching_username->sockfd != sockfd) {
+            // user hasn't logged in yet (at least on this client)
+            message_printf(&new_msg, "%s - you need to log in first", msg->data);
+        } else if (matching_session == NULL && home == server->local_node) {
+            message_printf(&new_msg, "%s - you entered an invalid session ID", msg->data);
+        } else if (matching_session != NULL && find_membership(matching_username, matching_session) != -1) {
+            message_printf(&new_msg, "%s - you're already in this session.", msg->data);
+        } else if (matching_username->num_sessions == MAX_JOINED_SESSIONS) {
+            message_printf(&new_msg, "%s - you're already in %d sessions. Leave one first.", msg->data, MAX_JOINED_SESSIONS);
+        } else if (mem_pressure(&server->memory) != MEM_OK) {
+            // every member costs output queue space, so don't take on more
+            server->memory.refused_joins++;
+            message_printf(&new_msg, "%s - the server is busy, try again later", msg->data);
+        } else if (home != server->local_node) {
+            // only the session's home knows whether there's room, and it answers
+            if (send_to_node(server, home, msg) == 0) {
+                return;
+            }
+            message_printf(&new_msg, "%s - the session's server can't be reached", msg->data);
+        } else if (add_user_to_session(server, matching_session, matching_username) == -1) {
+            // the session is full
+            message_printf(&new_msg, "%s - the session is full!", msg->data);
+        } else {
+            new_msg.type = JN_ACK;
+            message_printf(&new_msg, "%s", msg->data);
+        }
+    } else {
+        // The user is not authenticated...
+        message_printf(&new_msg, "%s - client ID unrecognized.", msg->data);
+    }
+    send_message_to_client(server, sockfd, &new_msg);
+    message_release(&new_msg);
+}
+
+
+void handle_leave_session(struct SERVER* server, struct message* msg, int sockfd) {
+    struct CLIENT_INFO_NODE* matching_username = get_client_info(server, msg->source);
+
+    // leave the named session, or every session if no name is given
+    if (matching_username && matching_username->sockfd == sockfd) {
+        if (msg->size == 1) {
+            remove_user_from_all_sessions(server, matching_username);
+        } else {
+            struct SESSION_INFO_NODE *matching_session = get_session_info(server, msg->data);
+            if (matching_session && find_membership(matching_username, matching_session) != -1) {
+                remove_user_from_session(server, matching_session, matching_username);
+            }
+        }
+    }
+    // No need to send any reply, even if it results in error
+}
+
+int find_membership(struct CLIENT_INFO_NODE* client, struct SESSION_INFO_NODE* session) {
+    for (int i = 0; i < client->num_sessions; i++) {
+        if (client->sessions[i].session == session) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int add_user_to_session(struct SERVER* server, struct SESSION_INFO_NODE* session, struct CLIENT_INFO_NODE* client) {
+    assert(client->num_sessions < MAX_JOINED_SESSIONS);
+    if (session->num_connected_client >= SESSION_CAP) {
+        // members on other nodes don't take a slot here, but count all the same
+        return -1;
+    }
+    for (int i = 0; i < SESSION_CAP; i++) {
+        if (session->clients[i] == NULL) {
+            session->clients[i] = client;
+            session->num_connected_client++;
+            client->sessions[client->num_sessions].session = session;
+            client->sessions[client->num_sessions].slot = i;
+            client->num_sessions++;
+
+            struct message record;
+            message_init(&record, JOIN);
+            strcpy(record.source, client->username);
+            message_printf(&record, "%s", session->session_id);
+            replicate(server, &record);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Helps with deleting a user from a session, and clearing the session too if it's now empty
+void remove_user_from_session(struct SERVER* server, struct SESSION_INFO_NODE* session, struct CLIENT_INFO_NODE* client) {
+    int index = find_membership(client, session);
+    assert(index != -1);
+
+    session->clients[client->sessions[index].slot] = NULL;
+    session->num_connected_client--;
+
+    // the membership set is unordered, so the last entry fills the gap
+    client->num_sessions--;
+    client->sessions[index] = client->sessions[client->num_sessions];
+
+    struct message record;
+    message_init(&record, LEAVE_SESS);
+    strcpy(record.source, client->username);
+    message_printf(&record, "%s", session->session_id);
+    replicate(server, &record);
+
+    if (session->home != server->local_node) {
+        // the home keeps count of the members here
+        struct message leave;
+        message_init(&leave, LEAVE_SESS);
+        strcpy(leave.source, client->username);
+        message_printf(&leave, "%s", session->session_id);
+        send_to_node(server, session->home, &leave);
+    }
+
+    if (session->num_connected_client == 0) {
+        // No more clients in this session, erase it
+        delete_session(server, session);
+    } else {
+        printf("There are still %d users in session\n", session->num_connected_client);
+    }
+}
+
+void delete_session(struct SERVER* server, struct SESSION_INFO_NODE* session) {
+    struct SESSION_INFO_NODE* p = session->prev;
+    struct SESSION_INFO_NODE* n = session->next;
+    if (p && n) {
+        p->next = n;
+        n->prev = p;
+    } else if (p) {
+        p->next = NULL;
+    } else {
+        if (n) n->prev = NULL;
+        server->session_info_head = n;
+    }
+    unindex_session(server, session);
+    free_session(server, session);
+}
+
+void remove_user_from_all_sessions(struct SERVER* server, struct CLIENT_INFO_NODE* client) {
+    while (client->num_sessions > 0) {
+        remove_user_from_session(server, client->sessions[client->num_sessions - 1].session, client);
+    }
+}
+
+void free_session(struct SERVER* server, struct SESSION_INFO_NODE* session) {
+    for (int i = 0; i < session->history_size; i++) {
+        free_history_entry(server, &session->history[i]);
+    }
+    free(session->history);
+    mem_credit(&server->memory, MEM_HISTORY, session->history_size * sizeof(struct HISTORY_ENTRY));
+    mem_credit(&server->memory, MEM_SEARCH, session->search.bytes);
+    search_index_free(&session->search);
+    free(session);
+    mem_credit(&server->memory, MEM_SESSIONS, sizeof(struct SESSION_INFO_NODE));
+}
+
+struct SESSION_INFO_NODE* create_session(struct SERVER* server, const char* session_id) {
+    // Add a session node to the head of the linked list
+    struct SESSION_INFO_NODE *new_session = malloc(sizeof(struct SESSION_INFO_NODE));
+    mem_charge(&server->memory, MEM_SESSIONS, sizeof(struct SESSION_INFO_NODE));
+    if (server->session_info_head) {
+        server->session_info_head->prev = new_session;
+    }
+    new_session->next = server->session_info_head;
+    new_session->prev = NULL;
+    server->session_info_head = new_session;
+
+    strncpy(new_session->session_id, session_id, MAX_SESSION_ID - 1);
+    new_session->session_id[MAX_SESSION_ID - 1] = '\0';
+    index_session(server, new_session);
+    new_session->num_connected_client = 0;
+    new_session->last_seq = 0;
+    new_session->history_size = server->config.history_size > 0 ? server->config.history_size : 1;
+    new_session->history = calloc(new_session->history_size, sizeof(struct HISTORY_ENTRY));
+    mem_charge(&server->memory, MEM_HISTORY, new_session->history_size * sizeof(struct HISTORY_ENTRY));
+    memset(&new_session->bucket, 0, sizeof(new_session->bucket));
+    search_index_init(&new_session->search);
+    new_session->home = server->local_node;
+    memset(new_session->remote_members, 0, sizeof(new_session->remote_members));
+    new_session->unsynced = 0;
+    for (int client = 0; client < SESSION_CAP; client++) {
+        new_session->clients[client] = NULL;
+    }
+    return new_session;
+}
+
+// Create and join a session
+// What's wrong with a session ID someone wants to create, NULL if nothing. Session IDs go into
+// the header of every session message as "sess=", so none of what separates the header's
+// fields can be in one, and neither can control characters, which no client expects there.
+static const char* session_id_problem(const char* id, unsigned int size) {
+    if (size <= 1) {
+        return "session IDs can't be empty";
+    }
+    if (size > MAX_SESSION_ID) {
+        return "session IDs can't be that long";
+    }
+    if (strlen(id) != size - 1) {
+        return "session IDs can't contain control characters";
+    }
+    for (const unsigned char* c = (const unsigned char*) id; *c != '\0'; c++) {
+        if (*c == ' ' || *c == ',' || *c == '=') {
+            return "session IDs can't contain ' ', ',' or '='";
+        }
+        if (*c < 0x20 || *c == 0x7f) {
+            return "session IDs can't contain control characters";
+        }
+    }
+    return NULL;
+}
+
+void handle_new_session(struct SERVER* server, struct message* msg, int sockfd) {
+    struct CLIENT_INFO_NODE* matching_username = get_client_info(server, msg->source);
+    struct message new_msg;
+    message_init(&new_msg, NS_NAK);
+    strcpy(new_msg.source, "SERVER");
+
+    if (matching_username) {
+        if (matching_username->sockfd != sockfd) {
+            // user hasn't logged in yet (at least on this client)
+            message_printf(&new_msg, "%s - you need to log in first", msg->data);
+        } else if (matching_username->num_sessions == MAX_JOINED_SESSIONS) {
+            // User is in too many sessions already
+            message_printf(&new_msg, "%s - you need to exit one of your sessions first", msg->data);
+        } else if (session_id_problem(msg->data, msg->size) != NULL) {
+            message_printf(&new_msg, "%s - %s", msg->data, session_id_problem(msg->data, msg->size));
+        } else if (get_session_info(server, msg->data) != NULL) {
+            // a session already exists with this name
+            message_printf(&new_msg, "%s - a session already exists with this name", msg->data);
+        } else if (mem_pressure(&server->memory) != MEM_OK) {
+            server->memory.refused_joins++;
+            message_printf(&new_msg, "%s - the server is busy, try again later", msg->data);
+        } else if (home_node(server, msg->data) != server->local_node) {
+            // created at its home, which answers
+            if (send_to_node(server, home_node(server, msg->data), msg) == 0) {
+                return;
+            }
+            message_printf(&new_msg, "%s - the session's server can't be reached", msg->data);
+        } else {
+            struct SESSION_INFO_NODE *new_session = create_session(server, msg->data);
+            add_user_to_session(server, new_session, matching_username);
+
+            new_msg.type = NS_ACK;
+            message_printf(&new_msg, "%s", msg->data);
+        }
+
+    } else {
+        // The user is not authenticated...
+        message_printf(&new_msg, "%s - client ID unrecognized", msg->data);
+    }
+    send_message_to_client(server, sockfd, &new_msg);
+    message_release(&new_msg);
+}
+
+
+void handle_send_message(struct SERVER* server, struct message* msg, int sockfd) {
+    struct CLIENT_INFO_NODE* matching_username = get_client_info(server, msg->source);
+    if (matching_username && matching_username->sockfd == sockfd) {
+        struct SESSION_INFO_NODE* session = message_session(server, matching_username, msg);
+        if (session && server->config.validate_text && !text_valid(msg->data, msg->size - 1)) {
+            // there's no NAK for a session message, it's just not passed on
+            server->invalid_text++;
+        } else if (session) {
+            strcpy(msg->session_id, session->session_id);
+            if (session->home != server->local_node) {
+                // the home numbers it, and sends it back for the members here
+                if (send_to_node(server, session->home, msg) == -1) {
+                    server->cluster_dropped++;
+                }
+                return;
+            }
+            broadcast_session_message(server, session, msg);
+        }
+    }
+}
+
+void broadcast_session_message(struct SERVER* server, struct SESSION_INFO_NODE* session, struct message* msg) {
+    msg->seq = ++session->last_seq;
+    if (msg->sent_us != 0) {
+        msg->forwarded_us = lat_now_us();
+    }
+    deliver_session_message(server, session, msg, 1);
+}
+
+void deliver_session_message(struct SERVER* server, struct SESSION_INFO_NODE* session, struct message* msg, int to_nodes) {
+    // Formatted (and compressed) at most once, no matter how many members there are
+    int len;
+    char* str = encode_message(msg, -1, &len);
+    struct HISTORY_ENTRY live = {msg->seq, out_buffer_new(server, str, len), NULL};
+    live.plain->trace = msg->trace;
+
+    // The history keeps it without latency stamps, since a RESUME replays it long after it
+    // was forwarded, and the client would take all that time for latency
+    struct OUT_BUFFER* plain = live.plain;
+    if (msg->sent_us != 0) {
+        struct message bare = *msg;
+        bare.sent_us = 0;
+        bare.received_us = 0;
+        bare.forwarded_us = 0;
+        str = encode_message(&bare, -1, &len);
+        plain = out_buffer_new(server, str, len);
+        plain->trace = msg->trace;
+    }
+    struct HISTORY_ENTRY* entry = keep_in_history(server, session, msg->seq, plain);
+    send_to_members(server, session, msg->sent_us != 0 ? &live : entry, msg->source);
+    if (server->archiver.dir != NULL
+        && archiver_add(&server->archiver, session->session_id, msg->seq, lat_now_us(), str, len) == -1) {
+        printf("Error - message %llu of session %s couldn't be archived: %s\n", msg->seq, session->session_id,
+               strerror(errno));
+    }
+
+    // and sent once to every other node with members, which does the same for its own
+    for (int node = 0; to_nodes && node < server->num_nodes; node++) {
+        if (session->remote_members[node] > 0 && server->nodes[node].link != NULL) {
+            queue_to_client(server, server->nodes[node].link->sockfd, live.plain, LANE_CONTROL);
+            server->nodes[node].frames_sent++;
+        }
+    }
+    if (msg->sent_us != 0) {
+        free_history_entry(server, &live);
+    }
+}
+
+struct HISTORY_ENTRY* keep_in_history(struct SERVER* server, struct SESSION_INFO_NODE* session, unsigned long long seq, struct OUT_BUFFER* plain) {
+    struct HISTORY_ENTRY* entry = &session->history[seq % session->history_size];
+    forget_history_entry(server, session, entry);
+    entry->seq = seq;
+    entry->plain = plain;
+    index_history_entry(server, session, entry);
+
+    if (server->replication.link != NULL && server->config.replicate_messages) {
+        replicate_buffer(server, plain);
+    } else if (server->replication.link != NULL) {
+        struct message record;
+        message_init(&record, REPL_SEQ);
+        strcpy(record.source, "SERVER");
+        strcpy(record.session_id, session->session_id);
+        record.seq = seq;
+        replicate(server, &record);
+    }
+    return entry;
+}
+
+void send_to_members(struct SERVER* server, struct SESSION_INFO_NODE* session, struct HISTORY_ENTRY* entry, const char* sender) {
+    for (int i = 0; i < SESSION_CAP; i++) {
+        // members whose connection dropped get it from the history when they resume
+        if (session->clients[i] != NULL && strcmp(session->clients[i]->username, sender) != 0
+            && session->clients[i]->sockfd != -1) {
+            send_history_entry(server, entry, session->clients[i]->sockfd);
+        }
+    }
+}
+
+// The message goes to the session named in its header, which has to be one of the client's
+// own, so only those are looked at. Older clients don't name one, which is fine as long as
+// they're only in one session.
+struct SESSION_INFO_NODE* message_session(struct SERVER* server, struct CLIENT_INFO_NODE* client, struct message* msg) {
+    if (msg->session_id[0] != '\0') {
+        for (int i = 0; i < client->num_sessions; i++) {
+            if (strcmp(client->sessions[i].session->session_id, msg->session_id) == 0) {
+                return client->sessions[i].session;
+            }
+        }
+        return NULL;
+    } else if (client->num_sessions == 1) {
+        return client->sessions[0].session;
+    }
+    return NULL;
+}
+
+
+void handle_query(struct SERVER* server, struct message* msg, int sockfd) {
+    // Sends the list of users, and their sessions back as reply.
+    // In a cluster that waits for the other nodes' lists.
+    struct CONNECTION* conn = server->connections[sockfd];
+    if (conn != NULL && conn->client != NULL && ask_other_nodes(server, sockfd, conn->client->username) == 0) {
+        return;
+    }
+
+    struct message new_msg;
+    message_init(&new_msg, QU_ACK);
+    strcpy(new_msg.source, "SERVER");
+    list_users(server, &new_msg);
+    send_message_to_client(server, sockfd, &new_msg);
+    message_release(&new_msg);
+}
+
+// Stops once the reply is full
+void list_users(struct SERVER* server, struct message* reply) {
+    struct CLIENT_INFO_NODE* curr = server->client_info_head;
+    while (curr != NULL) {
+        if (curr->sockfd != -1) {
+            message_appendf(reply, "%s: ", curr->username);
+            if (curr->num_sessions == 0) {
+                message_appendf(reply, "no session");
+            }
+            for (int i = 0; i < curr->num_sessions; i++) {
+                message_appendf(reply, i == 0 ? "%s" : ", %s", curr->sessions[i].session->session_id);
+            }
+            message_appendf(reply, "\n");
+        }
+        curr = curr->next;
+
+        if (curr != NULL && reply->size > max_data - MAX_NAME - MAX_JOINED_SESSIONS * (MAX_SESSION_ID + 2) - 20) {
+            // It won't fit, so don't put any more data in
+            message_appendf(reply, "...\n");
+            break;
+        }
+    }
+}
+
+
+// Check the user information and put it into the login file for persistent storage.
+// Assume that the username and password are all valid (they're checked by the client).
+// The user isn't automatically logged-in by this - they have to login separately.
+void handle_register_user(struct SERVER* server, struct message* msg, int sockfd) {
+    struct message new_msg;
+    message_init(&new_msg, REG_NAK);
+    strcpy(new_msg.source, "SERVER");
+
+    struct CLIENT_INFO_NODE* existing_username = get_client_info(server, msg->source);
+    if (existing_username != NULL) {
+        message_printf(&new_msg, "The username has already been registered.");
+    } else {
+        FILE* fp = fopen(server->config.login_file, "a");
+        if (fp == NULL) {
+            message_printf(&new_msg, "Server cannot write to the login file.");
+        } else {
+            fprintf(fp, "%s %s\n", msg->source, msg->data);
+            new_msg.type = REG_ACK;
+            fclose(fp);
+            printf("Registration successful for user %s\n", msg->source);
+
+            // Add the user to the directory. Re-reading the file would lose everyone's login state.
+            struct CLIENT_INFO_NODE* new_client = new_client_info(server, msg->source, msg->data);
+            new_client->next = server->client_info_head;
+            server->client_info_head = new_client;
+            replicate(server, msg);
+        }
+    }
+    send_message_to_client(server, sockfd, &new_msg);
+}
+
+
+// Handle direct messaging from one user to another. Messages for a user who is offline
+// wait in their mailbox until they log in.
+void handle_dm(struct SERVER* server, struct message* msg, int sockfd) {
+    struct message new_msg;
+    message_init(&new_msg, DM_NAK);
+    strcpy(new_msg.source, "SERVER");
+
+    struct CLIENT_INFO_NODE* source_username = get_client_info(server, msg->source);
+    if (source_username != NULL && source_username->sockfd == sockfd) {
+
+        // The receiver is named in the header. Older clients put it in front of the text instead.
+        char receiver[MAX_NAME] = "";
+        const char* text = msg->data;
+        if (msg->to[0] != '\0') {
+            strcpy(receiver, msg->to);
+        } else {
+            size_t name_len = strcspn(msg->data, " ");
+            if (msg->data[name_len] == ' ' && name_len > 0 && name_len < MAX_NAME) {
+                memcpy(receiver, msg->data, name_len);
+                receiver[name_len] = '\0';
+                text = msg->data + name_len + 1;
+            }
+        }
+
+        struct CLIENT_INFO_NODE* recv_client = receiver[0] != '\0' ? get_client_info(server, receiver) : NULL;
+        if (receiver[0] == '\0') {
+            message_printf(&new_msg, "Message formatting error");
+        } else if (server->config.validate_text && !text_valid(text, msg->size - 1 - (text - msg->data))) {
+            server->invalid_text++;
+            message_printf(&new_msg, "The message is not valid UTF-8");
+        } else if (recv_client == NULL) {
+            message_printf(&new_msg, "The receiving client does not exist");
+        } else {
+            // We can send the message to the receiver, now or when they're back
+            message_printf(&new_msg, "%s", text);
+            new_msg.type = DM_MSG;
+            strncpy(new_msg.source, msg->source, MAX_NAME);
+            strcpy(new_msg.to, receiver);
+            new_msg.trace = msg->trace;
+            if (msg->sent_us != 0) {
+                new_msg.sent_us = msg->sent_us;
+                new_msg.received_us = msg->received_us;
+                new_msg.forwarded_us = lat_now_us();
+            }
+            if (route_dm(server, &new_msg, recv_client) == 0) {
+                message_release(&new_msg);
+                return;
+            }
+            server->mailbox_refused++;
+            new_msg.type = DM_NAK;
+            strcpy(new_msg.source, "SERVER");
+            new_msg.to[0] = '\0';
+            message_printf(&new_msg, "The receiving client is not online, and can't take more messages until they are");
+        }
+
+    } else {
+        message_printf(&new_msg, "An error was encountered by the server...");
+    }
+    send_message_to_client(server, sockfd, &new_msg);
+    message_release(&new_msg);
+}
+
+int route_dm(struct SERVER* server, struct message* dm, struct CLIENT_INFO_NODE* recv_client) {
+    if (recv_client->sockfd != -1) {
+        send_message_to_client(server, recv_client->sockfd, dm);
+        return 0;
+    }
+
+    // Not here, so it goes to their home, and from there to the node they're logged in at.
+    // A node that gets one for a user who has just left sends it back to the home, which
+    // had that news first since it came over the same link.
+    if (server->num_nodes > 0) {
+        int home = home_node(server, recv_client->username);
+        int node = (home != server->local_node) ? home : recv_client->node;
+        if (node != -1 && send_to_node(server, node, dm) == 0) {
+            return 0;
+        }
+    }
+
+    // how long it waits in there isn't latency
+    dm->sent_us = 0;
+    dm->received_us = 0;
+    dm->forwarded_us = 0;
+    int len;
+    char* frame = encode_message(dm, -1, &len);
+    int stored = store_in_mailbox(server, recv_client, frame, len);
+    if (stored == 0 && server->replication.link != NULL) {
+        // it names recv_client in "to", which is whose mailbox the standby puts it in
+        struct OUT_BUFFER* out = out_buffer_new(server, frame, len);
+        replicate_buffer(server, out);
+        out_buffer_release(server, out);
+    } else {
+        free(frame);
+    }
+    return stored;
+}
+
+void mailbox_path(struct SERVER* server, const struct CLIENT_INFO_NODE* client, char* path, size_t size) {
+    int n = snprintf(path, size, "%s/", server->config.mailbox_dir);
+    for (const char* c = client->username; *c != '\0' && n + 3 < (int) size; c++) {
+        n += sprintf(path + n, "%02x", (unsigned char) *c);
+    }
+    snprintf(path + n, size - n, ".mbox");
+}
+
+// Appends to the mailbox's file (or starts it over), leaving it as it was if that fails
+static int write_mailbox_file(struct SERVER* server, const struct CLIENT_INFO_NODE* client, const char* data, size_t len, int start_over) {
+    char path[PATH_MAX];
+    mailbox_path(server, client, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | (start_over ? O_TRUNC : 0), 0600);
+    if (fd == -1) {
+        printf("Error - can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    off_t old_size = lseek(fd, 0, SEEK_END);
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, data + written, len - written);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            // a frame cut off halfway would spoil everything after it
+            printf("Error - can't write %s: %s\n", path, strerror(errno));
+            if (ftruncate(fd, old_size) == -1) {
+                printf("Error - can't undo the write to %s\n", path);
+            }
+            close(fd);
+            return -1;
+        }
+        written += n;
+    }
+    close(fd);
+    return 0;
+}
+
+static void free_mailbox(struct SERVER* server, struct CLIENT_INFO_NODE* client) {
+    struct MAILBOX* mailbox = client->mailbox;
+    mem_credit(&server->memory, MEM_MAILBOXES, sizeof(struct MAILBOX) + mailbox->capacity);
+    free(mailbox->frames);
+    free(mailbox);
+    client->mailbox = NULL;
+}
+
+char* read_mailbox_file(struct SERVER* server, const struct CLIENT_INFO_NODE* client, size_t* len) {
+    char path[PATH_MAX];
+    mailbox_path(server, client, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    size_t size = 0;
+    char* frames = NULL;
+    *len = 0;
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        size = st.st_size;
+        frames = malloc(size);
+        while (*len < size) {
+            ssize_t n = read(fd, frames + *len, size - *len);
+            if (n <= 0 && !(n == -1 && errno == EINTR)) {
+                break;
+            }
+            *len += n > 0 ? n : 0;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    if (frames == NULL || *len != size) {
+        free(frames);
+        *len = 0;
+        return NULL;
+    }
+    return frames;
+}
+
+int store_in_mailbox(struct SERVER* server, struct CLIENT_INFO_NODE* client, const char* frame, size_t len) {
+    if (server->config.mailbox_size <= 0 || (client->mailbox != NULL && client->mailbox->count >= server->config.mailbox_size)) {
+        return -1;
+    }
+    if (client->mailbox == NULL) {
+        client->mailbox = calloc(1, sizeof(struct MAILBOX));
+        mem_charge(&server->memory, MEM_MAILBOXES, sizeof(struct MAILBOX));
+    }
+    struct MAILBOX* mailbox = client->mailbox;
+
+    if (!mailbox->spilled && (mailbox->len + len > (size_t) server->config.mailbox_memory * 1024
+                              || mem_pressure(&server->memory) != MEM_OK)) {
+        // no more room in memory, so everything moves to the file
+        if (server->config.mailbox_dir == NULL || spill_mailbox(server, client) == -1) {
+            if (mailbox->count == 0) {
+                free_mailbox(server, client);
+            }
+            return -1;
+        }
+    }
+
+    if (mailbox->spilled) {
+        if (write_mailbox_file(server, client, frame, len, 0) == -1) {
+            return -1;
+        }
+    } else {
+        if (mailbox->len + len > mailbox->capacity) {
+            size_t capacity = mailbox->capacity > 0 ? mailbox->capacity : 1024;
+            while (capacity < mailbox->len + len) {
+                capacity *= 2;
+            }
+            mailbox->frames = realloc(mailbox->frames, capacity);
+            mem_charge(&server->memory, MEM_MAILBOXES, capacity - mailbox->capacity);
+            mailbox->capacity = capacity;
+        }
+        memcpy(mailbox->frames + mailbox->len, frame, len);
+        mailbox->len += len;
+    }
+    mailbox->count++;
+    return 0;
+}
+
+int spill_mailbox(struct SERVER* server, struct CLIENT_INFO_NODE* client) {
+    struct MAILBOX* mailbox = client->mailbox;
+    if (write_mailbox_file(server, client, mailbox->frames, mailbox->len, 1) == -1) {
+        return -1;
+    }
+    mem_credit(&server->memory, MEM_MAILBOXES, mailbox->capacity);
+    free(mailbox->frames);
+    mailbox->frames = NULL;
+    mailbox->len = 0;
+    mailbox->capacity = 0;
+    mailbox->spilled = 1;
+    printf("Mailbox of %s moved to disk, %d messages\n", client->username, mailbox->count);
+    return 0;
+}
+
+size_t spill_biggest_mailbox(struct SERVER* server) {
+    struct CLIENT_INFO_NODE* biggest = NULL;
+    for (struct CLIENT_INFO_NODE* client = server->client_info_head; client != NULL; client = client->next) {
+        if (client->mailbox != NULL && !client->mailbox->spilled
+            && (biggest == NULL || client->mailbox->capacity > biggest->mailbox->capacity)) {
+            biggest = client;
+        }
+    }
+    if (biggest == NULL) {
+        return 0;
+    }
+    size_t freed = biggest->mailbox->capacity;
+    return spill_mailbox(server, biggest) == 0 ? freed : 0;
+}
+
+void deliver_mailbox(struct SERVER* server, struct CLIENT_INFO_NODE* client, int sockfd) {
+    struct MAILBOX* mailbox = client->mailbox;
+    if (mailbox == NULL) {
+        return;
+    }
+
+    // The frames are ready to send as they are, so they go out as one buffer. They aren't
+    // compressed, which every client understands.
+    char* frames = NULL;
+    size_t len = 0;
+    if (mailbox->spilled) {
+        frames = read_mailbox_file(server, client, &len);
+        if (frames == NULL) {
+            printf("Error - the mailbox of %s is lost: %s\n", client->username, strerror(errno));
+        }
+        char path[PATH_MAX];
+        mailbox_path(server, client, path, sizeof(path));
+        unlink(path);
+    } else {
+        // taken over by the output buffer, which charges it to the output from now on
+        frames = mailbox->frames;
+        len = mailbox->len;
+        mailbox->frames = NULL;
+    }
+
+    if (frames != NULL) {
+        struct OUT_BUFFER* out = out_buffer_new(server, frames, len);
+        queue_to_client(server, sockfd, out, LANE_CONTROL);
+        out_buffer_release(server, out);
+        printf("Delivered %d stored messages to %s\n", mailbox->count, client->username);
+    }
+    free_mailbox(server, client);
+
+    struct message record;
+    message_init(&record, REPL_MAILBOX_TAKEN);
+    strcpy(record.source, client->username);
+    replicate(server, &record);
+}
+
+
+
+void generate_resume_token(char* token) {
+    unsigned char random_bytes[(RESUME_TOKEN_LEN - 1) / 2];
+    FILE* fp = fopen("/dev/urandom", "r");
+    if (fp == NULL || fread(random_bytes, 1, sizeof(random_bytes), fp) != sizeof(random_bytes)) {
+        for (int i = 0; i < sizeof(random_bytes); i++) {
+            random_bytes[i] = rand();
+        }
+    }
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    for (int i = 0; i < sizeof(random_bytes); i++) {
+        sprintf(token + 2 * i, "%02x", random_bytes[i]);
+    }
+}
+
+// The client didn't come back in time, so it's logged out for good
+void resume_expired(struct TIMER* timer, void* arg) {
+    struct CLIENT_INFO_NODE* client = arg;
+    struct SERVER* server = client->server;
+    remove_user_from_all_sessions(server, client);
+    client->resume_token[0] = '\0';
+    printf("Client %s did not resume in time\n", client->username);
+
+    struct message record;
+    message_init(&record, EXIT);
+    strcpy(record.source, client->username);
+    replicate(server, &record);
+}
+
+// Sends every message after after_seq that is still in the session's history
+void replay_history(struct SERVER* server, struct SESSION_INFO_NODE* session, unsigned long long after_seq, int sockfd) {
+    unsigned long long first = after_seq + 1;
+    if (session->last_seq >= session->history_size && first <= session->last_seq - session->history_size) {
+        // older messages were already dropped from the history
+        first = session->last_seq - session->history_size + 1;
+    }
+    for (unsigned long long seq = first; seq <= session->last_seq; seq++) {
+        struct HISTORY_ENTRY* entry = &session->history[seq % session->history_size];
+        if (entry->plain != NULL && entry->seq == seq) {
+            send_history_entry(server, entry, sockfd);
+        }
+    }
+}
+
+void free_history_entry(struct SERVER* server, struct HISTORY_ENTRY* entry) {
+    out_buffer_release(server, entry->plain);
+    out_buffer_release(server, entry->packed);
+    entry->plain = NULL;
+    entry->packed = NULL;
+}
+
+void forget_history_entry(struct SERVER* server, struct SESSION_INFO_NODE* session, struct HISTORY_ENTRY* entry) {
+    if (entry->plain != NULL && entry->seq > session->search.removed_seq && session->search.last_seq != 0) {
+        size_t bytes = session->search.bytes;
+        int len;
+        const char* text = history_text(entry, &len);
+        search_index_remove(&session->search, entry->seq, text, len);
+        mem_credit(&server->memory, MEM_SEARCH, bytes - session->search.bytes);
+    }
+    free_history_entry(server, entry);
+}
+
+const char* history_text(struct HISTORY_ENTRY* entry, int* len) {
+    // the plain form is never compressed, so the text is right after the header
+    unsigned int type;
+    int size;
+    int header_len = frame_header(entry->plain->data, entry->plain->len, &type, &size);
+    if (header_len <= 0 || header_len + size - 1 > entry->plain->len) {
+        return NULL;
+    }
+    *len = size - 1;
+    return entry->plain->data + header_len;
+}
+
+void index_history_entry(struct SERVER* server, struct SESSION_INFO_NODE* session, struct HISTORY_ENTRY* entry) {
+    if (server->config.search_memory <= 0) {
+        return;
+    }
+    struct SEARCH_INDEX* index = &session->search;
+    size_t bytes = index->bytes;
+    int len;
+    const char* text = history_text(entry, &len);
+    if (text != NULL) {
+        search_index_add(index, entry->seq, text, len);
+    }
+
+    size_t limit = (size_t) server->config.search_memory * 1024;
+    while (index->bytes > limit && index->removed_seq < index->last_seq) {
+        // everything still indexed is in the ring
+        unsigned long long seq = index->removed_seq + 1;
+        if (index->last_seq - seq >= (unsigned long long) session->history_size) {
+            seq = index->last_seq - session->history_size + 1;
+        }
+        struct HISTORY_ENTRY* oldest = &session->history[seq % session->history_size];
+        text = oldest->plain != NULL && oldest->seq == seq ? history_text(oldest, &len) : NULL;
+        search_index_remove(index, seq, text, text != NULL ? len : 0);
+    }
+    if (index->bytes > bytes) {
+        mem_charge(&server->memory, MEM_SEARCH, index->bytes - bytes);
+    } else {
+        mem_credit(&server->memory, MEM_SEARCH, bytes - index->bytes);
+    }
+}
+
+void handle_search(struct SERVER* server, struct message* msg, int sockfd) {
+    struct CLIENT_INFO_NODE* client = get_client_info(server, msg->source);
+    if (client == NULL || client->sockfd != sockfd) {
+        return;
+    }
+
+    struct message reply;
+    message_init(&reply, SR_NAK);
+    strcpy(reply.source, "SERVER");
+    struct SESSION_INFO_NODE* session = message_session(server, client, msg);
+    unsigned long long hits[SEARCH_PAGE + 1];
+    int num_hits = -1;
+    if (session != NULL && server->config.search_memory > 0) {
+        // one more than fits on the page tells whether there's a next one
+        num_hits = search_index_query(&session->search, msg->data, msg->size - 1, msg->seq, hits, SEARCH_PAGE + 1);
+    }
+
+    if (server->config.search_memory <= 0) {
+        message_printf(&reply, "Searching is turned off on this server");
+    } else if (session == NULL) {
+        message_printf(&reply, "%s - not in that session", msg->session_id[0] != '\0' ? msg->session_id : "no session given");
+    } else if (num_hits == -1) {
+        message_printf(&reply, "Nothing to search for, words have at least 2 letters");
+    } else {
+        reply.type = SR_ACK;
+        strcpy(reply.session_id, session->session_id);
+        server->searches++;
+        int shown = 0;
+        while (shown < num_hits && shown < SEARCH_PAGE) {
+            struct HISTORY_ENTRY* entry = &session->history[hits[shown] % session->history_size];
+            struct message* hit = entry->plain != NULL && entry->seq == hits[shown]
+                                  ? buf_to_message(entry->plain->data, entry->plain->len) : NULL;
+            if (hit != NULL) {
+                int line_len = 24 + strlen(hit->source) + hit->size;
+                if (shown > 0 && reply.size + line_len > max_data) {
+                    // the rest is on the next page, the first one is cut short if it has to be
+                    free(hit);
+                    break;
+                }
+                message_appendf(&reply, "%llu %s: %s\n", hits[shown], hit->source, hit->data);
+                server->search_hits++;
+                free(hit);
+            }
+            shown++;
+        }
+        reply.seq = shown < num_hits ? hits[shown - 1] : 0;
+    }
+    send_message_to_client(server, sockfd, &reply);
+    message_release(&reply);
+}
+
+// Sends the compressed form to clients that negotiated it, compressing on first use
+void send_history_entry(struct SERVER* server, struct HISTORY_ENTRY* entry, int sockfd) {
+    int threshold = client_compress_threshold(server, sockfd);
+    if (threshold < 0) {
+        queue_to_client(server, sockfd, entry->plain, LANE_BULK);
+        return;
+    }
+
+    if (entry->packed == NULL) {
+        struct message* msg = buf_to_message(entry->plain->data, entry->plain->len);
+        int len;
+        char* str = encode_message(msg, threshold, &len);
+        entry->packed = out_buffer_new(server, str, len);
+        entry->packed->trace = entry->plain->trace;
+        free(msg);
+    }
+    queue_to_client(server, sockfd, entry->packed, LANE_BULK);
+}
+
+// Compression is used on a connection if the client offered it and the server allows it
+int negotiate_compression(struct SERVER* server, struct message* msg, int sockfd) {
+    int enabled = msg->compression && server->config.compression;
+    if (sockfd >= 0 && sockfd < server->max_connections && server->connections[sockfd] != NULL) {
+        server->connections[sockfd]->compression = enabled;
+    }
+    return enabled;
+}
+
+// Reattach a dropped client to its login and sessions. The first line of msg->data is the
+// token from LO_ACK, followed by a "<last seq seen> <session ID>" line per session.
+// RS_ACK lists the sessions the client is still in, and is followed by everything
+// newer that is still in their histories.
+int handle_resume(struct SERVER* server, struct message* msg, int sockfd) {
+    struct message new_msg;
+    message_init(&new_msg, RS_NAK);
+    strcpy(new_msg.source, "SERVER");
+
+    char* saveptr;
+    char* token = strtok_r(msg->data, "\n", &saveptr);
+
+    struct CLIENT_INFO_NODE* client = get_client_info(server, msg->source);
+    if (client == NULL || token == NULL || client->resume_token[0] == '\0' || !keys_match(token, client->resume_token)) {
+        message_printf(&new_msg, "nothing to resume, please log in again");
+    } else if (client->sockfd != -1 || client->node != -1) {
+        message_printf(&new_msg, "You have already logged in elsewhere");
+    } else {
+        timer_cancel(&server->timers, &client->resume_timer);
+        client->sockfd = sockfd;
+        new_msg.type = RS_ACK;
+        new_msg.compression = negotiate_compression(server, msg, sockfd);
+        new_msg.max_data = max_data;
+
+        for (int i = 0; i < client->num_sessions; i++) {
+            message_appendf(&new_msg, i == 0 ? "%s" : " %s", client->sessions[i].session->session_id);
+        }
+        send_message_to_client(server, sockfd, &new_msg);
+        message_release(&new_msg);
+
+        // sessions the client doesn't mention are replayed from the start of the history
+        unsigned long long last_seen[MAX_JOINED_SESSIONS] = {0};
+        for (char* line = strtok_r(NULL, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr)) {
+            unsigned long long seq;
+            char session_id[MAX_SESSION_ID];
+            if (sscanf(line, "%llu %19s", &seq, session_id) == 2) {
+                struct SESSION_INFO_NODE* session = get_session_info(server, session_id);
+                int index = session ? find_membership(client, session) : -1;
+                if (index != -1) {
+                    last_seen[index] = seq;
+                }
+            }
+        }
+        for (int i = 0; i < client->num_sessions; i++) {
+            replay_history(server, client->sessions[i].session, last_seen[i], sockfd);
+        }
+        deliver_mailbox(server, client, sockfd);
+        announce_presence(server, client);
+        printf("Client %s resumed\n", client->username);
+        return 0;
+    }
+    send_message_to_client(server, sockfd, &new_msg);
+    return -1;
+}
+
+// The snapshot is written with these, in the order read_snapshot takes it back
+static void put_u32(FILE* fp, unsigned int value) {
+    fwrite(&value, sizeof(value), 1, fp);
+}
+
+static void put_u64(FILE* fp, unsigned long long value) {
+    fwrite(&value, sizeof(value), 1, fp);
+}
+
+static void put_blob(FILE* fp, const void* data, size_t len) {
+    put_u32(fp, len);
+    fwrite(data, 1, len, fp);
+}
+
+static void put_str(FILE* fp, const char* str) {
+    put_blob(fp, str, strlen(str));
+}
+
+// Once anything is missing or out of range, everything after reads as 0 and failed is set
+struct SNAPSHOT_READER {
+    FILE* fp;
+    int failed;
+};
+
+static void get_bytes(struct SNAPSHOT_READER* reader, void* data, size_t len) {
+    if (!reader->failed && fread(data, 1, len, reader->fp) != len) {
+        reader->failed = 1;
+    }
+    if (reader->failed) {
+        memset(data, 0, len);
+    }
+}
+
+static unsigned int get_u32(struct SNAPSHOT_READER* reader) {
+    unsigned int value;
+    get_bytes(reader, &value, sizeof(value));
+    return value;
+}
+
+static unsigned long long get_u64(struct SNAPSHOT_READER* reader) {
+    unsigned long long value;
+    get_bytes(reader, &value, sizeof(value));
+    return value;
+}
+
+// Returns it malloc'd, or NULL once the snapshot has failed
+static char* get_blob(struct SNAPSHOT_READER* reader, size_t* len) {
+    *len = get_u32(reader);
+    if (*len > SNAPSHOT_BLOB_MAX) {
+        reader->failed = 1;
+    }
+    if (reader->failed) {
+        *len = 0;
+        return NULL;
+    }
+    char* data = malloc(*len > 0 ? *len : 1);
+    get_bytes(reader, data, *len);
+    if (reader->failed) {
+        free(data);
+        *len = 0;
+        return NULL;
+    }
+    return data;
+}
+
+static void get_str(struct SNAPSHOT_READER* reader, char* str, size_t size) {
+    unsigned int len = get_u32(reader);
+    if (len >= size) {
+        reader->failed = 1;
+    }
+    get_bytes(reader, str, reader->failed ? 0 : len);
+    str[reader->failed ? 0 : len] = '\0';
+}
+
+int write_snapshot(struct SERVER* server, int* num_connections, int for_standby) {
+    int snapshot_fd = memfd_create("chat-snapshot", MFD_CLOEXEC);
+    int copy = snapshot_fd == -1 ? -1 : dup(snapshot_fd);
+    FILE* fp = copy == -1 ? NULL : fdopen(copy, "w");
+    if (fp == NULL) {
+        printf("Error - can't make a snapshot: %s\n", strerror(errno));
+        if (snapshot_fd != -1) {
+            close(snapshot_fd);
+        }
+        return -1;
+    }
+    put_u32(fp, SNAPSHOT_MAGIC);
+    put_u32(fp, SNAPSHOT_VERSION);
+    // so the frames this server traced aren't given the same IDs again by the next
+    put_u64(fp, server->next_trace_id);
+
+    // The directory, in its order
+    int num_users = 0;
+    for (struct CLIENT_INFO_NODE* client = server->client_info_head; client != NULL; client = client->next) {
+        num_users++;
+    }
+    put_u32(fp, num_users);
+    for (struct CLIENT_INFO_NODE* client = server->client_info_head; client != NULL; client = client->next) {
+        put_str(fp, client->username);
+        put_str(fp, client->password);
+        put_str(fp, client->resume_token);
+        fwrite(client->buckets, sizeof(client->buckets), 1, fp);
+        struct MAILBOX* mailbox = client->mailbox;
+        put_u32(fp, mailbox != NULL);
+        if (mailbox != NULL && mailbox->spilled && for_standby) {
+            // the standby may be on another host, without the file
+            size_t len = 0;
+            char* frames = read_mailbox_file(server, client, &len);
+            put_u32(fp, frames != NULL ? mailbox->count : 0);
+            put_u32(fp, 0);
+            put_blob(fp, frames, len);
+            free(frames);
+        } else if (mailbox != NULL) {
+            put_u32(fp, mailbox->count);
+            put_u32(fp, mailbox->spilled);
+            put_blob(fp, mailbox->frames, mailbox->len);
+        }
+    }
+
+    // Sessions from the tail, since each one goes back in at the head
+    int num_sessions = 0;
+    struct SESSION_INFO_NODE* tail = NULL;
+    for (struct SESSION_INFO_NODE* session = server->session_info_head; session != NULL; session = session->next) {
+        num_sessions++;
+        tail = session;
+    }
+    put_u32(fp, num_sessions);
+    for (struct SESSION_INFO_NODE* session = tail; session != NULL; session = session->prev) {
+        put_str(fp, session->session_id);
+        put_u64(fp, session->last_seq);
+        fwrite(&session->bucket, sizeof(session->bucket), 1, fp);
+        for (int slot = 0; slot < SESSION_CAP; slot++) {
+            put_str(fp, session->clients[slot] ? session->clients[slot]->username : "");
+        }
+        put_u32(fp, session->home);
+        fwrite(session->remote_members, sizeof(session->remote_members), 1, fp);
+
+        // the history from its oldest message
+        unsigned long long first = session->last_seq >= (unsigned long long) session->history_size
+                                   ? session->last_seq - session->history_size + 1 : 1;
+        int num_entries = 0;
+        for (unsigned long long seq = first; seq <= session->last_seq; seq++) {
+            struct HISTORY_ENTRY* entry = &session->history[seq % session->history_size];
+            num_entries += (entry->plain != NULL && entry->seq == seq);
+        }
+        put_u32(fp, num_entries);
+        for (unsigned long long seq = first; seq <= session->last_seq; seq++) {
+            struct HISTORY_ENTRY* entry = &session->history[seq % session->history_size];
+            if (entry->plain != NULL && entry->seq == seq) {
+                put_u64(fp, seq);
+                put_blob(fp, entry->plain->data, entry->plain->len);
+            }
+        }
+    }
+
+    // Connections in descriptor order, which is the order their sockets are passed in
+    *num_connections = 0;
+    for (int i = 0; i <= server->highest_fd && !for_standby; i++) {
+        *num_connections += (server->connections[i] != NULL);
+    }
+    put_u32(fp, *num_connections);
+    for (int i = 0; i <= server->highest_fd && !for_standby; i++) {
+        struct CONNECTION* conn = server->connections[i];
+        if (conn == NULL) {
+            continue;
+        }
+        put_u32(fp, conn->state);
+        put_str(fp, conn->client ? conn->client->username : "");
+        put_u32(fp, conn->compression);
+        put_u32(fp, conn->local);
+        put_u32(fp, conn->ping_outstanding);
+        put_u32(fp, conn->query_deferred_ms != 0);
+        put_u64(fp, conn->dropped_frames);
+        put_blob(fp, conn->in_buf, conn->in_len);
+        for (int lane = 0; lane < NUM_LANES; lane++) {
+            struct OUT_QUEUE* queue = &conn->lanes[lane];
+            int num_chunks = 0;
+            for (struct OUT_CHUNK* chunk = queue->head; chunk != NULL; chunk = chunk->next) {
+                num_chunks++;
+            }
+            put_u32(fp, num_chunks);
+            for (struct OUT_CHUNK* chunk = queue->head; chunk != NULL; chunk = chunk->next) {
+                // what's already been written of the first one isn't sent again
+                int skip = (chunk == queue->head) ? queue->offset : 0;
+                put_blob(fp, chunk->buf->data + skip, chunk->buf->len - skip);
+            }
+        }
+    }
+    put_u32(fp, SNAPSHOT_MAGIC);
+
+    if (fclose(fp) != 0) {
+        printf("Error - can't write the snapshot: %s\n", strerror(errno));
+        close(snapshot_fd);
+        return -1;
+    }
+    return snapshot_fd;
+}
+
+int read_snapshot(struct SERVER* server, int snapshot_fd, const int* fds, int num_fds) {
+    lseek(snapshot_fd, 0, SEEK_SET);
+    struct SNAPSHOT_READER reader = {.fp = fdopen(snapshot_fd, "r"), .failed = 0};
+    if (reader.fp == NULL || get_u32(&reader) != SNAPSHOT_MAGIC || get_u32(&reader) != SNAPSHOT_VERSION) {
+        printf("Error - the snapshot isn't one this server can read\n");
+        return -1;
+    }
+    server->next_trace_id = get_u64(&reader);
+
+    int num_users = get_u32(&reader);
+    struct CLIENT_INFO_NODE** client_link = &server->client_info_head;
+    for (int i = 0; i < num_users && !reader.failed; i++) {
+        char username[MAX_NAME];
+        char password[MAX_PASSWD];
+        get_str(&reader, username, sizeof(username));
+        get_str(&reader, password, sizeof(password));
+        struct CLIENT_INFO_NODE* client = new_client_info(server, username, password);
+        *client_link = client;
+        client_link = &client->next;
+        get_str(&reader, client->resume_token, RESUME_TOKEN_LEN);
+        get_bytes(&reader, client->buckets, sizeof(client->buckets));
+        if (get_u32(&reader)) {
+            struct MAILBOX* mailbox = calloc(1, sizeof(struct MAILBOX));
+            mailbox->count = get_u32(&reader);
+            mailbox->spilled = get_u32(&reader);
+            mailbox->frames = get_blob(&reader, &mailbox->len);
+            mailbox->capacity = mailbox->len;
+            mem_charge(&server->memory, MEM_MAILBOXES, sizeof(struct MAILBOX) + mailbox->capacity);
+            client->mailbox = mailbox;
+        }
+        // Anyone not connected can still RESUME, with the full timeout from now.
+        // Connected clients have it cancelled again when their connection comes back.
+        if (client->resume_token[0] != '\0') {
+            timer_add(&server->timers, &client->resume_timer, SECONDS_TO_TICKS(server->config.resume_timeout));
+        }
+    }
+
+    int num_sessions = get_u32(&reader);
+    for (int i = 0; i < num_sessions && !reader.failed; i++) {
+        char session_id[MAX_SESSION_ID];
+        get_str(&reader, session_id, sizeof(session_id));
+        struct SESSION_INFO_NODE* session = create_session(server, session_id);
+        session->last_seq = get_u64(&reader);
+        get_bytes(&reader, &session->bucket, sizeof(session->bucket));
+        for (int slot = 0; slot < SESSION_CAP; slot++) {
+            char username[MAX_NAME];
+            get_str(&reader, username, sizeof(username));
+            struct CLIENT_INFO_NODE* client = username[0] != '\0' ? get_client_info(server, username) : NULL;
+            if (client != NULL && client->num_sessions < MAX_JOINED_SESSIONS) {
+                session->clients[slot] = client;
+                session->num_connected_client++;
+                client->sessions[client->num_sessions].session = session;
+                client->sessions[client->num_sessions].slot = slot;
+                client->num_sessions++;
+            }
+        }
+        session->home = get_u32(&reader);
+        get_bytes(&reader, session->remote_members, sizeof(session->remote_members));
+        for (int node = 0; node < MAX_NODES; node++) {
+            session->num_connected_client += session->remote_members[node];
+        }
+        // history_size may have changed, the newest messages are the ones that stay
+        int num_entries = get_u32(&reader);
+        for (int j = 0; j < num_entries && !reader.failed; j++) {
+            unsigned long long seq = get_u64(&reader);
+            size_t len;
+            char* data = get_blob(&reader, &len);
+            if (data != NULL) {
+                struct HISTORY_ENTRY* entry = &session->history[seq % session->history_size];
+                forget_history_entry(server, session, entry);
+                entry->seq = seq;
+                entry->plain = out_buffer_new(server, data, len);
+                index_history_entry(server, session, entry);
+            }
+        }
+    }
+
+    int num_connections = get_u32(&reader);
+    if (num_connections != num_fds) {
+        reader.failed = 1;
+    }
+    for (int i = 0; i < num_connections && !reader.failed; i++) {
+        int fd = fds[i];
+        unsigned int state = get_u32(&reader);
+        char username[MAX_NAME];
+        get_str(&reader, username, sizeof(username));
+        unsigned int compression = get_u32(&reader);
+        unsigned int local = get_u32(&reader);
+        unsigned int ping_outstanding = get_u32(&reader);
+        unsigned int query_deferred = get_u32(&reader);
+        unsigned long long dropped_frames = get_u64(&reader);
+        size_t in_len;
+        char* input = get_blob(&reader, &in_len);
+
+        struct CONNECTION* conn = NULL;
+        if (fd < server->max_connections) {
+            conn = open_connection(server, fd);
+        } else {
+            printf("Error - no room for connection %d, closing it\n", fd);
+            close(fd);
+        }
+        for (int lane = 0; lane < NUM_LANES; lane++) {
+            int num_chunks = get_u32(&reader);
+            for (int j = 0; j < num_chunks && !reader.failed; j++) {
+                size_t len;
+                char* data = get_blob(&reader, &len);
+                if (data != NULL && conn != NULL) {
+                    struct OUT_BUFFER* out = out_buffer_new(server, data, len);
+                    queue_to_client(server, fd, out, lane);
+                    out_buffer_release(server, out);
+                } else {
+                    free(data);
+                }
+            }
+        }
+        if (conn == NULL) {
+            free(input);
+            continue;
+        }
+
+        conn->compression = compression;
+        conn->local = local;
+        conn->ping_outstanding = ping_outstanding;
+        conn->dropped_frames = dropped_frames;
+        struct CLIENT_INFO_NODE* client = username[0] != '\0' ? get_client_info(server, username) : NULL;
+        if (state == CONN_LOGGED_IN && client != NULL) {
+            conn->state = CONN_LOGGED_IN;
+            conn->client = client;
+            client->sockfd = fd;
+            timer_cancel(&server->timers, &client->resume_timer);
+            timer_add(&server->timers, &conn->timer,
+                      SECONDS_TO_TICKS(ping_outstanding ? server->config.ping_timeout : server->config.idle_timeout));
+        }
+        if (query_deferred) {
+            conn->query_deferred_ms = now_ms(server);
+            server->num_deferred_queries++;
+        }
+        if (in_len > 0) {
+            // whatever complete messages are in there get handled on the first turn
+            if (in_len > (size_t) server->in_buf_size || take_input_buffer(server, conn) == -1) {
+                schedule_close(server, conn, "too much input to hand over");
+            } else {
+                memcpy(conn->in_buf, input, in_len);
+                conn->in_len = in_len;
+                pause_input(server, conn);
+                mark_ready(server, conn);
+            }
+        }
+        free(input);
+    }
+
+    if (get_u32(&reader) != SNAPSHOT_MAGIC) {
+        reader.failed = 1;
+    }
+    fclose(reader.fp);
+    if (reader.failed) {
+        printf("Error - the snapshot is cut short or corrupt\n");
+        return -1;
+    }
+    printf("Server: took over %d connections, %d users and %d sessions\n", num_connections, num_users, num_sessions);
+    return 0;
+}
+
+static int send_with_fds(int sock, const void* data, size_t len, const int* fds, int num_fds) {
+    char control[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = (void*) data, .iov_len = len};
+    struct msghdr header = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (num_fds > 0) {
+        header.msg_control = control;
+        header.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+    }
+    return sendmsg(sock, &header, MSG_NOSIGNAL) == (ssize_t) len ? 0 : -1;
+}
+
+// Receives exactly len bytes, returns how many descriptors came with them or -1
+static int recv_with_fds(int sock, void* data, size_t len, int* fds, int max_fds) {
+    char control[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+    struct iovec iov = {.iov_base = data, .iov_len = len};
+    struct msghdr header = {.msg_iov = &iov, .msg_iovlen = 1,
+                            .msg_control = control, .msg_controllen = CMSG_SPACE(max_fds * sizeof(int))};
+    if (recvmsg(sock, &header, MSG_WAITALL) != (ssize_t) len || (header.msg_flags & MSG_CTRUNC)) {
+        return -1;
+    }
+    int num_fds = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header); cmsg != NULL; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+        }
+    }
+    return num_fds;
+}
+
+void close_unmovable_connections(struct SERVER* server) {
+    for (struct BLOB_TRANSFER* transfer = server->blob_transfers; transfer != NULL; transfer = transfer->next) {
+        schedule_close(server, transfer->sender, "a file transfer can't be handed over");
+        for (int i = 0; i < transfer->num_targets; i++) {
+            if (transfer->targets[i] != NULL) {
+                schedule_close(server, transfer->targets[i], "a file transfer can't be handed over");
+            }
+        }
+    }
+    for (int i = 0; i <= server->highest_fd; i++) {
+        struct CONNECTION* conn = server->connections[i];
+        if (conn != NULL && (conn->chunk_active || conn->reserved_by != NULL || conn->shm != NULL
+                             || conn->peer != -1 || conn->replica || conn->replica_pending
+                             || conn->held_login != NULL)) {
+            schedule_close(server, conn, "can't be handed over");
+        }
+    }
+    close_pending_connections(server);
+}
+
+void hand_off(struct SERVER* server, int listen_fd, int tcp_fd, int unix_fd, int cluster_listen_fd, int replica_listen_fd) {
+    int sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock == -1) {
+        return;
+    }
+    struct ucred peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) == -1 || peer.uid != geteuid()) {
+        printf("Handoff: turned away a process of another user\n");
+        close(sock);
+        return;
+    }
+    struct timeval timeout = {.tv_sec = HANDOFF_TIMEOUT_S, .tv_usec = 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    printf("Handoff: process %d is taking over\n", (int) peer.pid);
+
+    // Their clients RESUME against the new server
+    close_unmovable_connections(server);
+
+    int num_connections = 0;
+    int snapshot_fd = write_snapshot(server, &num_connections, 0);
+    int* fds = malloc((num_connections + 1) * sizeof(int));
+    int n = 0;
+    for (int i = 0; i <= server->highest_fd; i++) {
+        if (server->connections[i] != NULL) {
+            fds[n++] = i;
+        }
+    }
+
+    struct HANDOFF_HEADER header = {.magic = HANDOFF_MAGIC, .num_connections = num_connections,
+                                    .has_unix = (unix_fd != -1), .has_cluster = (cluster_listen_fd != -1),
+                                    .has_replica = (replica_listen_fd != -1)};
+    int listeners[6] = {snapshot_fd, tcp_fd, listen_fd};
+    int num_listeners = 3;
+    if (unix_fd != -1) {
+        listeners[num_listeners++] = unix_fd;
+    }
+    if (cluster_listen_fd != -1) {
+        listeners[num_listeners++] = cluster_listen_fd;
+    }
+    if (replica_listen_fd != -1) {
+        listeners[num_listeners++] = replica_listen_fd;
+    }
+    int ok = (snapshot_fd != -1 && send_with_fds(sock, &header, sizeof(header), listeners, num_listeners) == 0);
+    for (int sent = 0; ok && sent < num_connections; ) {
+        int batch = num_connections - sent < HANDOFF_FDS_PER_MSG ? num_connections - sent : HANDOFF_FDS_PER_MSG;
+        ok = (send_with_fds(sock, &batch, sizeof(batch), fds + sent, batch) == 0);
+        sent += batch;
+    }
+    free(fds);
+    if (snapshot_fd != -1) {
+        close(snapshot_fd);
+    }
+
+    // The new server says when it has everything, and only starts once we're out of its way
+    char answer;
+    if (ok && recv(sock, &answer, 1, MSG_WAITALL) == 1 && answer == 'K') {
+        // so every segment is finished before the new server starts on the archive directory
+        archiver_stop(&server->archiver);
+        if (send(sock, "B", 1, MSG_NOSIGNAL) == 1) {
+            printf("Handoff: %d connections handed over, exiting\n", num_connections);
+            capture_close(&server->capture);
+            exit(0);
+        }
+        if (start_archiver(server) == -1) {
+            printf("Error - can't archive to %s any more: %s\n", server->config.archive_dir, strerror(errno));
+        }
+    }
+    printf("Handoff failed, carrying on\n");
+    close(sock);
+}
+
+int take_over(struct SERVER* server, const char* path, int* tcp_fd, int* unix_fd, int* handoff_fd, int* cluster_listen_fd,
+              int* replica_listen_fd) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Error - the handoff socket path is too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        printf("Error - can't reach a server at %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct timeval timeout = {.tv_sec = HANDOFF_TIMEOUT_S, .tv_usec = 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    struct HANDOFF_HEADER header;
+    int listeners[6] = {-1, -1, -1, -1, -1, -1};
+    int num_listeners = recv_with_fds(sock, &header, sizeof(header), listeners, 6);
+    if (num_listeners == -1 || header.magic != HANDOFF_MAGIC || header.num_connections < 0
+        || num_listeners != 3 + (header.has_unix != 0) + (header.has_cluster != 0) + (header.has_replica != 0)) {
+        printf("Error - the old server didn't hand anything over\n");
+        close(sock);
+        return -1;
+    }
+
+    int* fds = malloc((header.num_connections + 1) * sizeof(int));
+    int received = 0;
+    while (received < header.num_connections) {
+        int batch;
+        int num_fds = recv_with_fds(sock, &batch, sizeof(batch), fds + received, HANDOFF_FDS_PER_MSG);
+        if (num_fds == -1 || num_fds != batch || received + num_fds > header.num_connections) {
+            printf("Error - the old server stopped handing over connections\n");
+            close(sock);
+            return -1;
+        }
+        received += num_fds;
+    }
+
+    int result = read_snapshot(server, listeners[0], fds, received);
+    free(fds);
+    char answer;
+    if (result == -1 || send(sock, "K", 1, MSG_NOSIGNAL) != 1
+        || recv(sock, &answer, 1, MSG_WAITALL) != 1 || answer != 'B') {
+        // the old server may still be running, and it's the one that gets to keep going
+        printf("Error - the handoff didn't go through\n");
+        close(sock);
+        return -1;
+    }
+    close(sock);
+
+    *tcp_fd = listeners[1];
+    *handoff_fd = listeners[2];
+    *unix_fd = header.has_unix ? listeners[3] : -1;
+    *cluster_listen_fd = header.has_cluster ? listeners[3 + (header.has_unix != 0)] : -1;
+    *replica_listen_fd = header.has_replica
+                         ? listeners[3 + (header.has_unix != 0) + (header.has_cluster != 0)] : -1;
+    if (server->config.handoff_socket == NULL) {
+        server->config.handoff_socket = path;
+    }
+    return 0;
+}
+
+// The ring needs hashes that spread out even for names that differ in one character
+static unsigned long long ring_hash(const char* key) {
+    unsigned long long hash = hash_name(key);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static int compare_ring_points(const void* a, const void* b) {
+    const struct RING_POINT* x = a;
+    const struct RING_POINT* y = b;
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+void setup_cluster(struct SERVER* server, const char* list) {
+    char* copy = strdup(list);
+    char* saveptr;
+    for (char* entry = strtok_r(copy, ",", &saveptr); entry != NULL; entry = strtok_r(NULL, ",", &saveptr)) {
+        char* colon = strrchr(entry, ':');
+        if (server->num_nodes == MAX_NODES || colon == NULL || colon == entry
+            || colon - entry >= (int) sizeof(server->nodes[0].host) || strlen(colon + 1) >= sizeof(server->nodes[0].port)) {
+            printf("Error - cluster has to be up to %d <host>:<port> separated by ','\n", MAX_NODES);
+            exit(1);
+        }
+        struct CLUSTER_NODE* node = &server->nodes[server->num_nodes];
+        memcpy(node->host, entry, colon - entry);
+        node->host[colon - entry] = '\0';
+        strcpy(node->port, colon + 1);
+        node->server = server;
+        node->link = NULL;
+        timer_init(&node->retry_timer, node_retry, node);
+        node->frames_sent = 0;
+        node->frames_received = 0;
+
+        // the points are named after the node rather than its index, so that adding one
+        // to the list doesn't move everything else around
+        for (int point = 0; point < RING_POINTS_PER_NODE; point++) {
+            char name[sizeof(node->host) + sizeof(node->port) + 16];
+            snprintf(name, sizeof(name), "%s:%s#%d", node->host, node->port, point);
+            server->ring[server->num_ring_points].hash = ring_hash(name);
+            server->ring[server->num_ring_points].node = server->num_nodes;
+            server->num_ring_points++;
+        }
+        server->num_nodes++;
+    }
+    free(copy);
+    if (server->config.node < 0 || server->config.node >= server->num_nodes) {
+        printf("Error - node has to be between 0 and %d\n", server->num_nodes - 1);
+        exit(1);
+    }
+    server->local_node = server->config.node;
+    server->cluster_hash = ring_hash(list);
+    qsort(server->ring, server->num_ring_points, sizeof(struct RING_POINT), compare_ring_points);
+}
+
+int home_node(struct SERVER* server, const char* key) {
+    if (server->num_nodes == 0) {
+        return server->local_node;
+    }
+    // the first point at or after the key's hash, going round
+    unsigned long long hash = ring_hash(key);
+    int low = 0;
+    int high = server->num_ring_points;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (server->ring[mid].hash < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return server->ring[low == server->num_ring_points ? 0 : low].node;
+}
+
+void connect_to_node(struct SERVER* server, int node) {
+    struct addrinfo hints;
+    struct addrinfo* info;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int fd = -1;
+    if (getaddrinfo(server->nodes[node].host, server->nodes[node].port, &hints, &info) == 0) {
+        fd = socket(info->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd != -1 && connect(fd, info->ai_addr, info->ai_addrlen) == -1 && errno != EINPROGRESS) {
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(info);
+    }
+    if (fd != -1 && fd >= server->max_connections) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1) {
+        timer_add(&server->timers, &server->nodes[node].retry_timer, SECONDS_TO_TICKS(NODE_RETRY_S));
+        return;
+    }
+    // frames are batched per loop iteration already, Nagle would only hold them back
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    // The HELLO goes out once the connection is made. Until the answer it's a link in
+    // the making, which prelogin_timeout gives up on like on a client that doesn't log in.
+    struct CONNECTION* conn = open_connection(server, fd);
+    conn->peer = node;
+    struct message hello;
+    message_init(&hello, NODE_HELLO);
+    strcpy(hello.source, "SERVER");
+    hello.seq = server->cluster_hash;
+    message_printf(&hello, "%d %s", server->local_node, server->config.cluster_key);
+    send_message_to_client(server, fd, &hello);
+    message_release(&hello);
+}
+
+void node_retry(struct TIMER* timer, void* arg) {
+    struct CLUSTER_NODE* node = arg;
+    struct SERVER* server = node->server;
+    if (node->link == NULL) {
+        connect_to_node(server, node - server->nodes);
+    }
+}
+
+int send_to_node(struct SERVER* server, int node, struct message* msg) {
+    if (node < 0 || node >= server->num_nodes || server->nodes[node].link == NULL || server->nodes[node].link->closing) {
+        return -1;
+    }
+    int len;
+    char* buf = encode_message(msg, -1, &len);
+    struct OUT_BUFFER* out = out_buffer_new(server, buf, len);
+    queue_to_client(server, server->nodes[node].link->sockfd, out, LANE_CONTROL);
+    out_buffer_release(server, out);
+    server->nodes[node].frames_sent++;
+    return 0;
+}
+
+void handle_node_message(struct SERVER* server, struct CONNECTION* conn, struct message* msg) {
+    if (conn->state == CONN_PRE_LOGIN) {
+        if (msg->type != NODE_HELLO) {
+            schedule_close(server, conn, "another node sent something before its NODE_HELLO");
+        } else {
+            handle_node_hello(server, conn, msg);
+        }
+        return;
+    }
+
+    int node = conn->peer;
+    server->nodes[node].frames_received++;
+    struct SESSION_INFO_NODE* session;
+    struct CLIENT_INFO_NODE* client;
+    switch (msg->type) {
+        case JOIN:
+        case NEW_SESS:
+            handle_node_join(server, node, msg);
+            break;
+        case JN_ACK:
+        case JN_NAK:
+        case NS_ACK:
+        case NS_NAK:
+            finish_node_join(server, node, msg);
+            break;
+        case LEAVE_SESS:
+            session = get_session_info(server, msg->data);
+            if (session != NULL && session->home == server->local_node && session->remote_members[node] > 0) {
+                drop_remote_member(server, session, node);
+            }
+            break;
+        case MESSAGE:
+            session = get_session_info(server, msg->session_id);
+            if (msg->seq != 0) {
+                accept_session_message(server, node, msg);
+            } else if (session != NULL && session->home == server->local_node && session->remote_members[node] > 0) {
+                // from a member there, to be numbered here
+                broadcast_session_message(server, session, msg);
+            }
+            break;
+        case DM_MSG:
+            client = get_client_info(server, msg->to);
+            if (client != NULL && route_dm(server, msg, client) == -1) {
+                server->mailbox_refused++;
+                struct message nak;
+                message_init(&nak, DM_NAK);
+                strcpy(nak.source, "SERVER");
+                strcpy(nak.to, msg->source);
+                message_printf(&nak, "The receiving client is not online, and can't take more messages until they are");
+                send_to_node(server, node, &nak);
+            }
+            break;
+        case DM_NAK:
+            client = get_client_info(server, msg->to);
+            if (client != NULL && client->sockfd != -1) {
+                msg->to[0] = '\0';
+                send_message_to_client(server, client->sockfd, msg);
+            }
+            break;
+        case QUERY: {
+            struct message reply;
+            message_init(&reply, QU_ACK);
+            strcpy(reply.source, "SERVER");
+            reply.seq = msg->seq;
+            list_users(server, &reply);
+            send_to_node(server, node, &reply);
+            message_release(&reply);
+            break;
+        }
+        case QU_ACK:
+            gather_query_answer(server, node, msg);
+            break;
+        case NODE_MEMBERS:
+            handle_node_members(server, node, msg);
+            break;
+        case NODE_PRESENCE:
+            handle_node_presence(server, node, msg);
+            break;
+        case NODE_SYNCED:
+            handle_node_synced(server, node);
+            break;
+        case NODE_CLAIM:
+            if (msg->to[0] == '\0') {
+                handle_node_claim(server, node, msg);
+            } else {
+                finish_node_claim(server, node, msg);
+            }
+            break;
+        case PING: {
+            struct message pong;
+            message_init(&pong, PONG);
+            strcpy(pong.source, "SERVER");
+            send_to_node(server, node, &pong);
+            break;
+        }
+        case PONG:
+            break;
+        default:
+            printf("Node %d sent a message of type %d, which isn't used between nodes\n", node, msg->type);
+            break;
+    }
+}
+
+void handle_node_hello(struct SERVER* server, struct CONNECTION* conn, struct message* msg) {
+    char* end;
+    long node = strtol(msg->data, &end, 10);
+    if (end == msg->data || *end != ' ' || !keys_match(end + 1, server->config.cluster_key)) {
+        // the node list is no secret, so anyone could say they're one of them
+        schedule_close(server, conn, "doesn't have the cluster_key");
+        return;
+    }
+    if (node < 0 || node >= server->num_nodes || node == server->local_node) {
+        schedule_close(server, conn, "isn't a node of this cluster");
+        return;
+    }
+    if (msg->seq != server->cluster_hash) {
+        // the two of them would put sessions in different places
+        schedule_close(server, conn, "has a different cluster list");
+        return;
+    }
+    if (conn->peer != PEER_UNIDENTIFIED && conn->peer != node) {
+        schedule_close(server, conn, "answered for another node");
+        return;
+    }
+
+    if (conn->peer == PEER_UNIDENTIFIED) {
+        // they dialled, so they get a HELLO back. A link they had before is dead.
+        if (server->nodes[node].link != NULL) {
+            struct CONNECTION* old = server->nodes[node].link;
+            server->nodes[node].link = NULL;
+            schedule_close(server, old, "replaced by a new link");
+        }
+        conn->peer = node;
+        struct message hello;
+        message_init(&hello, NODE_HELLO);
+        strcpy(hello.source, "SERVER");
+        hello.seq = server->cluster_hash;
+        message_printf(&hello, "%d %s", server->local_node, server->config.cluster_key);
+        send_message_to_client(server, conn->sockfd, &hello);
+        message_release(&hello);
+    }
+    conn->state = CONN_LOGGED_IN;
+    timer_add(&server->timers, &conn->timer, SECONDS_TO_TICKS(server->config.idle_timeout));
+    node_link_up(server, node, conn);
+}
+
+void node_link_up(struct SERVER* server, int node, struct CONNECTION* conn) {
+    server->nodes[node].link = conn;
+    timer_cancel(&server->timers, &server->nodes[node].retry_timer);
+    printf("Cluster: link to node %d (%s:%s) is up\n", node, server->nodes[node].host, server->nodes[node].port);
+
+    // Whatever it told us before may have changed while the link was down, it says again
+    for (struct SESSION_INFO_NODE* session = server->session_info_head; session != NULL; session = session->next) {
+        if (session->home == server->local_node && session->remote_members[node] > 0) {
+            session->unsynced |= 1u << node;
+        }
+    }
+    for (struct CLIENT_INFO_NODE* client = server->client_info_head; client != NULL; client = client->next) {
+        if (client->node == node) {
+            client->node = -1;
+        }
+    }
+
+    // and so do we: the members of its sessions, and the users it's home to, that are here
+    for (struct SESSION_INFO_NODE* session = server->session_info_head; session != NULL; session = session->next) {
+        if (session->home == node) {
+            struct message members;
+            message_init(&members, NODE_MEMBERS);
+            strcpy(members.source, "SERVER");
+            strcpy(members.session_id, session->session_id);
+            members.seq = session->last_seq;
+            message_printf(&members, "%d", session->num_connected_client);
+            send_to_node(server, node, &members);
+        }
+    }
+    for (struct CLIENT_INFO_NODE* client = server->client_info_head; client != NULL; client = client->next) {
+        if (client->sockfd != -1 && home_node(server, client->username) == node) {
+            announce_presence(server, client);
+        }
+    }
+    struct message synced;
+    message_init(&synced, NODE_SYNCED);
+    strcpy(synced.source, "SERVER");
+    send_to_node(server, node, &synced);
+}
+
+void node_link_down(struct SERVER* server, struct CONNECTION* conn) {
+    int node = conn->peer;
+    if (node == PEER_UNIDENTIFIED) {
+        return;
+    }
+    if (server->nodes[node].link == conn) {
+        server->nodes[node].link = NULL;
+        printf("Cluster: lost the link to node %d\n", node);
+
+        // Its members stay where they are, they're announced again when it's back.
+        // QUERYs stop waiting for it.
+        struct PENDING_QUERY* query = server->pending_queries;
+        while (query != NULL) {
+            struct PENDING_QUERY* next = query->next;
+            query->waiting &= ~(1u << node);
+            if (query->waiting == 0) {
+                finish_query(server, query);
+            }
+            query = next;
+        }
+    }
+    if (node > server->local_node && server->nodes[node].link == NULL) {
+        // this side makes the link, so it keeps trying
+        timer_add(&server->timers, &server->nodes[node].retry_timer, SECONDS_TO_TICKS(NODE_RETRY_S));
+    }
+}
+
+void handle_node_join(struct SERVER* server, int node, struct message* msg) {
+    struct message reply;
+    message_init(&reply, msg->type == JOIN ? JN_NAK : NS_NAK);
+    strcpy(reply.source, "SERVER");
+    strcpy(reply.to, msg->source);
+
+    struct SESSION_INFO_NODE* session = get_session_info(server, msg->data);
+    if (msg->type == JOIN && session == NULL) {
+        message_printf(&reply, "%s - you entered an invalid session ID", msg->data);
+    } else if (msg->type == NEW_SESS && session_id_problem(msg->data, msg->size) != NULL) {
+        message_printf(&reply, "%s - %s", msg->data, session_id_problem(msg->data, msg->size));
+    } else if (msg->type == NEW_SESS && session != NULL) {
+        message_printf(&reply, "%s - a session already exists with this name", msg->data);
+    } else if (session != NULL && session->num_connected_client >= SESSION_CAP) {
+        message_printf(&reply, "%s - the session is full!", msg->data);
+    } else if (mem_pressure(&server->memory) != MEM_OK) {
+        server->memory.refused_joins++;
+        message_printf(&reply, "%s - the server is busy, try again later", msg->data);
+    } else {
+        if (session == NULL) {
+            session = create_session(server, msg->data);
+        }
+        session->remote_members[node]++;
+        session->num_connected_client++;
+        reply.type = msg->type == JOIN ? JN_ACK : NS_ACK;
+        message_printf(&reply, "%s", session->session_id);
+    }
+    send_to_node(server, node, &reply);
+    message_release(&reply);
+}
+
+void finish_node_join(struct SERVER* server, int node, struct message* msg) {
+    struct CLIENT_INFO_NODE* client = get_client_info(server, msg->to);
+    if (msg->type == JN_ACK || msg->type == NS_ACK) {
+        struct SESSION_INFO_NODE* session = get_session_info(server, msg->data);
+        if (client == NULL || client->sockfd == -1 || client->num_sessions == MAX_JOINED_SESSIONS
+            || (session != NULL && find_membership(client, session) != -1)) {
+            // they left, or asked twice, in the meantime, so the place goes back
+            struct message leave;
+            message_init(&leave, LEAVE_SESS);
+            strcpy(leave.source, msg->to);
+            message_printf(&leave, "%s", msg->data);
+            send_to_node(server, node, &leave);
+            return;
+        }
+        if (session == NULL) {
+            session = create_session(server, msg->data);
+            session->home = node;
+        }
+        add_user_to_session(server, session, client);
+    }
+    if (client != NULL && client->sockfd != -1) {
+        msg->to[0] = '\0';
+        send_message_to_client(server, client->sockfd, msg);
+    }
+}
+
+void drop_remote_member(struct SERVER* server, struct SESSION_INFO_NODE* session, int node) {
+    session->remote_members[node]--;
+    session->num_connected_client--;
+    if (session->num_connected_client == 0) {
+        delete_session(server, session);
+    }
+}
+
+void handle_node_members(struct SERVER* server, int node, struct message* msg) {
+    struct SESSION_INFO_NODE* session = get_session_info(server, msg->session_id);
+    int count = atoi(msg->data);
+    if (count < 0 || count > SESSION_CAP || (session != NULL && session->home != server->local_node)) {
+        printf("Node %d has members in %s, which isn't this node's\n", node, msg->session_id);
+        return;
+    }
+    if (session == NULL) {
+        if (count == 0) {
+            return;
+        }
+        // This node restarted, and the session lives on in the others. Its numbers
+        // carry on from the last message they saw.
+        session = create_session(server, msg->session_id);
+    }
+    if (msg->seq > session->last_seq) {
+        session->last_seq = msg->seq;
+    }
+    session->num_connected_client += count - session->remote_members[node];
+    session->remote_members[node] = count;
+    session->unsynced &= ~(1u << node);
+
+    if (session->num_connected_client == 0) {
+        delete_session(server, session);
+    } else if (count > 0) {
+        // what they missed while the link was down
+        replay_history(server, session, msg->seq, server->nodes[node].link->sockfd);
+    }
+}
+
+void handle_node_synced(struct SERVER* server, int node) {
+    struct SESSION_INFO_NODE* session = server->session_info_head;
+    while (session != NULL) {
+        struct SESSION_INFO_NODE* next = session->next;
+        if (session->unsynced & (1u << node)) {
+            session->unsynced &= ~(1u << node);
+            session->num_connected_client -= session->remote_members[node];
+            session->remote_members[node] = 0;
+            if (session->num_connected_client == 0) {
+                delete_session(server, session);
+            }
+        }
+        session = next;
+    }
+}
+
+void handle_node_presence(struct SERVER* server, int node, struct message* msg) {
+    struct CLIENT_INFO_NODE* client = get_client_info(server, msg->source);
+    if (client == NULL) {
+        return;
+    }
+    if (strcmp(msg->data, "1") == 0) {
+        client->node = node;
+        // the mailbox is kept here, and goes to them there
+        deliver_mailbox(server, client, server->nodes[node].link->sockfd);
+    } else if (client->node == node) {
+        client->node = -1;
+    }
+}
+
+void announce_presence(struct SERVER* server, struct CLIENT_INFO_NODE* client) {
+    if (server->num_nodes == 0 || home_node(server, client->username) == server->local_node) {
+        return;
+    }
+    struct message presence;
+    message_init(&presence, NODE_PRESENCE);
+    strcpy(presence.source, client->username);
+    message_printf(&presence, "%d", client->sockfd != -1);
+    send_to_node(server, home_node(server, client->username), &presence);
+}
+
+int ask_home(struct SERVER* server, struct CONNECTION* conn, struct message* msg) {
+    struct CLIENT_INFO_NODE* client = get_client_info(server, msg->source);
+    if (server->num_nodes == 0 || client == NULL || home_node(server, client->username) == server->local_node) {
+        return -1;
+    }
+    // Without the password or the token the user isn't asked about, and gets the usual answer
+    if (msg->type == LOGIN && strcmp(msg->data, client->password) != 0) {
+        return -1;
+    }
+    char token[RESUME_TOKEN_LEN] = "";
+    size_t token_len = strcspn(msg->data, "\n");
+    if (token_len < sizeof(token)) {
+        memcpy(token, msg->data, token_len);
+        token[token_len] = '\0';
+    }
+    if (msg->type == RESUME && (client->resume_token[0] == '\0' || !keys_match(token, client->resume_token))) {
+        return -1;
+    }
+
+    struct message nak;
+    message_init(&nak, msg->type == LOGIN ? LO_NAK : RS_NAK);
+    strcpy(nak.source, "SERVER");
+    if (client->sockfd != -1 || client->claim_sockfd != -1) {
+        message_printf(&nak, "You have already logged in elsewhere");
+    } else {
+        struct message claim;
+        message_init(&claim, NODE_CLAIM);
+        strcpy(claim.source, client->username);
+        claim.seq = ++server->claim_seq;
+        if (send_to_node(server, home_node(server, client->username), &claim) == 0) {
+            // it goes ahead once the home agrees, prelogin_timeout gives up on the home
+            int len;
+            char* frame = encode_message(msg, -1, &len);
+            conn->held_login = buf_to_message(frame, len);
+            free(frame);
+            client->claim_sockfd = conn->sockfd;
+            client->claim_seq = claim.seq;
+            return 0;
+        }
+        message_printf(&nak, "the user's server can't be reached");
+        nak.retry_after = server->config.retry_after;
+    }
+    send_message_to_client(server, conn->sockfd, &nak);
+    message_release(&nak);
+    schedule_close(server, conn, msg->type == LOGIN ? "login failed" : "resume failed");
+    return 0;
+}
+
+void handle_node_claim(struct SERVER* server, int node, struct message* msg) {
+    struct CLIENT_INFO_NODE* client = get_client_info(server, msg->source);
+    struct message reply;
+    message_init(&reply, NODE_CLAIM);
+    strcpy(reply.source, "SERVER");
+    strcpy(reply.to, msg->source);
+    reply.seq = msg->seq;
+    if (client == NULL || client->sockfd != -1 || (client->node != -1 && client->node != node)) {
+        message_printf(&reply, "0");
+    } else {
+        client->node = node;
+        if (client->resume_token[0] != '\0') {
+            // a login there replaces what's left here of one that dropped, as it would here
+            timer_cancel(&server->timers, &client->resume_timer);
+            remove_user_from_all_sessions(server, client);
+            client->resume_token[0] = '\0';
+
+            struct message record;
+            message_init(&record, EXIT);
+            strcpy(record.source, client->username);
+            replicate(server, &record);
+        }
+        message_printf(&reply, "1");
+    }
+    send_to_node(server, node, &reply);
+}
+
+void finish_node_claim(struct SERVER* server, int node, struct message* msg) {
+    struct CLIENT_INFO_NODE* client = get_client_info(server, msg->to);
+    if (client == NULL || node != home_node(server, client->username)) {
+        return;
+    }
+    if (client->claim_sockfd == -1 || client->claim_seq != msg->seq) {
+        // whoever asked has gone, so the home is told where they really are
+        if (client->claim_sockfd == -1 && strcmp(msg->data, "1") == 0) {
+            announce_presence(server, client);
+        }
+        return;
+    }
+    struct CONNECTION* conn = server->connections[client->claim_sockfd];
+    struct message* held = conn->held_login;
+    conn->held_login = NULL;
+    client->claim_sockfd = -1;
+
+    if (conn->closing) {
+        if (strcmp(msg->data, "1") == 0) {
+            announce_presence(server, client);
+        }
+    } else if (strcmp(msg->data, "1") == 0) {
+        login_or_resume(server, conn, held);
+        if (client->sockfd != conn->sockfd) {
+            announce_presence(server, client);
+        }
+    } else {
+        struct message nak;
+        message_init(&nak, held->type == LOGIN ? LO_NAK : RS_NAK);
+        strcpy(nak.source, "SERVER");
+        message_printf(&nak, "You have already logged in elsewhere");
+        send_message_to_client(server, conn->sockfd, &nak);
+        schedule_close(server, conn, held->type == LOGIN ? "login failed" : "resume failed");
+    }
+    free(held);
+}
+
+void accept_session_message(struct SERVER* server, int node, struct message* msg) {
+    struct SESSION_INFO_NODE* session = get_session_info(server, msg->session_id);
+    if (session == NULL || session->home != node || msg->seq <= session->last_seq) {
+        // nobody here is in it any more, or it was replayed and has been seen
+        return;
+    }
+    session->last_seq = msg->seq;
+    deliver_session_message(server, session, msg, 0);
+}
+
+int ask_other_nodes(struct SERVER* server, int sockfd, const char* username) {
+    unsigned int waiting = 0;
+    for (int node = 0; node < server->num_nodes; node++) {
+        if (server->nodes[node].link != NULL && !server->nodes[node].link->closing) {
+            waiting |= 1u << node;
+        }
+    }
+    if (waiting == 0) {
+        return -1;
+    }
+
+    struct PENDING_QUERY* query = malloc(sizeof(struct PENDING_QUERY));
+    query->server = server;
+    query->id = server->next_query_id++;
+    query->sockfd = sockfd;
+    strcpy(query->username, username);
+    query->waiting = waiting;
+    message_init(&query->reply, QU_ACK);
+    strcpy(query->reply.source, "SERVER");
+    list_users(server, &query->reply);
+    timer_init(&query->timer, query_expired, query);
+    timer_add(&server->timers, &query->timer, SECONDS_TO_TICKS(NODE_QUERY_TIMEOUT_S));
+    query->next = server->pending_queries;
+    server->pending_queries = query;
+
+    struct message ask;
+    message_init(&ask, QUERY);
+    strcpy(ask.source, "SERVER");
+    ask.seq = query->id;
+    for (int node = 0; node < server->num_nodes; node++) {
+        if (waiting & (1u << node)) {
+            send_to_node(server, node, &ask);
+        }
+    }
+    return 0;
+}
+
+void gather_query_answer(struct SERVER* server, int node, struct message* msg) {
+    struct PENDING_QUERY* query = server->pending_queries;
+    while (query != NULL && query->id != msg->seq) {
+        query = query->next;
+    }
+    if (query == NULL || !(query->waiting & (1u << node))) {
+        // it was answered without this node already
+        return;
+    }
+    // cut off at max_data, like a single node's list
+    message_appendf(&query->reply, "%s", msg->data);
+    query->waiting &= ~(1u << node);
+    if (query->waiting == 0) {
+        finish_query(server, query);
+    }
+}
+
+void finish_query(struct SERVER* server, struct PENDING_QUERY* query) {
+    struct PENDING_QUERY** link = &server->pending_queries;
+    while (*link != query) {
+        link = &(*link)->next;
+    }
+    *link = query->next;
+    timer_cancel(&server->timers, &query->timer);
+
+    // the connection may have closed, or even been reused, in the meantime
+    struct CLIENT_INFO_NODE* client = get_client_info(server, query->username);
+    if (client != NULL && client->sockfd == query->sockfd) {
+        send_message_to_client(server, query->sockfd, &query->reply);
+    }
+    message_release(&query->reply);
+    free(query);
+}
+
+void query_expired(struct TIMER* timer, void* arg) {
+    struct PENDING_QUERY* query = arg;
+    finish_query(query->server, query);
+}
+
+int keys_match(const char* given, const char* key) {
+    size_t given_len = strlen(given);
+    size_t key_len = strlen(key);
+    unsigned char diff = given_len != key_len;
+    for (size_t i = 0; i < key_len; i++) {
+        diff |= key[i] ^ given[i < given_len ? i : given_len];
+    }
+    return diff == 0;
+}
+
+void handle_replica_hello(struct SERVER* server, struct CONNECTION* conn, struct message* msg) {
+    if (msg->type != REPL_HELLO || !keys_match(msg->data, server->config.replica_key)) {
+        // the standby that's following stays, this was only someone who could reach the port
+        schedule_close(server, conn, "isn't a standby with the replica_key");
+        return;
+    }
+    conn->replica_pending = 0;
+    start_replica(server, conn);
+}
+
+void start_replica(struct SERVER* server, struct CONNECTION* conn) {
+    int num_connections;
+    int snapshot_fd = write_snapshot(server, &num_connections, 1);
+    struct stat st;
+    char* snapshot = NULL;
+    size_t len = 0;
+    if (snapshot_fd != -1 && fstat(snapshot_fd, &st) == 0) {
+        snapshot = malloc(st.st_size > 0 ? st.st_size : 1);
+        while (len < (size_t) st.st_size) {
+            ssize_t n = pread(snapshot_fd, snapshot + len, st.st_size - len, len);
+            if (n <= 0) {
+                break;
+            }
+            len += n;
+        }
+    }
+    if (snapshot_fd != -1) {
+        close(snapshot_fd);
+    }
+    if (snapshot == NULL || len != (size_t) st.st_size) {
+        free(snapshot);
+        schedule_close(server, conn, "couldn't make a snapshot for the standby");
+        return;
+    }
+
+    // There's only ever one standby, the newest
+    if (server->replication.link != NULL) {
+        schedule_close(server, server->replication.link, "replaced by a new standby");
+        replica_link_down(server, server->replication.link);
+    }
+    conn->replica = 1;
+    conn->state = CONN_LOGGED_IN;
+    timer_add(&server->timers, &conn->timer, SECONDS_TO_TICKS(server->config.idle_timeout));
+    int yes = 1;
+    setsockopt(conn->sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    struct message header;
+    message_init(&header, REPL_SNAPSHOT);
+    strcpy(header.source, "SERVER");
+    message_printf(&header, "%zu", len);
+    send_message_to_client(server, conn->sockfd, &header);
+    struct OUT_BUFFER* out = out_buffer_new(server, snapshot, len);
+    queue_to_client(server, conn->sockfd, out, LANE_CONTROL);
+    out_buffer_release(server, out);
+
+    server->replication.link = conn;
+    server->replication.snapshot_len = len;
+    server->replication.records_sent = 0;
+    server->replication.records_acked = 0;
+    server->replication.lag_ms = 0;
+    timer_add(&server->timers, &server->replication.heartbeat_timer, SECONDS_TO_TICKS(REPLICA_HEARTBEAT_S));
+    printf("Replication: a standby is following, snapshot of %zu bytes\n", len);
+}
+
+void replicate(struct SERVER* server, struct message* record) {
+    if (server->replication.link == NULL) {
+        return;
+    }
+    int len;
+    char* buf = encode_message(record, -1, &len);
+    struct OUT_BUFFER* out = out_buffer_new(server, buf, len);
+    replicate_buffer(server, out);
+    out_buffer_release(server, out);
+}
+
+void replicate_buffer(struct SERVER* server, struct OUT_BUFFER* buf) {
+    struct CONNECTION* link = server->replication.link;
+    if (link == NULL || link->closing) {
+        return;
+    }
+    queue_to_client(server, link->sockfd, buf, LANE_CONTROL);
+    server->replication.records_sent++;
+
+    // The standby is what gives, never the clients it's following for
+    if (server->config.replica_lag_limit > 0
+        && link->out_bytes > server->replication.snapshot_len + (size_t) server->config.replica_lag_limit * 1024) {
+        server->replication.standbys_dropped++;
+        schedule_close(server, link, "the standby fell too far behind");
+    }
+}
+
+void replica_heartbeat(struct TIMER* timer, void* arg) {
+    struct SERVER* server = arg;
+    if (server->replication.link == NULL || server->replication.link->closing) {
+        return;
+    }
+    struct message heartbeat;
+    message_init(&heartbeat, REPL_HEARTBEAT);
+    strcpy(heartbeat.source, "SERVER");
+    heartbeat.seq = server->replication.records_sent;
+    message_printf(&heartbeat, "%llu", now_ms(server));
+    send_message_to_client(server, server->replication.link->sockfd, &heartbeat);
+    timer_add(&server->timers, timer, SECONDS_TO_TICKS(REPLICA_HEARTBEAT_S));
+}
+
+void handle_replica_message(struct SERVER* server, struct CONNECTION* conn, struct message* msg) {
+    switch (msg->type) {
+        case REPL_ACK: {
+            unsigned long long sent_ms = strtoull(msg->data, NULL, 10);
+            unsigned long long now = now_ms(server);
+            server->replication.records_acked = msg->seq;
+            server->replication.lag_ms = now > sent_ms ? now - sent_ms : 0;
+            break;
+        }
+        case PING: {
+            struct message pong;
+            message_init(&pong, PONG);
+            strcpy(pong.source, "SERVER");
+            send_message_to_client(server, conn->sockfd, &pong);
+            break;
+        }
+        case PONG:
+            break;
+        default:
+            printf("The standby sent a message of type %d, which isn't used by standbys\n", msg->type);
+            break;
+    }
+}
+
+void replica_link_down(struct SERVER* server, struct CONNECTION* conn) {
+    if (server->replication.link == conn) {
+        server->replication.link = NULL;
+        timer_cancel(&server->timers, &server->replication.heartbeat_timer);
+        printf("Replication: the standby is gone\n");
+    }
+}
+
+int connect_to_primary(const char* host, const char* port) {
+    struct addrinfo hints;
+    struct addrinfo* info;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &info) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo* curr = info; curr != NULL && fd == -1; curr = curr->ai_next) {
+        fd = socket(curr->ai_family, curr->ai_socktype | SOCK_CLOEXEC, curr->ai_protocol);
+        if (fd != -1 && connect(fd, curr->ai_addr, curr->ai_addrlen) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(info);
+    return fd;
+}
+
+void run_standby(struct SERVER* server, const char* address) {
+    char host[256];
+    const char* colon = strrchr(address, ':');
+    if (colon == NULL || colon == address || colon - address >= (int) sizeof(host)) {
+        printf("Error - standby has to be <host>:<port>\n");
+        exit(1);
+    }
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+    const char* port = colon + 1;
+
+    int sock = connect_to_primary(host, port);
+    if (sock == -1) {
+        printf("Error - can't reach the primary at %s: %s\n", address, strerror(errno));
+        exit(1);
+    }
+    struct message hello;
+    message_init(&hello, REPL_HELLO);
+    strcpy(hello.source, "SERVER");
+    message_printf(&hello, "%s", server->config.replica_key);
+    int hello_len;
+    char* hello_frame = encode_message(&hello, -1, &hello_len);
+    send(sock, hello_frame, hello_len, MSG_NOSIGNAL);
+    free(hello_frame);
+    message_release(&hello);
+    printf("Standby: following the primary at %s\n", address);
+    struct timeval timeout = {.tv_sec = server->config.standby_timeout > 0 ? server->config.standby_timeout : 1, .tv_usec = 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    int yes = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    char* buf = malloc(server->in_buf_size);
+    int len = 0;
+    int snapshot_fd = -1;
+    long long snapshot_left = -1; // -1 until the snapshot starts, 0 once it's been read
+    unsigned long long applied = 0;
+    int timed_out = 0;
+    while (1) {
+        ssize_t n = recv(sock, buf + len, server->in_buf_size - len, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            timed_out = (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+            break;
+        }
+        len += n;
+
+        int offset = 0;
+        while (offset < len) {
+            if (snapshot_left > 0) {
+                int take = (long long) (len - offset) < snapshot_left ? len - offset : (int) snapshot_left;
+                if (write(snapshot_fd, buf + offset, take) != take) {
+                    printf("Error - can't keep the primary's snapshot: %s\n", strerror(errno));
+                    exit(1);
+                }
+                offset += take;
+                snapshot_left -= take;
+                if (snapshot_left == 0) {
+                    // read_snapshot closes it
+                    if (read_snapshot(server, snapshot_fd, NULL, 0) == -1) {
+                        exit(1);
+                    }
+                    snapshot_fd = -1;
+                }
+                continue;
+            }
+
+            int frame_len = frame_length(buf + offset, len - offset);
+            if (frame_len == 0) {
+                break;
+            }
+            struct message* record = frame_len == -1 ? NULL : buf_to_message(buf + offset, frame_len);
+            if (record == NULL || (snapshot_left == -1) != (record->type == REPL_SNAPSHOT)) {
+                printf("Error - the primary sent something a standby can't follow\n");
+                exit(1);
+            }
+            offset += frame_len;
+
+            if (record->type == REPL_SNAPSHOT) {
+                snapshot_left = strtoll(record->data, NULL, 10);
+                snapshot_fd = memfd_create("chat-standby", MFD_CLOEXEC);
+                if (snapshot_fd == -1 || snapshot_left <= 0) {
+                    printf("Error - can't take the primary's snapshot\n");
+                    exit(1);
+                }
+            } else if (record->type == REPL_HEARTBEAT || record->type == PING) {
+                struct message answer;
+                message_init(&answer, record->type == PING ? PONG : REPL_ACK);
+                strcpy(answer.source, "SERVER");
+                answer.seq = applied;
+                message_printf(&answer, "%s", record->type == PING ? "" : record->data);
+                int answer_len;
+                char* frame = encode_message(&answer, -1, &answer_len);
+                send(sock, frame, answer_len, MSG_NOSIGNAL);
+                free(frame);
+            } else {
+                apply_record(server, record);
+                applied++;
+            }
+            free(record);
+        }
+        memmove(buf, buf + offset, len - offset);
+        len -= offset;
+    }
+    free(buf);
+    close(sock);
+
+    if (snapshot_left != 0) {
+        // nothing to take over with
+        printf("Error - lost the primary before it sent its state\n");
+        exit(1);
+    }
+    if (!timed_out) {
+        // The primary may have only dropped us (for falling behind, or because it handed
+        // off to a newer server). If it's still there we start over, from a clean slate.
+        sleep(1);
+        int again = connect_to_primary(host, port);
+        if (again != -1) {
+            close(again);
+            printf("Standby: the primary dropped us, starting over\n");
+            if (server->argv != NULL) {
+                execv("/proc/self/exe", (char* const*) server->argv);
+            }
+            printf("Error - can't start over: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    printf("Standby: the primary is gone after %llu records\n", applied);
+}
+
+void apply_record(struct SERVER* server, struct message* record) {
+    struct CLIENT_INFO_NODE* client = get_client_info(server, record->source);
+    struct SESSION_INFO_NODE* session;
+    int len;
+    char* frame;
+    switch (record->type) {
+        case REGISTER:
+            if (client == NULL) {
+                client = new_client_info(server, record->source, record->data);
+                client->next = server->client_info_head;
+                server->client_info_head = client;
+            }
+            break;
+        case LOGIN:
+            if (client != NULL) {
+                strncpy(client->resume_token, record->data, RESUME_TOKEN_LEN - 1);
+                client->resume_token[RESUME_TOKEN_LEN - 1] = '\0';
+            }
+            break;
+        case EXIT:
+            if (client != NULL) {
+                remove_user_from_all_sessions(server, client);
+                client->resume_token[0] = '\0';
+            }
+            break;
+        case JOIN:
+            if (client == NULL || client->num_sessions >= MAX_JOINED_SESSIONS) {
+                break;
+            }
+            session = get_session_info(server, record->data);
+            if (session == NULL) {
+                session = create_session(server, record->data);
+                session->home = home_node(server, session->session_id);
+            }
+            if (find_membership(client, session) == -1 && add_user_to_session(server, session, client) == -1
+                && session->num_connected_client == 0) {
+                delete_session(server, session);
+            }
+            break;
+        case LEAVE_SESS:
+            session = get_session_info(server, record->data);
+            if (client != NULL && session != NULL && find_membership(client, session) != -1) {
+                remove_user_from_session(server, session, client);
+            }
+            break;
+        case MESSAGE:
+        case REPL_SEQ:
+            session = get_session_info(server, record->session_id);
+            if (session == NULL || record->seq <= session->last_seq) {
+                break;
+            }
+            session->last_seq = record->seq;
+            if (record->type == MESSAGE) {
+                frame = encode_message(record, -1, &len);
+                keep_in_history(server, session, record->seq, out_buffer_new(server, frame, len));
+            }
+            break;
+        case DM_MSG:
+            client = get_client_info(server, record->to);
+            if (client != NULL) {
+                frame = encode_message(record, -1, &len);
+                store_in_mailbox(server, client, frame, len);
+                free(frame);
+            }
+            break;
+        case REPL_MAILBOX_TAKEN:
+            if (client != NULL && client->mailbox != NULL) {
+                if (client->mailbox->spilled) {
+                    char path[PATH_MAX];
+                    mailbox_path(server, client, path, sizeof(path));
+                    unlink(path);
+                }
+                free_mailbox(server, client);
+            }
+            break;
+        default:
+            printf("Standby: the primary sent a record of type %d\n", record->type);
+            break;
+    }
+}
+
+void promote_standby(struct SERVER* server) {
+    // The resume timers the snapshot set went by the time it arrived. Everyone who was
+    // logged in was connected to the primary, and gets the full resume_timeout from now.
+    for (struct CLIENT_INFO_NODE* client = server->client_info_head; client != NULL; client = client->next) {
+        timer_cancel(&server->timers, &client->resume_timer);
+    }
+    timer_wheel_init(&server->timers, now_ms(server) / TIMER_TICK_MS);
+    int num_resumable = 0;
+    for (struct CLIENT_INFO_NODE* client = server->client_info_head; client != NULL; client = client->next) {
+        client->sockfd = -1;
+        client->node = -1;
+        if (client->resume_token[0] != '\0') {
+            timer_add(&server->timers, &client->resume_timer, SECONDS_TO_TICKS(server->config.resume_timeout));
+            num_resumable++;
+        }
+    }
+    printf("Standby: taking over, %d users can resume\n", num_resumable);
+}
+
+int start_archiver(struct SERVER* server) {
+    if (server->config.archive_dir == NULL) {
+        return 0;
+    }
+    int recovered = archiver_start(&server->archiver, server->config.archive_dir,
+                                   (size_t) server->config.archive_segment * 1024, (size_t) server->config.archive_queue * 1024);
+    if (recovered == -1) {
+        return -1;
+    }
+    if (recovered > 0) {
+        printf("Server: finished %d archive segments left open\n", recovered);
+    }
+    printf("Server: archiving session messages to %s\n", server->config.archive_dir);
+    return 0;
+}
+
+void capture_flush_timer(struct TIMER* timer, void* arg) {
+    struct SERVER* server = arg;
+    if (capture_flush(&server->capture) == -1) {
+        printf("Error writing the capture to %s, no longer recording\n", server->config.capture);
+        return;
+    }
+    timer_add(&server->timers, timer, SECONDS_TO_TICKS(CAPTURE_FLUSH_S));
+}
+
+struct SERVER* server_create(const struct SERVER_CONFIG* config) {
+    if (config->max_data < MAX_SESSION_ID || config->max_data > MAX_DATA_LIMIT) {
+        printf("Error - max_data has to be between %d and %d\n", MAX_SESSION_ID, MAX_DATA_LIMIT);
+        return NULL;
+    }
+    if ((config->replica_port != NULL || config->standby != NULL) && config->replica_key == NULL) {
+        // or anyone who can reach replica_port gets every password
+        printf("Error - replica_port and standby need a replica_key, the same on both\n");
+        return NULL;
+    }
+    if (config->cluster != NULL && config->cluster_key == NULL) {
+        printf("Error - cluster needs a cluster_key, the same on every node\n");
+        return NULL;
+    }
+    if (config->standby != NULL && config->takeover != NULL) {
+        printf("Error - a server can't be a standby and take over from another at once\n");
+        return NULL;
+    }
+    struct SERVER* server = calloc(1, sizeof(struct SERVER));
+    if (server == NULL) {
+        return NULL;
+    }
+    server->config = *config;
+    server->listen_fd = -1;
+    server->unix_fd = -1;
+    server->handoff_fd = -1;
+    server->cluster_fd = -1;
+    server->replica_fd = -1;
+    server->capture.fd = -1;
+    server->next_query_id = 1;
+
+    // The codec is shared by everything in the process, so the last server created sets it
+    max_data = config->max_data;
+    server->in_buf_size = 2 * (max_data + MAX_NAME + MAX_OPTIONS_LEN + 24);
+
+    mem_init(&server->memory, (size_t) config->memory_budget * 1024);
+
+    // One slot per descriptor we're allowed, so raise RLIMIT_NOFILE before this for more connections
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    server->max_connections = (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > (1 << 24))
+                              ? (1 << 24) : (int) limit.rlim_cur;
+    server->connections = calloc(server->max_connections, sizeof(struct CONNECTION*));
+    if (server->connections == NULL) {
+        printf("Error - can't make room for %d connections\n", server->max_connections);
+        free(server);
+        return NULL;
+    }
+
+    // Level triggered, so it reports the same readiness select() would
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->epoll_fd == -1) {
+        printf("Error setting up epoll: %s\n", strerror(errno));
+        free(server->connections);
+        free(server);
+        return NULL;
+    }
+    timer_wheel_init(&server->timers, now_ms(server) / TIMER_TICK_MS);
+    server->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    timer_init(&server->replication.heartbeat_timer, replica_heartbeat, server);
+    timer_init(&server->capture_timer, capture_flush_timer, server);
+
+    // Output is written with writev, which can't be told not to raise SIGPIPE on a socket the
+    // other end reset (or a link that never connected). The error is handled where it's returned.
+    signal(SIGPIPE, SIG_IGN);
+    if (config->cluster != NULL) {
+        setup_cluster(server, config->cluster);
+    }
+    server->next_trace_id = (unsigned long long) server->local_node << 48;
+    return server;
+}
+
+int server_set_clock(struct SERVER* server, unsigned long long us) {
+    if (!server->manual_clock) {
+        // the wheel starts over on the new clock, which only works while nothing is on it
+        if (server->timers.count > 0) {
+            return -1;
+        }
+        server->manual_clock = 1;
+        server->clock_us = us;
+        timer_wheel_init(&server->timers, now_ms(server) / TIMER_TICK_MS);
+        return 0;
+    }
+    if (us > server->clock_us) {
+        server->clock_us = us;
+    }
+    return 0;
+}
+
+void server_add_user(struct SERVER* server, const char* username, const char* password) {
+    struct CLIENT_INFO_NODE* client = new_client_info(server, username, password);
+    client->next = server->client_info_head;
+    server->client_info_head = client;
+}
+
+void server_start(struct SERVER* server, const char* port) {
+    if (server->config.takeover != NULL) {
+        // The listening sockets, the directory, sessions and connections all come from
+        // the server that's running now
+        if (take_over(server, server->config.takeover, &server->listen_fd, &server->unix_fd, &server->handoff_fd,
+                      &server->cluster_fd, &server->replica_fd) == -1) {
+            printf("Error - couldn't take over from the server at %s\n", server->config.takeover);
+            exit(1);
+        }
+    } else if (server->config.standby != NULL) {
+        // The state comes from the primary, and clients are let in once it's gone
+        run_standby(server, server->config.standby);
+        server->listen_fd = try_tcp_listener(port);
+        if (server->listen_fd == -1) {
+            printf("Standby: waiting for port %s to be free\n", port);
+        }
+        while (server->listen_fd == -1) {
+            sleep(1);
+            server->listen_fd = try_tcp_listener(port);
+        }
+        promote_standby(server);
+        printf("Server: Listening for connection on port %s\n", port);
+    } else {
+        // read login information
+        struct CLIENT_INFO_NODE* users = read_login(server);
+        if (users == NULL && server->client_info_head == NULL) {
+            printf("Error - no client login information is found\n");
+            exit(1);
+        }
+        if (users != NULL) {
+            // after any added with server_add_user
+            struct CLIENT_INFO_NODE* last = users;
+            while (last->next != NULL) {
+                last = last->next;
+            }
+            last->next = server->client_info_head;
+            server->client_info_head = users;
+        }
+        server->listen_fd = open_tcp_listener(port);
+        printf("Server: Listening for connection on port %s\n", port);
+    }
+
+    printf("Server: room for %d connections\n", server->max_connections);
+
+    // Clients on this host can skip TCP
+    if (server->config.unix_socket != NULL && server->unix_fd == -1) {
+        server->unix_fd = open_unix_listener(server->config.unix_socket);
+        if (server->unix_fd == -1) {
+            printf("Error - can't listen on %s: %s\n", server->config.unix_socket, strerror(errno));
+            exit(1);
+        }
+        printf("Server: Listening for local connections on %s\n", server->config.unix_socket);
+    }
+
+    // A newer server can take over from this one there
+    if (server->config.handoff_socket != NULL && server->handoff_fd == -1) {
+        server->handoff_fd = open_unix_listener(server->config.handoff_socket);
+        if (server->handoff_fd == -1) {
+            printf("Error - can't listen on %s: %s\n", server->config.handoff_socket, strerror(errno));
+            exit(1);
+        }
+    }
+    if (server->handoff_fd != -1) {
+        printf("Server: Waiting for a successor on %s\n", server->config.handoff_socket);
+    }
+
+    // The other nodes connect to this one there
+    if (server->num_nodes > 0 && server->cluster_fd == -1) {
+        server->cluster_fd = open_tcp_listener(server->nodes[server->local_node].port);
+        printf("Server: node %d of %d, listening for the others on port %s\n",
+               server->local_node, server->num_nodes, server->nodes[server->local_node].port);
+    }
+
+    // A standby follows this server there
+    if (server->config.replica_port != NULL && server->replica_fd == -1) {
+        server->replica_fd = open_tcp_listener(server->config.replica_port);
+        printf("Server: a standby can follow this server on port %s\n", server->config.replica_port);
+    }
+
+    // Clients connected from now on are recorded (a standby's timers only start once it's promoted)
+    if (server->config.capture != NULL) {
+        if (capture_open(&server->capture, server->config.capture, CAPTURE_BUFFER, now_us(server)) == -1) {
+            printf("Error - can't write a capture to %s: %s\n", server->config.capture, strerror(errno));
+            exit(1);
+        }
+        timer_add(&server->timers, &server->capture_timer, SECONDS_TO_TICKS(CAPTURE_FLUSH_S));
+        printf("Server: recording what clients send to %s\n", server->config.capture);
+    }
+    if (start_archiver(server) == -1) {
+        printf("Error - can't archive to %s: %s\n", server->config.archive_dir, strerror(errno));
+        exit(1);
+    }
+
+    int listeners[] = {server->listen_fd, server->unix_fd, server->handoff_fd, server->cluster_fd, server->replica_fd};
+    for (int i = 0; i < 5; i++) {
+        struct epoll_event listen_event = {.events = EPOLLIN, .data.fd = listeners[i]};
+        if (listeners[i] == -1) {
+            continue;
+        }
+        fcntl(listeners[i], F_SETFL, fcntl(listeners[i], F_GETFL) | O_NONBLOCK);
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, listeners[i], &listen_event) == -1) {
+            printf("Error setting up epoll: %s\n", strerror(errno));
+            exit(1);
+        }
+        server->highest_fd = listeners[i] > server->highest_fd ? listeners[i] : server->highest_fd;
+    }
+    for (int node = server->local_node + 1; node < server->num_nodes; node++) {
+        connect_to_node(server, node);
+    }
+}
+
+struct CONNECTION* server_attach(struct SERVER* server, int sockfd, int local) {
+    if (sockfd >= server->max_connections) {
+        return NULL;
+    }
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    struct CONNECTION* conn = open_connection(server, sockfd);
+    conn->local = local;
+    if (server->capture.fd != -1) {
+        conn->capture_id = ++server->next_capture_id;
+        capture_record(&server->capture, CAPTURE_OPEN, conn->capture_id, 0, NULL, 0, now_us(server));
+    }
+    return conn;
+}
+
+int server_run_once(struct SERVER* server, int max_wait_ms) {
+    // sleep until the next timer could be due
+    int timeout_ms = -1;
+    long long ticks = timer_wheel_next_timeout(&server->timers);
+    if (server->ready_head != NULL) {
+        // input is already waiting, only check for more
+        timeout_ms = 0;
+    } else if (ticks >= 0) {
+        long long wait_ms = (long long) ((server->timers.now + ticks) * TIMER_TICK_MS) - (long long) now_ms(server);
+        timeout_ms = wait_ms < 0 ? 0 : (int) wait_ms;
+    }
+    if (server->monitor.mode != MODE_NORMAL && (timeout_ms == -1 || timeout_ms > 1000)) {
+        // wake up now and then even when idle, so the lag average can come back down
+        timeout_ms = 1000;
+    }
+    if (max_wait_ms >= 0 && (timeout_ms == -1 || timeout_ms > max_wait_ms)) {
+        timeout_ms = max_wait_ms;
+    }
+
+    struct epoll_event events[EPOLL_BATCH];
+    int num_events = epoll_wait(server->epoll_fd, events, EPOLL_BATCH, timeout_ms);
+    if (num_events == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        printf("epoll_wait error\n");
+        return -1;
+    }
+    unsigned long long ready_us = now_us(server);
+    server->loop_woke_us = lat_now_us();
+
+    // Timers the handlers set count from now, not from when the loop went to sleep
+    timer_wheel_advance(&server->timers, now_ms(server) / TIMER_TICK_MS);
+    close_pending_connections(server);
+
+    for (int e = 0; e < num_events; e++) {
+        int i = events[e].data.fd;
+        if (i == server->listen_fd || i == server->unix_fd || i == server->cluster_fd || i == server->replica_fd) {
+            // This is the socket that listens for incoming connections.
+            // Establish new connections here.
+            accept_connections(server, i);
+            continue;
+        }
+        if (i == server->handoff_fd) {
+            // only comes back if the new server couldn't take over
+            hand_off(server, server->handoff_fd, server->listen_fd, server->unix_fd, server->cluster_fd,
+                     server->replica_fd);
+            continue;
+        }
+        // The fd may have been closed by an earlier event, and even reused by
+        // an accept since, which at worst means a read that finds nothing
+        struct CONNECTION* conn = server->connections[i];
+        if (conn == NULL || conn->closing) {
+            continue;
+        }
+        if (events[e].events & EPOLLOUT) {
+            if (conn->reserved_by != NULL) {
+                // room for more of the file being spliced into it
+                continue_blob_chunk(server, conn->reserved_by);
+            } else {
+                flush_connection(server, conn);
+            }
+        }
+        if (!conn->closing && (events[e].events & (EPOLLERR | EPOLLHUP)) && conn->input_paused) {
+            // reported even while we're not reading, and it would be again every time
+            schedule_close(server, conn, "connection reset");
+        } else if (!conn->closing && (events[e].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+            // handle regular communication with clients that have already connected
+            handle_client_data(server, conn);
+        }
+        close_pending_connections(server);
+    }
+
+    timer_wheel_advance(&server->timers, now_ms(server) / TIMER_TICK_MS);
+    close_pending_connections(server);
+
+    // Connections that had more input than one turn's worth get another turn
+    process_ready_connections(server);
+    close_pending_connections(server);
+
+    // Everything the handlers sent goes out now, one write per client
+    flush_pending_output(server);
+    close_pending_connections(server);
+    if (server->num_blob_blocked > 0) {
+        retry_blocked_blob_senders(server);
+    }
+
+    // Whatever is still queued counts against the memory budget
+    enforce_memory_budget(server);
+    close_pending_connections(server);
+
+    update_load_mode(server, now_us(server) - ready_us);
+    if (server->num_deferred_queries > 0) {
+        answer_deferred_queries(server);
+        flush_pending_output(server);
+        close_pending_connections(server);
+    }
+    return num_events;
+}
+
+int server_run(struct SERVER* server) {
+    while (1) {
+        if (server_run_once(server, -1) == -1) {
+            return -1;
+        }
+    }
+}
+
+void server_destroy(struct SERVER* server) {
+    for (int fd = 0; fd <= server->highest_fd; fd++) {
+        if (server->connections[fd] != NULL) {
+            close_connection(server, server->connections[fd]);
+        }
+    }
+    // Nothing fires any more, so the timers of what's left can go with it
+    while (server->session_info_head != NULL) {
+        delete_session(server, server->session_info_head);
+    }
+    while (server->client_info_head != NULL) {
+        struct CLIENT_INFO_NODE* client = server->client_info_head;
+        server->client_info_head = client->next;
+        if (client->mailbox != NULL) {
+            free_mailbox(server, client);
+        }
+        free(client);
+        mem_credit(&server->memory, MEM_CLIENTS, sizeof(struct CLIENT_INFO_NODE));
+    }
+    while (server->pending_queries != NULL) {
+        struct PENDING_QUERY* query = server->pending_queries;
+        server->pending_queries = query->next;
+        message_release(&query->reply);
+        free(query);
+    }
+    while (server->input_pool_size > 0) {
+        free(server->input_pool[--server->input_pool_size]);
+        mem_credit(&server->memory, MEM_INPUT, server->in_buf_size);
+    }
+
+    int listeners[] = {server->listen_fd, server->unix_fd, server->handoff_fd, server->cluster_fd, server->replica_fd};
+    for (int i = 0; i < 5; i++) {
+        if (listeners[i] != -1) {
+            close(listeners[i]);
+        }
+    }
+    capture_close(&server->capture);
+    archiver_stop(&server->archiver);
+    close(server->epoll_fd);
+    if (server->spare_fd != -1) {
+        close(server->spare_fd);
+    }
+    free(server->client_index);
+    free(server->session_index);
+    free(server->connections);
+    free(server);
+}
@@ -6,16 +6,412 @@
 #define ECE361_TEXTCONFERENCING_SERVER_H
 
 #include "packet.h"
+#include "timer.h"
+#include "shm_ring.h"
+#include "capture.h"
+#include "archive.h"
+#include "governor.h"
+#include "latency.h"
+#include "search.h"
 
 struct SESSION_INFO_NODE;
 struct CLIENT_INFO_NODE;
+struct CONNECTION;
+struct SERVER;
+
+// Timer wheel resolution
+#define TIMER_TICK_MS 100
+#define SECONDS_TO_TICKS(s) ((unsigned long long)(s) * 1000 / TIMER_TICK_MS)
+
+// Token bucket limit: up to burst requests at once, refilled at rate per second.
+// A rate of 0 means unlimited.
+struct RATE_LIMIT {
+    int rate;
+    int burst;
+};
+
+struct TOKEN_BUCKET {
+    double tokens;
+    unsigned long long updated_ms;
+};
+
+// Message types are limited in groups, see rate_class
+enum RATE_CLASS {
+    RATE_MESSAGE,  // session messages
+    RATE_DM,       // direct messages
+    RATE_REQUEST,  // joining, leaving, creating, listing and searching sessions
+    NUM_RATE_CLASSES
+};
+
+// How far behind the event loop is running, see update_load_mode
+enum LOAD_MODE {
+    MODE_NORMAL,
+    MODE_DEGRADED,   // QUERY answers wait, idle PINGs are skipped
+    MODE_OVERLOADED, // new LOGINs are turned away too
+};
+
+// Tunables, set as "name=value" on the command line. Timeouts are in seconds.
+struct SERVER_CONFIG {
+    int prelogin_timeout; // connected, but no successful LOGIN yet
+    int idle_timeout;     // nothing received for this long -> PING the client
+    int ping_timeout;     // no answer to the PING -> the peer is considered dead
+    int stall_timeout;    // queued output that makes no progress for this long
+    int resume_timeout;   // how long a dropped client can RESUME its login and session
+    int history_size;     // session messages kept for replay on RESUME
+    int compression;      // 0 turns down clients that offer LZ compression
+    int compress_threshold; // smallest payload (in bytes) that is sent compressed
+    struct RATE_LIMIT rate_limits[NUM_RATE_CLASSES]; // per client
+    struct RATE_LIMIT session_rate_limit; // MESSAGEs into one session, from all members together
+    int frames_per_turn;  // most messages taken from one connection per loop iteration
+    int memory_budget;    // KB the server may hold in buffers and tables, 0 for no limit
+    int degraded_lag_ms;  // loop lag that switches to MODE_DEGRADED
+    int overloaded_lag_ms; // and to MODE_OVERLOADED
+    int retry_after;      // what a LOGIN turned away while overloaded is told to wait
+    int bulk_queue_limit; // KB of session traffic queued for one client before dropping, 0 for no limit
+    int blob_max_size;    // MB, the largest file that can be offered
+    int splice;           // 0 always copies file data through user space
+    int max_data;         // largest payload accepted (with the \0), up to MAX_DATA_LIMIT
+    const char* unix_socket; // path of a Unix-domain socket to listen on as well, NULL for none
+    int shm_ring_size;    // KB each way for a local client's shared memory rings, 0 turns them down
+    int mailbox_size;     // direct messages kept for a user who is offline, 0 turns them away
+    int mailbox_memory;   // KB of them held in memory per user, the rest go to mailbox_dir
+    const char* mailbox_dir; // where mailboxes that outgrow memory are written, NULL for nowhere
+    const char* handoff_socket; // where a newer server can connect to take over, NULL for nowhere
+    const char* takeover; // the handoff_socket of a running server to take over from
+    const char* cluster;  // "<host>:<port>,..." of every server in the cluster, NULL to run alone
+    int node;             // which of them this is, counting from 0
+    const char* cluster_key; // what the nodes show each other on their links, needed with cluster
+    const char* replica_port; // where a hot standby can connect to follow this server, NULL for nowhere
+    const char* standby;  // "<host>:<port>" of the primary to follow until it's gone, NULL to serve right away
+    const char* replica_key; // what a standby has to send before it's given anything, both need it
+    int standby_timeout;  // nothing from the primary for this long and the standby takes over
+    int replica_lag_limit; // KB queued for the standby before it's dropped and has to start over
+    int replicate_messages; // 0 leaves the text of session messages out of the stream
+    const char* capture;  // where to record what clients send for replay.c, NULL for nowhere
+    const char* login_file; // users and their passwords, REGISTER appends to it
+    int validate_text;    // 0 passes on chat text without checking that it's UTF-8 (see scan.h)
+    int search_memory;    // KB of search index per session, past that the oldest messages can't be found; 0 turns SEARCH off
+    const char* archive_dir; // where every session message is kept for archive_export, NULL for nowhere; one per server
+    int archive_segment;  // KB in an archive segment before the next is started
+    int archive_queue;    // KB of messages waiting to be archived, past that as much again waits to be spilled to a file
+};
+
+// Loop lag is the time from select() reporting events to the last of them being handled,
+// which is how long a message that arrived at the worst moment waited for us. It's
+// smoothed, and a mode is only left once the lag has dropped to half its threshold.
+struct LOOP_MONITOR {
+    double lag_ewma_us;
+    unsigned long long max_lag_us;
+    enum LOAD_MODE mode;
+    unsigned long long mode_changes;
+    unsigned long long deferred_queries;
+    unsigned long long skipped_pings;
+    unsigned long long rejected_logins;
+};
+
+// Most a QUERY is held back while the server is degraded
+#define QUERY_DEFER_MAX_MS 5000
+
+// A formatted message on its way out. Broadcasts share one buffer between every
+// recipient's queue (and the session history), so it's reference counted.
+struct OUT_BUFFER {
+    int refcount;
+    int len;
+    char* data;
+    unsigned long long trace;  // of the message it carries, 0 if none (see probes.h)
+};
+
+struct OUT_CHUNK {
+    struct OUT_BUFFER* buf;
+    struct OUT_CHUNK* next;
+};
+
+// Most chunks writev takes at once
+#define FLUSH_IOV_MAX 64
+
+// Replies to the client's own requests go in the control lane, which is always written
+// first and never dropped. File transfers come next; they're never dropped either, the
+// sender is paused instead (see BLOB_WINDOW). Session traffic goes in the bulk lane,
+// which a slow reader loses the oldest frames of once it's over bulk_queue_limit.
+enum OUT_LANE {
+    LANE_CONTROL,
+    LANE_BLOB,
+    LANE_BULK,
+    NUM_LANES
+};
+
+// File data waiting in one recipient's blob lane before its sender stops being read from
+#define BLOB_WINDOW (256 * 1024)
+
+// A file being relayed, from when it's offered until its BLOB_END. The recipients are
+// fixed by the offer; one that disconnects is just taken off the list.
+struct BLOB_TRANSFER {
+    unsigned int id;                 // chosen by the sender, unique among its transfers
+    struct CONNECTION* sender;
+    unsigned long long size;
+    struct CONNECTION* targets[SESSION_CAP];
+    int num_targets;
+    struct BLOB_TRANSFER* next;
+};
+
+struct OUT_QUEUE {
+    struct OUT_CHUNK* head;
+    struct OUT_CHUNK* tail;
+    int offset;                      // bytes of head already written
+    size_t bytes;                    // queued and not yet written
+};
+
+enum CONNECTION_STATE {
+    CONN_PRE_LOGIN,
+    CONN_LOGGED_IN
+};
+
+// The part of a connection that relays file chunks, made for its first BLOB_CHUNK.
+// A BLOB_CHUNK whose payload hadn't all arrived with its header has the rest read
+// straight from the socket: spliced through a pipe into the socket of a single idle
+// recipient, or collected in chunk_buf and queued to every recipient when complete.
+struct BLOB_RELAY {
+    struct BLOB_TRANSFER* chunk_transfer; // NULL if the chunk is being thrown away
+    size_t chunk_remaining;          // payload bytes still to come from the socket
+    struct OUT_BUFFER* chunk_buf;
+    int chunk_filled;
+    int splice_pipe[2];              // made on first use
+    struct CONNECTION* splice_target;
+    size_t pipe_size;
+    size_t pipe_bytes;               // in the pipe, not yet in splice_target's socket
+};
+
+// One per accepted socket, indexed by fd. Exists before the user logs in. There can be
+// a great many of these sitting idle, so whatever only matters while the connection
+// is busy (its input buffer, file relay state) is allocated when it's needed.
+struct CONNECTION {
+    struct SERVER* server;
+    int sockfd;
+    enum CONNECTION_STATE state;
+    struct CLIENT_INFO_NODE* client; // set once logged in
+    struct TIMER timer;              // whichever timeout applies to the current state
+    unsigned char ping_outstanding;
+    unsigned char closing;           // close once the current event has been handled
+    unsigned char compression;       // negotiated at LOGIN / RESUME
+    unsigned char dirty;             // on the list of connections to flush
+    unsigned char input_paused;
+    unsigned char ready;
+    unsigned char want_write;        // output is waiting for the socket to take it
+    unsigned char watched;           // the epoll events currently asked for
+    struct CONNECTION* next_closing;
+
+    // Everything sent to the client during a loop iteration is queued here, and written
+    // with one writev at the end of the iteration. What the socket doesn't take waits
+    // for it to become writable; if it makes no progress for stall_timeout, we give up.
+    struct OUT_QUEUE lanes[NUM_LANES];
+    size_t out_bytes;                // queued in all lanes and not yet written
+    unsigned long long dropped_frames; // bulk frames this client was too slow for
+    struct CONNECTION* next_dirty;
+    struct TIMER stall_timer;
+
+    // Input is taken at most frames_per_turn messages at a time. A connection with more
+    // left (or whose rate limit has refilled) waits on the ready list for the next turn,
+    // and isn't read from until what it already sent has been handled.
+    struct CONNECTION* next_ready;
+    struct TIMER throttle_timer;     // a deferred message is allowed again
+    unsigned long long query_deferred_ms; // when a QUERY was put off, 0 if none is waiting
+
+    // bytes received but not yet forming a complete message, room for two of the
+    // largest ones max_data allows. Borrowed from the input pool while there are any.
+    char* in_buf;
+    int in_len;
+
+    unsigned char chunk_active;      // in the middle of a BLOB_CHUNK, see BLOB_RELAY
+    unsigned char blob_blocked;      // waiting for recipients to drain below BLOB_WINDOW
+    unsigned char local;             // came in on the Unix-domain socket
+    struct BLOB_RELAY* relay;
+
+    // Once a local client switched to shared memory, frames go through these rings instead
+    // of the socket, which is left carrying doorbells
+    struct SHM_MAP* shm;
+
+    // A sender is splicing a chunk into this socket, nothing else may be written until it's done
+    struct CONNECTION* reserved_by;
+
+    // The node at the other end of a link between servers, -1 for a client
+    int peer;
+
+    unsigned char replica;           // a hot standby following this server
+    unsigned char replica_pending;   // connected to replica_port, and hasn't sent the replica_key yet
+
+    // A LOGIN or RESUME from a user whose home is another node, until the home agrees
+    struct message* held_login;
+    unsigned int capture_id;         // its number in the capture, 0 if it isn't in one
+};
+
+// 360 bytes on x86-64, most of what an idle connection costs (loadgen idle measures the rest
+// against its 1 KB target). A new field has to fit in what's left, or the budget has to be
+// raised on purpose.
+#define CONNECTION_SIZE_BUDGET 384
+_Static_assert(sizeof(struct CONNECTION) <= CONNECTION_SIZE_BUDGET, "struct CONNECTION outgrew CONNECTION_SIZE_BUDGET");
+
+// Input buffers of connections that have nothing left to process go back here, up to
+// this many, for the next connection that receives something
+#define INPUT_POOL_MAX 256
+
+// Ready events taken from epoll at a time, and connections accepted per listener event
+#define EPOLL_BATCH 256
+#define ACCEPT_BATCH 64
+
+// A session the client is in, and where in session->clients it sits
+struct SESSION_MEMBERSHIP {
+    struct SESSION_INFO_NODE* session;
+    int slot;
+};
 
 struct CLIENT_INFO_NODE {
+    struct SERVER* server;
     char username [MAX_NAME];
     char password [MAX_PASSWD];
-    struct SESSION_INFO_NODE* active_session;
+    // A handful of entries at most, so looking one up is effectively constant time
+    struct SESSION_MEMBERSHIP sessions[MAX_JOINED_SESSIONS];
+    int num_sessions;
     int sockfd;
     struct CLIENT_INFO_NODE* next;
+    struct CLIENT_INFO_NODE* index_next; // in the same client_index bucket
+
+    // Handed out with LO_ACK. When the connection drops the client stays in its
+    // sessions (with sockfd == -1) until resume_timer fires, and may RESUME with this.
+    char resume_token[RESUME_TOKEN_LEN];
+    struct TIMER resume_timer;
+
+    // Kept across connections, so reconnecting doesn't reset the limits
+    struct TOKEN_BUCKET buckets[NUM_RATE_CLASSES];
+
+    struct MAILBOX* mailbox;         // NULL while empty
+
+    // On the user's home node, the other node they're logged in at, -1 if none
+    int node;
+
+    // Anywhere else, the connection the home was asked to let them log in on (-1 if none),
+    // and which NODE_CLAIM that was
+    int claim_sockfd;
+    unsigned long long claim_seq;
+};
+
+// Direct messages sent while the user was offline, already formatted as DM_MSG frames, and
+// handed over together right after the next LOGIN or RESUME. They're kept in memory up to
+// mailbox_memory. Past that (or when the server is short of memory) the whole mailbox moves
+// to a file in mailbox_dir, and everything after goes straight there, so the order holds.
+struct MAILBOX {
+    char* frames;
+    size_t len;
+    size_t capacity;
+    int count;                       // messages held, in memory or in the file
+    unsigned char spilled;           // they're in the file
+};
+
+// An already formatted session message, kept so it can be replayed on RESUME. The
+// compressed form is made the first time a client that negotiated compression needs it.
+struct HISTORY_ENTRY {
+    unsigned long long seq;
+    struct OUT_BUFFER* plain;
+    struct OUT_BUFFER* packed;
+};
+
+// Most matches in one SR_ACK, fewer if their text doesn't fit in max_data
+#define SEARCH_PAGE 20
+
+/*
+ * Federation. Servers started with the same cluster=<host>:<port>,... list, each with its own
+ * node=<index> in it, share their users and sessions, and a client can log in at any of them.
+ * Every session and every user has a home node, found by consistent hashing of the name, so
+ * changing the list only moves what hashes next to the points of the nodes that changed.
+ *  - A session's home numbers its messages and keeps its history and member count. Other nodes
+ *    with members keep a shadow of it, and pass their members' JOIN, NEW_SESS, LEAVE_SESS and
+ *    MESSAGE on to the home. Each numbered message crosses a link once for every node with
+ *    members in the session, which fans it out to them.
+ *  - A user's home knows which node they're logged in at, and DMs for them go there. While
+ *    they're offline the home keeps them in its mailbox, which goes to the node they next log
+ *    in at.
+ *  - A QUERY asks every node for its users, and is answered once they all did.
+ *  - A user is logged in at one node at a time. Logging in anywhere but their home, the node
+ *    checks the password (or resume token) and then asks the home with a NODE_CLAIM, holding
+ *    the LOGIN or RESUME until the answer. The home says no while they're logged in there or
+ *    at another node, and keeps to that while the link to the other node is down. It only
+ *    lets in users it knows.
+ * Each pair of nodes keeps one TCP link (made by the lower index), which is a connection like
+ * a client's: its output is batched and written once per loop iteration, in a single lane so
+ * everything arrives in order. Frames on it are client messages sent on a user's behalf, with
+ * the user as source and replies naming them in "to", plus the NODE_* types. When a link comes
+ * back up each side announces its members and logins again, and homes replay the messages
+ * a shadow missed. What a shadow's members say while the home is unreachable is lost.
+ * A link starts with NODE_HELLO, which has to carry the cluster_key every node was started
+ * with, or the link is closed before anything else is said on it.
+ */
+#define MAX_NODES 32
+#define RING_POINTS_PER_NODE 64
+#define NODE_RETRY_S 1               // between attempts to connect a link
+#define NODE_QUERY_TIMEOUT_S 1       // a QUERY is answered without nodes that take longer
+#define LINK_FRAMES_PER_TURN 512     // a link carries many users' traffic, frames_per_turn is per user
+#define PEER_UNIDENTIFIED MAX_NODES  // an accepted link until its NODE_HELLO
+
+struct CLUSTER_NODE {
+    struct SERVER* server;
+    char host[256];
+    char port[16];
+    struct CONNECTION* link;         // NULL until it's up
+    struct TIMER retry_timer;
+    unsigned long long frames_sent;
+    unsigned long long frames_received;
+};
+
+struct RING_POINT {
+    unsigned long long hash;
+    int node;
+};
+
+// A QUERY waiting for the other nodes' users
+struct PENDING_QUERY {
+    struct SERVER* server;
+    unsigned long long id;
+    int sockfd;
+    char username[MAX_NAME];
+    unsigned int waiting;            // nodes that haven't answered, one bit each
+    struct message reply;
+    struct TIMER timer;
+    struct PENDING_QUERY* next;
+};
+
+/*
+ * Hot standby. A server started with standby=<host>:<port> follows the primary that was started
+ * with replica_port=<port>, and takes over from it once it's gone. The primary sends a snapshot
+ * of its state (like a handoff's, without the connections), then a record of every change to it
+ * as it happens: logins and logouts, joining and leaving sessions, registrations, mailboxes, and
+ * session messages (or just their numbers, if replicate_messages=0). A record is the message
+ * type whose effect it carries, with the user as source. They're queued on the standby's
+ * connection like anything else, so replicating never waits for the standby. A standby that
+ * lets more than replica_lag_limit pile up is dropped instead, and starts over.
+ *
+ * The snapshot has every user's password and resume token, so the standby first has to send a
+ * REPL_HELLO with the replica_key both were started with. Anything else closes the connection,
+ * and leaves the standby that's following (if any) alone. Without a replica_key neither starts.
+ *
+ * Once a second the primary sends a REPL_HEARTBEAT, which the standby answers, so how far behind
+ * it is shows in STATS. When the link closes and the primary can't be reached again (or it says
+ * nothing for standby_timeout), the standby starts listening on the client port as soon as it's
+ * free. Everyone who was logged in has resume_timeout to RESUME there, with their sessions and
+ * missed messages waiting for them.
+ */
+#define REPLICA_HEARTBEAT_S 1
+
+// What the capture (see capture.h) collects before writing, and how often it's written anyway
+#define CAPTURE_BUFFER (256 * 1024)
+#define CAPTURE_FLUSH_S 1
+
+struct REPLICATION {
+    struct CONNECTION* link;         // on the primary, the standby's connection, NULL if none
+    struct TIMER heartbeat_timer;
+    size_t snapshot_len;             // the snapshot the stream started with doesn't count as lag
+    unsigned long long records_sent;
+    unsigned long long records_acked;
+    unsigned long long lag_ms;       // how old the last heartbeat the standby answered was
+    unsigned long long standbys_dropped;
 };
 
 struct SESSION_INFO_NODE {
@@ -24,42 +420,618 @@ struct SESSION_INFO_NODE {
     int num_connected_client;
     struct SESSION_INFO_NODE* prev;
     struct SESSION_INFO_NODE* next;
+    struct SESSION_INFO_NODE* index_next; // in the same session_index bucket
+
+    // Ring buffer of the last history_size messages, the newest one has seq last_seq
+    unsigned long long last_seq;
+    struct HISTORY_ENTRY* history;
+    int history_size;
+
+    struct TOKEN_BUCKET bucket; // see session_rate_limit
+
+    // The messages in the history, by the words in them. Messages leave it when they leave
+    // the history, or before that once it has outgrown search_memory.
+    struct SEARCH_INDEX search;
+
+    // The node that numbers the session's messages. There, num_connected_client counts the
+    // members on every node, and remote_members how many are on each of the others.
+    // Anywhere else this is a shadow with only the members on this node.
+    int home;
+    unsigned char remote_members[MAX_NODES];
+    unsigned int unsynced;      // nodes whose members haven't been announced since their link came back
+};
+
+/*
+ * Warm restart. A server started with handoff_socket=<path> waits there for its successor,
+ * a newer server started with takeover=<path>. When one connects, the old server writes
+ * its state (the directory, sessions with their history, mailboxes, and every connection
+ * with its unprocessed input and queued output) to a memfd, and passes that, its listening
+ * sockets and every client socket over with SCM_RIGHTS. The new server rebuilds it all,
+ * answers "K", and the old one answers "B" and exits. Clients notice nothing but a pause.
+ *
+ * Connections in the middle of a file transfer or on shared memory rings can't be handed
+ * over. They're closed first, and their clients RESUME against the new server.
+ */
+#define SNAPSHOT_MAGIC 0x534e4150 // "SNAP"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_BLOB_MAX (256 * 1024 * 1024)
+#define HANDOFF_MAGIC 0x48414e44 // "HAND"
+#define HANDOFF_TIMEOUT_S 10
+
+// The kernel takes at most 253 descriptors in one message
+#define HANDOFF_FDS_PER_MSG 250
+
+// The first message on the handoff socket. It comes with the snapshot and the listening
+// sockets (TCP, handoff, then the Unix-domain and cluster ones if there are any). The client
+// sockets follow, each message an int count with that many of them.
+struct HANDOFF_HEADER {
+    unsigned int magic;
+    int num_connections;
+    int has_unix;
+    int has_cluster;
+    int has_replica;
 };
 
-struct CLIENT_INFO_NODE* read_login();
+/*
+ * Everything one server holds: the directory, sessions, connections and config. Nothing in
+ * server.c lives outside of it, so a program can embed a server (or several) and drive it
+ * itself, see server_create and server_run_once. Records that timers fire on point back here.
+ */
+struct SERVER {
+    struct SERVER_CONFIG config;
+    const char** argv;               // a standby that has to start over runs itself again, NULL if it can't
+
+    struct CLIENT_INFO_NODE* client_info_head;
+    // Users by name, a power of two of chained buckets, so a login doesn't walk the whole list
+    struct CLIENT_INFO_NODE** client_index;
+    size_t client_index_size;
+    size_t num_clients;
+    struct SESSION_INFO_NODE* session_info_head;
+    // Sessions by ID, the same way, so joining or messaging one doesn't walk them all
+    struct SESSION_INFO_NODE** session_index;
+    size_t session_index_size;
+    size_t num_sessions;
+
+    // Per-socket state, and everything the event loop needs to reach from the handlers
+    struct CONNECTION** connections; // max_connections of them, one per descriptor we may have open
+    int max_connections;
+    struct CONNECTION* closing_head;
+    struct CONNECTION* dirty_head;
+    struct CONNECTION* ready_head;
+    struct TIMER_WHEEL timers;
+    struct MEMORY_GOVERNOR memory;
+    struct LOOP_MONITOR monitor;
+    int num_deferred_queries;
+    unsigned long long dropped_bulk_frames;
+    struct BLOB_TRANSFER* blob_transfers;
+    int num_blob_blocked;
+    unsigned long long blob_bytes_spliced;
+    unsigned long long blob_bytes_copied;
+    unsigned long long mailbox_refused;
+    unsigned long long invalid_text; // chat messages turned away for not being UTF-8
+    unsigned long long searches;
+    unsigned long long search_hits;  // sent back for them
+    int epoll_fd;
+    int spare_fd;                    // given up for a moment to turn a connection away when we're out of descriptors
+    int highest_fd;
+    int in_buf_size;
+    char* input_pool[INPUT_POOL_MAX];
+    int input_pool_size;
+    int input_buffers_lent;
+
+    // Listening sockets, -1 for the ones not in use
+    int listen_fd;
+    int unix_fd;
+    int handoff_fd;
+
+    // The other servers, when this one is in a cluster
+    struct CLUSTER_NODE nodes[MAX_NODES];
+    int num_nodes;
+    int local_node;
+    unsigned long long cluster_hash; // of the node list, which every node has to agree on
+    struct RING_POINT ring[MAX_NODES * RING_POINTS_PER_NODE];
+    int num_ring_points;
+    int cluster_fd;
+    struct PENDING_QUERY* pending_queries;
+    unsigned long long next_query_id;
+    unsigned long long cluster_dropped; // session messages whose home couldn't be reached
+    unsigned long long claim_seq;    // the last NODE_CLAIM sent
+
+    // The hot standby following this server, if there is one
+    struct REPLICATION replication;
+    int replica_fd;
+
+    // Trace IDs, see probes.h. Each node numbers from its own range, so they stay apart in a cluster,
+    // and a server that takes over or is promoted carries on from the snapshot it was given.
+    unsigned long long next_trace_id;
+    unsigned long long current_trace; // of the message whose handler is running
+
+    // What clients measured and reported, see latency.h
+    struct LAT_HISTOGRAM client_latency[NUM_LAT_LEGS];
+    unsigned long long latency_reports;
+    unsigned long long loop_woke_us; // wall clock, the "tr" of whatever is read this iteration
+
+    // What clients send, for replay.c
+    struct CAPTURE_WRITER capture;
+    struct TIMER capture_timer;
+    unsigned int next_capture_id;
+
+    // Every session message, written out by a thread of its own (see archive.h)
+    struct ARCHIVER archiver;
+
+    // With manual_clock set, timeouts and rate limits go by clock_us (see server_set_clock)
+    // instead of the system's monotonic clock, so a harness gets the same timing every run
+    int manual_clock;
+    unsigned long long clock_us;
+};
+
+/*
+ * Running a server. server_main.c does create, start and run, a program embedding one can
+ * leave out start and hand it sockets (or socketpairs) of its own with server_attach, then
+ * turn the loop itself. Errors setting a server up are printed, and server_start exits on
+ * them the way the server always has.
+ */
+// Returns NULL if the config is no good. The config's strings have to outlive the server.
+struct SERVER* server_create(const struct SERVER_CONFIG* config);
+
+// Listens on port and whatever else the config asks for, after taking over or following a primary
+void server_start(struct SERVER* server, const char* port);
+
+// One iteration of the event loop, waiting at most max_wait_ms (-1 for as long as nothing is
+// due). Returns how many events it handled, or -1 if the loop can't go on.
+int server_run_once(struct SERVER* server, int max_wait_ms);
+
+// Only returns if the loop can't go on
+int server_run(struct SERVER* server);
+
+// Takes sockfd as a client connection, as if it was accepted. local is for the Unix-domain
+// socket's clients, which can switch to shared memory. Returns NULL if there's no room for it.
+struct CONNECTION* server_attach(struct SERVER* server, int sockfd, int local);
+
+// Adds a user to the directory, like a line of the login file
+void server_add_user(struct SERVER* server, const char* username, const char* password);
+
+// Switches the server to a clock of the caller's (in microseconds), and moves it forward.
+// The switch has to come before anything is on a timer, i.e. before start or attach; -1 if it's too late.
+int server_set_clock(struct SERVER* server, unsigned long long us);
+
+// Closes every connection and frees everything the server holds
+void server_destroy(struct SERVER* server);
+
+struct CLIENT_INFO_NODE* read_login(struct SERVER* server);
+
+struct CLIENT_INFO_NODE* new_client_info(struct SERVER* server, const char* username, const char* password);
+
+// The defaults, what the server runs with when nothing is given on the command line
+void server_default_config(struct SERVER_CONFIG* config);
+
+// Sets one "name=value" option from the command line, returns -1 if there's no such option
+int parse_config_option(struct SERVER_CONFIG* config, const char* option);
+
+unsigned long long now_ms(struct SERVER* server);
+
+// Takes up to ACCEPT_BATCH pending connections off a listening socket
+void accept_connections(struct SERVER* server, int listen_fd);
+
+// Binds and listens on the TCP port, exits if it can't
+int open_tcp_listener(const char* port);
+
+// The same, but returns -1 if it can't
+int try_tcp_listener(const char* port);
+
+// Listens on a Unix-domain socket at path, returns the socket or -1
+int open_unix_listener(const char* path);
+
+struct CONNECTION* open_connection(struct SERVER* server, int sockfd);
+
+// Closing is deferred until the current event is done, so handlers can fail a send
+// halfway through a fan-out without invalidating anything they're iterating over.
+void schedule_close(struct SERVER* server, struct CONNECTION* conn, const char* reason);
+
+void close_pending_connections(struct SERVER* server);
+
+void close_connection(struct SERVER* server, struct CONNECTION* conn);
+
+void connection_timeout(struct TIMER* timer, void* arg);
+
+void handle_client_data(struct SERVER* server, struct CONNECTION* conn);
+
+// Handles up to frames_per_turn of the complete messages in conn->in_buf
+void process_input(struct SERVER* server, struct CONNECTION* conn);
+
+// Gives conn an input buffer if it doesn't have one, returns -1 if there's no memory
+int take_input_buffer(struct SERVER* server, struct CONNECTION* conn);
+
+// Puts conn's input buffer back in the pool, once nothing is left in it
+void release_input_buffer(struct SERVER* server, struct CONNECTION* conn);
+
+// Asks epoll for whichever events conn is waiting on now, if that changed
+void update_events(struct SERVER* server, struct CONNECTION* conn);
+
+// Whether conn has output left for the socket to take
+void watch_output(struct SERVER* server, struct CONNECTION* conn, int on);
+
+void pause_input(struct SERVER* server, struct CONNECTION* conn);
+
+void resume_input(struct SERVER* server, struct CONNECTION* conn);
+
+void mark_ready(struct SERVER* server, struct CONNECTION* conn);
+
+// Gives every connection on the ready list its turn
+void process_ready_connections(struct SERVER* server);
+
+void throttle_expired(struct TIMER* timer, void* arg);
+
+// returns the RATE_CLASS of a message type, or -1 if it isn't limited
+int rate_class(unsigned int type);
+
+// Refills the bucket, and returns 0 if it has a token, or how many ms until it will
+long long bucket_wait(struct TOKEN_BUCKET* bucket, const struct RATE_LIMIT* limit, unsigned long long now);
+
+// Takes the tokens msg needs and returns 0, or returns how many ms until it's allowed
+long long rate_limit_wait(struct SERVER* server, struct CONNECTION* conn, struct message* msg);
+
+// Answers a rate limited request that has a NAK. Returns -1 if it has none, and has to wait.
+int send_rate_limit_nak(struct SERVER* server, struct message* msg, int sockfd);
+
+void dispatch_message(struct SERVER* server, struct CONNECTION* conn, struct message* msg);
+
+// Answers SHM_REQ with the memfd of a new pair of rings, or SHM_NAK
+void handle_shm_request(struct SERVER* server, struct CONNECTION* conn, struct message* msg);
+
+// Moves what the client put in its ring into in_buf, as far as it fits
+void pull_shm_input(struct SERVER* server, struct CONNECTION* conn);
+
+// Tells the client to ring the doorbell when it writes more, and returns 1 if it
+// already did in the meantime (so there's input without one)
+int shm_input_pending(struct SERVER* server, struct CONNECTION* conn);
+
+// Sends the client a doorbell if it's waiting for one
+void ring_doorbell(struct CONNECTION* conn);
 
 // returns the CLIENT_INFO* node corresponding to the username
-struct CLIENT_INFO_NODE* get_client_info (const char* username);
+struct CLIENT_INFO_NODE* get_client_info (struct SERVER* server, const char* username);
+
+// Adds a new client to client_index, which get_client_info looks names up in
+void index_client(struct SERVER* server, struct CLIENT_INFO_NODE* client);
 
-struct SESSION_INFO_NODE* get_session_info (const char* session_id);
+// Adds a new session to session_index, and takes a deleted one out, for get_session_info
+void index_session(struct SERVER* server, struct SESSION_INFO_NODE* session);
+void unindex_session(struct SERVER* server, struct SESSION_INFO_NODE* session);
+
+struct SESSION_INFO_NODE* get_session_info (struct SERVER* server, const char* session_id);
 
 struct SESSION_INFO_NODE* create_new_session (struct SESSION_INFO_NODE* head, char* session_id, struct CLIENT_INFO_NODE* client);
 
 struct SESSION_INFO_NODE* remove_from_session(struct CLIENT_INFO_NODE* client);
 
-void send_message_to_client(int sockfd, struct message* msg);
+void send_message_to_client(struct SERVER* server, int sockfd, struct message* msg);
+
+void send_string_to_client(struct SERVER* server, int sockfd, const char* msg_str);
+
+void send_buffer_to_client(struct SERVER* server, int sockfd, const char* msg_str, size_t len);
+
+// Takes ownership of data, which has to come from malloc
+struct OUT_BUFFER* out_buffer_new(struct SERVER* server, char* data, int len);
+
+void out_buffer_release(struct SERVER* server, struct OUT_BUFFER* buf);
+
+// Adds a reference to buf to one of the client's output lanes
+void queue_to_client(struct SERVER* server, int sockfd, struct OUT_BUFFER* buf, enum OUT_LANE lane);
+
+void mark_dirty(struct SERVER* server, struct CONNECTION* conn);
+
+// The lane a message of this type is queued in
+enum OUT_LANE message_lane(unsigned int type);
+
+// Removes the chunk after *link from the lane, dropping its reference
+void remove_out_chunk(struct SERVER* server, struct CONNECTION* conn, enum OUT_LANE lane, struct OUT_CHUNK** link);
+
+// Drops the oldest unstarted bulk frames while the lane is over bulk_queue_limit
+void drop_bulk_backlog(struct SERVER* server, struct CONNECTION* conn);
+
+void flush_connection(struct SERVER* server, struct CONNECTION* conn);
+
+// Writes out everything queued during this loop iteration
+void flush_pending_output(struct SERVER* server);
+
+void output_stalled(struct TIMER* timer, void* arg);
+
+// Over the memory budget, closes the connections with the most output queued until
+// enough of it would be freed, then trims the history if that wasn't enough
+void enforce_memory_budget(struct SERVER* server);
+
+unsigned long long now_us(struct SERVER* server);
+
+// Folds one loop iteration's lag into the average, and changes mode if it crossed a threshold
+void update_load_mode(struct SERVER* server, unsigned long long lag_us);
+
+const char* load_mode_name(enum LOAD_MODE mode);
+
+// Answers the QUERYs that were put off, once the load has dropped (or they waited too long)
+void answer_deferred_queries(struct SERVER* server);
+
+// Drops the older half of the history of the session that keeps the most, leaving at least
+// one entry. Returns how many entries were dropped, 0 once every session is down to one.
+int trim_history(struct SERVER* server);
+
+void handle_stats(struct SERVER* server, struct message* msg, int sockfd);
+
+// Sends a report as ST_ACKs of up to max_data each, split between lines. "s" on each is how
+// many more are coming, so a client can tell when it has the whole report.
+void send_stats_report(struct SERVER* server, int sockfd, const char* text, size_t len);
+
+// Adds a client's LAT_REPORT to what STATS shows
+void handle_latency_report(struct SERVER* server, struct message* msg, int sockfd);
+
+void handle_blob_offer(struct SERVER* server, struct CONNECTION* conn, struct message* msg);
+
+void handle_blob_end(struct SERVER* server, struct CONNECTION* conn, struct message* msg);
+
+struct BLOB_TRANSFER* find_blob_transfer(struct SERVER* server, struct CONNECTION* sender, unsigned int id);
+
+// Sends a BLOB_END (with reason as data, empty if it completed) and frees the transfer
+void end_blob_transfer(struct SERVER* server, struct BLOB_TRANSFER* transfer, const char* reason);
+
+// Called when a connection closes, for the transfers it sent or was receiving
+void detach_blob_transfers(struct SERVER* server, struct CONNECTION* conn);
+
+// 1 if a recipient of the transfer has too much file data queued to take another chunk
+int blob_window_full(struct BLOB_TRANSFER* transfer);
+
+// Starts relaying the BLOB_CHUNK whose header is at in_buf + offset. Returns how many bytes
+// of in_buf it used, or 0 if the chunk has to wait for the recipients to catch up.
+int start_blob_chunk(struct SERVER* server, struct CONNECTION* conn, int offset, int header_len, int size);
+
+// Moves more of the current chunk, whichever of the two sockets just became ready
+void continue_blob_chunk(struct SERVER* server, struct CONNECTION* conn);
+
+// The spliced half of continue_blob_chunk
+void pump_splice(struct SERVER* server, struct CONNECTION* conn);
+
+// Makes sure conn has a pipe to splice through, returns -1 if splicing isn't possible
+int setup_splice_pipe(struct CONNECTION* conn);
+
+void finish_blob_chunk(struct SERVER* server, struct CONNECTION* conn);
+
+// Gives senders that were waiting on BLOB_WINDOW another turn once their recipients drained
+void retry_blocked_blob_senders(struct SERVER* server);
+
+// compress_threshold if the client negotiated compression, otherwise -1
+int client_compress_threshold(struct SERVER* server, int sockfd);
+
+int negotiate_compression(struct SERVER* server, struct message* msg, int sockfd);
+
+int handle_login (struct SERVER* server, struct message* msg, int sockfd);
+
+void handle_exit(struct SERVER* server, struct message* msg, int sockfd);
+
+void handle_join_session(struct SERVER* server, struct message* msg, int sockfd);
+
+void handle_leave_session(struct SERVER* server, struct message* msg, int sockfd);
+
+// A new, empty session at the head of the list
+struct SESSION_INFO_NODE* create_session(struct SERVER* server, const char* session_id);
+
+void handle_new_session(struct SERVER* server, struct message* msg, int sockfd);
+
+void handle_send_message(struct SERVER* server, struct message* msg, int sockfd);
+
+// The session a MESSAGE goes to, or NULL if the client isn't in it
+struct SESSION_INFO_NODE* message_session(struct SERVER* server, struct CLIENT_INFO_NODE* client, struct message* msg);
+
+void handle_query(struct SERVER* server, struct message* msg, int sockfd);
+
+void handle_dm(struct SERVER* server, struct message* msg, int sockfd);
+
+// Keeps a DM_MSG frame for a user who is offline, returns -1 if there's no room for it
+int store_in_mailbox(struct SERVER* server, struct CLIENT_INFO_NODE* client, const char* frame, size_t len);
+
+// Moves a mailbox out of memory into its file, returns -1 if it can't be written
+int spill_mailbox(struct SERVER* server, struct CLIENT_INFO_NODE* client);
+
+// Moves the biggest mailbox still in memory to disk, returns the bytes freed
+size_t spill_biggest_mailbox(struct SERVER* server);
+
+// Sends the client everything in its mailbox as one batch of frames, and empties it
+void deliver_mailbox(struct SERVER* server, struct CLIENT_INFO_NODE* client, int sockfd);
+
+// The file a user's mailbox spills to (the name is hex, so any username is safe in it)
+void mailbox_path(struct SERVER* server, const struct CLIENT_INFO_NODE* client, char* path, size_t size);
+
+// Returns the contents of a mailbox's file malloc'd, or NULL if it can't be read
+char* read_mailbox_file(struct SERVER* server, const struct CLIENT_INFO_NODE* client, size_t* len);
+
+void remove_user_from_session(struct SERVER* server, struct SESSION_INFO_NODE* session, struct CLIENT_INFO_NODE* client);
+
+void remove_user_from_all_sessions(struct SERVER* server, struct CLIENT_INFO_NODE* client);
+
+// returns the index into client->sessions, or -1 if the client isn't in the session
+int find_membership(struct CLIENT_INFO_NODE* client, struct SESSION_INFO_NODE* session);
+
+// returns 0, or -1 if the session is full
+int add_user_to_session(struct SERVER* server, struct SESSION_INFO_NODE* session, struct CLIENT_INFO_NODE* client);
+
+void replay_history(struct SERVER* server, struct SESSION_INFO_NODE* session, unsigned long long after_seq, int sockfd);
+
+void free_history_entry(struct SERVER* server, struct HISTORY_ENTRY* entry);
+
+// Frees an entry of the session's history, after taking it out of the search index.
+// Entries have to go oldest first, or older ones may stop being found.
+void forget_history_entry(struct SERVER* server, struct SESSION_INFO_NODE* session, struct HISTORY_ENTRY* entry);
+
+// The text of a message in the history, NULL if there's none
+const char* history_text(struct HISTORY_ENTRY* entry, int* len);
+
+// Adds a new history entry to the session's search index, then takes the oldest messages
+// out of it until it fits in search_memory again
+void index_history_entry(struct SERVER* server, struct SESSION_INFO_NODE* session, struct HISTORY_ENTRY* entry);
+
+// Answers with a page of the messages in the session that have every word of the SEARCH
+void handle_search(struct SERVER* server, struct message* msg, int sockfd);
+
+void send_history_entry(struct SERVER* server, struct HISTORY_ENTRY* entry, int sockfd);
+
+void free_session(struct SERVER* server, struct SESSION_INFO_NODE* session);
+
+// Takes the session off the list and frees it
+void delete_session(struct SERVER* server, struct SESSION_INFO_NODE* session);
+
+void generate_resume_token(char* token);
+
+void resume_expired(struct TIMER* timer, void* arg);
+
+int handle_resume(struct SERVER* server, struct message* msg, int sockfd);
+
+// Returns a memfd holding the server's state, and how many connections are in it. For a
+// standby the connections are left out, and mailboxes on disk are read into it.
+int write_snapshot(struct SERVER* server, int* num_connections, int for_standby);
+
+// Rebuilds the state in a snapshot, fds being the sockets of its connections in order.
+// Returns -1 if it couldn't (and the process can't go on).
+int read_snapshot(struct SERVER* server, int snapshot_fd, const int* fds, int num_fds);
+
+// Closes the connections that can't be handed over (see above). Links to other nodes are
+// among them, the new server makes them again.
+void close_unmovable_connections(struct SERVER* server);
+
+// The old server's side, for a successor connecting to the handoff socket. Only returns
+// if the handoff didn't go through, in which case this server just carries on.
+void hand_off(struct SERVER* server, int listen_fd, int tcp_fd, int unix_fd, int cluster_listen_fd, int replica_listen_fd);
+
+// The new server's side. Sets the listening sockets it got, or returns -1.
+int take_over(struct SERVER* server, const char* path, int* tcp_fd, int* unix_fd, int* handoff_fd, int* cluster_listen_fd,
+              int* replica_listen_fd);
+
+// Reads the cluster= list and places the nodes on the ring, exits if it's no good
+void setup_cluster(struct SERVER* server, const char* list);
+
+// The node a session ID or username belongs to
+int home_node(struct SERVER* server, const char* key);
+
+// Starts connecting the link to a node, which is retried until it's up
+void connect_to_node(struct SERVER* server, int node);
+
+void node_retry(struct TIMER* timer, void* arg);
+
+// Queues msg on the link to node, returns -1 if the link is down
+int send_to_node(struct SERVER* server, int node, struct message* msg);
+
+void handle_node_message(struct SERVER* server, struct CONNECTION* conn, struct message* msg);
+
+void handle_node_hello(struct SERVER* server, struct CONNECTION* conn, struct message* msg);
+
+// A LOGIN or RESUME is about to be handled. If the user's home is another node that has
+// to agree first, asks it (or refuses right away) and returns 0, otherwise returns -1.
+int ask_home(struct SERVER* server, struct CONNECTION* conn, struct message* msg);
+
+// Handles a LOGIN or RESUME and sets the connection up for what comes after, or closes it
+void login_or_resume(struct SERVER* server, struct CONNECTION* conn, struct message* msg);
+
+// The home's side of a NODE_CLAIM from another node
+void handle_node_claim(struct SERVER* server, int node, struct message* msg);
+
+// The answer, which lets the held LOGIN or RESUME go ahead or turns it down
+void finish_node_claim(struct SERVER* server, int node, struct message* msg);
+
+// A link is up: the other side is told what's here, and has to do the same
+void node_link_up(struct SERVER* server, int node, struct CONNECTION* conn);
+
+// Called when a link closes, before the connection goes away
+void node_link_down(struct SERVER* server, struct CONNECTION* conn);
+
+// The home's side of a JOIN or NEW_SESS from another node's user
+void handle_node_join(struct SERVER* server, int node, struct message* msg);
+
+// The shadow's side of the answer, which goes on to the user
+void finish_node_join(struct SERVER* server, int node, struct message* msg);
+
+// One member less on node, and the session is gone if that was the last one
+void drop_remote_member(struct SERVER* server, struct SESSION_INFO_NODE* session, int node);
+
+void handle_node_members(struct SERVER* server, int node, struct message* msg);
+
+// Forgets the members node had before its link came back, and didn't announce again
+void handle_node_synced(struct SERVER* server, int node);
+
+void handle_node_presence(struct SERVER* server, int node, struct message* msg);
+
+// Tells the user's home whether they're logged in here now
+void announce_presence(struct SERVER* server, struct CLIENT_INFO_NODE* client);
+
+// Delivers a DM_MSG to dm->to, sends it towards the node they're at, or keeps it in their
+// mailbox. Returns -1 if the mailbox has no room.
+int route_dm(struct SERVER* server, struct message* dm, struct CLIENT_INFO_NODE* recv_client);
+
+// Numbers a session message and sends it to every member, here and on other nodes
+void broadcast_session_message(struct SERVER* server, struct SESSION_INFO_NODE* session, struct message* msg);
+
+// Keeps a numbered session message in the history (and the archive) and sends it to the
+// members here, and to the other nodes with members if to_nodes is set
+void deliver_session_message(struct SERVER* server, struct SESSION_INFO_NODE* session, struct message* msg, int to_nodes);
+
+// A message the session's home numbered, for the members of a shadow
+void accept_session_message(struct SERVER* server, int node, struct message* msg);
+
+// Keeps plain in the history (and the search index) as message seq, and returns its entry
+struct HISTORY_ENTRY* keep_in_history(struct SERVER* server, struct SESSION_INFO_NODE* session, unsigned long long seq, struct OUT_BUFFER* plain);
+
+// Sends a history entry to the session's members on this node, except the sender
+void send_to_members(struct SERVER* server, struct SESSION_INFO_NODE* session, struct HISTORY_ENTRY* entry, const char* sender);
+
+// Adds a line per user logged in here to a QU_ACK
+void list_users(struct SERVER* server, struct message* reply);
+
+// Asks the other nodes for their users, returns -1 if there are none to ask
+int ask_other_nodes(struct SERVER* server, int sockfd, const char* username);
+
+// Adds a node's users to the QUERY waiting for them
+void gather_query_answer(struct SERVER* server, int node, struct message* msg);
+
+void finish_query(struct SERVER* server, struct PENDING_QUERY* query);
+
+void query_expired(struct TIMER* timer, void* arg);
+
+// Whether a key someone sent is ours, in time that doesn't depend on where they differ
+int keys_match(const char* given, const char* key);
+
+// The first frame on a connection to replica_port, which has to be a REPL_HELLO with the key
+void handle_replica_hello(struct SERVER* server, struct CONNECTION* conn, struct message* msg);
+
+// The primary's side of a standby that connected: the snapshot, then the stream begins
+void start_replica(struct SERVER* server, struct CONNECTION* conn);
 
-void send_string_to_client(int sockfd, const char* msg_str);
+// Queues a record for the standby, if there is one
+void replicate(struct SERVER* server, struct message* record);
 
-int handle_login (struct message* msg, int sockfd);
+// Queues a frame that's already formatted (a session message, a DM_MSG) as a record
+void replicate_buffer(struct SERVER* server, struct OUT_BUFFER* buf);
 
-void handle_exit(struct message* msg);
+void replica_heartbeat(struct TIMER* timer, void* arg);
 
-void handle_join_session(struct message* msg, int sockfd);
+void handle_replica_message(struct SERVER* server, struct CONNECTION* conn, struct message* msg);
 
-void handle_leave_session(struct message* msg, int sockfd);
+// Called when the standby's connection closes
+void replica_link_down(struct SERVER* server, struct CONNECTION* conn);
 
-void handle_new_session(struct message* msg, int sockfd);
+// Writes out the capture once every CAPTURE_FLUSH_S
+void capture_flush_timer(struct TIMER* timer, void* arg);
 
-void handle_send_message(struct message* msg, int sockfd);
+// Starts archiving to archive_dir, if it's set. Returns -1 if it can't be used.
+int start_archiver(struct SERVER* server);
 
-void handle_query(struct message* msg, int sockfd);
+// The standby's side. Follows the primary at address, and returns once it's gone.
+void run_standby(struct SERVER* server, const char* address);
 
-void handle_dm(struct message* msg, int sockfd);
+// A blocking connection to host:port, or -1
+int connect_to_primary(const char* host, const char* port);
 
-void remove_user_from_session(struct SESSION_INFO_NODE* session, struct CLIENT_INFO_NODE* client);
+// Applies one record from the primary
+void apply_record(struct SERVER* server, struct message* record);
 
+// Gets the standby's state ready to serve: everyone who was logged in may RESUME
+void promote_standby(struct SERVER* server);
 
 // Lab 5
-void handle_register_user(struct message* msg, int sockfd);
+void handle_register_user(struct SERVER* server, struct message* msg, int sockfd);
 #endif //ECE361_TEXTCONFERENCING_SERVER_H
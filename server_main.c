@@ -0,0 +1,36 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+int main(int argc, const char** argv) {
+    // process command line input
+    if (argc < 2) {
+        printf("Error - please run this command as 'server <TCP port to listen on> [option=value ...]'\n");
+        exit(1);
+    }
+    struct SERVER_CONFIG config;
+    server_default_config(&config);
+    for (int i = 2; i < argc; i++) {
+        if (parse_config_option(&config, argv[i]) == -1) {
+            printf("Error - unrecognized option %s\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    // Every connection is a descriptor, so take as many as we're allowed
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    struct SERVER* server = server_create(&config);
+    if (server == NULL) {
+        exit(1);
+    }
+    server->argv = argv;
+    server_start(server, argv[1]);
+    server_run(server);
+    exit(1);
+}
@@ -0,0 +1,135 @@
+#define _GNU_SOURCE // memfd_create
+#include "shm_ring.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static char* ring_data(struct SHM_MAP* map, struct SHM_RING* ring) {
+    char* data = (char*) (map->region + 1);
+    return ring == &map->region->to_server ? data : data + map->ring_size;
+}
+
+size_t shm_region_size(size_t ring_size) {
+    return sizeof(struct SHM_REGION) + 2 * ring_size;
+}
+
+int shm_region_create(size_t ring_size, struct SHM_MAP* map) {
+    size_t size = 4096;
+    while (size < ring_size && size < SHM_RING_MAX) {
+        size *= 2;
+    }
+
+    int fd = memfd_create("chat-ring", MFD_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    void* region = MAP_FAILED;
+    if (ftruncate(fd, shm_region_size(size)) == -1
+        || (region = mmap(NULL, shm_region_size(size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    // a fresh memfd is zeroed, so the rings start out empty with nobody waiting
+    map->region = region;
+    map->ring_size = size;
+    map->region->ring_size = size;
+    map->region->magic = SHM_MAGIC;
+    return fd;
+}
+
+int shm_region_map(int fd, struct SHM_MAP* map) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(struct SHM_REGION)) {
+        return -1;
+    }
+    struct SHM_REGION* region = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) {
+        return -1;
+    }
+    size_t size = region->ring_size;
+    if (region->magic != SHM_MAGIC || size == 0 || (size & (size - 1)) != 0
+        || shm_region_size(size) != (size_t) st.st_size) {
+        munmap(region, st.st_size);
+        return -1;
+    }
+    map->region = region;
+    map->ring_size = size;
+    return 0;
+}
+
+void shm_region_unmap(struct SHM_MAP* map) {
+    munmap(map->region, shm_region_size(map->ring_size));
+    map->region = NULL;
+}
+
+ssize_t shm_ring_used(const struct SHM_MAP* map, const struct SHM_RING* ring) {
+    unsigned long long used = atomic_load_explicit(&ring->tail, memory_order_acquire)
+                              - atomic_load_explicit(&ring->head, memory_order_acquire);
+    return used > map->ring_size ? -1 : (ssize_t) used;
+}
+
+ssize_t shm_ring_writev(struct SHM_MAP* map, struct SHM_RING* ring, const struct iovec* iov, int count) {
+    ssize_t used = shm_ring_used(map, ring);
+    if (used == -1) {
+        return -1;
+    }
+    size_t size = map->ring_size;
+    size_t room = size - used;
+    unsigned long long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    char* data = ring_data(map, ring);
+
+    size_t written = 0;
+    for (int i = 0; i < count && written < room; i++) {
+        size_t len = iov[i].iov_len < room - written ? iov[i].iov_len : room - written;
+        size_t pos = (tail + written) & (size - 1);
+        size_t first = len < size - pos ? len : size - pos;
+        memcpy(data + pos, iov[i].iov_base, first);
+        memcpy(data, (const char*) iov[i].iov_base + first, len - first);
+        written += len;
+    }
+    atomic_store_explicit(&ring->tail, tail + written, memory_order_release);
+    return written;
+}
+
+ssize_t shm_ring_write(struct SHM_MAP* map, struct SHM_RING* ring, const char* data, size_t len) {
+    struct iovec iov = {.iov_base = (void*) data, .iov_len = len};
+    return shm_ring_writev(map, ring, &iov, 1);
+}
+
+ssize_t shm_ring_read(struct SHM_MAP* map, struct SHM_RING* ring, char* buf, size_t len) {
+    ssize_t used = shm_ring_used(map, ring);
+    if (used == -1) {
+        return -1;
+    }
+    if (len > (size_t) used) {
+        len = used;
+    }
+    size_t size = map->ring_size;
+    unsigned long long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t pos = head & (size - 1);
+    size_t first = len < size - pos ? len : size - pos;
+    char* data = ring_data(map, ring);
+    memcpy(buf, data + pos, first);
+    memcpy(buf + first, data, len - first);
+    atomic_store_explicit(&ring->head, head + len, memory_order_release);
+    return len;
+}
+
+int shm_ring_wake(_Atomic int* waiting) {
+    // The counter we just moved has to be visible before we look at the flag, or the
+    // other side could check the ring, find nothing, and sleep without a doorbell coming
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load_explicit(waiting, memory_order_relaxed)
+           && atomic_exchange_explicit(waiting, 0, memory_order_acq_rel);
+}
+
+void shm_ring_arm(_Atomic int* waiting) {
+    atomic_store_explicit(waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void shm_ring_disarm(_Atomic int* waiting) {
+    atomic_store_explicit(waiting, 0, memory_order_relaxed);
+}
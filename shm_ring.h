@@ -0,0 +1,80 @@
+#ifndef ECE361_TEXTCONFERENCING_SHM_RING_H
+#define ECE361_TEXTCONFERENCING_SHM_RING_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * The shared memory transport for clients on the same host. A client connected over the
+ * Unix-domain socket asks for it with SHM_REQ, and gets a memfd holding two byte rings
+ * passed along with SHM_ACK. From then on frames go through the rings in the same format
+ * they would over the socket, and the socket only carries doorbells: one byte, sent when
+ * the other side has said it's going to sleep (reader_waiting / writer_waiting).
+ *
+ * Each ring has one writer and one reader. head and tail only ever grow, the position in
+ * the data is their value modulo the ring size. The other process can write anything it
+ * likes into the region, so the counters are checked before they're trusted.
+ */
+
+#define SHM_MAGIC 0x53484d31 // "SHM1"
+
+// Anything bigger than this a client asks for is cut down to it
+#define SHM_RING_MAX (64 * 1024 * 1024)
+
+struct SHM_RING {
+    _Atomic unsigned long long head; // bytes read, only the reader moves it
+    char head_pad[56];
+    _Atomic unsigned long long tail; // bytes written, only the writer moves it
+    char tail_pad[56];
+    _Atomic int reader_waiting;      // the reader wants a doorbell once tail moves
+    _Atomic int writer_waiting;      // the writer wants one once head moves
+    char flag_pad[56];
+};
+
+// The data of both rings follows, to_server's first, each ring_size bytes
+struct SHM_REGION {
+    unsigned int magic;
+    unsigned int ring_size;          // a power of two
+    char pad[56];
+    struct SHM_RING to_server;
+    struct SHM_RING to_client;
+};
+
+// One process's mapping of a region. The size is kept here, since the other process
+// can overwrite the one in the region whenever it likes.
+struct SHM_MAP {
+    struct SHM_REGION* region;
+    size_t ring_size;
+};
+
+// Makes a region with two rings of ring_size bytes (rounded up to a power of two), and
+// returns the memfd to pass to the client, or -1
+int shm_region_create(size_t ring_size, struct SHM_MAP* map);
+
+// Maps a region received from the server, returns -1 if it isn't one
+int shm_region_map(int fd, struct SHM_MAP* map);
+
+void shm_region_unmap(struct SHM_MAP* map);
+
+size_t shm_region_size(size_t ring_size);
+
+// Bytes waiting in the ring, or -1 if its counters make no sense
+ssize_t shm_ring_used(const struct SHM_MAP* map, const struct SHM_RING* ring);
+
+// Copy as much as fits, and return how much that was (-1 if the ring is corrupt)
+ssize_t shm_ring_writev(struct SHM_MAP* map, struct SHM_RING* ring, const struct iovec* iov, int count);
+ssize_t shm_ring_write(struct SHM_MAP* map, struct SHM_RING* ring, const char* data, size_t len);
+ssize_t shm_ring_read(struct SHM_MAP* map, struct SHM_RING* ring, char* buf, size_t len);
+
+// Called after moving head or tail: 1 if the other side was waiting for that, and has
+// to be sent a doorbell
+int shm_ring_wake(_Atomic int* waiting);
+
+// Called before going to sleep on the doorbell. The caller checks the ring again
+// afterwards, and if it's no longer worth sleeping calls shm_ring_disarm.
+void shm_ring_arm(_Atomic int* waiting);
+void shm_ring_disarm(_Atomic int* waiting);
+
+#endif //ECE361_TEXTCONFERENCING_SHM_RING_H
@@ -0,0 +1,338 @@
+// Checks of the server's behaviour, run inside this process the way bench_server does it:
+// the server gets one end of a socketpair per client and a clock of its own, so every run
+// goes the same way. Each check starts a server of its own.
+// Usage: test_server
+//            prints a line per failed check, and exits with 1 if there were any
+// The server's own output is thrown away.
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/socket.h>
+
+#define MAX_TEST_CLIENTS 8
+#define CLOCK_STEP_US 100
+// Turns of the server's loop to wait for a frame before giving up on it
+#define MAX_WAIT_TURNS 10000
+#define CLIENT_BUF (2 * MAX_STR_LEN + MAX_OPTIONS_LEN)
+
+struct TEST_CLIENT {
+    int fd;                          // our end of the socketpair
+    char name[MAX_NAME];
+    char buf[CLIENT_BUF];
+    int len;
+    int bad_frames;                  // ones frame_header wouldn't take
+};
+
+static struct SERVER* server;
+static struct TEST_CLIENT clients[MAX_TEST_CLIENTS];
+static int num_clients;
+static unsigned long long clock_us;
+static FILE* out;
+static int failures = 0;
+
+static void fail(const char* check, const char* what) {
+    fprintf(out, "FAILED %s: %s\n", check, what);
+    failures++;
+}
+
+// The defaults, except for the rate limits, which checks would run into and aren't about
+static void test_config(struct SERVER_CONFIG* config) {
+    server_default_config(config);
+    for (int i = 0; i < NUM_RATE_CLASSES; i++) {
+        config->rate_limits[i].rate = 0;
+    }
+    config->session_rate_limit.rate = 0;
+}
+
+static void start_server(struct SERVER_CONFIG* config) {
+    clock_us = 0;
+    num_clients = 0;
+    server = server_create(config);
+    if (server == NULL || server_set_clock(server, clock_us) == -1) {
+        fprintf(out, "Error - can't create the server\n");
+        exit(1);
+    }
+}
+
+static void stop_server() {
+    for (int i = 0; i < num_clients; i++) {
+        close(clients[i].fd);
+    }
+    server_destroy(server);
+}
+
+static struct TEST_CLIENT* add_client(const char* name) {
+    struct TEST_CLIENT* client = &clients[num_clients++];
+    memset(client, 0, sizeof(*client));
+    snprintf(client->name, MAX_NAME, "%s", name);
+    server_add_user(server, client->name, "p");
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1 || server_attach(server, pair[1], 0) == NULL) {
+        fprintf(out, "Error - can't attach %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    client->fd = pair[0];
+    fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) | O_NONBLOCK);
+    return client;
+}
+
+static void turn() {
+    server_run_once(server, 0);
+    clock_us += CLOCK_STEP_US;
+    server_set_clock(server, clock_us);
+}
+
+static void send_request(struct TEST_CLIENT* client, unsigned int type, const char* data, unsigned int size) {
+    struct message msg;
+    message_init(&msg, type);
+    strcpy(msg.source, client->name);
+    memcpy(message_reserve(&msg, size), data, size);
+    msg.size = size;
+    int len;
+    char* frame = encode_message(&msg, -1, &len);
+    if (send(client->fd, frame, len, MSG_NOSIGNAL) != len) {
+        fprintf(out, "Error - can't send to the server for %s\n", client->name);
+        exit(1);
+    }
+    free(frame);
+    message_release(&msg);
+}
+
+// A request whose payload is text
+static void send_text(struct TEST_CLIENT* client, unsigned int type, const char* data) {
+    send_request(client, type, data, strlen(data) + 1);
+}
+
+// The next frame the client gets, NULL if none comes or it's malformed. free() it.
+static struct message* next_frame(struct TEST_CLIENT* client) {
+    for (int turns = 0; turns < MAX_WAIT_TURNS; turns++) {
+        unsigned int type;
+        int size;
+        int header = frame_header(client->buf, client->len, &type, &size);
+        if (header == -1) {
+            client->bad_frames++;
+            client->len = 0;
+            return NULL;
+        }
+        if (header > 0 && header + size - 1 <= client->len) {
+            struct message* msg = buf_to_message(client->buf, header + size - 1);
+            memmove(client->buf, client->buf + header + size - 1, client->len - (header + size - 1));
+            client->len -= header + size - 1;
+            if (msg == NULL) {
+                client->bad_frames++;
+            }
+            return msg;
+        }
+        ssize_t n = recv(client->fd, client->buf + client->len, CLIENT_BUF - client->len, 0);
+        if (n > 0) {
+            client->len += n;
+        } else {
+            turn();
+        }
+    }
+    return NULL;
+}
+
+// Skips frames until one of the type arrives, NULL if it doesn't. free() it.
+static struct message* expect(struct TEST_CLIENT* client, unsigned int type) {
+    struct message* msg;
+    while ((msg = next_frame(client)) != NULL) {
+        if (msg->type == type) {
+            return msg;
+        }
+        free(msg);
+    }
+    return NULL;
+}
+
+static int login(struct TEST_CLIENT* client) {
+    send_text(client, LOGIN, "p");
+    struct message* ack = expect(client, LO_ACK);
+    free(ack);
+    return ack != NULL;
+}
+
+// Session IDs go into the header of every session message, so ones that would break it are
+// turned away, and the members of a good session keep getting frames they can read
+static void check_session_ids() {
+    const char* check = "session IDs";
+    struct SERVER_CONFIG config;
+    test_config(&config);
+    start_server(&config);
+    struct TEST_CLIENT* alice = add_client("alice");
+    struct TEST_CLIENT* bob = add_client("bob");
+    if (!login(alice) || !login(bob)) {
+        fail(check, "couldn't log in");
+        stop_server();
+        return;
+    }
+
+    const char* bad[] = {"a b", "a,b", "a=b", "a\tb", "a\nb", "", "a-session-id-that-is-too-long"};
+    for (unsigned int i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        send_text(alice, NEW_SESS, bad[i]);
+        struct message* reply = next_frame(alice);
+        if (reply == NULL || reply->type != NS_NAK) {
+            fail(check, "a bad session ID was accepted");
+        } else if (strlen(bad[i]) >= MAX_SESSION_ID && strstr(reply->data, "long") == NULL) {
+            fail(check, "a session ID that's too long isn't said to be");
+        }
+        free(reply);
+    }
+    // a \0 inside the ID, which would cut it short
+    send_request(alice, NEW_SESS, "ab\0c", 5);
+    struct message* reply = next_frame(alice);
+    if (reply == NULL || reply->type != NS_NAK) {
+        fail(check, "a session ID with a \\0 in it was accepted");
+    }
+    free(reply);
+
+    send_text(alice, NEW_SESS, "good");
+    free(expect(alice, NS_ACK));
+    send_text(bob, JOIN, "good");
+    free(expect(bob, JN_ACK));
+    send_text(alice, MESSAGE, "hello");
+    struct message* msg = expect(bob, MESSAGE);
+    if (msg == NULL || strcmp(msg->session_id, "good") != 0 || strcmp(msg->data, "hello") != 0) {
+        fail(check, "the other member didn't get the message");
+    }
+    free(msg);
+    if (alice->bad_frames > 0 || bob->bad_frames > 0) {
+        fail(check, "a client got a malformed frame");
+    }
+    stop_server();
+}
+
+// Removes a directory a check made, and the files in it
+static void remove_dir(const char* dir) {
+    DIR* entries = opendir(dir);
+    struct dirent* entry;
+    while (entries != NULL && (entry = readdir(entries)) != NULL) {
+        char path[PATH_MAX];
+        if (entry->d_name[0] != '.' && snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) < PATH_MAX) {
+            unlink(path);
+        }
+    }
+    if (entries != NULL) {
+        closedir(entries);
+    }
+    if (rmdir(dir) == -1) {
+        fprintf(out, "Error - can't remove %s: %s\n", dir, strerror(errno));
+    }
+}
+
+// With most options on, the STATS report is longer than max_data, so it comes in parts, the
+// last with "s" 0, and none of it is left out
+static void check_stats_report() {
+    const char* check = "stats report";
+    char dir[] = "/tmp/test_server.XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        fail(check, "couldn't make a directory for the archive");
+        return;
+    }
+    struct SERVER_CONFIG config;
+    test_config(&config);
+    config.archive_dir = dir;
+    config.replica_port = "0";
+    config.replica_key = "key";
+    config.validate_text = 1;
+    start_server(&config);
+    struct TEST_CLIENT* alice = add_client("alice");
+    if (start_archiver(server) == -1 || !login(alice)) {
+        fail(check, "couldn't start");
+        stop_server();
+        remove_dir(dir);
+        return;
+    }
+
+    send_text(alice, STATS, "");
+    char report[8 * MAX_DATA_LIMIT] = "";
+    size_t len = 0;
+    int parts = 0;
+    struct message* part;
+    while ((part = expect(alice, ST_ACK)) != NULL) {
+        parts++;
+        if ((int) part->size > config.max_data) {
+            fail(check, "a part is longer than max_data");
+        }
+        len += snprintf(report + len, sizeof(report) - len, "%s\n", part->data);
+        int last = part->seq == 0;
+        free(part);
+        if (last || len >= sizeof(report)) {
+            break;
+        }
+    }
+    if (part == NULL) {
+        fail(check, "the last part never came");
+    }
+    if (parts < 2) {
+        fail(check, "the report wasn't long enough to need splitting");
+    }
+    // the last line is the one to lose if anything is, so it has to be there to the end
+    if (strstr(report, "archive: ") == NULL || strstr(report, "replica: ") == NULL ||
+        strstr(report, "\nrefused: ") == NULL || strstr(report, " history entries\n") == NULL) {
+        fail(check, "a section is missing");
+    }
+    if (alice->bad_frames > 0) {
+        fail(check, "the client got a malformed frame");
+    }
+    stop_server();
+
+    remove_dir(dir);
+}
+
+// A server given another's snapshot numbers traces on from where that one was, rather than
+// handing out the IDs it already used again
+static void check_snapshot_traces() {
+    const char* check = "trace IDs in the snapshot";
+    struct SERVER_CONFIG config;
+    test_config(&config);
+    start_server(&config);
+    struct TEST_CLIENT* alice = add_client("alice");
+    if (!login(alice)) {
+        fail(check, "couldn't log in");
+        stop_server();
+        return;
+    }
+    send_text(alice, STATS, "");
+    free(expect(alice, ST_ACK));
+    unsigned long long used = server->next_trace_id;
+    int num_connections;
+    int snapshot_fd = write_snapshot(server, &num_connections, 1);
+    stop_server();
+
+    struct SERVER* next = server_create(&config);
+    // read_snapshot closes it
+    if (next == NULL || snapshot_fd == -1 || read_snapshot(next, snapshot_fd, NULL, 0) == -1) {
+        fail(check, "the snapshot couldn't be read back");
+    } else if (used == 0 || next->next_trace_id != used) {
+        fail(check, "the next server starts its trace IDs over");
+    }
+    if (next != NULL) {
+        server_destroy(next);
+    }
+}
+
+int main() {
+    // The server talks about every login and join, which nobody needs to see here
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("test_server");
+        exit(1);
+    }
+    setvbuf(out, NULL, _IOLBF, 0);
+
+    check_session_ids();
+    check_stats_report();
+    check_snapshot_traces();
+
+    fprintf(out, failures == 0 ? "All checks passed\n" : "%d checks failed\n", failures);
+    fclose(out);
+    return failures > 0;
+}
@@ -0,0 +1,144 @@
+#include "timer.h"
+
+#include <string.h>
+
+void timer_wheel_init(struct TIMER_WHEEL* wheel, unsigned long long now) {
+    memset(wheel, 0, sizeof(struct TIMER_WHEEL));
+    wheel->now = now;
+}
+
+void timer_init(struct TIMER* timer, timer_callback callback, void* arg) {
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+int timer_pending(const struct TIMER* timer) {
+    return timer->pprev != NULL;
+}
+
+static void unlink_timer(struct TIMER* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// Puts the timer into the slot its expiry belongs to, relative to wheel->now
+static void place_timer(struct TIMER_WHEEL* wheel, struct TIMER* timer) {
+    unsigned long long expires = timer->expires;
+    struct TIMER** slot;
+
+    if (expires < wheel->now) {
+        // Already expired, run it on the next tick
+        slot = &wheel->slots[0][wheel->now & TIMER_SLOT_MASK];
+    } else {
+        unsigned long long delta = expires - wheel->now;
+        if (delta > TIMER_MAX_DELAY) {
+            delta = TIMER_MAX_DELAY;
+            expires = wheel->now + delta;
+            timer->expires = expires;
+        }
+        int level = 0;
+        while (level < TIMER_LEVELS - 1 && delta >= (1ULL << ((level + 1) * TIMER_SLOT_BITS))) {
+            level++;
+        }
+        slot = &wheel->slots[level][(expires >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK];
+    }
+
+    timer->next = *slot;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+void timer_add(struct TIMER_WHEEL* wheel, struct TIMER* timer, unsigned long long delay) {
+    if (timer_pending(timer)) {
+        unlink_timer(timer);
+    } else {
+        wheel->count++;
+    }
+    if (delay > TIMER_MAX_DELAY) {
+        delay = TIMER_MAX_DELAY;
+    }
+    timer->expires = wheel->now + delay;
+    place_timer(wheel, timer);
+}
+
+void timer_cancel(struct TIMER_WHEEL* wheel, struct TIMER* timer) {
+    if (timer_pending(timer)) {
+        unlink_timer(timer);
+        wheel->count--;
+    }
+}
+
+// Moves every timer in a higher-level slot down to where it now belongs.
+// Returns the slot index, so the caller knows whether the next level wrapped too.
+static int cascade(struct TIMER_WHEEL* wheel, int level) {
+    int index = (wheel->now >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK;
+    struct TIMER* head = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+
+    while (head) {
+        struct TIMER* timer = head;
+        head = timer->next;
+        place_timer(wheel, timer);
+    }
+    return index;
+}
+
+void timer_wheel_advance(struct TIMER_WHEEL* wheel, unsigned long long now) {
+    while (wheel->now <= now) {
+        if (wheel->count == 0) {
+            // Nothing to run or cascade, skip straight to the target
+            wheel->now = now + 1;
+            break;
+        }
+
+        int index = wheel->now & TIMER_SLOT_MASK;
+        if (index == 0) {
+            for (int level = 1; level < TIMER_LEVELS; level++) {
+                if (cascade(wheel, level) != 0) {
+                    break;
+                }
+            }
+        }
+
+        // Detach the slot first, since callbacks are allowed to re-arm timers
+        struct TIMER* head = wheel->slots[0][index];
+        wheel->slots[0][index] = NULL;
+        if (head) {
+            head->pprev = &head;
+        }
+        wheel->now++;
+
+        while (head) {
+            struct TIMER* timer = head;
+            unlink_timer(timer);
+            wheel->count--;
+            timer->callback(timer, timer->arg);
+        }
+    }
+}
+
+long long timer_wheel_next_timeout(const struct TIMER_WHEEL* wheel) {
+    if (wheel->count == 0) {
+        return -1;
+    }
+
+    // Only level 0 is looked at; a wrap-around is reported as a wake-up so that
+    // the cascade happens on time
+    long long remaining = TIMER_SLOTS - (wheel->now & TIMER_SLOT_MASK);
+    for (long long i = 0; i < remaining; i++) {
+        if (wheel->slots[0][(wheel->now + i) & TIMER_SLOT_MASK] != NULL) {
+            return i;
+        }
+    }
+    return remaining;
+}
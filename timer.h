@@ -0,0 +1,58 @@
+#ifndef ECE361_TEXTCONFERENCING_TIMER_H
+#define ECE361_TEXTCONFERENCING_TIMER_H
+
+#include <stddef.h>
+
+/*
+ * Hierarchical timer wheel (the classic Varghese/Lauck layout the Linux kernel used).
+ * Time is measured in ticks. Level 0 has one slot per tick, and every level above it
+ * covers TIMER_SLOTS times the range of the one below. Timers far in the future sit in
+ * a coarse slot and are cascaded down when the lower level wraps around.
+ *
+ * Timers are intrusive, so the wheel never allocates. Adding and cancelling are O(1),
+ * and a tick only touches the timers that actually expire (plus an occasional cascade).
+ */
+
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+// Anything further away than this is clamped to it (2^24 ticks)
+#define TIMER_MAX_DELAY ((1ULL << (TIMER_LEVELS * TIMER_SLOT_BITS)) - 1)
+
+struct TIMER;
+typedef void (*timer_callback)(struct TIMER* timer, void* arg);
+
+struct TIMER {
+    unsigned long long expires; // absolute tick
+    timer_callback callback;
+    void* arg;
+    struct TIMER* next;
+    struct TIMER** pprev; // NULL when the timer isn't pending
+};
+
+struct TIMER_WHEEL {
+    unsigned long long now; // the next tick that will be run
+    size_t count;           // number of pending timers
+    struct TIMER* slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+void timer_wheel_init(struct TIMER_WHEEL* wheel, unsigned long long now);
+
+void timer_init(struct TIMER* timer, timer_callback callback, void* arg);
+
+// (Re)arms the timer to fire "delay" ticks from now. A pending timer is moved.
+void timer_add(struct TIMER_WHEEL* wheel, struct TIMER* timer, unsigned long long delay);
+
+void timer_cancel(struct TIMER_WHEEL* wheel, struct TIMER* timer);
+
+int timer_pending(const struct TIMER* timer);
+
+// Runs every timer that expired up to (and including) tick "now"
+void timer_wheel_advance(struct TIMER_WHEEL* wheel, unsigned long long now);
+
+// Number of ticks the caller can sleep before the wheel needs to be advanced again,
+// or -1 if there are no timers at all. This may be earlier than the next expiry.
+long long timer_wheel_next_timeout(const struct TIMER_WHEEL* wheel);
+
+#endif //ECE361_TEXTCONFERENCING_TIMER_H